@@ -21,10 +21,17 @@
 #include "debugdraw.cpp"
 #include "input.cpp"
 #include "gui.cpp"
+#include "aabbtree.cpp"
+#include "heightfield.cpp"
 #include "physics.cpp"
+#include "solver.cpp"
+#include "charcontroller.cpp"
+#include "spatialgrid.cpp"
 #include "geom.cpp"
+#include "meshbvh.cpp"
 #include "drawable.cpp"
 #include "models.cpp"
+#include "archetypes.cpp"
 #include "peony_parser.cpp"
 #include "peony_parser_utils.cpp"
 #include "cameras.cpp"
@@ -33,5 +40,6 @@
 #include "internals.cpp"
 #include "engine.cpp"
 #include "behavior_functions.cpp"
+#include "bench.cpp"
 #include "core.cpp"
 #include "main.cpp"
@@ -0,0 +1,353 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "logs.hpp"
+#include "aabbtree.hpp"
+#include "intrinsics.hpp"
+
+
+void
+aabbtree::init_tree(Tree *tree, memory::Pool *memory_pool, u32 max_n_leaves)
+{
+    // A tree with n leaves has n - 1 internal nodes, and we also skip node 0.
+    tree->nodes = Array<Node>(memory_pool, 2 * max_n_leaves, "aabbtree_nodes", true, 1);
+    tree->idx_root = NO_NODE;
+    tree->idx_free_list = NO_NODE;
+    tree->n_leaves = 0;
+}
+
+
+void
+aabbtree::clear(Tree *tree)
+{
+    if (tree->nodes.length > 0) {
+        tree->nodes.delete_elements_after_index(0);
+    }
+    tree->idx_root = NO_NODE;
+    tree->idx_free_list = NO_NODE;
+    tree->n_leaves = 0;
+}
+
+
+/*!
+    Inserts a leaf for `entity_handle` on `layers` and returns its index, which
+    is needed to later move or remove it.
+*/
+u32
+aabbtree::insert(
+    Tree *tree,
+    entities::Handle entity_handle,
+    spatial::Aabb *aabb,
+    u32 layers
+) {
+    u32 idx_leaf = allocate_node(tree);
+    Node *leaf = tree->nodes[idx_leaf];
+    leaf->aabb = spatial::grow_aabb(aabb, FAT_AABB_MARGIN);
+    leaf->layers = layers;
+    leaf->entity_handle = entity_handle;
+    leaf->height = 0;
+    insert_leaf(tree, idx_leaf);
+    tree->n_leaves++;
+    return idx_leaf;
+}
+
+
+void
+aabbtree::remove(Tree *tree, u32 idx_leaf)
+{
+    assert(is_leaf(tree->nodes[idx_leaf]));
+    remove_leaf(tree, idx_leaf);
+    free_node(tree, idx_leaf);
+    tree->n_leaves--;
+}
+
+
+/*!
+    Updates a leaf's AABB. If the new AABB is still inside the leaf's fat AABB,
+    we don't have to do anything. Otherwise, we reinsert the leaf, and return
+    true.
+*/
+bool
+aabbtree::move(Tree *tree, u32 idx_leaf, spatial::Aabb *aabb)
+{
+    Node *leaf = tree->nodes[idx_leaf];
+    assert(is_leaf(leaf));
+    if (spatial::does_aabb_contain_aabb(&leaf->aabb, aabb)) {
+        return false;
+    }
+    remove_leaf(tree, idx_leaf);
+    leaf->aabb = spatial::grow_aabb(aabb, FAT_AABB_MARGIN);
+    insert_leaf(tree, idx_leaf);
+    return true;
+}
+
+
+/*!
+    Changes a leaf's layers, and updates the layers of its ancestors. The tree's
+    shape doesn't depend on layers, so we don't have to rebalance anything.
+*/
+void
+aabbtree::set_layers(Tree *tree, u32 idx_leaf, u32 layers)
+{
+    Node *leaf = tree->nodes[idx_leaf];
+    assert(is_leaf(leaf));
+    leaf->layers = layers;
+    u32 idx_node = leaf->idx_parent;
+    while (idx_node != NO_NODE) {
+        Node *node = tree->nodes[idx_node];
+        node->layers = tree->nodes[node->idx_left]->layers |
+            tree->nodes[node->idx_right]->layers;
+        idx_node = node->idx_parent;
+    }
+}
+
+
+aabbtree::Node *
+aabbtree::get_node(Tree *tree, u32 idx_node)
+{
+    return tree->nodes[idx_node];
+}
+
+
+u32
+aabbtree::get_height(Tree *tree)
+{
+    if (tree->idx_root == NO_NODE) {
+        return 0;
+    }
+    return tree->nodes[tree->idx_root]->height;
+}
+
+
+u32
+aabbtree::allocate_node(Tree *tree)
+{
+    u32 idx_node;
+    if (tree->idx_free_list != NO_NODE) {
+        idx_node = tree->idx_free_list;
+        tree->idx_free_list = tree->nodes[idx_node]->idx_parent;
+    } else {
+        idx_node = max(tree->nodes.length, tree->nodes.starting_idx);
+        if (idx_node >= tree->nodes.capacity) {
+            logs::fatal("Ran out of aabbtree nodes");
+        }
+    }
+    Node *node = tree->nodes[idx_node];
+    *node = {};
+    node->idx_parent = NO_NODE;
+    node->idx_left = NO_NODE;
+    node->idx_right = NO_NODE;
+    return idx_node;
+}
+
+
+void
+aabbtree::free_node(Tree *tree, u32 idx_node)
+{
+    Node *node = tree->nodes[idx_node];
+    node->idx_parent = tree->idx_free_list;
+    node->height = -1;
+    tree->idx_free_list = idx_node;
+}
+
+
+void
+aabbtree::insert_leaf(Tree *tree, u32 idx_leaf)
+{
+    if (tree->idx_root == NO_NODE) {
+        tree->idx_root = idx_leaf;
+        tree->nodes[idx_leaf]->idx_parent = NO_NODE;
+        return;
+    }
+
+    // Find the best sibling for our new leaf, by walking down the tree and
+    // choosing whichever child makes the total surface area grow the least.
+    spatial::Aabb leaf_aabb = tree->nodes[idx_leaf]->aabb;
+    u32 idx_sibling = tree->idx_root;
+    while (!is_leaf(tree->nodes[idx_sibling])) {
+        Node *node = tree->nodes[idx_sibling];
+        Node *left = tree->nodes[node->idx_left];
+        Node *right = tree->nodes[node->idx_right];
+
+        f32 area = spatial::get_aabb_surface_area(&node->aabb);
+        spatial::Aabb combined_aabb = spatial::merge_aabbs(&node->aabb, &leaf_aabb);
+        f32 combined_area = spatial::get_aabb_surface_area(&combined_aabb);
+
+        // Cost of making a new parent for this node and the new leaf
+        f32 cost = 2.0f * combined_area;
+        // Minimum cost of pushing the leaf further down the tree
+        f32 inheritance_cost = 2.0f * (combined_area - area);
+
+        auto get_descent_cost = [&](Node *child) -> f32 {
+            spatial::Aabb aabb = spatial::merge_aabbs(&leaf_aabb, &child->aabb);
+            if (is_leaf(child)) {
+                return spatial::get_aabb_surface_area(&aabb) + inheritance_cost;
+            }
+            return spatial::get_aabb_surface_area(&aabb) -
+                spatial::get_aabb_surface_area(&child->aabb) + inheritance_cost;
+        };
+        f32 left_cost = get_descent_cost(left);
+        f32 right_cost = get_descent_cost(right);
+
+        if (cost < left_cost && cost < right_cost) {
+            break;
+        }
+        idx_sibling = (left_cost < right_cost) ? node->idx_left : node->idx_right;
+    }
+
+    // Make a new parent for the sibling and the leaf.
+    u32 idx_old_parent = tree->nodes[idx_sibling]->idx_parent;
+    u32 idx_new_parent = allocate_node(tree);
+    Node *new_parent = tree->nodes[idx_new_parent];
+    Node *sibling = tree->nodes[idx_sibling];
+    new_parent->idx_parent = idx_old_parent;
+    new_parent->aabb = spatial::merge_aabbs(&leaf_aabb, &sibling->aabb);
+    new_parent->layers = tree->nodes[idx_leaf]->layers | sibling->layers;
+    new_parent->height = sibling->height + 1;
+    new_parent->idx_left = idx_sibling;
+    new_parent->idx_right = idx_leaf;
+    sibling->idx_parent = idx_new_parent;
+    tree->nodes[idx_leaf]->idx_parent = idx_new_parent;
+
+    if (idx_old_parent == NO_NODE) {
+        tree->idx_root = idx_new_parent;
+    } else {
+        Node *old_parent = tree->nodes[idx_old_parent];
+        if (old_parent->idx_left == idx_sibling) {
+            old_parent->idx_left = idx_new_parent;
+        } else {
+            old_parent->idx_right = idx_new_parent;
+        }
+    }
+
+    refit_ancestors(tree, tree->nodes[idx_leaf]->idx_parent);
+}
+
+
+void
+aabbtree::remove_leaf(Tree *tree, u32 idx_leaf)
+{
+    if (idx_leaf == tree->idx_root) {
+        tree->idx_root = NO_NODE;
+        return;
+    }
+
+    u32 idx_parent = tree->nodes[idx_leaf]->idx_parent;
+    Node *parent = tree->nodes[idx_parent];
+    u32 idx_grandparent = parent->idx_parent;
+    u32 idx_sibling = (parent->idx_left == idx_leaf) ? parent->idx_right : parent->idx_left;
+
+    // The sibling takes the parent's place.
+    if (idx_grandparent == NO_NODE) {
+        tree->idx_root = idx_sibling;
+        tree->nodes[idx_sibling]->idx_parent = NO_NODE;
+        free_node(tree, idx_parent);
+        return;
+    }
+
+    Node *grandparent = tree->nodes[idx_grandparent];
+    if (grandparent->idx_left == idx_parent) {
+        grandparent->idx_left = idx_sibling;
+    } else {
+        grandparent->idx_right = idx_sibling;
+    }
+    tree->nodes[idx_sibling]->idx_parent = idx_grandparent;
+    free_node(tree, idx_parent);
+
+    refit_ancestors(tree, idx_grandparent);
+}
+
+
+/*!
+    Walks up from `idx_node` to the root, rebalancing and recomputing the AABB,
+    height and layers of every node on the way.
+*/
+void
+aabbtree::refit_ancestors(Tree *tree, u32 idx_node)
+{
+    while (idx_node != NO_NODE) {
+        idx_node = balance(tree, idx_node);
+
+        Node *node = tree->nodes[idx_node];
+        Node *left = tree->nodes[node->idx_left];
+        Node *right = tree->nodes[node->idx_right];
+        node->height = 1 + max(left->height, right->height);
+        node->aabb = spatial::merge_aabbs(&left->aabb, &right->aabb);
+        node->layers = left->layers | right->layers;
+
+        idx_node = node->idx_parent;
+    }
+}
+
+
+/*!
+    If `idx_a`'s children's heights differ by more than 1, rotates the taller
+    child up, and returns the index of the node that's now where `idx_a` was.
+*/
+u32
+aabbtree::balance(Tree *tree, u32 idx_a)
+{
+    Node *a = tree->nodes[idx_a];
+    if (is_leaf(a) || a->height < 2) {
+        return idx_a;
+    }
+
+    u32 idx_b = a->idx_left;
+    u32 idx_c = a->idx_right;
+    Node *b = tree->nodes[idx_b];
+    Node *c = tree->nodes[idx_c];
+    i32 height_difference = c->height - b->height;
+
+    if (height_difference >= -1 && height_difference <= 1) {
+        return idx_a;
+    }
+
+    // Rotate the taller child (`idx_up`) up, into `a`'s place. `a` becomes its
+    // child, and gets one of its children, whichever is shorter.
+    bool is_right_taller = height_difference > 1;
+    u32 idx_up = is_right_taller ? idx_c : idx_b;
+    u32 idx_other = is_right_taller ? idx_b : idx_c;
+    Node *up = tree->nodes[idx_up];
+    Node *other = tree->nodes[idx_other];
+    u32 idx_f = up->idx_left;
+    u32 idx_g = up->idx_right;
+    Node *f = tree->nodes[idx_f];
+    Node *g = tree->nodes[idx_g];
+
+    up->idx_left = idx_a;
+    up->idx_parent = a->idx_parent;
+    a->idx_parent = idx_up;
+
+    if (up->idx_parent == NO_NODE) {
+        tree->idx_root = idx_up;
+    } else {
+        Node *up_parent = tree->nodes[up->idx_parent];
+        if (up_parent->idx_left == idx_a) {
+            up_parent->idx_left = idx_up;
+        } else {
+            up_parent->idx_right = idx_up;
+        }
+    }
+
+    // Keep the taller of `up`'s children, and give the shorter one to `a`.
+    u32 idx_kept = (f->height > g->height) ? idx_f : idx_g;
+    u32 idx_given = (f->height > g->height) ? idx_g : idx_f;
+    Node *kept = tree->nodes[idx_kept];
+    Node *given = tree->nodes[idx_given];
+
+    up->idx_right = idx_kept;
+    if (is_right_taller) {
+        a->idx_right = idx_given;
+    } else {
+        a->idx_left = idx_given;
+    }
+    given->idx_parent = idx_a;
+
+    a->aabb = spatial::merge_aabbs(&other->aabb, &given->aabb);
+    a->height = 1 + max(other->height, given->height);
+    a->layers = other->layers | given->layers;
+    up->aabb = spatial::merge_aabbs(&a->aabb, &kept->aabb);
+    up->height = 1 + max(a->height, kept->height);
+    up->layers = a->layers | kept->layers;
+
+    return idx_up;
+}
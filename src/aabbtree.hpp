@@ -0,0 +1,186 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "array.hpp"
+#include "entities.hpp"
+#include "spatial.hpp"
+
+/*!
+    A dynamic bounding volume tree of AABBs, used as a broadphase, so that we
+    don't have to test every object against every other object.
+
+    Each leaf holds a "fat" AABB, which is a bit bigger than the object it
+    contains. When an object moves, we only have to take it out of the tree
+    and put it back in if it's left its fat AABB, which doesn't happen every
+    frame.
+
+    Each node also stores the layers of everything under it, as bit flags, so
+    that queries can skip whole subtrees that don't contain any of the layers
+    they're looking for, without looking at their AABBs.
+
+    Resources
+    ---------
+    This is heavily based on the dynamic tree in Erin Catto's Box2D.
+
+    erincatto/box2d/blob/main/src/collision/b2_dynamic_tree.cpp
+*/
+class aabbtree {
+public:
+    // NOTE: 0 is an invalid node index.
+    static constexpr u32 NO_NODE = 0;
+    static constexpr f32 FAT_AABB_MARGIN = 0.1f;
+    static constexpr u32 MAX_STACK_DEPTH = 256;
+    static constexpr u32 ALL_LAYERS = 0xFFFFFFFF;
+
+    struct Node {
+        // For leaves, this is the fat AABB.
+        spatial::Aabb aabb;
+        // For nodes in the free list, this is the next free node.
+        u32 idx_parent;
+        u32 idx_left;
+        u32 idx_right;
+        // Leaves have height 0, free nodes have height -1.
+        i32 height;
+        // For leaves, the layers of the object. For other nodes, the union of
+        // their children's layers.
+        u32 layers;
+        entities::Handle entity_handle;
+    };
+
+    struct Tree {
+        Array<Node> nodes;
+        u32 idx_root;
+        u32 idx_free_list;
+        u32 n_leaves;
+    };
+
+    static void init_tree(Tree *tree, memory::Pool *memory_pool, u32 max_n_leaves);
+    static void clear(Tree *tree);
+    static u32 insert(
+        Tree *tree,
+        entities::Handle entity_handle,
+        spatial::Aabb *aabb,
+        u32 layers
+    );
+    static void remove(Tree *tree, u32 idx_leaf);
+    static bool move(Tree *tree, u32 idx_leaf, spatial::Aabb *aabb);
+    static void set_layers(Tree *tree, u32 idx_leaf, u32 layers);
+    static Node * get_node(Tree *tree, u32 idx_node);
+    static u32 get_height(Tree *tree);
+
+    static bool is_leaf(Node *node) {
+        return node->idx_left == NO_NODE;
+    }
+
+    // Calls `fn(entity_handle)` for every leaf on one of `layer_mask`'s layers
+    // whose fat AABB overlaps `aabb`. If `fn` returns false, we stop.
+    template <typename F>
+        static void query_aabb(Tree *tree, spatial::Aabb *aabb, u32 layer_mask, F fn) {
+            u32 stack[MAX_STACK_DEPTH];
+            u32 n_stack = 0;
+            if (tree->idx_root != NO_NODE) {
+                stack[n_stack++] = tree->idx_root;
+            }
+            while (n_stack > 0) {
+                Node *node = tree->nodes[stack[--n_stack]];
+                if (
+                    !(node->layers & layer_mask) ||
+                    !spatial::do_aabbs_overlap(&node->aabb, aabb)
+                ) {
+                    continue;
+                }
+                if (is_leaf(node)) {
+                    if (!fn(node->entity_handle)) {
+                        return;
+                    }
+                } else {
+                    assert(n_stack + 2 <= MAX_STACK_DEPTH);
+                    stack[n_stack++] = node->idx_left;
+                    stack[n_stack++] = node->idx_right;
+                }
+            }
+        }
+
+    // Calls `fn(entity_handle)` for every leaf on one of `layer_mask`'s layers
+    // whose fat AABB is hit by `ray` within `max_distance`. If `fn` returns
+    // false, we stop.
+    template <typename F>
+        static void query_ray(
+            Tree *tree,
+            spatial::Ray *ray,
+            f32 max_distance,
+            u32 layer_mask,
+            F fn
+        ) {
+            u32 stack[MAX_STACK_DEPTH];
+            u32 n_stack = 0;
+            if (tree->idx_root != NO_NODE) {
+                stack[n_stack++] = tree->idx_root;
+            }
+            while (n_stack > 0) {
+                Node *node = tree->nodes[stack[--n_stack]];
+                if (
+                    !(node->layers & layer_mask) ||
+                    !spatial::intersect_aabb_ray(&node->aabb, ray, max_distance)
+                ) {
+                    continue;
+                }
+                if (is_leaf(node)) {
+                    if (!fn(node->entity_handle)) {
+                        return;
+                    }
+                } else {
+                    assert(n_stack + 2 <= MAX_STACK_DEPTH);
+                    stack[n_stack++] = node->idx_left;
+                    stack[n_stack++] = node->idx_right;
+                }
+            }
+        }
+
+    // Like `query_ray()`, but `fn(entity_handle, max_distance)` returns a new
+    // max distance, so that once we've found a hit, we can skip everything
+    // behind it. If `fn` returns 0, we stop.
+    template <typename F>
+        static void cast_ray(
+            Tree *tree,
+            spatial::Ray *ray,
+            f32 max_distance,
+            u32 layer_mask,
+            F fn
+        ) {
+            u32 stack[MAX_STACK_DEPTH];
+            u32 n_stack = 0;
+            if (tree->idx_root != NO_NODE) {
+                stack[n_stack++] = tree->idx_root;
+            }
+            while (n_stack > 0) {
+                Node *node = tree->nodes[stack[--n_stack]];
+                if (
+                    !(node->layers & layer_mask) ||
+                    !spatial::intersect_aabb_ray(&node->aabb, ray, max_distance)
+                ) {
+                    continue;
+                }
+                if (is_leaf(node)) {
+                    max_distance = fn(node->entity_handle, max_distance);
+                    if (max_distance <= 0.0f) {
+                        return;
+                    }
+                } else {
+                    assert(n_stack + 2 <= MAX_STACK_DEPTH);
+                    stack[n_stack++] = node->idx_left;
+                    stack[n_stack++] = node->idx_right;
+                }
+            }
+        }
+
+private:
+    static u32 allocate_node(Tree *tree);
+    static void free_node(Tree *tree, u32 idx_node);
+    static void insert_leaf(Tree *tree, u32 idx_leaf);
+    static void remove_leaf(Tree *tree, u32 idx_leaf);
+    static void refit_ancestors(Tree *tree, u32 idx_node);
+    static u32 balance(Tree *tree, u32 idx_a);
+};
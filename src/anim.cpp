@@ -1,8 +1,10 @@
 // (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
 
+#include "../src_external/pstr.h"
 #include "util.hpp"
 #include "logs.hpp"
 #include "engine.hpp"
+#include "tasks.hpp"
 #include "anim.hpp"
 #include "intrinsics.hpp"
 
@@ -13,130 +15,377 @@ anim::State *anim::state = nullptr;
 bool
 anim::is_animation_component_valid(anim::Component *animation_component)
 {
-    return animation_component->n_bones > 0 &&
-        animation_component->n_animations > 0;
+    return animation_component->skeleton &&
+        is_skeleton_valid(animation_component->skeleton);
 }
 
 
-u32
-anim::push_to_bone_matrix_pool()
+bool
+anim::is_skeleton_valid(anim::Skeleton *skeleton)
 {
-    return anim::state->bone_matrix_pool.n_bone_matrix_sets++;
+    return skeleton->n_bones > 0 && skeleton->n_animations > 0;
 }
 
 
-m4 *
-anim::get_bone_matrix(u32 idx, u32 idx_bone, u32 idx_anim_key)
+void
+anim::update()
 {
-    return anim::state->bone_matrix_pool.bone_matrices[
-        idx * MAX_N_ANIM_KEYS * MAX_N_BONES +
-            idx_anim_key * MAX_N_BONES +
-            idx_bone
-    ];
+    Array<Component> *components = get_components();
+    update_batch(components->begin(), (u32)(components->end() - components->begin()),
+        engine::get_dt());
 }
 
 
+/*!
+    Moves each of `animation_components` on by `dt` seconds and rebuilds
+    their bone matrices, spread over our worker threads. Invalid components
+    are skipped.
+*/
 void
-anim::update()
+anim::update_batch(anim::Component *animation_components, u32 n_components, f64 dt)
 {
+    UpdateBatchJob job = {
+        .animation_components = animation_components,
+        .dt = dt,
+    };
+    tasks::parallel_for(n_components, UPDATE_BATCH_SIZE, run_update_batch_job, &job);
+}
+
+
+/*!
+    Sets up `animation_component` to play `skeleton`'s animations, starting
+    with the first one, and gives it bone matrices from the pool. If
+    `skeleton` has nothing to play, the component is left invalid.
+*/
+void
+anim::make_component(
+    anim::Component *animation_component,
+    entities::Handle entity_handle,
+    anim::Skeleton *skeleton
+) {
+    *animation_component = {
+        .entity_handle = entity_handle,
+    };
+    if (!is_skeleton_valid(skeleton)) {
+        return;
+    }
+    animation_component->skeleton = skeleton;
+    add_layer(animation_component, 0, 1.0f);
+
+    Array<m4> *bone_matrix_pool = &anim::state->bone_matrix_pool;
+    // The bone matrices for each component are next to each other.
+    animation_component->bone_matrices = bone_matrix_pool->push(m4(1.0f));
+    range (1, skeleton->n_bones) {
+        bone_matrix_pool->push(m4(1.0f));
+    }
+}
+
+
+/*!
+    Frees the bone matrices after the last ones any valid component is still
+    using, so that the ones belonging to entities we've just destroyed can
+    be reused.
+*/
+void
+anim::release_unused_bone_matrices()
+{
+    Array<m4> *bone_matrix_pool = &anim::state->bone_matrix_pool;
+    u32 n_used_bone_matrices = 0;
     each (animation_component, *get_components()) {
         if (!is_animation_component_valid(animation_component)) {
             continue;
         }
+        u32 idx_end = (u32)(animation_component->bone_matrices - bone_matrix_pool->items) +
+            animation_component->skeleton->n_bones;
+        n_used_bone_matrices = max(n_used_bone_matrices, idx_end);
+    }
+    if (n_used_bone_matrices < bone_matrix_pool->length) {
+        bone_matrix_pool->delete_elements_after_index(n_used_bone_matrices);
+    }
+}
 
-        Animation *animation = &animation_component->animations[0];
-
-        range_named (idx_bone, 0, animation_component->n_bones) {
-            Bone *bone = &animation_component->bones[idx_bone];
 
-            // If we have no anim keys, just return the identity matrix.
-            if (bone->n_anim_keys == 0) {
-                animation_component->bone_matrices[idx_bone] = m4(1.0f);
+/*!
+    Starts playing `idx_animation` on top of whatever `animation_component`
+    is already playing, looping from the start at normal speed. Returns the
+    new layer, so its settings can be changed, or nullptr if there is no room
+    for it.
+*/
+anim::Layer *
+anim::add_layer(anim::Component *animation_component, u32 idx_animation, f32 weight)
+{
+    if (animation_component->n_layers >= MAX_N_ANIM_LAYERS) {
+        logs::warning("Could not add animation layer, as we already have %u",
+            animation_component->n_layers);
+        return nullptr;
+    }
+    assert(idx_animation < animation_component->skeleton->n_animations);
+    Layer *layer = &animation_component->layers[animation_component->n_layers++];
+    *layer = {
+        .idx_animation = idx_animation,
+        .speed = 1.0f,
+        .weight = weight,
+        .target_weight = weight,
+        .is_looping = true,
+    };
+    return layer;
+}
 
-                // If we only have one anim key, just return that.
-            } else if (bone->n_anim_keys == 1) {
-                animation_component->bone_matrices[idx_bone] = *get_bone_matrix(
-                    animation->idx_bone_matrix_set, idx_bone, 0);
 
-                // If we have multiple anim keys, find the right ones and interpolate.
-            } else {
-                f64 animation_timepoint = fmod(engine::get_t(), animation->duration);
+/*!
+    Moves `layer`'s weight to `target_weight` over `fade_duration` seconds,
+    or straight away if `fade_duration` is zero. Layers that fade out to
+    nothing are removed.
+*/
+void
+anim::fade_layer(anim::Layer *layer, f32 target_weight, f32 fade_duration)
+{
+    layer->target_weight = target_weight;
+    if (fade_duration > 0.0f) {
+        layer->fade_rate = abs(target_weight - layer->weight) / fade_duration;
+    } else {
+        layer->weight = target_weight;
+        layer->fade_rate = 0.0f;
+    }
+}
 
-                u32 idx_anim_key = get_bone_matrix_anim_key_for_timepoint(
-                    animation_component,
-                    animation_timepoint, animation->idx_bone_matrix_set,
-                    idx_bone);
 
-                f64 t0 = *get_bone_matrix_time(
-                    animation->idx_bone_matrix_set, idx_bone, idx_anim_key);
-                m4 transform_t0 = *get_bone_matrix(
-                    animation->idx_bone_matrix_set, idx_bone, idx_anim_key);
+/*!
+    Crossfades from whatever `animation_component` is playing to
+    `idx_animation`, over `fade_duration` seconds. If there's no room for
+    another layer, we make room by dropping the quietest one.
+*/
+anim::Layer *
+anim::play(anim::Component *animation_component, u32 idx_animation, f32 fade_duration)
+{
+    if (animation_component->n_layers >= MAX_N_ANIM_LAYERS) {
+        u32 idx_quietest = 0;
+        range (1, animation_component->n_layers) {
+            if (
+                animation_component->layers[idx].weight <
+                animation_component->layers[idx_quietest].weight
+            ) {
+                idx_quietest = idx;
+            }
+        }
+        animation_component->n_layers--;
+        animation_component->layers[idx_quietest] =
+            animation_component->layers[animation_component->n_layers];
+    }
 
-                f64 t1 = *get_bone_matrix_time(
-                    animation->idx_bone_matrix_set, idx_bone, idx_anim_key + 1);
-                m4 transform_t1 = *get_bone_matrix(
-                    animation->idx_bone_matrix_set, idx_bone, idx_anim_key + 1);
+    range (0, animation_component->n_layers) {
+        fade_layer(&animation_component->layers[idx], 0.0f, fade_duration);
+    }
+    // Layers that were faded out straight away can go now.
+    if (fade_duration <= 0.0f) {
+        animation_component->n_layers = 0;
+    }
 
-                f32 lerp_factor = (f32)((animation_timepoint - t0) / (t1 - t0));
+    Layer *layer = add_layer(animation_component, idx_animation, 0.0f);
+    fade_layer(layer, 1.0f, fade_duration);
+    return layer;
+}
 
-                // NOTE: This is probably bad if we have scaling in our transform?
-                m4 interpolated_matrix =
-                    (transform_t0 * (1.0f - lerp_factor)) + (transform_t1 * lerp_factor);
 
-                animation_component->bone_matrices[idx_bone] = interpolated_matrix;
-            }
+bool
+anim::find_animation(anim::Skeleton *skeleton, char const *name, u32 *idx_animation)
+{
+    range (0, skeleton->n_animations) {
+        if (pstr_eq(skeleton->animations[idx].name, name)) {
+            *idx_animation = idx;
+            return true;
         }
     }
+    return false;
 }
 
 
+/*!
+    Compresses the keys from `ai_animation` into `animation`, making one
+    channel for each of `skeleton`'s bones. The bones must already be loaded.
+*/
 void
-anim::make_bone_matrices_for_animation_bone(
-    anim::Component *animation_component,
-    aiNodeAnim *ai_channel,
-    u32 idx_animation,
-    u32 idx_bone
+anim::make_animation(
+    anim::Skeleton *skeleton,
+    anim::Animation *animation,
+    aiAnimation *ai_animation
 ) {
-    assert(ai_channel->mNumPositionKeys == ai_channel->mNumRotationKeys);
-    assert(ai_channel->mNumPositionKeys == ai_channel->mNumScalingKeys);
+    f64 ticks_per_second = ai_animation->mTicksPerSecond > 0.0 ?
+        ai_animation->mTicksPerSecond : DEFAULT_TICKS_PER_SECOND;
 
-    Bone *bone = &animation_component->bones[idx_bone];
-    bone->n_anim_keys = ai_channel->mNumPositionKeys;
+    *animation = {
+        .duration = ai_animation->mDuration / ticks_per_second,
+    };
+    pstr_copy(animation->name, MAX_NODE_NAME_LENGTH, ai_animation->mName.C_Str());
 
-    range_named (idx_anim_key, 0, bone->n_anim_keys) {
-        assert(ai_channel->mPositionKeys[idx_anim_key].mTime ==
-            ai_channel->mRotationKeys[idx_anim_key].mTime);
-        assert(ai_channel->mPositionKeys[idx_anim_key].mTime ==
-            ai_channel->mScalingKeys[idx_anim_key].mTime);
-        f64 anim_key_time = ai_channel->mPositionKeys[idx_anim_key].mTime;
+    u32 n_bones = skeleton->n_bones;
+    if (n_bones == 0) {
+        return;
+    }
 
-        m4 *bone_matrix = get_bone_matrix(
-            animation_component->animations[idx_animation].idx_bone_matrix_set,
-            idx_bone, idx_anim_key);
+    memory::Pool temp_memory_pool = {};
+    defer { memory::destroy_memory_pool(&temp_memory_pool); };
+
+    // Work out which keys we're keeping first, so that we know how much
+    // memory we need.
+    ReducedChannel *reduced_channels = (ReducedChannel*)memory::push(&temp_memory_pool,
+        n_bones * sizeof(ReducedChannel), "anim_reduced_channels");
+    u32 n_v3_keys = 0;
+    u32 n_quat_keys = 0;
+    range_named (idx_bone, 0, n_bones) {
+        ReducedChannel *reduced_channel = &reduced_channels[idx_bone];
+        *reduced_channel = {};
+
+        Bone *bone = &skeleton->bones[idx_bone];
+        aiNodeAnim *ai_channel = nullptr;
+        range_named (idx_channel, 0, ai_animation->mNumChannels) {
+            if (pstr_eq(ai_animation->mChannels[idx_channel]->mNodeName.C_Str(), bone->name)) {
+                ai_channel = ai_animation->mChannels[idx_channel];
+                break;
+            }
+        }
+
+        if (!ai_channel) {
+            // No channel for this bone. Maybe it's just not animated, in which
+            // case it keeps its rest transform.
+            continue;
+        }
 
-        f64 *time = get_bone_matrix_time(
-            animation_component->animations[idx_animation].idx_bone_matrix_set,
-            idx_bone, idx_anim_key);
+        reduced_channel->ai_channel = ai_channel;
+        reduced_channel->translation_key_idxs = (u32*)memory::push(&temp_memory_pool,
+            ai_channel->mNumPositionKeys * sizeof(u32), "anim_translation_key_idxs");
+        reduced_channel->n_translation_keys = reduce_keys(ai_channel->mPositionKeys,
+            ai_channel->mNumPositionKeys, MAX_TRANSLATION_ERROR,
+            reduced_channel->translation_key_idxs);
+        reduced_channel->rotation_key_idxs = (u32*)memory::push(&temp_memory_pool,
+            ai_channel->mNumRotationKeys * sizeof(u32), "anim_rotation_key_idxs");
+        reduced_channel->n_rotation_keys = reduce_keys(ai_channel->mRotationKeys,
+            ai_channel->mNumRotationKeys, MAX_ROTATION_ERROR,
+            reduced_channel->rotation_key_idxs);
+        reduced_channel->scale_key_idxs = (u32*)memory::push(&temp_memory_pool,
+            ai_channel->mNumScalingKeys * sizeof(u32), "anim_scale_key_idxs");
+        reduced_channel->n_scale_keys = reduce_keys(ai_channel->mScalingKeys,
+            ai_channel->mNumScalingKeys, MAX_SCALE_ERROR,
+            reduced_channel->scale_key_idxs);
+
+        n_v3_keys += reduced_channel->n_translation_keys + reduced_channel->n_scale_keys;
+        n_quat_keys += reduced_channel->n_rotation_keys;
+    }
+
+    animation->memory_pool = {
+        .size = n_bones * sizeof(Channel) +
+            n_v3_keys * (sizeof(u16) + sizeof(PackedV3)) +
+            n_quat_keys * (sizeof(u16) + sizeof(PackedQuat)),
+    };
+    animation->channels = (Channel*)memory::push(&animation->memory_pool,
+        n_bones * sizeof(Channel), "anim_channels");
+    animation->v3_key_times = (u16*)memory::push(&animation->memory_pool,
+        n_v3_keys * sizeof(u16), "anim_v3_key_times");
+    animation->v3_key_values = (PackedV3*)memory::push(&animation->memory_pool,
+        n_v3_keys * sizeof(PackedV3), "anim_v3_key_values");
+    animation->quat_key_times = (u16*)memory::push(&animation->memory_pool,
+        n_quat_keys * sizeof(u16), "anim_quat_key_times");
+    animation->quat_key_values = (PackedQuat*)memory::push(&animation->memory_pool,
+        n_quat_keys * sizeof(PackedQuat), "anim_quat_key_values");
+
+    u32 n_packed_v3_keys = 0;
+    u32 n_packed_quat_keys = 0;
+    range_named (idx_bone, 0, n_bones) {
+        ReducedChannel *reduced_channel = &reduced_channels[idx_bone];
+        Channel *channel = &animation->channels[idx_bone];
+        *channel = {};
+        aiNodeAnim *ai_channel = reduced_channel->ai_channel;
+        if (!ai_channel) {
+            continue;
+        }
+        channel->translation = pack_v3_track(animation, &n_packed_v3_keys,
+            ai_channel->mPositionKeys, reduced_channel->translation_key_idxs,
+            reduced_channel->n_translation_keys, ticks_per_second);
+        channel->rotation = pack_quat_track(animation, &n_packed_quat_keys,
+            ai_channel->mRotationKeys, reduced_channel->rotation_key_idxs,
+            reduced_channel->n_rotation_keys, ticks_per_second);
+        channel->scale = pack_v3_track(animation, &n_packed_v3_keys,
+            ai_channel->mScalingKeys, reduced_channel->scale_key_idxs,
+            reduced_channel->n_scale_keys, ticks_per_second);
+    }
+}
 
-        m4 parent_transform = m4(1.0f);
 
-        if (idx_bone > 0) {
-            parent_transform = *get_bone_matrix(
-                animation_component->animations[idx_animation].idx_bone_matrix_set,
-                bone->idx_parent, idx_anim_key);
+void
+anim::destroy_skeleton(anim::Skeleton *skeleton)
+{
+    range (0, skeleton->n_animations) {
+        Animation *animation = &skeleton->animations[idx];
+        if (animation->memory_pool.memory) {
+            memory::destroy_memory_pool(&animation->memory_pool);
         }
+    }
+    *skeleton = {};
+}
+
+
+/*!
+    Gets `bone`'s transform relative to its parent at time `t` in
+    `animation`, where `idx_bone` is the bone's index in its skeleton.
+*/
+anim::BoneTransform
+anim::sample_bone(anim::Animation *animation, anim::Bone *bone, u32 idx_bone, f32 t)
+{
+    return sample_channel(animation, bone, idx_bone, get_packed_t(animation, t));
+}
 
-        m4 translation = glm::translate(m4(1.0f),
-            util::aiVector3D_to_glm(&ai_channel->mPositionKeys[idx_anim_key].mValue));
-        m4 rotation = glm::toMat4(normalize(
-            util::aiQuaternion_to_glm(&ai_channel->mRotationKeys[idx_anim_key].mValue)
-        ));
-        m4 scaling = glm::scale(m4(1.0f),
-            util::aiVector3D_to_glm(&ai_channel->mScalingKeys[idx_anim_key].mValue));
 
-        m4 anim_transform = translation * rotation * scaling;
-        *bone_matrix = parent_transform * anim_transform;
-        *time = anim_key_time;
+/*!
+    Fills in `bone_matrices`, which has one matrix for each of `skeleton`'s
+    bones, by blending `layers` together. We do this in one pass over the
+    bones, which works because each bone's parent comes before it.
+*/
+void
+anim::make_bone_matrices(
+    anim::Skeleton *skeleton,
+    anim::Layer const *layers,
+    u32 n_layers,
+    m4 *bone_matrices
+) {
+    // Work out everything that's the same for every bone up front, and skip
+    // the layers we can't see.
+    LayerSample samples[MAX_N_ANIM_LAYERS];
+    u32 n_samples = 0;
+    f32 total_weight = 0.0f;
+    range (0, n_layers) {
+        Layer const *layer = &layers[idx];
+        if (layer->weight <= 0.0f) {
+            continue;
+        }
+        Animation *animation = &skeleton->animations[layer->idx_animation];
+        samples[n_samples++] = {
+            .animation = animation,
+            .packed_t = get_packed_t(animation, (f32)layer->time),
+            .weight = layer->weight,
+        };
+        total_weight += layer->weight;
+    }
+    range (0, n_samples) {
+        samples[idx].weight /= total_weight;
+    }
+
+    // Each bone's transform into the model's space, including the scene root
+    // transform.
+    m4 global_transforms[MAX_N_BONES];
+
+    range_named (idx_bone, 0, skeleton->n_bones) {
+        Bone *bone = &skeleton->bones[idx_bone];
+        BoneTransform local_transform = blend_bone(bone, idx_bone, samples, n_samples);
+        m4 local_matrix = make_bone_transform_matrix(&local_transform);
+
+        // The root is marked as its own parent, so we start it off from the
+        // scene root instead.
+        m4 const *parent_transform = idx_bone == 0 ?
+            &skeleton->scene_root_transform :
+            &global_transforms[bone->idx_parent];
+        multiply_matrices(parent_transform, &local_matrix, &global_transforms[idx_bone]);
+        multiply_matrices(&global_transforms[idx_bone], &bone->offset,
+            &bone_matrices[idx_bone]);
     }
 }
 
@@ -177,54 +426,519 @@ void
 anim::init(anim::State *anim_state, memory::Pool *asset_memory_pool)
 {
     anim::state = anim_state;
-    anim::state->bone_matrix_pool.bone_matrices = Array<m4>(asset_memory_pool,
-        MAX_N_ANIMATED_MODELS * MAX_N_BONES * MAX_N_ANIMATIONS * MAX_N_ANIM_KEYS,
-        "bone_matrices", true);
-    anim::state->bone_matrix_pool.times = Array<f64>(asset_memory_pool,
-        MAX_N_ANIMATED_MODELS * MAX_N_BONES * MAX_N_ANIMATIONS * MAX_N_ANIM_KEYS,
-        "bone_matrix_times", true);
     anim::state->components =  Array<anim::Component>(
         asset_memory_pool, MAX_N_ENTITIES, "animation_components", true, 1);
+    anim::state->bone_matrix_pool = Array<m4>(
+        asset_memory_pool, MAX_N_ENTITIES * MAX_N_BONES, "bone_matrix_pool");
+}
+
+
+/*!
+    Picks which of `keys` we need to keep so that interpolating between them
+    gets within `max_error` of every key, and puts their indices in
+    `kept_key_idxs`, which must have room for `n_keys`. Returns how many we
+    kept. We greedily make each stretch between kept keys as long as we can,
+    which isn't always the fewest keys, but is close, and only takes one pass.
+*/
+template <typename T>
+u32
+anim::reduce_keys(T *keys, u32 n_keys, f32 max_error, u32 *kept_key_idxs)
+{
+    if (n_keys == 0) {
+        return 0;
+    }
+
+    kept_key_idxs[0] = 0;
+    u32 n_kept_keys = 1;
+
+    // Lots of tracks never change, and only need one key.
+    bool is_constant = true;
+    range (1, n_keys) {
+        if (get_key_error(keys, 0, 0, idx) > max_error) {
+            is_constant = false;
+            break;
+        }
+    }
+    if (is_constant) {
+        return n_kept_keys;
+    }
+
+    u32 idx_start = 0;
+    range_named (idx_end, 2, n_keys) {
+        range_named (idx_key, idx_start + 1, idx_end) {
+            if (get_key_error(keys, idx_start, idx_end, idx_key) > max_error) {
+                idx_start = idx_end - 1;
+                kept_key_idxs[n_kept_keys++] = idx_start;
+                break;
+            }
+        }
+    }
+    kept_key_idxs[n_kept_keys++] = n_keys - 1;
+    return n_kept_keys;
+}
+
+
+/*!
+    Gets how far off we'd be at key `idx_key` if we interpolated between keys
+    `idx_start` and `idx_end` instead.
+*/
+f32
+anim::get_key_error(aiVectorKey *keys, u32 idx_start, u32 idx_end, u32 idx_key)
+{
+    f64 key_duration = keys[idx_end].mTime - keys[idx_start].mTime;
+    f32 lerp_factor = key_duration > 0.0 ?
+        (f32)((keys[idx_key].mTime - keys[idx_start].mTime) / key_duration) : 0.0f;
+    v3 start = util::aiVector3D_to_glm(&keys[idx_start].mValue);
+    v3 end = util::aiVector3D_to_glm(&keys[idx_end].mValue);
+    v3 error = abs(start + (end - start) * lerp_factor -
+        util::aiVector3D_to_glm(&keys[idx_key].mValue));
+    return max(max(error.x, error.y), error.z);
+}
+
+
+f32
+anim::get_key_error(aiQuatKey *keys, u32 idx_start, u32 idx_end, u32 idx_key)
+{
+    f64 key_duration = keys[idx_end].mTime - keys[idx_start].mTime;
+    f32 lerp_factor = key_duration > 0.0 ?
+        (f32)((keys[idx_key].mTime - keys[idx_start].mTime) / key_duration) : 0.0f;
+    quat interpolated = interpolate_rotation(
+        normalize(util::aiQuaternion_to_glm(&keys[idx_start].mValue)),
+        normalize(util::aiQuaternion_to_glm(&keys[idx_end].mValue)),
+        lerp_factor);
+    quat difference = interpolated *
+        glm::conjugate(normalize(util::aiQuaternion_to_glm(&keys[idx_key].mValue)));
+    // This is more precise than taking the acos of the dot product, which
+    // is far off for the tiny angles we care about here.
+    return 2.0f * atan2(length(v3(difference.x, difference.y, difference.z)),
+        abs(difference.w));
+}
+
+
+/*!
+    Packs the keys at `key_idxs` in `ai_keys` into `animation`, after the
+    `n_packed_keys` v3 keys that are already there.
+*/
+anim::V3Track
+anim::pack_v3_track(
+    anim::Animation *animation,
+    u32 *n_packed_keys,
+    aiVectorKey *ai_keys,
+    u32 const *key_idxs,
+    u32 n_keys,
+    f64 ticks_per_second
+) {
+    V3Track track = {
+        .idx_first_key = *n_packed_keys,
+        .n_keys = n_keys,
+    };
+    if (n_keys == 0) {
+        return track;
+    }
+
+    v3 range_max = v3(-FLT_MAX);
+    track.range_min = v3(FLT_MAX);
+    range (0, n_keys) {
+        v3 value = util::aiVector3D_to_glm(&ai_keys[key_idxs[idx]].mValue);
+        track.range_min = min(track.range_min, value);
+        range_max = max(range_max, value);
+    }
+    track.range_step = (range_max - track.range_min) / MAX_PACKED_V3_VALUE;
+
+    range (0, n_keys) {
+        aiVectorKey *ai_key = &ai_keys[key_idxs[idx]];
+        v3 value = util::aiVector3D_to_glm(&ai_key->mValue);
+        PackedV3 *packed_value = &animation->v3_key_values[track.idx_first_key + idx];
+        range_named (idx_component, 0, 3) {
+            f32 step = track.range_step[idx_component];
+            packed_value->values[idx_component] = step > 0.0f ?
+                (u16)round((value[idx_component] - track.range_min[idx_component]) / step) : 0;
+        }
+        animation->v3_key_times[track.idx_first_key + idx] =
+            pack_time(animation, ai_key->mTime / ticks_per_second);
+    }
+
+    *n_packed_keys += n_keys;
+    return track;
+}
+
+
+anim::QuatTrack
+anim::pack_quat_track(
+    anim::Animation *animation,
+    u32 *n_packed_keys,
+    aiQuatKey *ai_keys,
+    u32 const *key_idxs,
+    u32 n_keys,
+    f64 ticks_per_second
+) {
+    QuatTrack track = {
+        .idx_first_key = *n_packed_keys,
+        .n_keys = n_keys,
+    };
+    range (0, n_keys) {
+        aiQuatKey *ai_key = &ai_keys[key_idxs[idx]];
+        animation->quat_key_values[track.idx_first_key + idx] =
+            pack_quat(util::aiQuaternion_to_glm(&ai_key->mValue));
+        animation->quat_key_times[track.idx_first_key + idx] =
+            pack_time(animation, ai_key->mTime / ticks_per_second);
+    }
+    *n_packed_keys += n_keys;
+    return track;
 }
 
 
-f64 *
-anim::get_bone_matrix_time(
-    u32 idx,
+void
+anim::run_update_batch_job(void *data, u32 idx_start, u32 idx_end)
+{
+    UpdateBatchJob *job = (UpdateBatchJob*)data;
+    range (idx_start, idx_end) {
+        Component *animation_component = &job->animation_components[idx];
+        if (!is_animation_component_valid(animation_component)) {
+            continue;
+        }
+        advance_layers(animation_component, job->dt);
+        make_bone_matrices(animation_component->skeleton, animation_component->layers,
+            animation_component->n_layers, animation_component->bone_matrices);
+    }
+}
+
+
+/*!
+    Moves each of `animation_component`'s layers on by `dt` seconds, and
+    removes the ones that have finished fading out.
+*/
+void
+anim::advance_layers(anim::Component *animation_component, f64 dt)
+{
+    u32 n_remaining_layers = 0;
+    range (0, animation_component->n_layers) {
+        Layer layer = animation_component->layers[idx];
+        Animation *animation = &animation_component->skeleton->animations[layer.idx_animation];
+
+        layer.time += dt * layer.speed;
+        if (animation->duration > 0.0) {
+            if (layer.is_looping) {
+                layer.time = fmod(layer.time, animation->duration);
+                if (layer.time < 0.0) {
+                    layer.time += animation->duration;
+                }
+            } else {
+                layer.time = min(max(layer.time, 0.0), animation->duration);
+            }
+        }
+
+        f32 fade_step = layer.fade_rate * (f32)dt;
+        if (layer.weight < layer.target_weight) {
+            layer.weight = min(layer.weight + fade_step, layer.target_weight);
+        } else if (layer.weight > layer.target_weight) {
+            layer.weight = max(layer.weight - fade_step, layer.target_weight);
+        }
+
+        if (layer.weight <= 0.0f && layer.target_weight <= 0.0f) {
+            continue;
+        }
+        animation_component->layers[n_remaining_layers++] = layer;
+    }
+    animation_component->n_layers = n_remaining_layers;
+}
+
+
+u16
+anim::pack_time(anim::Animation *animation, f64 time)
+{
+    if (animation->duration <= 0.0) {
+        return 0;
+    }
+    f64 fraction = min(max(time / animation->duration, 0.0), 1.0);
+    return (u16)round(fraction * MAX_PACKED_TIME);
+}
+
+
+f32
+anim::get_packed_t(anim::Animation *animation, f32 t)
+{
+    if (animation->duration <= 0.0) {
+        return 0.0f;
+    }
+    return t / (f32)animation->duration * MAX_PACKED_TIME;
+}
+
+
+anim::BoneTransform
+anim::sample_channel(anim::Animation *animation, anim::Bone *bone, u32 idx_bone, f32 packed_t)
+{
+    if (!animation->channels) {
+        return bone->rest_transform;
+    }
+    Channel *channel = &animation->channels[idx_bone];
+    return {
+        .translation = sample_v3_track(animation, &channel->translation,
+            bone->rest_transform.translation, packed_t),
+        .rotation = sample_quat_track(animation, &channel->rotation,
+            bone->rest_transform.rotation, packed_t),
+        .scale = sample_v3_track(animation, &channel->scale,
+            bone->rest_transform.scale, packed_t),
+    };
+}
+
+
+/*!
+    Blends `bone`'s transforms from each of `samples`, whose weights must add
+    up to 1. Rotations are blended by adding up the weighted quaternions and
+    normalising, which is close enough to slerp for the small differences
+    we get between animations of the same skeleton, and works for any number
+    of them.
+*/
+anim::BoneTransform
+anim::blend_bone(
+    anim::Bone *bone,
     u32 idx_bone,
-    u32 idx_anim_key
+    anim::LayerSample const *samples,
+    u32 n_samples
 ) {
-    return anim::state->bone_matrix_pool.times[
-        idx * MAX_N_ANIM_KEYS * MAX_N_BONES +
-            idx_anim_key * MAX_N_BONES +
-            idx_bone
-    ];
+    if (n_samples == 0) {
+        return bone->rest_transform;
+    }
+    BoneTransform result = sample_channel(samples[0].animation, bone, idx_bone,
+        samples[0].packed_t);
+    if (n_samples == 1) {
+        return result;
+    }
+
+    simd::f32x4 first_rotation = quat_to_f32x4(result.rotation);
+    simd::f32x4 rotation = simd::mul(first_rotation, simd::set1(samples[0].weight));
+    result.translation *= samples[0].weight;
+    result.scale *= samples[0].weight;
+    range (1, n_samples) {
+        f32 weight = samples[idx].weight;
+        BoneTransform transform = sample_channel(samples[idx].animation, bone, idx_bone,
+            samples[idx].packed_t);
+        result.translation += transform.translation * weight;
+        result.scale += transform.scale * weight;
+        // q and -q are the same rotation, so make sure we add up the ones
+        // on the same side.
+        simd::f32x4 sample_rotation = quat_to_f32x4(transform.rotation);
+        f32 rotation_weight = simd::sum(simd::mul(sample_rotation, first_rotation)) < 0.0f ?
+            -weight : weight;
+        rotation = simd::add(rotation, simd::mul(sample_rotation, simd::set1(rotation_weight)));
+    }
+    result.rotation = f32x4_to_quat(normalize_quat(rotation));
+    return result;
+}
+
+
+/*!
+    Packs `rotation` as its three smallest components. Since the quaternion
+    is normalised, the largest component can be worked out from the others,
+    as long as we know which one it is, and that it's positive, which we can
+    always make it be by flipping the quaternion. The other components are
+    then all no bigger than `MAX_SMALLEST_QUAT_COMPONENT`.
+*/
+anim::PackedQuat
+anim::pack_quat(quat rotation)
+{
+    rotation = normalize(rotation);
+    u32 idx_largest = 0;
+    range (1, 4) {
+        if (abs(rotation[idx]) > abs(rotation[idx_largest])) {
+            idx_largest = idx;
+        }
+    }
+    if (rotation[idx_largest] < 0.0f) {
+        rotation = -rotation;
+    }
+
+    PackedQuat packed = {};
+    u32 idx_packed = 0;
+    range (0, 4) {
+        if (idx == idx_largest) {
+            continue;
+        }
+        f32 fraction = (rotation[idx] / MAX_SMALLEST_QUAT_COMPONENT + 1.0f) * 0.5f;
+        fraction = min(max(fraction, 0.0f), 1.0f);
+        packed.values[idx_packed] = (u16)round(fraction * MAX_PACKED_QUAT_VALUE);
+        idx_packed++;
+    }
+    packed.values[0] |= (u16)((idx_largest >> 1) << 15);
+    packed.values[1] |= (u16)((idx_largest & 1) << 15);
+    return packed;
 }
 
 
+quat
+anim::unpack_quat(anim::PackedQuat packed)
+{
+    u32 idx_largest = ((packed.values[0] >> 15) << 1) | (packed.values[1] >> 15);
+    quat rotation;
+    f32 sum_of_squares = 0.0f;
+    u32 idx_packed = 0;
+    range (0, 4) {
+        if (idx == idx_largest) {
+            continue;
+        }
+        f32 fraction = (f32)(packed.values[idx_packed] & PACKED_QUAT_VALUE_MASK) /
+            MAX_PACKED_QUAT_VALUE;
+        rotation[idx] = (fraction * 2.0f - 1.0f) * MAX_SMALLEST_QUAT_COMPONENT;
+        sum_of_squares += rotation[idx] * rotation[idx];
+        idx_packed++;
+    }
+    rotation[idx_largest] = sqrt(max(1.0f - sum_of_squares, 0.0f));
+    return rotation;
+}
+
+
+/*!
+    Finds the keys on either side of `packed_t` using a binary search, and returns
+    the index of the first one. `lerp_factor` is set to how far `t` is between
+    the two keys. `packed_t` is in the same units as the packed key times. If
+    it's before the first key or after the last one, we just use that key.
+    There must be at least two keys.
+*/
 u32
-anim::get_bone_matrix_anim_key_for_timepoint(
-    anim::Component *animation_component,
-    f64 animation_timepoint,
-    u32 idx_bone_matrix_set,
-    u32 idx_bone
+anim::find_key(u16 const *times, u32 n_keys, f32 packed_t, f32 *lerp_factor)
+{
+    assert(n_keys > 1);
+    u32 idx_low = 0;
+    u32 idx_high = n_keys - 1;
+    while (idx_high - idx_low > 1) {
+        u32 idx_mid = (idx_low + idx_high) / 2;
+        if ((f32)times[idx_mid] <= packed_t) {
+            idx_low = idx_mid;
+        } else {
+            idx_high = idx_mid;
+        }
+    }
+
+    f32 key_duration = (f32)times[idx_high] - (f32)times[idx_low];
+    *lerp_factor = key_duration > 0.0f ?
+        min(max((packed_t - (f32)times[idx_low]) / key_duration, 0.0f), 1.0f) :
+        0.0f;
+    return idx_low;
+}
+
+
+v3
+anim::sample_v3_track(anim::Animation *animation, anim::V3Track *track, v3 rest_value, f32 packed_t)
+{
+    if (track->n_keys == 0) {
+        return rest_value;
+    }
+    PackedV3 *values = &animation->v3_key_values[track->idx_first_key];
+    v3 packed_value;
+    if (track->n_keys == 1) {
+        packed_value = v3(values[0].values[0], values[0].values[1], values[0].values[2]);
+    } else {
+        f32 lerp_factor;
+        u32 idx_key = find_key(&animation->v3_key_times[track->idx_first_key],
+            track->n_keys, packed_t, &lerp_factor);
+        // Unpacking is linear, so we can interpolate the packed values.
+        v3 v0 = v3(values[idx_key].values[0], values[idx_key].values[1],
+            values[idx_key].values[2]);
+        v3 v1 = v3(values[idx_key + 1].values[0], values[idx_key + 1].values[1],
+            values[idx_key + 1].values[2]);
+        packed_value = v0 + (v1 - v0) * lerp_factor;
+    }
+    return track->range_min + track->range_step * packed_value;
+}
+
+
+quat
+anim::sample_quat_track(
+    anim::Animation *animation,
+    anim::QuatTrack *track,
+    quat rest_value,
+    f32 packed_t
 ) {
-    Bone *bone = &animation_component->bones[idx_bone];
-    assert(bone->n_anim_keys > 1);
-    u32 idx_anim_key = bone->last_anim_key;
-    do {
-        f64 t0 = *get_bone_matrix_time(idx_bone_matrix_set, idx_bone, idx_anim_key);
-        f64 t1 = *get_bone_matrix_time(idx_bone_matrix_set, idx_bone, idx_anim_key + 1);
-        if (animation_timepoint > t0 && animation_timepoint < t1) {
-            bone->last_anim_key = idx_anim_key;
-            return idx_anim_key;
-        }
-        idx_anim_key++;
-        assert(idx_anim_key < bone->n_anim_keys);
-        if (idx_anim_key == bone->n_anim_keys - 1) {
-            idx_anim_key = 0;
-        }
-    } while (idx_anim_key != bone->last_anim_key);
-    logs::fatal("Could not find anim key.");
-    return 0;
+    if (track->n_keys == 0) {
+        return rest_value;
+    }
+    PackedQuat *values = &animation->quat_key_values[track->idx_first_key];
+    if (track->n_keys == 1) {
+        return unpack_quat(values[0]);
+    }
+    f32 lerp_factor;
+    u32 idx_key = find_key(&animation->quat_key_times[track->idx_first_key],
+        track->n_keys, packed_t, &lerp_factor);
+    return interpolate_rotation(unpack_quat(values[idx_key]),
+        unpack_quat(values[idx_key + 1]), lerp_factor);
+}
+
+
+quat
+anim::interpolate_rotation(quat q0, quat q1, f32 lerp_factor)
+{
+    simd::f32x4 start = quat_to_f32x4(q0);
+    simd::f32x4 end = quat_to_f32x4(q1);
+    // q and -q are the same rotation, so flip one if needed to make sure we
+    // go the short way round.
+    f32 cos_angle = simd::sum(simd::mul(start, end));
+    f32 end_weight = cos_angle < 0.0f ? -lerp_factor : lerp_factor;
+    if (abs(cos_angle) >= MIN_NLERP_DOT) {
+        return f32x4_to_quat(normalize_quat(simd::add(
+            simd::mul(start, simd::set1(1.0f - lerp_factor)),
+            simd::mul(end, simd::set1(end_weight)))));
+    }
+    return glm::slerp(q0, cos_angle < 0.0f ? -q1 : q1, lerp_factor);
+}
+
+
+m4
+anim::make_bone_transform_matrix(anim::BoneTransform *transform)
+{
+    // This is translation * rotation * scale, without doing the whole
+    // multiplications.
+    m4 matrix = glm::toMat4(transform->rotation);
+    matrix[0] *= transform->scale.x;
+    matrix[1] *= transform->scale.y;
+    matrix[2] *= transform->scale.z;
+    matrix[3] = v4(transform->translation, 1.0f);
+    return matrix;
+}
+
+
+/*!
+    Sets `result` to `a * b`, which must not be the same matrix as `b`. Each
+    column of the result is the sum of `a`'s columns, weighted by the
+    corresponding column of `b`, so we can work on whole columns at once.
+*/
+void
+anim::multiply_matrices(m4 const *a, m4 const *b, m4 *result)
+{
+    simd::f32x4 a_columns[4];
+    range (0, 4) {
+        a_columns[idx] = simd::load(&(*a)[idx][0]);
+    }
+    range_named (idx_column, 0, 4) {
+        simd::f32x4 column = simd::mul(a_columns[0], simd::set1((*b)[idx_column][0]));
+        range (1, 4) {
+            column = simd::add(column,
+                simd::mul(a_columns[idx], simd::set1((*b)[idx_column][idx])));
+        }
+        simd::store(&(*result)[idx_column][0], column);
+    }
+}
+
+
+simd::f32x4
+anim::quat_to_f32x4(quat q)
+{
+    f32 values[4] = { q.x, q.y, q.z, q.w };
+    return simd::load(values);
+}
+
+
+quat
+anim::f32x4_to_quat(simd::f32x4 q)
+{
+    f32 values[4];
+    simd::store(values, q);
+    return quat(values[3], values[0], values[1], values[2]);
+}
+
+
+simd::f32x4
+anim::normalize_quat(simd::f32x4 q)
+{
+    return simd::mul(q, simd::set1(1.0f / sqrt(simd::sum(simd::mul(q, q)))));
 }
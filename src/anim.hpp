@@ -5,60 +5,216 @@
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
 #include "types.hpp"
+#include "simd.hpp"
 #include "array.hpp"
 #include "entities.hpp"
 #include "spatial.hpp"
 
+/*!
+    Skeletal animation. Each animation stores, for each bone, keys for the
+    bone's translation, rotation and scale relative to its parent. Each of
+    these three is a separate track, with its own key times, since assimp
+    doesn't promise that they line up.
+
+    Every frame, we sample each bone's tracks at the current time, then go
+    through the bones once, combining each one with its parent's transform.
+    Bones are stored so that parents always come before their children, so by
+    the time we get to a bone, its parent has already been done. Doing the
+    interpolation on the separate parts, rather than on whole matrices, means
+    rotations stay rotations, instead of shrinking partway between keys.
+
+    Each component plays one or more layers, each with its own animation,
+    time, speed and weight. When there's more than one layer, we blend each
+    bone's transforms from all of them by their weights, relative to the
+    total weight, which is how crossfades work: the old layer fades out while
+    the new one fades in. Blending happens on the local transforms, before
+    the pass over the bones, so each extra layer only costs one more sample
+    per bone.
+
+    Keys are compressed when we load an animation. First, we drop every key
+    that we can get back to within a small error by interpolating between
+    the keys around it, which gets rid of most keys in smooth or still
+    tracks. Then we quantise what's left. Times are 16-bit fractions of the
+    animation's duration, translations and scales are 16 bits per component
+    within their track's range, and rotations are stored as their three
+    smallest components, which we can get the fourth from. Each animation
+    gets its own memory pool, sized for exactly the keys it ends up with.
+
+    Components never touch each other's poses, and only read their
+    skeletons, so `update()` spreads them over our worker threads. Within a
+    component, most of the work for each bone is two 4x4 matrix products,
+    which we do four floats at a time using `simd`, along with nlerping and
+    blending rotations, since a quaternion fits exactly in four lanes.
+
+    Resources
+    ---------
+    Jason Gregory, "Game Engine Architecture", chapter 12
+    Nicholas Frechette, "Animation Compression: Table of Contents"
+    nfrechette.github.io/2016/10/21/anim_compression_toc/
+*/
 class anim {
 public:
-    struct BoneMatrixPool {
-        Array<m4> bone_matrices;
-        Array<f64> times;
-        u32 n_bone_matrix_sets;
+    // If two rotation keys are closer than this, which is the dot product of
+    // their quaternions, we nlerp between them, which is much cheaper than
+    // slerp and looks the same at these angles.
+    static constexpr f32 MIN_NLERP_DOT = 0.95f;
+    // What assimp tells us to assume when a file doesn't say.
+    static constexpr f64 DEFAULT_TICKS_PER_SECOND = 25.0;
+    // How many components each worker takes at a time in `update()`
+    static constexpr u32 UPDATE_BATCH_SIZE = 8;
+    // How far we let a bone's local transform drift from the source keys
+    // when dropping keys. This doesn't include the quantisation error.
+    static constexpr f32 MAX_TRANSLATION_ERROR = 0.0001f;
+    static constexpr f32 MAX_SCALE_ERROR = 0.0001f;
+    // In radians
+    static constexpr f32 MAX_ROTATION_ERROR = 0.0005f;
+    static constexpr f32 MAX_PACKED_TIME = (f32)UINT16_MAX;
+    static constexpr f32 MAX_PACKED_V3_VALUE = (f32)UINT16_MAX;
+    // Each of the three smallest components gets 15 bits, and the top bit of
+    // the first two holds the index of the largest one.
+    static constexpr u16 PACKED_QUAT_VALUE_MASK = 0x7fff;
+    static constexpr f32 MAX_PACKED_QUAT_VALUE = (f32)PACKED_QUAT_VALUE_MASK;
+    // 1 / sqrt(2), since if a component were any bigger, it would be the
+    // largest one
+    static constexpr f32 MAX_SMALLEST_QUAT_COMPONENT = 0.70710678f;
+
+    struct BoneTransform {
+        v3 translation;
+        quat rotation;
+        v3 scale;
+    };
+
+    struct PackedV3 {
+        u16 values[3];
+    };
+
+    struct PackedQuat {
+        u16 values[3];
+    };
+
+    // A range of keys in an Animation. Values are unpacked as
+    // `range_min + range_step * packed_value`.
+    struct V3Track {
+        u32 idx_first_key;
+        u32 n_keys;
+        v3 range_min;
+        v3 range_step;
+    };
+
+    struct QuatTrack {
+        u32 idx_first_key;
+        u32 n_keys;
+    };
+
+    // The tracks for one bone in one animation. A track with no keys means
+    // that part of the bone doesn't move, and keeps its rest transform.
+    struct Channel {
+        V3Track translation;
+        QuatTrack rotation;
+        V3Track scale;
     };
 
     struct Bone {
         char name[MAX_NODE_NAME_LENGTH];
         u32 idx_parent;
-        u32 n_anim_keys;
-        u32 last_anim_key;
+        // Takes vertices from the model's space into the bone's space. Once
+        // animations are loaded, this also undoes the scene root transform.
         m4 offset;
+        // The bone's transform relative to its parent when it's not animated
+        BoneTransform rest_transform;
     };
 
     struct Animation {
         char name[MAX_NODE_NAME_LENGTH];
+        // In seconds
         f64 duration;
-        // NOTE: Index into the BoneMatrixPool
-        u32 idx_bone_matrix_set;
+        // Holds everything below, and nothing else.
+        memory::Pool memory_pool;
+        // One for each bone, in order
+        Channel *channels;
+        // Key times are fractions of `duration`, out of `MAX_PACKED_TIME`.
+        u16 *v3_key_times;
+        PackedV3 *v3_key_values;
+        u16 *quat_key_times;
+        PackedQuat *quat_key_values;
     };
 
-    struct Component {
-        entities::Handle entity_handle;
+    // Everything about a model's bones and animations, which never changes
+    // once it's loaded, and is shared by every entity using that model.
+    struct Skeleton {
         Bone bones[MAX_N_BONES];
-        m4 bone_matrices[MAX_N_BONES];
         u32 n_bones;
         Animation animations[MAX_N_ANIMATIONS];
         u32 n_animations;
+        m4 scene_root_transform;
+    };
+
+    // One animation that a component is playing. A component can play
+    // several at once, and blends them together by weight.
+    struct Layer {
+        u32 idx_animation;
+        // In seconds from the start of the animation
+        f64 time;
+        // How many seconds of the animation we play for each second that
+        // passes. This can be negative, to play it backwards.
+        f32 speed;
+        f32 weight;
+        // For fades, `weight` moves towards `target_weight` by `fade_rate`
+        // each second.
+        f32 target_weight;
+        f32 fade_rate;
+        // If this is false, we stop at the end of the animation.
+        bool is_looping;
+    };
+
+    // One entity's playback of its skeleton's animations. The component
+    // itself is small, since the skeleton is shared, and the bone matrices
+    // live in the bone matrix pool, with only as many as the skeleton has
+    // bones.
+    struct Component {
+        entities::Handle entity_handle;
+        Skeleton *skeleton;
+        Layer layers[MAX_N_ANIM_LAYERS];
+        u32 n_layers;
+        m4 *bone_matrices;
     };
 
     struct State {
         Array<Component> components;
-        BoneMatrixPool bone_matrix_pool;
+        Array<m4> bone_matrix_pool;
     };
 
     static bool is_animation_component_valid(Component *animation_component);
-    static u32 push_to_bone_matrix_pool();
-    static m4 * get_bone_matrix(
-        u32 idx,
-        u32 idx_bone,
-        u32 idx_anim_key
-    );
+    static bool is_skeleton_valid(Skeleton *skeleton);
     static void update();
-    static void make_bone_matrices_for_animation_bone(
+    static void update_batch(Component *animation_components, u32 n_components, f64 dt);
+    static void make_component(
         Component *animation_component,
-        aiNodeAnim *ai_channel,
-        u32 idx_animation,
-        u32 idx_bone
+        entities::Handle entity_handle,
+        Skeleton *skeleton
+    );
+    static void release_unused_bone_matrices();
+    static Layer * add_layer(Component *animation_component, u32 idx_animation, f32 weight);
+    static void fade_layer(Layer *layer, f32 target_weight, f32 fade_duration);
+    static Layer * play(Component *animation_component, u32 idx_animation, f32 fade_duration);
+    static bool find_animation(Skeleton *skeleton, char const *name, u32 *idx_animation);
+    static void make_animation(
+        Skeleton *skeleton,
+        Animation *animation,
+        aiAnimation *ai_animation
+    );
+    static void destroy_skeleton(Skeleton *skeleton);
+    static BoneTransform sample_bone(
+        Animation *animation,
+        Bone *bone,
+        u32 idx_bone,
+        f32 t
+    );
+    static void make_bone_matrices(
+        Skeleton *skeleton,
+        Layer const *layers,
+        u32 n_layers,
+        m4 *bone_matrices
     );
     static Component * find_animation_component(spatial::Component *spatial_component);
     static Array<anim::Component> * get_components();
@@ -66,17 +222,81 @@ public:
     static void init(anim::State *anim_state, memory::Pool *pool);
 
 private:
-    static f64 * get_bone_matrix_time(
-        u32 idx,
+    // A layer that's ready to sample, with its weight out of the total
+    struct LayerSample {
+        Animation *animation;
+        f32 packed_t;
+        f32 weight;
+    };
+
+    struct UpdateBatchJob {
+        Component *animation_components;
+        f64 dt;
+    };
+
+    // The keys we keep from one source channel, as indices into its keys
+    struct ReducedChannel {
+        aiNodeAnim *ai_channel;
+        u32 *translation_key_idxs;
+        u32 n_translation_keys;
+        u32 *rotation_key_idxs;
+        u32 n_rotation_keys;
+        u32 *scale_key_idxs;
+        u32 n_scale_keys;
+    };
+
+    template <typename T>
+        static u32 reduce_keys(T *keys, u32 n_keys, f32 max_error, u32 *kept_key_idxs);
+    static f32 get_key_error(aiVectorKey *keys, u32 idx_start, u32 idx_end, u32 idx_key);
+    static f32 get_key_error(aiQuatKey *keys, u32 idx_start, u32 idx_end, u32 idx_key);
+    static V3Track pack_v3_track(
+        Animation *animation,
+        u32 *n_packed_keys,
+        aiVectorKey *ai_keys,
+        u32 const *key_idxs,
+        u32 n_keys,
+        f64 ticks_per_second
+    );
+    static QuatTrack pack_quat_track(
+        Animation *animation,
+        u32 *n_packed_keys,
+        aiQuatKey *ai_keys,
+        u32 const *key_idxs,
+        u32 n_keys,
+        f64 ticks_per_second
+    );
+    static void run_update_batch_job(void *data, u32 idx_start, u32 idx_end);
+    static void advance_layers(Component *animation_component, f64 dt);
+    static u16 pack_time(Animation *animation, f64 time);
+    static f32 get_packed_t(Animation *animation, f32 t);
+    static BoneTransform sample_channel(
+        Animation *animation,
+        Bone *bone,
         u32 idx_bone,
-        u32 idx_anim_key
+        f32 packed_t
     );
-    static u32 get_bone_matrix_anim_key_for_timepoint(
-        Component *animation_component,
-        f64 animation_timepoint,
-        u32 idx_bone_matrix_set,
-        u32 idx_bone
+    static BoneTransform blend_bone(
+        Bone *bone,
+        u32 idx_bone,
+        LayerSample const *samples,
+        u32 n_samples
+    );
+    static PackedQuat pack_quat(quat rotation);
+    static quat unpack_quat(PackedQuat packed);
+    static u32 find_key(u16 const *times, u32 n_keys, f32 packed_t, f32 *lerp_factor);
+    static v3 sample_v3_track(Animation *animation, V3Track *track, v3 rest_value, f32 packed_t);
+    static quat sample_quat_track(
+        Animation *animation,
+        QuatTrack *track,
+        quat rest_value,
+        f32 packed_t
     );
+    static quat interpolate_rotation(quat q0, quat q1, f32 lerp_factor);
+    static m4 make_bone_transform_matrix(BoneTransform *transform);
+    static void multiply_matrices(m4 const *a, m4 const *b, m4 *result);
+    static simd::f32x4 quat_to_f32x4(quat q);
+    static quat f32x4_to_quat(simd::f32x4 q);
+    static simd::f32x4 normalize_quat(simd::f32x4 q);
 
     static anim::State *state;
 };
@@ -0,0 +1,313 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "logs.hpp"
+#include "archetypes.hpp"
+#include "spatial.hpp"
+#include "drawable.hpp"
+#include "lights.hpp"
+#include "behavior.hpp"
+#include "anim.hpp"
+#include "physics.hpp"
+#include "intrinsics.hpp"
+
+
+pny_internal u32
+align_up(u32 value, u32 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+
+size_t
+archetypes::get_component_size(entities::ComponentType component_type)
+{
+    switch (component_type) {
+    case entities::ComponentType::spatial: return sizeof(spatial::Component);
+    case entities::ComponentType::drawable: return sizeof(drawable::Component);
+    case entities::ComponentType::light: return sizeof(lights::Component);
+    case entities::ComponentType::behavior: return sizeof(behavior::Component);
+    case entities::ComponentType::anim: return sizeof(anim::Component);
+    case entities::ComponentType::physics: return sizeof(physics::Component);
+    default:
+        logs::fatal("Don't know the size of ComponentType %d", (u32)component_type);
+        return 0;
+    }
+}
+
+
+void
+archetypes::init_store(Store *store, memory::Pool *memory_pool, u32 max_n_entities)
+{
+    store->memory_pool = memory_pool;
+    store->archetypes = Array<Archetype>(memory_pool, MAX_N_ARCHETYPES, "archetypes");
+    store->locations = Array<Location>(memory_pool, max_n_entities, "archetype_locations", true);
+    range (0, max_n_entities) {
+        store->locations[idx]->idx_archetype = NO_ARCHETYPE;
+    }
+}
+
+
+archetypes::Archetype *
+archetypes::get_archetype(Store *store, entities::Signature signature)
+{
+    return store->archetypes.find([signature](Archetype *candidate) -> bool {
+        return candidate->signature == signature;
+    });
+}
+
+
+void
+archetypes::add_entity(Store *store, entities::Handle entity_handle, entities::Signature signature)
+{
+    assert(store->locations[entity_handle]->idx_archetype == NO_ARCHETYPE);
+    Archetype *archetype = get_archetype(store, signature);
+    if (!archetype) {
+        archetype = make_archetype(store, signature);
+    }
+    u16 idx_archetype = (u16)(archetype - store->archetypes.items);
+    *store->locations[entity_handle] = push_entity_to_archetype(store, idx_archetype, entity_handle);
+}
+
+
+void
+archetypes::remove_entity(Store *store, entities::Handle entity_handle)
+{
+    Location *location = store->locations[entity_handle];
+    if (location->idx_archetype == NO_ARCHETYPE) {
+        return;
+    }
+    remove_entity_from_archetype(store, *location);
+    location->idx_archetype = NO_ARCHETYPE;
+}
+
+
+void
+archetypes::set_signature(Store *store, entities::Handle entity_handle, entities::Signature signature)
+{
+    Location old_location = *store->locations[entity_handle];
+    if (old_location.idx_archetype == NO_ARCHETYPE) {
+        add_entity(store, entity_handle, signature);
+        return;
+    }
+
+    Archetype *old_archetype = store->archetypes[old_location.idx_archetype];
+    if (old_archetype->signature == signature) {
+        return;
+    }
+
+    Archetype *new_archetype = get_archetype(store, signature);
+    if (!new_archetype) {
+        new_archetype = make_archetype(store, signature);
+        // `make_archetype()` can't move the archetypes array, but let's not
+        // rely on pointers we got before it.
+        old_archetype = store->archetypes[old_location.idx_archetype];
+    }
+    u16 idx_new_archetype = (u16)(new_archetype - store->archetypes.items);
+    Location new_location = push_entity_to_archetype(store, idx_new_archetype, entity_handle);
+
+    // Bring over whichever components both archetypes have.
+    Chunk *old_chunk = old_archetype->chunks[old_location.idx_chunk];
+    Chunk *new_chunk = new_archetype->chunks[new_location.idx_chunk];
+    entities::Signature shared_signature = old_archetype->signature & signature;
+    range_named (idx_type, 0, entities::N_COMPONENT_TYPES) {
+        if (!(shared_signature & (1u << idx_type))) {
+            continue;
+        }
+        u32 size = old_archetype->component_sizes[idx_type];
+        memcpy(
+            new_chunk->memory + new_archetype->component_offsets[idx_type] +
+                new_location.idx_in_chunk * size,
+            old_chunk->memory + old_archetype->component_offsets[idx_type] +
+                old_location.idx_in_chunk * size,
+            size);
+    }
+
+    remove_entity_from_archetype(store, old_location);
+    *store->locations[entity_handle] = new_location;
+}
+
+
+void *
+archetypes::get_component(
+    Store *store,
+    entities::Handle entity_handle,
+    entities::ComponentType component_type
+) {
+    Location *location = store->locations[entity_handle];
+    if (location->idx_archetype == NO_ARCHETYPE) {
+        return nullptr;
+    }
+    Archetype *archetype = store->archetypes[location->idx_archetype];
+    if (!(archetype->signature & (u32)component_type)) {
+        return nullptr;
+    }
+    Chunk *chunk = archetype->chunks[location->idx_chunk];
+    u32 idx_type = entities::get_component_type_idx(component_type);
+    return chunk->memory + archetype->component_offsets[idx_type] +
+        location->idx_in_chunk * archetype->component_sizes[idx_type];
+}
+
+
+/*!
+    Fills the store with every entity that currently exists, copying its
+    components over from the usual per-system component arrays.
+*/
+void
+archetypes::copy_from_component_arrays(Store *store)
+{
+    entities::query(0, [store](entities::Handle entity_handle) {
+        entities::Signature signature = entities::get_signature(entity_handle);
+        if (signature == 0) {
+            return;
+        }
+        set_signature(store, entity_handle, signature);
+        range_named (idx_type, 0, entities::N_COMPONENT_TYPES) {
+            if (!(signature & (1u << idx_type))) {
+                continue;
+            }
+            entities::ComponentType component_type = entities::get_component_type_from_idx(idx_type);
+            memcpy(get_component(store, entity_handle, component_type),
+                get_component_from_array(entity_handle, component_type),
+                get_component_size(component_type));
+        }
+    });
+}
+
+
+entities::Handle *
+archetypes::get_chunk_handles(Chunk *chunk)
+{
+    return (entities::Handle*)chunk->memory;
+}
+
+
+void *
+archetypes::get_component_from_array(
+    entities::Handle entity_handle,
+    entities::ComponentType component_type
+) {
+    switch (component_type) {
+    case entities::ComponentType::spatial: return spatial::get_component(entity_handle);
+    case entities::ComponentType::drawable: return drawable::get_component(entity_handle);
+    case entities::ComponentType::light: return lights::get_component(entity_handle);
+    case entities::ComponentType::behavior: return behavior::get_component(entity_handle);
+    case entities::ComponentType::anim: return anim::get_component(entity_handle);
+    case entities::ComponentType::physics: return physics::get_component(entity_handle);
+    default:
+        logs::fatal("Don't know where to find ComponentType %d", (u32)component_type);
+        return nullptr;
+    }
+}
+
+
+archetypes::Archetype *
+archetypes::make_archetype(Store *store, entities::Signature signature)
+{
+    Archetype *archetype = store->archetypes.push();
+    archetype->signature = signature;
+    archetype->chunks = Array<Chunk>(store->memory_pool, MAX_N_CHUNKS_PER_ARCHETYPE,
+        "archetype_chunks");
+
+    // Work out how many entities fit in a chunk. We leave some room for
+    // aligning each of the component arrays.
+    u32 row_size = sizeof(entities::Handle);
+    u32 n_arrays = 1;
+    range_named (idx_type, 0, entities::N_COMPONENT_TYPES) {
+        archetype->component_offsets[idx_type] = 0;
+        archetype->component_sizes[idx_type] = 0;
+        if (!(signature & (1u << idx_type))) {
+            continue;
+        }
+        archetype->component_sizes[idx_type] =
+            (u32)get_component_size(entities::get_component_type_from_idx(idx_type));
+        row_size += archetype->component_sizes[idx_type];
+        n_arrays++;
+    }
+    archetype->chunk_capacity = (CHUNK_SIZE - n_arrays * CHUNK_ALIGNMENT) / row_size;
+    if (archetype->chunk_capacity == 0) {
+        logs::fatal("Archetype with signature %d does not fit into a chunk", signature);
+    }
+
+    // The handles go first, then each component's array.
+    u32 offset = align_up(archetype->chunk_capacity * sizeof(entities::Handle), CHUNK_ALIGNMENT);
+    range_named (idx_type, 0, entities::N_COMPONENT_TYPES) {
+        if (!(signature & (1u << idx_type))) {
+            continue;
+        }
+        archetype->component_offsets[idx_type] = offset;
+        offset = align_up(
+            offset + archetype->chunk_capacity * archetype->component_sizes[idx_type],
+            CHUNK_ALIGNMENT);
+    }
+    assert(offset <= CHUNK_SIZE);
+
+    return archetype;
+}
+
+
+archetypes::Location
+archetypes::push_entity_to_archetype(
+    Store *store,
+    u16 idx_archetype,
+    entities::Handle entity_handle
+) {
+    Archetype *archetype = store->archetypes[idx_archetype];
+
+    Chunk *chunk = archetype->chunks.find([archetype](Chunk *candidate) -> bool {
+        return candidate->n_entities < archetype->chunk_capacity;
+    });
+    if (!chunk) {
+        chunk = archetype->chunks.push();
+        u8 *memory = (u8*)memory::push(store->memory_pool,
+            CHUNK_SIZE + CHUNK_ALIGNMENT, "archetype_chunk");
+        chunk->memory = (u8*)(((uintptr_t)memory + CHUNK_ALIGNMENT - 1) &
+            ~(uintptr_t)(CHUNK_ALIGNMENT - 1));
+        chunk->n_entities = 0;
+    }
+
+    u32 idx_in_chunk = chunk->n_entities++;
+    get_chunk_handles(chunk)[idx_in_chunk] = entity_handle;
+    range_named (idx_type, 0, entities::N_COMPONENT_TYPES) {
+        if (!(archetype->signature & (1u << idx_type))) {
+            continue;
+        }
+        u32 size = archetype->component_sizes[idx_type];
+        memset(chunk->memory + archetype->component_offsets[idx_type] + idx_in_chunk * size,
+            0, size);
+    }
+
+    return {
+        .idx_archetype = idx_archetype,
+        .idx_chunk = (u16)(chunk - archetype->chunks.items),
+        .idx_in_chunk = idx_in_chunk,
+    };
+}
+
+
+void
+archetypes::remove_entity_from_archetype(Store *store, Location location)
+{
+    Archetype *archetype = store->archetypes[location.idx_archetype];
+    Chunk *chunk = archetype->chunks[location.idx_chunk];
+    u32 idx_last = chunk->n_entities - 1;
+
+    // Keep the chunk tightly packed by moving its last entity into the hole.
+    if (location.idx_in_chunk != idx_last) {
+        entities::Handle *handles = get_chunk_handles(chunk);
+        entities::Handle moved_handle = handles[idx_last];
+        handles[location.idx_in_chunk] = moved_handle;
+        range_named (idx_type, 0, entities::N_COMPONENT_TYPES) {
+            if (!(archetype->signature & (1u << idx_type))) {
+                continue;
+            }
+            u32 size = archetype->component_sizes[idx_type];
+            u8 *component_array = chunk->memory + archetype->component_offsets[idx_type];
+            memcpy(component_array + location.idx_in_chunk * size,
+                component_array + idx_last * size,
+                size);
+        }
+        store->locations[moved_handle]->idx_in_chunk = location.idx_in_chunk;
+    }
+
+    chunk->n_entities--;
+}
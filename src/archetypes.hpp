@@ -0,0 +1,123 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "array.hpp"
+#include "entities.hpp"
+
+/*!
+    This is an alternative way of storing components, next to the usual
+    `Array<Component>` that each system keeps, indexed by entity handle.
+
+    Entities that have exactly the same set of components (i.e. the same
+    signature) belong to the same archetype. Each archetype stores its
+    entities in fixed-size chunks, and inside each chunk, the data for each
+    component type is laid out contiguously, like so:
+
+        [handles...][spatial::Component...][physics::Component...]
+
+    This means that a system that wants e.g. all entities with spatial and
+    physics components can stream linearly through a few chunks, instead of
+    jumping around a number of sparse arrays.
+*/
+class archetypes {
+public:
+    static constexpr u32 CHUNK_SIZE = 64 * 1024;
+    static constexpr u32 CHUNK_ALIGNMENT = 16;
+    static constexpr u32 MAX_N_ARCHETYPES = 64;
+    static constexpr u32 MAX_N_CHUNKS_PER_ARCHETYPE = 1024;
+    static constexpr u16 NO_ARCHETYPE = 0xFFFF;
+
+    struct Chunk {
+        u8 *memory;
+        u32 n_entities;
+    };
+
+    struct Archetype {
+        entities::Signature signature;
+        // Entities per chunk
+        u32 chunk_capacity;
+        // Offset of each component type's array in a chunk, indexed by
+        // `entities::get_component_type_idx()`. Only valid for the types in
+        // `signature`.
+        u32 component_offsets[entities::N_COMPONENT_TYPES];
+        u32 component_sizes[entities::N_COMPONENT_TYPES];
+        Array<Chunk> chunks;
+    };
+
+    struct Location {
+        u16 idx_archetype;
+        u16 idx_chunk;
+        u32 idx_in_chunk;
+    };
+
+    struct Store {
+        memory::Pool *memory_pool;
+        Array<Archetype> archetypes;
+        // Indexed by entity handle
+        Array<Location> locations;
+    };
+
+    static size_t get_component_size(entities::ComponentType component_type);
+    static void init_store(Store *store, memory::Pool *memory_pool, u32 max_n_entities);
+    static Archetype * get_archetype(Store *store, entities::Signature signature);
+    static void add_entity(Store *store, entities::Handle entity_handle, entities::Signature signature);
+    static void remove_entity(Store *store, entities::Handle entity_handle);
+    static void set_signature(Store *store, entities::Handle entity_handle, entities::Signature signature);
+    static void * get_component(
+        Store *store,
+        entities::Handle entity_handle,
+        entities::ComponentType component_type
+    );
+    static void copy_from_component_arrays(Store *store);
+    static entities::Handle * get_chunk_handles(Chunk *chunk);
+
+    template <typename T>
+        static T * get_chunk_components(
+            Archetype *archetype,
+            Chunk *chunk,
+            entities::ComponentType component_type
+        ) {
+            assert(archetype->signature & (u32)component_type);
+            u32 idx_type = entities::get_component_type_idx(component_type);
+            return (T*)(chunk->memory + archetype->component_offsets[idx_type]);
+        }
+
+    // Calls `fn(archetype, chunk)` for every non-empty chunk of every
+    // archetype that has all of the components in `mask`.
+    template <typename F>
+        static void query(Store *store, entities::Signature mask, F fn) {
+            for (
+                Archetype *archetype = store->archetypes.begin();
+                archetype < store->archetypes.end();
+                archetype++
+            ) {
+                if ((archetype->signature & mask) != mask) {
+                    continue;
+                }
+                for (
+                    Chunk *chunk = archetype->chunks.begin();
+                    chunk < archetype->chunks.end();
+                    chunk++
+                ) {
+                    if (chunk->n_entities > 0) {
+                        fn(archetype, chunk);
+                    }
+                }
+            }
+        }
+
+private:
+    static void * get_component_from_array(
+        entities::Handle entity_handle,
+        entities::ComponentType component_type
+    );
+    static Archetype * make_archetype(Store *store, entities::Signature signature);
+    static Location push_entity_to_archetype(
+        Store *store,
+        u16 idx_archetype,
+        entities::Handle entity_handle
+    );
+    static void remove_entity_from_archetype(Store *store, Location location);
+};
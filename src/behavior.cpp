@@ -14,6 +14,7 @@ behavior::Function behavior::function_map[(u32)Behavior::length] = {
     (behavior::Function)nullptr,
     (behavior::Function)behavior_functions::test,
     (behavior::Function)behavior_functions::char_movement_test,
+    (behavior::Function)behavior_functions::char_stairs_test,
 };
 
 
@@ -26,6 +27,8 @@ behavior::behavior_to_string(Behavior behavior)
         return "test";
     } else if (behavior == Behavior::char_movement_test) {
         return "char_movement_test";
+    } else if (behavior == Behavior::char_stairs_test) {
+        return "char_stairs_test";
     } else {
         logs::error("Don't know how to convert Behavior to string: %d", behavior);
         return "<unknown>";
@@ -42,6 +45,8 @@ behavior::behavior_from_string(char const *str)
         return Behavior::test;
     } else if (strcmp(str, "char_movement_test") == 0) {
         return Behavior::char_movement_test;
+    } else if (strcmp(str, "char_stairs_test") == 0) {
+        return Behavior::char_stairs_test;
     } else {
         logs::fatal("Could not parse Behavior: %s", str);
         return Behavior::none;
@@ -59,17 +64,23 @@ behavior::is_behavior_component_valid(behavior::Component *behavior_component)
 void
 behavior::update()
 {
-    each (behavior_component, *get_components()) {
-        if (!is_behavior_component_valid(behavior_component)) {
-            continue;
-        }
+    if (entities::get_changed_handles(entities::ComponentType::behavior)->length > 0) {
+        rebuild_spans();
+    }
 
-        entities::Handle entity_handle = behavior_component->entity_handle;
+    FrameInputs frame_inputs = {
+        .t = engine::get_t(),
+        .dt = engine::get_dt(),
+    };
 
-        auto handler = function_map[(u32)behavior_component->behavior];
-        if (handler) {
-            handler(entity_handle);
+    range (0, (u32)Behavior::length) {
+        u32 span_start = behavior::state->span_starts[idx];
+        u32 n_entities = behavior::state->span_starts[idx + 1] - span_start;
+        auto handler = function_map[idx];
+        if (n_entities == 0 || !handler) {
+            continue;
         }
+        handler(&behavior::state->sorted_handles.items[span_start], n_entities, &frame_inputs);
     }
 }
 
@@ -88,6 +99,41 @@ behavior::get_component(entities::Handle entity_handle)
 }
 
 
+/*!
+    Sorts the handles of all entities with a behavior component by their
+    behavior, using a counting sort.
+*/
+void
+behavior::rebuild_spans()
+{
+    u32 *span_starts = behavior::state->span_starts;
+    Array<entities::Handle> *sorted_handles = &behavior::state->sorted_handles;
+    memset(span_starts, 0, sizeof(behavior::state->span_starts));
+
+    // Count how many entities have each behavior. We count behavior `b`
+    // in `span_starts[b + 1]`, so that the prefix sum below directly gives
+    // us where each span starts.
+    entities::query(
+        (u32)entities::ComponentType::behavior,
+        [span_starts](entities::Handle entity_handle) {
+            span_starts[(u32)get_component(entity_handle)->behavior + 1]++;
+        });
+
+    range (0, (u32)Behavior::length) {
+        span_starts[idx + 1] += span_starts[idx];
+    }
+
+    // Put each handle in its place, using the end of each span as a cursor.
+    u32 span_ends[(u32)Behavior::length];
+    memcpy(span_ends, span_starts, sizeof(span_ends));
+    sorted_handles->length = span_starts[(u32)Behavior::length];
+    entities::query((u32)entities::ComponentType::behavior, [&](entities::Handle entity_handle) {
+        u32 idx_behavior = (u32)get_component(entity_handle)->behavior;
+        *sorted_handles->get(span_ends[idx_behavior]++) = entity_handle;
+    });
+}
+
+
 void behavior::init(
     behavior::State *behavior_state,
     memory::Pool *asset_memory_pool,
@@ -98,4 +144,6 @@ void behavior::init(
     behavior::state->state = state;
     behavior::state->components = Array<behavior::Component>(
         asset_memory_pool, MAX_N_ENTITIES, "behavior_components", true, 1);
+    behavior::state->sorted_handles = Array<entities::Handle>(
+        asset_memory_pool, MAX_N_ENTITIES, "behavior_sorted_handles");
 }
@@ -16,6 +16,7 @@ public:
         none,
         test,
         char_movement_test,
+        char_stairs_test,
         length
     };
 
@@ -24,12 +25,30 @@ public:
         Behavior behavior = Behavior::none;
     };
 
+    // Things behavior functions commonly need, which are the same for every
+    // entity, so we only have to fetch them once per frame.
+    struct FrameInputs {
+        f64 t;
+        f64 dt;
+    };
+
     struct State {
         Array<Component> components;
+        // The handles of all entities with a behavior, sorted by behavior, so
+        // that all entities with behavior `b` are in
+        // `[span_starts[b], span_starts[b + 1])`. These are only rebuilt when
+        // some behavior component has changed.
+        Array<entities::Handle> sorted_handles;
+        u32 span_starts[(u32)Behavior::length + 1];
         ::State *state;
     };
 
-    typedef void (*Function) (entities::Handle entity_handle);
+    // Each behavior function gets all entities with that behavior in one go.
+    typedef void (*Function) (
+        entities::Handle const *entity_handles,
+        u32 n_entities,
+        FrameInputs const *frame_inputs
+    );
 
     static Function function_map[(u32)Behavior::length];
 
@@ -46,5 +65,7 @@ public:
     );
 
 private:
+    static void rebuild_spans();
+
     static behavior::State *state;
 };
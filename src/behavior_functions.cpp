@@ -3,112 +3,232 @@
 #include "logs.hpp"
 #include "state.hpp"
 #include "behavior_functions.hpp"
+#include "charcontroller.hpp"
 
 
 void
-behavior_functions::test(entities::Handle entity_handle)
-{
-    spatial::Component *spatial_component = spatial::get_component(entity_handle);
-    if (!spatial_component) {
-        logs::error("Could not get spatial::Component for behavior::Component");
-        return;
-    }
+behavior_functions::test(
+    entities::Handle const *entity_handles,
+    u32 n_entities,
+    behavior::FrameInputs const *frame_inputs
+) {
+    // This only depends on the time, so it's the same for every entity.
+    f32 t = (f32)frame_inputs->t;
+    quat rotation =
+        glm::angleAxis((f32)sin(1.0f - t), v3(0.0f, 1.0f, 0.0f)) *
+        glm::angleAxis((f32)cos(1.0f - t), v3(1.0f, 0.0f, 0.0f));
 
-    spatial_component->rotation =
-        glm::angleAxis((f32)sin(1.0f - (engine::get_t())), v3(0.0f, 1.0f, 0.0f)) *
-        glm::angleAxis((f32)cos(1.0f - (engine::get_t())), v3(1.0f, 0.0f, 0.0f));
+    range (0, n_entities) {
+        entities::Handle entity_handle = entity_handles[idx];
+        spatial::Component *spatial_component = spatial::get_component(entity_handle);
+        if (!spatial_component) {
+            logs::error("Could not get spatial::Component for behavior::Component");
+            continue;
+        }
+        spatial_component->rotation = rotation;
+        entities::mark_changed(entity_handle, entities::ComponentType::spatial);
+    }
 }
 
 
 void
-behavior_functions::char_movement_test(entities::Handle entity_handle)
-{
-    spatial::Component *spatial_component = spatial::get_component(entity_handle);
-    if (!spatial_component) {
-        logs::error("Could not get spatial::Component for behavior::Component");
-        return;
-    }
+behavior_functions::char_movement_test(
+    entities::Handle const *entity_handles,
+    u32 n_entities,
+    behavior::FrameInputs const *frame_inputs
+) {
+    // How fast we fall when we're not on the ground
+    constexpr f32 FALL_SPEED = 5.0f;
 
-    physics::Component *physics_component = physics::get_component(entity_handle);
-    if (!physics_component) {
-        logs::error("Could not get physics::Component for behavior::Component");
-        return;
-    }
-    spatial::Obb *obb = &physics_component->transformed_obb;
-
-    // Update position
-    spatial_component->position.x =
-        (f32)sin((engine::get_t()) * 1.0f) * 4.0f +
-        (f32)sin((engine::get_t()) * 2.0f) * 0.1f +
-        (f32)cos((engine::get_t()) * 3.0f) * 0.3f;
-    spatial_component->position.z =
-        (f32)cos((engine::get_t()) * 1.0f) * 4.0f +
-        (f32)cos((engine::get_t()) * 2.0f) * 0.3f +
-        (f32)sin((engine::get_t()) * 3.0f) * 0.1f;
-    spatial_component->rotation =
+    // Work out the movement once, since it only depends on the time.
+    f32 t = (f32)frame_inputs->t;
+    f32 position_x =
+        (f32)sin(t * 1.0f) * 4.0f +
+        (f32)sin(t * 2.0f) * 0.1f +
+        (f32)cos(t * 3.0f) * 0.3f;
+    f32 position_z =
+        (f32)cos(t * 1.0f) * 4.0f +
+        (f32)cos(t * 2.0f) * 0.3f +
+        (f32)sin(t * 3.0f) * 0.1f;
+    quat rotation =
         glm::angleAxis(
-            (f32)sin((engine::get_t()) * 3.0f) + radians(70.0f), v3(0.0f, 1.0f, 0.0f)
+            (f32)sin(t * 3.0f) + radians(70.0f), v3(0.0f, 1.0f, 0.0f)
         ) *
         glm::angleAxis(
-            (f32)cos((engine::get_t()) * 2.0f) / 3.0f, v3(0.0f, 1.0f, 0.0f)
+            (f32)cos(t * 2.0f) / 3.0f, v3(0.0f, 1.0f, 0.0f)
         ) *
-        glm::angleAxis((f32)cos((engine::get_t()) * 2.0f), v3(1.0f, 0.0f, 0.0f)) *
-        glm::angleAxis((f32)sin((engine::get_t()) * 1.5f) / 2.0f, v3(1.0f, 0.0f, 0.0f)) *
-        glm::angleAxis((f32)sin((engine::get_t()) * 2.5f) / 1.5f, v3(0.5f, 0.5f, 0.2f));
+        glm::angleAxis((f32)cos(t * 2.0f), v3(1.0f, 0.0f, 0.0f)) *
+        glm::angleAxis((f32)sin(t * 1.5f) / 2.0f, v3(1.0f, 0.0f, 0.0f)) *
+        glm::angleAxis((f32)sin(t * 2.5f) / 1.5f, v3(0.5f, 0.5f, 0.2f));
 #if 0
-    spatial_component->position.x = -5.0f;
-    spatial_component->position.z = -5.0f;
-    spatial_component->rotation =
-        glm::angleAxis((f32)sin((engine::get_t())) + radians(70.0f), v3(0.0f, 1.0f, 0.0f)) *
+    position_x = -5.0f;
+    position_z = -5.0f;
+    rotation =
+        glm::angleAxis((f32)sin(t) + radians(70.0f), v3(0.0f, 1.0f, 0.0f)) *
         glm::angleAxis(radians(90.0f), v3(1.0f, 0.0f, 0.0f));
 #endif
 
-    // Check collision with other entities
-    {
-        physics::CollisionManifold manifold = physics::find_collision(
-            physics_component, spatial_component);
+    range (0, n_entities) {
+        entities::Handle entity_handle = entity_handles[idx];
+        spatial::Component *spatial_component = spatial::get_component(entity_handle);
+        if (!spatial_component) {
+            logs::error("Could not get spatial::Component for behavior::Component");
+            continue;
+        }
+
+        physics::Component *physics_component = physics::get_component(entity_handle);
+        if (!physics_component) {
+            logs::error("Could not get physics::Component for behavior::Component");
+            continue;
+        }
+
+        // Head towards where we want to be, falling at a constant speed, without
+        // going through anything. We keep the same controller from frame to
+        // frame, so that once we've landed, we step up onto things and stay
+        // on the ground when walking off them.
+        spatial_component->rotation = rotation;
+        charcontroller::Controller *controller = charcontroller::get_controller(entity_handle);
+        v3 displacement = v3(position_x - spatial_component->position.x,
+            -FALL_SPEED * (f32)frame_inputs->dt,
+            position_z - spatial_component->position.z);
+        charcontroller::move(controller, displacement);
 
-        if (manifold.did_collide) {
+        // The controller keeps us `skin_width` away from whatever we touch, so
+        // grow our OBB by a bit more than that to find it.
+        spatial::Obb obb = physics::transform_obb(physics_component->obb, spatial_component);
+        obb.extents += v3(2.0f * controller->skin_width);
+        physics::CollisionManifold manifolds[charcontroller::MAX_N_OVERLAPS];
+        u32 n_manifolds = physics::find_overlaps(&obb, controller->layer_mask,
+            physics_component, manifolds, charcontroller::MAX_N_OVERLAPS);
+        range_named (idx_manifold, 0, n_manifolds) {
+            physics::CollisionManifold *manifold = &manifolds[idx_manifold];
             v4 color;
-            if (manifold.axis <= 5) {
+            if (manifold->axis <= 5) {
                 color = v4(1.0f, 0.0f, 0.0f, 1.0f);
             } else {
                 color = v4(1.0f, 1.0f, 0.0f, 1.0f);
             }
-            debugdraw::draw_obb(obb, color);
-            debugdraw::draw_obb(&manifold.collidee->transformed_obb, color);
-            debugdraw::draw_line(obb->center,
-                obb->center + manifold.normal * 100.0f, color);
-            gui::log("manifold.axis = %d", manifold.axis);
-            gui::log("manifold.sep_max = %f", manifold.sep_max);
+            debugdraw::draw_obb(&obb, color);
+            debugdraw::draw_obb(&manifold->collidee->transformed_obb, color);
+            debugdraw::draw_line(obb.center,
+                obb.center + manifold->normal * 100.0f, color);
+            range_named (idx_point, 0, manifold->n_contact_points) {
+                debugdraw::draw_point(manifold->contact_points[idx_point], 0.1f,
+                    v4(0.0f, 1.0f, 0.0f, 1.0f));
+            }
+            gui::log("manifold.axis = %d", manifold->axis);
+            gui::log("manifold.sep_max = %f", manifold->sep_max);
             gui::log("manifold.normal = (%f, %f, %f)",
-                manifold.normal.x, manifold.normal.y, manifold.normal.z);
-            gui::log("length(manifold.normal) = %f", length(manifold.normal));
+                manifold->normal.x, manifold->normal.y, manifold->normal.z);
+            gui::log("length(manifold.normal) = %f", length(manifold->normal));
+            gui::log("manifold.n_contact_points = %d", manifold->n_contact_points);
             gui::log("---");
-        } else {
-            debugdraw::draw_obb(obb, v4(1.0f, 1.0f, 1.0f, 1.0f));
         }
-    }
+        if (n_manifolds == 0) {
+            debugdraw::draw_obb(&obb, v4(1.0f, 1.0f, 1.0f, 1.0f));
+        }
+        gui::log("is_grounded = %d, did_step_up = %d, did_hit_wall = %d, "
+            "did_hit_ceiling = %d",
+            controller->is_grounded, controller->did_step_up, controller->did_hit_wall,
+            controller->did_hit_ceiling);
 
-    // Check ray collision
+        // Check which triggers we're in, as of the last physics update
+        each (trigger_event, *physics::get_trigger_events()) {
+            if (trigger_event->other_entity_handle != entity_handle) {
+                continue;
+            }
+            physics::Component *trigger_physics_component =
+                physics::get_component(trigger_event->trigger_entity_handle);
+            if (trigger_event->type == physics::TriggerEventType::enter) {
+                logs::info("Entered trigger %d", trigger_event->trigger_entity_handle);
+            } else if (trigger_event->type == physics::TriggerEventType::exit) {
+                logs::info("Left trigger %d", trigger_event->trigger_entity_handle);
+            } else {
+                debugdraw::draw_obb(&trigger_physics_component->transformed_obb,
+                    v4(0.0f, 0.0f, 1.0f, 1.0f));
+            }
+        }
+
+        // Check ray collision
 #if 0
-    {
-        spatial::Ray ray = {
-            .origin = obb->center + obb->y_axis * obb->extents[1],
-            .direction = obb->y_axis,
-        };
-        RayCollisionResult ray_collision_result = physics::find_ray_collision(
-            &ray, physics_component);
-
-        if (ray_collision_result.did_intersect) {
-            debugdraw::draw_ray(&ray, ray_collision_result.distance,
-                v4(1.0f, 0.0f, 0.0f, 0.0f));
-            debugdraw::draw_obb(&ray_collision_result.collidee->transformed_obb,
-                v4(1.0f, 0.0f, 0.0f, 1.0f));
-        } else {
-            debugdraw::draw_ray(&ray, 500.0f,
-                v4(1.0f, 1.0f, 1.0f, 0.0f));
+        {
+            spatial::Ray ray = {
+                .origin = obb.center + obb.y_axis * obb.extents[1],
+                .direction = obb.y_axis,
+            };
+            RayCollisionResult ray_collision_result = physics::closest_hit(
+                &ray, FLT_MAX, physics_component->layer_mask, physics_component);
+
+            if (ray_collision_result.did_intersect) {
+                debugdraw::draw_ray(&ray, ray_collision_result.distance,
+                    v4(1.0f, 0.0f, 0.0f, 0.0f));
+                debugdraw::draw_obb(&ray_collision_result.collidee->transformed_obb,
+                    v4(1.0f, 0.0f, 0.0f, 1.0f));
+            } else {
+                debugdraw::draw_ray(&ray, 500.0f,
+                    v4(1.0f, 1.0f, 1.0f, 0.0f));
+            }
         }
-    }
 #endif
+    }
+}
+
+
+/*!
+    Walks characters back and forth over the stairs in the `chartest` scene,
+    which are all low enough to step onto, and warns if they get stuck on a
+    step or lose the ground on the way down.
+*/
+void
+behavior_functions::char_stairs_test(
+    entities::Handle const *entity_handles,
+    u32 n_entities,
+    behavior::FrameInputs const *frame_inputs
+) {
+    // Where we walk between, which takes us over all the stairs
+    constexpr f32 MIN_X = -3.0f;
+    constexpr f32 MAX_X = 15.0f;
+    // How long it takes us to walk from one end to the other
+    constexpr f32 WALK_DURATION = 6.0f;
+    // How fast we fall when we're not on the ground
+    constexpr f32 FALL_SPEED = 5.0f;
+
+    // Work out where we should be once, since it only depends on the time.
+    f32 t = fmod((f32)frame_inputs->t, 2.0f * WALK_DURATION) / WALK_DURATION;
+    f32 walk_progress = (t < 1.0f) ? t : 2.0f - t;
+    f32 position_x = MIN_X + (MAX_X - MIN_X) * walk_progress;
+    quat rotation = glm::angleAxis(
+        (t < 1.0f) ? radians(90.0f) : radians(-90.0f), v3(0.0f, 1.0f, 0.0f));
+
+    range (0, n_entities) {
+        entities::Handle entity_handle = entity_handles[idx];
+        spatial::Component *spatial_component = spatial::get_component(entity_handle);
+        if (!spatial_component) {
+            logs::error("Could not get spatial::Component for behavior::Component");
+            continue;
+        }
+
+        spatial_component->rotation = rotation;
+        charcontroller::Controller *controller = charcontroller::get_controller(entity_handle);
+        bool was_grounded = controller->is_grounded;
+        v3 displacement = v3(position_x - spatial_component->position.x,
+            -FALL_SPEED * (f32)frame_inputs->dt, 0.0f);
+        charcontroller::move(controller, displacement);
+
+        gui::log("is_grounded = %d, did_step_up = %d, did_hit_wall = %d",
+            controller->is_grounded, controller->did_step_up, controller->did_hit_wall);
+        gui::log("ground_normal = (%f, %f, %f)", controller->ground_normal.x,
+            controller->ground_normal.y, controller->ground_normal.z);
+
+        // There's nothing we can't step onto, and no drop we can't snap down,
+        // so once we've landed, we should never leave the ground.
+        if (controller->did_hit_wall && !controller->did_step_up) {
+            logs::warning("Character %d got stuck on a step at x = %f",
+                entity_handle, spatial_component->position.x);
+        }
+        if (was_grounded && !controller->is_grounded) {
+            logs::warning("Character %d lost the ground at x = %f",
+                entity_handle, spatial_component->position.x);
+        }
+    }
 }
@@ -8,6 +8,19 @@
 
 class behavior_functions {
 public:
-    static void test(entities::Handle entity_handle);
-    static void char_movement_test(entities::Handle entity_handle);
+    static void test(
+        entities::Handle const *entity_handles,
+        u32 n_entities,
+        behavior::FrameInputs const *frame_inputs
+    );
+    static void char_movement_test(
+        entities::Handle const *entity_handles,
+        u32 n_entities,
+        behavior::FrameInputs const *frame_inputs
+    );
+    static void char_stairs_test(
+        entities::Handle const *entity_handles,
+        u32 n_entities,
+        behavior::FrameInputs const *frame_inputs
+    );
 };
@@ -0,0 +1,1810 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "../src_external/pstr.h"
+#include "bench.hpp"
+#include "logs.hpp"
+#include "debug.hpp"
+#include "gui.hpp"
+#include "util.hpp"
+#include "tasks.hpp"
+#include "intrinsics.hpp"
+
+
+void
+bench::run(char const *bench_name)
+{
+    if (pstr_eq(bench_name, "archetypes")) {
+        run_archetypes();
+    } else if (pstr_eq(bench_name, "drawables")) {
+        run_drawables();
+    } else if (pstr_eq(bench_name, "aabbtree")) {
+        run_aabbtree();
+    } else if (pstr_eq(bench_name, "spatialgrid")) {
+        run_spatialgrid();
+    } else if (pstr_eq(bench_name, "raycasts")) {
+        run_raycasts();
+    } else if (pstr_eq(bench_name, "paircache")) {
+        run_paircache();
+    } else if (pstr_eq(bench_name, "solver")) {
+        run_solver();
+    } else if (pstr_eq(bench_name, "sat")) {
+        run_sat();
+    } else if (pstr_eq(bench_name, "meshbvh")) {
+        run_meshbvh();
+    } else if (pstr_eq(bench_name, "anim")) {
+        run_anim();
+    } else {
+        gui::log("Unknown benchmark: %s. Available benchmarks: archetypes, drawables, "
+            "aabbtree, spatialgrid, raycasts, paircache, solver, sat, meshbvh, anim",
+            bench_name);
+    }
+}
+
+
+void
+bench::make_component_arrays(
+    ComponentArrays *arrays,
+    memory::Pool *memory_pool,
+    u32 n_entities
+) {
+    // Only some entities are animated, which is also roughly what happens in
+    // real scenes.
+    u32 max_n_anim_components = min(n_entities / 8, (u32)1000);
+    u32 n_anim_components = 0;
+
+    u32 n_slots = n_entities + 1;
+    arrays->signatures = Array<entities::Signature>(memory_pool, n_slots,
+        "bench_signatures", true, 1);
+    arrays->spatials = Array<spatial::Component>(memory_pool, n_slots,
+        "bench_spatial_components", true, 1);
+    arrays->drawables = Array<drawable::Component>(memory_pool, n_slots,
+        "bench_drawable_components", true, 1);
+    arrays->physics_components = Array<physics::Component>(memory_pool, n_slots,
+        "bench_physics_components", true, 1);
+    arrays->anim_components = Array<anim::Component>(memory_pool, n_slots,
+        "bench_anim_components", true, 1);
+
+    range_named (entity_handle, 1, n_slots) {
+        entities::Signature signature = (u32)entities::ComponentType::spatial;
+        spatial::Component *spatial_component = arrays->spatials[entity_handle];
+        spatial_component->entity_handle = entity_handle;
+        spatial_component->position = v3((f32)entity_handle, 0.0f, 0.0f);
+        spatial_component->rotation = glm::angleAxis(
+            radians((f32)(entity_handle % 360)), v3(0.0f, 1.0f, 0.0f));
+        spatial_component->scale = v3(1.0f);
+        spatial_component->parent_entity_handle = entities::NO_ENTITY_HANDLE;
+
+        if (entity_handle % 4 != 3) {
+            signature |= (u32)entities::ComponentType::drawable;
+            drawable::Component *drawable_component = arrays->drawables[entity_handle];
+            drawable_component->entity_handle = entity_handle;
+            drawable_component->target_render_pass = drawable::Pass::deferred;
+        }
+
+        if (entity_handle % 2 == 0) {
+            signature |= (u32)entities::ComponentType::physics;
+            physics::Component *physics_component = arrays->physics_components[entity_handle];
+            physics_component->entity_handle = entity_handle;
+            physics_component->obb.x_axis = v3(1.0f, 0.0f, 0.0f);
+            physics_component->obb.y_axis = v3(0.0f, 1.0f, 0.0f);
+            physics_component->obb.extents = v3(0.5f);
+        }
+
+        if (
+            entity_handle % 8 == 0 &&
+            (signature & (u32)entities::ComponentType::drawable) &&
+            n_anim_components < max_n_anim_components
+        ) {
+            signature |= (u32)entities::ComponentType::anim;
+            anim::Component *anim_component = arrays->anim_components[entity_handle];
+            anim_component->entity_handle = entity_handle;
+            anim_component->bone_matrices = MEMORY_PUSH(memory_pool, m4, "bench_bone_matrices");
+            anim_component->bone_matrices[0] = m4(1.0f);
+            n_anim_components++;
+        }
+
+        *arrays->signatures[entity_handle] = signature;
+    }
+}
+
+
+void
+bench::fill_archetype_store(archetypes::Store *store, ComponentArrays *arrays)
+{
+    range_named (entity_handle, arrays->signatures.starting_idx, arrays->signatures.length) {
+        entities::Signature signature = *arrays->signatures[entity_handle];
+        archetypes::add_entity(store, entity_handle, signature);
+        *(spatial::Component*)archetypes::get_component(store, entity_handle,
+            entities::ComponentType::spatial) = *arrays->spatials[entity_handle];
+        if (signature & (u32)entities::ComponentType::drawable) {
+            *(drawable::Component*)archetypes::get_component(store, entity_handle,
+                entities::ComponentType::drawable) = *arrays->drawables[entity_handle];
+        }
+        if (signature & (u32)entities::ComponentType::physics) {
+            *(physics::Component*)archetypes::get_component(store, entity_handle,
+                entities::ComponentType::physics) = *arrays->physics_components[entity_handle];
+        }
+        if (signature & (u32)entities::ComponentType::anim) {
+            *(anim::Component*)archetypes::get_component(store, entity_handle,
+                entities::ComponentType::anim) = *arrays->anim_components[entity_handle];
+        }
+    }
+}
+
+
+void
+bench::run_archetypes()
+{
+    u32 const entity_counts[] = { 1000, 10000, 50000 };
+    for (u32 n_entities : entity_counts) {
+        run_archetypes_for_n_entities(n_entities);
+    }
+}
+
+
+/*!
+    Runs the same work over components stored in per-system arrays and in
+    archetype chunks, for three access patterns: the renderer's
+    (spatial + drawable), physics' (spatial + physics) and the animated
+    draw path's (spatial + drawable + anim).
+*/
+void
+bench::run_archetypes_for_n_entities(u32 n_entities)
+{
+    // The arrays have room for every component for every entity, and the
+    // chunks hold each entity's components again. On top of that, we need
+    // room for partly full chunks, the bone matrices, and the store itself.
+    size_t entity_size = sizeof(entities::Signature) + sizeof(spatial::Component) +
+        sizeof(drawable::Component) + sizeof(physics::Component) + sizeof(anim::Component);
+    memory::Pool memory_pool = {
+        .size = 2 * (size_t)(n_entities + 1) * entity_size + util::mb_to_b(32),
+    };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    ComponentArrays *arrays = MEMORY_PUSH(&memory_pool, ComponentArrays, "bench_arrays");
+    make_component_arrays(arrays, &memory_pool, n_entities);
+    archetypes::Store *store = MEMORY_PUSH(&memory_pool, archetypes::Store, "bench_store");
+    archetypes::init_store(store, &memory_pool, n_entities + 1);
+    fill_archetype_store(store, arrays);
+
+    entities::Signature const render_mask =
+        (u32)entities::ComponentType::spatial | (u32)entities::ComponentType::drawable;
+    entities::Signature const physics_mask =
+        (u32)entities::ComponentType::spatial | (u32)entities::ComponentType::physics;
+    entities::Signature const anim_mask = render_mask | (u32)entities::ComponentType::anim;
+
+    // We sum up some results so that the compiler can't throw the work away.
+    f32 checksum = 0.0f;
+    spatial::ModelMatrixCache cache = {};
+    f64 arrays_ms;
+    f64 chunks_ms;
+    Array<entities::Signature> *signatures = &arrays->signatures;
+
+    // Render
+    {
+        auto t0 = debug_start_timer();
+        range_named (idx_iteration, 0, N_ITERATIONS) {
+            range_named (entity_handle, signatures->starting_idx, signatures->length) {
+                if ((*arrays->signatures[entity_handle] & render_mask) != render_mask) {
+                    continue;
+                }
+                drawable::Component *drawable_component = arrays->drawables[entity_handle];
+                m4 model_matrix = spatial::make_model_matrix(arrays->spatials[entity_handle],
+                    &cache);
+                checksum += model_matrix[3][0] + (f32)drawable_component->target_render_pass;
+            }
+        }
+        arrays_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+        t0 = debug_start_timer();
+        range_named (idx_iteration, 0, N_ITERATIONS) {
+            archetypes::query(store, render_mask, [&](
+                archetypes::Archetype *archetype, archetypes::Chunk *chunk
+            ) {
+                spatial::Component *spatials =
+                    archetypes::get_chunk_components<spatial::Component>(
+                        archetype, chunk, entities::ComponentType::spatial);
+                drawable::Component *drawables =
+                    archetypes::get_chunk_components<drawable::Component>(
+                        archetype, chunk, entities::ComponentType::drawable);
+                range (0, chunk->n_entities) {
+                    m4 model_matrix = spatial::make_model_matrix(&spatials[idx], &cache);
+                    checksum += model_matrix[3][0] + (f32)drawables[idx].target_render_pass;
+                }
+            });
+        }
+        chunks_ms = debug_end_timer(t0) / N_ITERATIONS;
+        log_result("render", n_entities, arrays_ms, chunks_ms);
+    }
+
+    // Physics
+    {
+        auto t0 = debug_start_timer();
+        range_named (idx_iteration, 0, N_ITERATIONS) {
+            range_named (entity_handle, signatures->starting_idx, signatures->length) {
+                if ((*arrays->signatures[entity_handle] & physics_mask) != physics_mask) {
+                    continue;
+                }
+                physics::Component *physics_component = arrays->physics_components[entity_handle];
+                physics_component->transformed_obb = physics::transform_obb(
+                    physics_component->obb, arrays->spatials[entity_handle]);
+                checksum += physics_component->transformed_obb.center.x;
+            }
+        }
+        arrays_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+        t0 = debug_start_timer();
+        range_named (idx_iteration, 0, N_ITERATIONS) {
+            archetypes::query(store, physics_mask, [&](
+                archetypes::Archetype *archetype, archetypes::Chunk *chunk
+            ) {
+                spatial::Component *spatials =
+                    archetypes::get_chunk_components<spatial::Component>(
+                        archetype, chunk, entities::ComponentType::spatial);
+                physics::Component *physics_components =
+                    archetypes::get_chunk_components<physics::Component>(
+                        archetype, chunk, entities::ComponentType::physics);
+                range (0, chunk->n_entities) {
+                    physics_components[idx].transformed_obb = physics::transform_obb(
+                        physics_components[idx].obb, &spatials[idx]);
+                    checksum += physics_components[idx].transformed_obb.center.x;
+                }
+            });
+        }
+        chunks_ms = debug_end_timer(t0) / N_ITERATIONS;
+        log_result("physics", n_entities, arrays_ms, chunks_ms);
+    }
+
+    // Animated
+    {
+        auto t0 = debug_start_timer();
+        range_named (idx_iteration, 0, N_ITERATIONS) {
+            range_named (entity_handle, signatures->starting_idx, signatures->length) {
+                if ((*arrays->signatures[entity_handle] & anim_mask) != anim_mask) {
+                    continue;
+                }
+                anim::Component *anim_component = arrays->anim_components[entity_handle];
+                m4 model_matrix = spatial::make_model_matrix(arrays->spatials[entity_handle],
+                    &cache);
+                checksum += (model_matrix * anim_component->bone_matrices[0])[3][0];
+            }
+        }
+        arrays_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+        t0 = debug_start_timer();
+        range_named (idx_iteration, 0, N_ITERATIONS) {
+            archetypes::query(store, anim_mask, [&](
+                archetypes::Archetype *archetype, archetypes::Chunk *chunk
+            ) {
+                spatial::Component *spatials =
+                    archetypes::get_chunk_components<spatial::Component>(
+                        archetype, chunk, entities::ComponentType::spatial);
+                anim::Component *anim_components =
+                    archetypes::get_chunk_components<anim::Component>(
+                        archetype, chunk, entities::ComponentType::anim);
+                range (0, chunk->n_entities) {
+                    m4 model_matrix = spatial::make_model_matrix(&spatials[idx], &cache);
+                    checksum += (model_matrix * anim_components[idx].bone_matrices[0])[3][0];
+                }
+            });
+        }
+        chunks_ms = debug_end_timer(t0) / N_ITERATIONS;
+        log_result("animated", n_entities, arrays_ms, chunks_ms);
+    }
+
+    logs::info("(checksum %f, %d archetypes)", checksum, store->archetypes.length);
+}
+
+
+void
+bench::run_drawables()
+{
+    u32 const entity_counts[] = { 1000, 10000, 50000 };
+    for (u32 n_entities : entity_counts) {
+        run_drawables_for_n_entities(n_entities);
+    }
+}
+
+
+/*!
+    Compares drawable components that embed their whole mesh with drawable
+    components that refer to meshes in a shared registry, both in terms of
+    memory used and in terms of how long it takes to go through them the way
+    the renderer does.
+*/
+void
+bench::run_drawables_for_n_entities(u32 n_entities)
+{
+    // Plenty of entities share each model.
+    constexpr u32 N_MESHES = 64;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(512) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    Array<EmbeddedMeshDrawableComponent> embedded_components(&memory_pool, n_entities,
+        "bench_embedded_mesh_drawable_components");
+    Array<drawable::Component> components(&memory_pool, n_entities,
+        "bench_drawable_components");
+    Array<geom::Mesh> meshes(&memory_pool, N_MESHES, "bench_meshes");
+
+    range (0, N_MESHES) {
+        meshes.push({
+            .vao = idx + 1,
+            .mode = GL_TRIANGLES,
+            .n_vertices = 3 * (idx + 1),
+            .n_indices = 3 * (idx + 1),
+        });
+    }
+
+    range (0, n_entities) {
+        u32 idx_mesh = idx % N_MESHES;
+        EmbeddedMeshDrawableComponent *embedded_component = embedded_components.push();
+        embedded_component->entity_handle = idx + 1;
+        embedded_component->mesh = *meshes[idx_mesh];
+        embedded_component->target_render_pass = drawable::Pass::deferred;
+        components.push({
+            .entity_handle = idx + 1,
+            .mesh_handle = idx_mesh,
+            .idx_material = 0,
+            .target_render_pass = drawable::Pass::deferred,
+        });
+    }
+
+    // We sum up some results so that the compiler can't throw the work away.
+    u64 checksum = 0;
+
+    auto t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        each (embedded_component, embedded_components) {
+            if (!((u32)embedded_component->target_render_pass & (u32)drawable::Pass::deferred)) {
+                continue;
+            }
+            checksum += embedded_component->mesh.vao + embedded_component->mesh.n_indices;
+        }
+    }
+    f64 embedded_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        each (component, components) {
+            if (!((u32)component->target_render_pass & (u32)drawable::Pass::deferred)) {
+                continue;
+            }
+            geom::Mesh *mesh = meshes[component->mesh_handle];
+            checksum += mesh->vao + mesh->n_indices + component->idx_material;
+        }
+    }
+    f64 registry_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    size_t embedded_size = n_entities * sizeof(EmbeddedMeshDrawableComponent);
+    size_t registry_size = n_entities * sizeof(drawable::Component) +
+        N_MESHES * sizeof(geom::Mesh);
+
+    gui::log("drawables (%u entities): embedded %.3fms %.2fMB, registry %.3fms %.2fMB",
+        n_entities,
+        embedded_ms, (f64)embedded_size / (1024.0 * 1024.0),
+        registry_ms, (f64)registry_size / (1024.0 * 1024.0));
+    logs::info("drawables (%u entities): embedded %.3fms %zu bytes, registry %.3fms %zu bytes",
+        n_entities, embedded_ms, embedded_size, registry_ms, registry_size);
+    logs::info("(checksum %llu)", (unsigned long long)checksum);
+}
+
+
+void
+bench::run_aabbtree()
+{
+    u32 const body_counts[] = { 1000, 10000, 50000 };
+    for (u32 n_bodies : body_counts) {
+        run_aabbtree_for_n_bodies(n_bodies);
+    }
+}
+
+
+/*!
+    Compares finding overlaps and ray hits with the AABB tree against testing
+    every body, and times building and updating the tree. The brute force
+    overlap test is O(n^2), so we skip it for the largest body counts.
+*/
+void
+bench::run_aabbtree_for_n_bodies(u32 n_bodies)
+{
+    constexpr u32 N_RAYS = 1000;
+    constexpr u32 MAX_N_BODIES_FOR_BRUTE_FORCE = 10000;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    // Spread the bodies out so that the density stays the same no matter how
+    // many bodies we have.
+    f32 world_size = 4.0f * (f32)cbrt((f64)n_bodies);
+
+    Array<spatial::Aabb> aabbs(&memory_pool, n_bodies, "bench_aabbs");
+    Array<u32> leaves(&memory_pool, n_bodies, "bench_leaves");
+    range (0, n_bodies) {
+        v3 center = v3(
+            util::random(0.0f, world_size),
+            util::random(0.0f, world_size),
+            util::random(0.0f, world_size));
+        v3 half_size = v3(
+            util::random(0.25f, 1.0f),
+            util::random(0.25f, 1.0f),
+            util::random(0.25f, 1.0f));
+        aabbs.push({ .min = center - half_size, .max = center + half_size });
+    }
+
+    aabbtree::Tree *tree = MEMORY_PUSH(&memory_pool, aabbtree::Tree, "bench_tree");
+    aabbtree::init_tree(tree, &memory_pool, n_bodies);
+
+    // Build
+    auto t0 = debug_start_timer();
+    range (0, n_bodies) {
+        leaves.push(aabbtree::insert(tree, idx + 1, aabbs[idx], aabbtree::ALL_LAYERS));
+    }
+    f64 build_ms = debug_end_timer(t0);
+
+    // Overlaps
+    u32 n_tree_overlaps = 0;
+    t0 = debug_start_timer();
+    range_named (idx_body, 0, n_bodies) {
+        aabbtree::query_aabb(tree, aabbs[idx_body], aabbtree::ALL_LAYERS,
+            [&](entities::Handle entity_handle) -> bool {
+                if (entity_handle != idx_body + 1) {
+                    n_tree_overlaps++;
+                }
+                return true;
+            });
+    }
+    f64 tree_overlaps_ms = debug_end_timer(t0);
+
+    u32 n_brute_force_overlaps = 0;
+    f64 brute_force_overlaps_ms = 0.0;
+    if (n_bodies <= MAX_N_BODIES_FOR_BRUTE_FORCE) {
+        t0 = debug_start_timer();
+        range_named (idx_a, 0, n_bodies) {
+            range_named (idx_b, 0, n_bodies) {
+                if (idx_a != idx_b && spatial::do_aabbs_overlap(aabbs[idx_a], aabbs[idx_b])) {
+                    n_brute_force_overlaps++;
+                }
+            }
+        }
+        brute_force_overlaps_ms = debug_end_timer(t0);
+    }
+
+    // Rays
+    spatial::Ray rays[N_RAYS];
+    range (0, N_RAYS) {
+        rays[idx] = {
+            .origin = v3(
+                util::random(0.0f, world_size),
+                util::random(0.0f, world_size),
+                util::random(0.0f, world_size)),
+            .direction = normalize(v3(
+                util::random(-1.0f, 1.0f),
+                util::random(-1.0f, 1.0f),
+                util::random(-1.0f, 1.0f))),
+        };
+    }
+    f32 const ray_length = 10.0f;
+
+    u32 n_tree_ray_hits = 0;
+    t0 = debug_start_timer();
+    range_named (idx_ray, 0, N_RAYS) {
+        aabbtree::query_ray(tree, &rays[idx_ray], ray_length, aabbtree::ALL_LAYERS,
+            [&](entities::Handle entity_handle) -> bool {
+                n_tree_ray_hits++;
+                return true;
+            });
+    }
+    f64 tree_rays_ms = debug_end_timer(t0);
+
+    u32 n_brute_force_ray_hits = 0;
+    t0 = debug_start_timer();
+    range_named (idx_ray, 0, N_RAYS) {
+        range_named (idx_body, 0, n_bodies) {
+            if (spatial::intersect_aabb_ray(aabbs[idx_body], &rays[idx_ray], ray_length)) {
+                n_brute_force_ray_hits++;
+            }
+        }
+    }
+    f64 brute_force_rays_ms = debug_end_timer(t0);
+
+    // Update, moving every body a little bit, like most bodies do each frame
+    u32 n_reinsertions = 0;
+    t0 = debug_start_timer();
+    range (0, n_bodies) {
+        v3 offset = v3(
+            util::random(-0.05f, 0.05f),
+            util::random(-0.05f, 0.05f),
+            util::random(-0.05f, 0.05f));
+        spatial::Aabb *aabb = aabbs[idx];
+        aabb->min += offset;
+        aabb->max += offset;
+        if (aabbtree::move(tree, *leaves[idx], aabb)) {
+            n_reinsertions++;
+        }
+    }
+    f64 update_ms = debug_end_timer(t0);
+
+    gui::log("aabbtree (%u bodies): build %.3fms, update %.3fms (%u reinserted), height %u",
+        n_bodies, build_ms, update_ms, n_reinsertions, aabbtree::get_height(tree));
+    gui::log("  overlaps: tree %.3fms (%u), brute force %.3fms (%u)",
+        tree_overlaps_ms, n_tree_overlaps, brute_force_overlaps_ms, n_brute_force_overlaps);
+    gui::log("  %u rays: tree %.3fms (%u leaf hits), brute force %.3fms (%u hits)",
+        N_RAYS, tree_rays_ms, n_tree_ray_hits, brute_force_rays_ms, n_brute_force_ray_hits);
+    logs::info("aabbtree (%u bodies): build %.3fms, update %.3fms (%u reinserted), "
+        "overlaps tree %.3fms brute force %.3fms, rays tree %.3fms brute force %.3fms",
+        n_bodies, build_ms, update_ms, n_reinsertions,
+        tree_overlaps_ms, brute_force_overlaps_ms, tree_rays_ms, brute_force_rays_ms);
+}
+
+
+void
+bench::run_spatialgrid()
+{
+    u32 const entity_counts[] = { 1000, 10000, 50000 };
+    for (u32 n_entities : entity_counts) {
+        run_spatialgrid_for_n_entities(n_entities);
+    }
+}
+
+
+/*!
+    Times rebuilding the grid, then compares a few thousand sphere and
+    k-nearest queries, like AI and triggers would make every frame, against
+    going through every entity.
+*/
+void
+bench::run_spatialgrid_for_n_entities(u32 n_entities)
+{
+    constexpr u32 N_QUERIES = 4000;
+    constexpr u32 MAX_N_RESULTS_PER_QUERY = 32;
+    constexpr u32 K = 8;
+    constexpr f32 QUERY_RADIUS = 3.0f;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    // Keep the density the same no matter how many entities we have.
+    f32 world_size = 4.0f * (f32)cbrt((f64)n_entities);
+
+    Array<v3> positions(&memory_pool, n_entities, "bench_positions");
+    range (0, n_entities) {
+        positions.push(v3(
+            util::random(0.0f, world_size),
+            util::random(0.0f, world_size),
+            util::random(0.0f, world_size)));
+    }
+
+    Array<v3> centers(&memory_pool, N_QUERIES, "bench_query_centers");
+    Array<f32> radii(&memory_pool, N_QUERIES, "bench_query_radii");
+    range (0, N_QUERIES) {
+        centers.push(v3(
+            util::random(0.0f, world_size),
+            util::random(0.0f, world_size),
+            util::random(0.0f, world_size)));
+        radii.push(QUERY_RADIUS);
+    }
+
+    Array<entities::Handle> results(&memory_pool, N_QUERIES * MAX_N_RESULTS_PER_QUERY,
+        "bench_results");
+    Array<f32> distances(&memory_pool, N_QUERIES * K, "bench_distances");
+    Array<u32> n_results(&memory_pool, N_QUERIES, "bench_n_results");
+    results.alloc();
+    distances.alloc();
+    n_results.alloc();
+
+    spatialgrid::Grid *grid = MEMORY_PUSH(&memory_pool, spatialgrid::Grid, "bench_grid");
+    spatialgrid::init_grid(grid, &memory_pool, n_entities, spatialgrid::DEFAULT_CELL_SIZE);
+
+    // Rebuild
+    auto t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        spatialgrid::begin_rebuild(grid);
+        range (0, n_entities) {
+            spatialgrid::add_entry(grid, idx + 1, *positions[idx]);
+        }
+        spatialgrid::end_rebuild(grid);
+    }
+    f64 rebuild_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    // Spheres
+    u32 n_grid_sphere_results = 0;
+    t0 = debug_start_timer();
+    spatialgrid::overlap_spheres(grid, centers.items, radii.items, N_QUERIES,
+        results.items, MAX_N_RESULTS_PER_QUERY, n_results.items);
+    f64 grid_spheres_ms = debug_end_timer(t0);
+    range (0, N_QUERIES) {
+        n_grid_sphere_results += n_results.items[idx];
+    }
+
+    u32 n_brute_force_sphere_results = 0;
+    t0 = debug_start_timer();
+    range_named (idx_query, 0, N_QUERIES) {
+        u32 n_query_results = 0;
+        range_named (idx_entity, 0, n_entities) {
+            if (
+                length2(*positions[idx_entity] - *centers[idx_query]) <=
+                    QUERY_RADIUS * QUERY_RADIUS &&
+                n_query_results < MAX_N_RESULTS_PER_QUERY
+            ) {
+                results.items[idx_query * MAX_N_RESULTS_PER_QUERY + n_query_results] =
+                    idx_entity + 1;
+                n_query_results++;
+            }
+        }
+        n_brute_force_sphere_results += n_query_results;
+    }
+    f64 brute_force_spheres_ms = debug_end_timer(t0);
+
+    // k nearest
+    u32 n_grid_nearest_results = 0;
+    t0 = debug_start_timer();
+    spatialgrid::find_k_nearest_batch(grid, centers.items, N_QUERIES, K, world_size,
+        results.items, distances.items, n_results.items);
+    f64 grid_nearest_ms = debug_end_timer(t0);
+    f32 grid_nearest_sum = 0.0f;
+    range (0, N_QUERIES) {
+        n_grid_nearest_results += n_results.items[idx];
+        grid_nearest_sum += distances.items[idx * K + K - 1];
+    }
+
+    f32 brute_force_nearest_sum = 0.0f;
+    t0 = debug_start_timer();
+    range_named (idx_query, 0, N_QUERIES) {
+        f32 *query_distances = &distances.items[idx_query * K];
+        u32 n_query_results = 0;
+        range_named (idx_entity, 0, n_entities) {
+            f32 distance_squared = length2(*positions[idx_entity] - *centers[idx_query]);
+            if (n_query_results == K && distance_squared >= query_distances[K - 1]) {
+                continue;
+            }
+            u32 idx = (n_query_results < K) ? n_query_results++ : K - 1;
+            while (idx > 0 && query_distances[idx - 1] > distance_squared) {
+                query_distances[idx] = query_distances[idx - 1];
+                idx--;
+            }
+            query_distances[idx] = distance_squared;
+        }
+        brute_force_nearest_sum += sqrt(query_distances[K - 1]);
+    }
+    f64 brute_force_nearest_ms = debug_end_timer(t0);
+
+    gui::log("spatialgrid (%u entities): rebuild %.3fms", n_entities, rebuild_ms);
+    gui::log("  %u spheres: grid %.3fms (%u), brute force %.3fms (%u)",
+        N_QUERIES, grid_spheres_ms, n_grid_sphere_results,
+        brute_force_spheres_ms, n_brute_force_sphere_results);
+    gui::log("  %u x %u nearest: grid %.3fms (%u, sum %.2f), brute force %.3fms (sum %.2f)",
+        N_QUERIES, K, grid_nearest_ms, n_grid_nearest_results, grid_nearest_sum,
+        brute_force_nearest_ms, brute_force_nearest_sum);
+    logs::info("spatialgrid (%u entities): rebuild %.3fms, spheres grid %.3fms "
+        "brute force %.3fms, nearest grid %.3fms brute force %.3fms",
+        n_entities, rebuild_ms, grid_spheres_ms, brute_force_spheres_ms,
+        grid_nearest_ms, brute_force_nearest_ms);
+}
+
+
+void
+bench::run_raycasts()
+{
+    u32 const body_counts[] = { MAX_N_ENTITIES, 1000, 10000 };
+    for (u32 n_bodies : body_counts) {
+        run_raycasts_for_n_bodies(n_bodies);
+    }
+}
+
+
+/*!
+    Compares casting a batch of rays one by one through the broadphase tree,
+    which is what looping over `physics::closest_hit()` does, against
+    `physics::raycast_obb_packets()`, on one thread and on all workers.
+*/
+void
+bench::run_raycasts_for_n_bodies(u32 n_bodies)
+{
+    constexpr u32 N_RAYS = 4096;
+    constexpr f32 RAY_LENGTH = 1000.0f;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    f32 world_size = 4.0f * (f32)cbrt((f64)n_bodies);
+
+    Array<physics::Component> components(&memory_pool, n_bodies + 1,
+        "bench_physics_components", true, 1);
+    range_named (entity_handle, 1, n_bodies + 1) {
+        physics::Component *component = components[entity_handle];
+        component->entity_handle = entity_handle;
+        component->obb = {
+            .center = v3(0.0f),
+            .x_axis = v3(1.0f, 0.0f, 0.0f),
+            .y_axis = v3(0.0f, 1.0f, 0.0f),
+            .extents = v3(
+                util::random(0.25f, 1.0f),
+                util::random(0.25f, 1.0f),
+                util::random(0.25f, 1.0f)),
+        };
+        component->layers = physics::DEFAULT_LAYERS;
+        component->layer_mask = physics::DEFAULT_LAYER_MASK;
+        spatial::Component spatial_component = {
+            .entity_handle = entity_handle,
+            .position = v3(
+                util::random(0.0f, world_size),
+                util::random(0.0f, world_size),
+                util::random(0.0f, world_size)),
+            .rotation = glm::angleAxis(radians(util::random(0.0f, 360.0f)),
+                normalize(v3(
+                    util::random(-1.0f, 1.0f),
+                    util::random(-1.0f, 1.0f),
+                    util::random(-1.0f, 1.0f)))),
+            .scale = v3(1.0f),
+        };
+        component->transformed_obb = physics::transform_obb(component->obb,
+            &spatial_component);
+    }
+
+    aabbtree::Tree *tree = MEMORY_PUSH(&memory_pool, aabbtree::Tree, "bench_tree");
+    aabbtree::init_tree(tree, &memory_pool, n_bodies);
+    each (component, components) {
+        spatial::Aabb aabb = spatial::make_aabb_from_obb(&component->transformed_obb);
+        aabbtree::insert(tree, component->entity_handle, &aabb, component->layers);
+    }
+
+    Array<physics::ObbPacket> obb_packets(&memory_pool,
+        (n_bodies + simd::WIDTH - 1) / simd::WIDTH, "bench_obb_packets");
+    auto t0 = debug_start_timer();
+    physics::fill_obb_packets(&obb_packets, &components);
+    f64 fill_ms = debug_end_timer(t0);
+
+    Array<spatial::Ray> rays(&memory_pool, N_RAYS, "bench_rays");
+    range (0, N_RAYS) {
+        rays.push({
+            .origin = v3(
+                util::random(0.0f, world_size),
+                util::random(0.0f, world_size),
+                util::random(0.0f, world_size)),
+            .direction = normalize(v3(
+                util::random(-1.0f, 1.0f),
+                util::random(-1.0f, 1.0f),
+                util::random(-1.0f, 1.0f))),
+        });
+    }
+    Array<physics::RayCollisionResult> results(&memory_pool, N_RAYS, "bench_ray_results");
+    results.alloc();
+
+    auto sum_results = [&](u32 *n_hits, f64 *distance_sum) {
+        *n_hits = 0;
+        *distance_sum = 0.0;
+        range (0, N_RAYS) {
+            if (results.items[idx].did_intersect) {
+                (*n_hits)++;
+                *distance_sum += results.items[idx].distance;
+            }
+        }
+    };
+
+    // One by one, through the tree
+    t0 = debug_start_timer();
+    range_named (idx_ray, 0, N_RAYS) {
+        physics::RayCollisionResult *result = &results.items[idx_ray];
+        *result = {};
+        aabbtree::cast_ray(tree, rays[idx_ray], RAY_LENGTH, physics::ALL_LAYERS,
+            [&](entities::Handle entity_handle, f32 max_distance) -> f32 {
+                physics::Component *candidate = components[entity_handle];
+                physics::RaycastResult raycast_result = physics::intersect_obb_ray(
+                    &candidate->transformed_obb, rays[idx_ray]);
+                if (!raycast_result.did_intersect || raycast_result.distance > max_distance) {
+                    return max_distance;
+                }
+                *result = {
+                    .did_intersect = true,
+                    .distance = raycast_result.distance,
+                    .collidee = candidate,
+                };
+                return raycast_result.distance;
+            });
+    }
+    f64 tree_ms = debug_end_timer(t0);
+    u32 n_tree_hits;
+    f64 tree_distance_sum;
+    sum_results(&n_tree_hits, &tree_distance_sum);
+
+    // Packets, on this thread only
+    physics::RaycastBatchJob job = {
+        .obb_packets = &obb_packets,
+        .components = &components,
+        .rays = rays.items,
+        .layer_mask = physics::ALL_LAYERS,
+        .handles_to_ignore_or_nullptr = nullptr,
+        .results = results.items,
+    };
+    t0 = debug_start_timer();
+    physics::run_raycast_batch_job(&job, 0, N_RAYS);
+    f64 packets_ms = debug_end_timer(t0);
+    u32 n_packet_hits;
+    f64 packet_distance_sum;
+    sum_results(&n_packet_hits, &packet_distance_sum);
+
+    // Packets, on all workers
+    t0 = debug_start_timer();
+    physics::raycast_obb_packets(&obb_packets, &components, rays.items, N_RAYS,
+        physics::ALL_LAYERS, nullptr, results.items);
+    f64 parallel_packets_ms = debug_end_timer(t0);
+
+    gui::log("raycasts (%u bodies, %u rays): filling packets %.3fms", n_bodies, N_RAYS, fill_ms);
+    gui::log("  tree %.3fms (%u hits, sum %.2f), packets %.3fms (%u hits, sum %.2f), "
+        "parallel packets %.3fms",
+        tree_ms, n_tree_hits, tree_distance_sum, packets_ms, n_packet_hits,
+        packet_distance_sum, parallel_packets_ms);
+    logs::info("raycasts (%u bodies, %u rays): tree %.3fms, packets %.3fms, "
+        "parallel packets %.3fms",
+        n_bodies, N_RAYS, tree_ms, packets_ms, parallel_packets_ms);
+}
+
+
+void
+bench::run_paircache()
+{
+    u32 const stack_heights[] = { 4, 16 };
+    for (u32 stack_height : stack_heights) {
+        run_paircache_for_stack_height(stack_height);
+    }
+}
+
+
+/*!
+    Compares the narrowphase with and without `physics::PairCache` on a grid of
+    resting stacks of boxes, which only jitter very slightly from frame to
+    frame, so most colliding pairs can reuse their contacts, and most
+    separated pairs are still separated along last frame's axis.
+*/
+void
+bench::run_paircache_for_stack_height(u32 stack_height)
+{
+    constexpr u32 N_STACKS_PER_SIDE = 8;
+    constexpr u32 N_FRAMES = 100;
+    constexpr f32 BOX_EXTENT = 0.5f;
+    // Boxes in a stack sink into each other a little, and stacks are a
+    // little apart, so their AABBs still overlap.
+    constexpr f32 PENETRATION = 0.01f;
+    constexpr f32 STACK_GAP = 0.05f;
+    constexpr f32 AABB_MARGIN = 0.1f;
+    constexpr f32 JITTER = 1.0e-5f;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    u32 n_bodies = N_STACKS_PER_SIDE * N_STACKS_PER_SIDE * stack_height;
+    Array<physics::Component> components(&memory_pool, n_bodies + 1,
+        "bench_physics_components", true, 1);
+    Array<v3> rest_positions(&memory_pool, n_bodies + 1, "bench_rest_positions", true, 1);
+    entities::Handle entity_handle = 1;
+    range_named (x, 0, N_STACKS_PER_SIDE) {
+        range_named (z, 0, N_STACKS_PER_SIDE) {
+            range_named (y, 0, stack_height) {
+                physics::Component *component = components[entity_handle];
+                component->entity_handle = entity_handle;
+                component->obb = {
+                    .center = v3(0.0f),
+                    .x_axis = v3(1.0f, 0.0f, 0.0f),
+                    .y_axis = v3(0.0f, 1.0f, 0.0f),
+                    .extents = v3(BOX_EXTENT),
+                };
+                component->layers = physics::DEFAULT_LAYERS;
+                component->layer_mask = physics::DEFAULT_LAYER_MASK;
+                *rest_positions[entity_handle] = v3(
+                    (f32)x * (2.0f * BOX_EXTENT + STACK_GAP),
+                    (f32)y * (2.0f * BOX_EXTENT - PENETRATION),
+                    (f32)z * (2.0f * BOX_EXTENT + STACK_GAP));
+                entity_handle++;
+            }
+        }
+    }
+
+    auto move_bodies = [&]() {
+        each (component, components) {
+            spatial::Component spatial_component = {
+                .entity_handle = component->entity_handle,
+                .position = *rest_positions[component->entity_handle] + v3(
+                    util::random(-JITTER, JITTER),
+                    util::random(-JITTER, JITTER),
+                    util::random(-JITTER, JITTER)),
+                .rotation = glm::angleAxis(util::random(-JITTER, JITTER), v3(0.0f, 1.0f, 0.0f)),
+                .scale = v3(1.0f),
+            };
+            component->transformed_obb = physics::transform_obb(component->obb,
+                &spatial_component);
+        }
+    };
+    move_bodies();
+
+    // The pairs the broadphase would give us, which don't change, since
+    // nothing really moves. Each box overlaps at most 26 others, and we only
+    // keep each pair once.
+    Array<physics::CandidatePair> pairs(&memory_pool, n_bodies * 13,
+        "bench_candidate_pairs");
+    range_named (idx_a, 1, n_bodies + 1) {
+        spatial::Aabb a = spatial::make_aabb_from_obb(&components[idx_a]->transformed_obb);
+        range_named (idx_b, idx_a + 1, n_bodies + 1) {
+            spatial::Aabb b = spatial::make_aabb_from_obb(&components[idx_b]->transformed_obb);
+            if (
+                a.min.x - AABB_MARGIN <= b.max.x && a.max.x + AABB_MARGIN >= b.min.x &&
+                a.min.y - AABB_MARGIN <= b.max.y && a.max.y + AABB_MARGIN >= b.min.y &&
+                a.min.z - AABB_MARGIN <= b.max.z && a.max.z + AABB_MARGIN >= b.min.z
+            ) {
+                pairs.push({ .entity_handle_a = idx_a, .entity_handle_b = idx_b });
+            }
+        }
+    }
+
+    physics::PairCache *pair_caches = (physics::PairCache*)memory::push(&memory_pool,
+        2 * sizeof(physics::PairCache), "bench_pair_caches");
+    u32 pair_cache_capacity = 64;
+    while (pair_cache_capacity < 2 * pairs.length) {
+        pair_cache_capacity *= 2;
+    }
+    range (0, 2) {
+        physics::init_pair_cache(&pair_caches[idx], &memory_pool, pair_cache_capacity);
+    }
+
+    f64 uncached_ms = 0.0;
+    f64 cached_ms = 0.0;
+    u32 n_uncached_contacts = 0;
+    u32 n_cached_contacts = 0;
+    u32 idx_pair_cache = 0;
+    range_named (idx_frame, 0, N_FRAMES) {
+        move_bodies();
+
+        auto t0 = debug_start_timer();
+        each (pair, pairs) {
+            physics::CollisionManifold manifold = physics::intersect_obb_obb(
+                &components[pair->entity_handle_a]->transformed_obb,
+                &components[pair->entity_handle_b]->transformed_obb);
+            if (manifold.did_collide) {
+                n_uncached_contacts++;
+            }
+        }
+        uncached_ms += debug_end_timer(t0);
+
+        t0 = debug_start_timer();
+        physics::PairCache *previous_pair_cache = &pair_caches[idx_pair_cache];
+        idx_pair_cache = 1 - idx_pair_cache;
+        physics::PairCache *pair_cache = &pair_caches[idx_pair_cache];
+        physics::clear_pair_cache(pair_cache);
+        each (pair, pairs) {
+            spatial::Obb *a = &components[pair->entity_handle_a]->transformed_obb;
+            spatial::Obb *b = &components[pair->entity_handle_b]->transformed_obb;
+            physics::CachedPair *cached_pair = physics::find_cached_pair(previous_pair_cache,
+                pair->entity_handle_a, pair->entity_handle_b);
+            physics::CollisionManifold manifold = physics::intersect_obb_obb_cached(a, b,
+                cached_pair, true);
+            physics::insert_cached_pair(pair_cache, pair->entity_handle_a,
+                pair->entity_handle_b, a, b, &manifold);
+            if (manifold.did_collide) {
+                n_cached_contacts++;
+            }
+        }
+        cached_ms += debug_end_timer(t0);
+    }
+
+    gui::log("paircache (%u bodies, stacks of %u, %u pairs, %u frames): "
+        "uncached %.3fms (%u contacts), cached %.3fms (%u contacts)",
+        n_bodies, stack_height, pairs.length, N_FRAMES, uncached_ms, n_uncached_contacts,
+        cached_ms, n_cached_contacts);
+    logs::info("paircache (%u bodies, stacks of %u): uncached %.3fms, cached %.3fms",
+        n_bodies, stack_height, uncached_ms, cached_ms);
+}
+
+
+void
+bench::run_solver()
+{
+    // Tall stacks test how well the solver keeps things still, and lots of
+    // stacks test how it copes with many bodies at once.
+    struct StackCase {
+        u32 n_stacks_per_side;
+        u32 stack_height;
+    };
+    StackCase const stack_cases[] = { { 4, 4 }, { 4, 10 }, { 10, 4 }, { 8, 10 } };
+    u32 n_failed_cases = 0;
+    for (StackCase stack_case : stack_cases) {
+        if (!run_solver_for_stacks(stack_case.n_stacks_per_side, stack_case.stack_height)) {
+            n_failed_cases++;
+        }
+    }
+    if (n_failed_cases > 0) {
+        gui::log("solver: FAILED, %u of %u cases drifted too far",
+            n_failed_cases, (u32)LEN(stack_cases));
+        logs::error("solver: %u of %u cases drifted too far",
+            n_failed_cases, (u32)LEN(stack_cases));
+    }
+}
+
+
+/*!
+    Drops a grid of stacks of boxes, each starting off a little apart, onto a
+    static floor, and steps `solver` for a few seconds. Besides the time it
+    takes, we check how far the top box of each stack has ended up from where
+    it would be if the stack were perfectly still, since a solver that's fast
+    but lets stacks slide or sink isn't much use. Returns false if any of them
+    ended up further than `MAX_TOP_DRIFT` away.
+*/
+bool
+bench::run_solver_for_stacks(u32 n_stacks_per_side, u32 stack_height)
+{
+    constexpr u32 N_STEPS = 300;
+    constexpr f32 BOX_EXTENT = 0.5f;
+    constexpr f32 BOX_MASS = 1.0f;
+    constexpr f32 FLOOR_EXTENT = 20.0f;
+    constexpr f32 DROP_GAP = 0.01f;
+    constexpr f32 STACK_GAP = 0.5f;
+    constexpr f32 AABB_MARGIN = 0.1f;
+    // How far the top box of a stack can end up from where it started out
+    // before we count the stack as having fallen over or sunk
+    constexpr f32 MAX_TOP_DRIFT = 0.05f;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    u32 n_bodies = n_stacks_per_side * n_stacks_per_side * stack_height + 1;
+    u32 n_constraints = n_bodies * 4 * physics::MAX_N_CONTACT_POINTS;
+    Array<physics::Component> components(&memory_pool, n_bodies + 1,
+        "bench_physics_components", true, 1);
+    Array<spatial::Component> spatials(&memory_pool, n_bodies + 1,
+        "bench_spatial_components", true, 1);
+    Array<v3> rest_positions(&memory_pool, n_bodies + 1, "bench_rest_positions", true, 1);
+
+    // The floor is body 1, and has no mass.
+    entities::Handle entity_handle = 1;
+    *components[entity_handle] = {
+        .entity_handle = entity_handle,
+        .obb = {
+            .center = v3(0.0f),
+            .x_axis = v3(1.0f, 0.0f, 0.0f),
+            .y_axis = v3(0.0f, 1.0f, 0.0f),
+            .extents = v3(FLOOR_EXTENT, BOX_EXTENT, FLOOR_EXTENT),
+        },
+        .layers = physics::DEFAULT_LAYERS,
+        .layer_mask = physics::DEFAULT_LAYER_MASK,
+        .is_static = true,
+    };
+    *spatials[entity_handle] = {
+        .entity_handle = entity_handle,
+        .position = v3(0.0f, -BOX_EXTENT, 0.0f),
+        .rotation = quat(1.0f, 0.0f, 0.0f, 0.0f),
+        .scale = v3(1.0f),
+    };
+    entity_handle++;
+    range_named (x, 0, n_stacks_per_side) {
+        range_named (z, 0, n_stacks_per_side) {
+            range_named (y, 0, stack_height) {
+                *components[entity_handle] = {
+                    .entity_handle = entity_handle,
+                    .obb = {
+                        .center = v3(0.0f),
+                        .x_axis = v3(1.0f, 0.0f, 0.0f),
+                        .y_axis = v3(0.0f, 1.0f, 0.0f),
+                        .extents = v3(BOX_EXTENT),
+                    },
+                    .layers = physics::DEFAULT_LAYERS,
+                    .layer_mask = physics::DEFAULT_LAYER_MASK,
+                    .mass = BOX_MASS,
+                };
+                *rest_positions[entity_handle] = v3(
+                    (f32)x * (2.0f * BOX_EXTENT + STACK_GAP),
+                    BOX_EXTENT + (f32)y * 2.0f * BOX_EXTENT,
+                    (f32)z * (2.0f * BOX_EXTENT + STACK_GAP));
+                *spatials[entity_handle] = {
+                    .entity_handle = entity_handle,
+                    .position = *rest_positions[entity_handle] +
+                        v3(0.0f, (f32)(y + 1) * DROP_GAP, 0.0f),
+                    .rotation = quat(1.0f, 0.0f, 0.0f, 0.0f),
+                    .scale = v3(1.0f),
+                };
+                entity_handle++;
+            }
+        }
+    }
+
+    Array<spatial::Aabb> aabbs(&memory_pool, n_bodies + 1, "bench_aabbs", true, 1);
+    Array<physics::CandidatePair> pairs(&memory_pool, n_bodies * 13, "bench_candidate_pairs");
+    Array<physics::Contact> contacts(&memory_pool, n_bodies * 13, "bench_contacts");
+    physics::PairCache *pair_caches = (physics::PairCache*)memory::push(&memory_pool,
+        2 * sizeof(physics::PairCache), "bench_pair_caches");
+    u32 pair_cache_capacity = 64;
+    while (pair_cache_capacity < 2 * pairs.capacity) {
+        pair_cache_capacity *= 2;
+    }
+    range (0, 2) {
+        physics::init_pair_cache(&pair_caches[idx], &memory_pool, pair_cache_capacity);
+    }
+    u32 idx_pair_cache = 0;
+
+    solver::Solver *solver = MEMORY_PUSH(&memory_pool, solver::Solver, "bench_solver");
+    solver::init_solver(solver, &memory_pool, n_bodies, n_constraints, n_bodies + 1);
+    solver->config = solver::get_solver()->config;
+
+    // The same as `physics::find_contacts()`, but brute force, since we're
+    // not measuring the broadphase.
+    auto find_contacts = [&]() {
+        each (component, components) {
+            component->transformed_obb = physics::transform_obb(component->obb,
+                spatials[component->entity_handle]);
+            *aabbs[component->entity_handle] = spatial::make_aabb_from_obb(
+                &component->transformed_obb);
+        }
+        pairs.length = 0;
+        range_named (idx_a, 1, n_bodies + 1) {
+            spatial::Aabb a = *aabbs[idx_a];
+            range_named (idx_b, idx_a + 1, n_bodies + 1) {
+                spatial::Aabb b = *aabbs[idx_b];
+                if (
+                    pairs.length < pairs.capacity &&
+                    a.min.x - AABB_MARGIN <= b.max.x && a.max.x + AABB_MARGIN >= b.min.x &&
+                    a.min.y - AABB_MARGIN <= b.max.y && a.max.y + AABB_MARGIN >= b.min.y &&
+                    a.min.z - AABB_MARGIN <= b.max.z && a.max.z + AABB_MARGIN >= b.min.z
+                ) {
+                    pairs.push({ .entity_handle_a = idx_a, .entity_handle_b = idx_b });
+                }
+            }
+        }
+
+        physics::PairCache *previous_pair_cache = &pair_caches[idx_pair_cache];
+        idx_pair_cache = 1 - idx_pair_cache;
+        physics::PairCache *pair_cache = &pair_caches[idx_pair_cache];
+        physics::clear_pair_cache(pair_cache);
+        contacts.length = 0;
+        each (pair, pairs) {
+            physics::Component *a = components[pair->entity_handle_a];
+            physics::Component *b = components[pair->entity_handle_b];
+            bool can_reuse_manifold = physics::can_reuse_manifold(a, b);
+            physics::CachedPair *previous_cached_pair = physics::find_cached_pair(
+                previous_pair_cache, pair->entity_handle_a, pair->entity_handle_b);
+            physics::CollisionManifold manifold = physics::intersect_obb_obb_cached(
+                &a->transformed_obb, &b->transformed_obb, previous_cached_pair,
+                can_reuse_manifold);
+            physics::cache_pair(pair_cache, previous_cached_pair,
+                pair->entity_handle_a, pair->entity_handle_b,
+                &a->transformed_obb, &b->transformed_obb, &manifold, can_reuse_manifold);
+            if (manifold.did_collide) {
+                contacts.push({
+                    .entity_handle_a = pair->entity_handle_a,
+                    .entity_handle_b = pair->entity_handle_b,
+                    .manifold = manifold,
+                });
+            }
+        }
+    };
+
+    Array<entities::Handle> body_handles(&memory_pool, n_bodies, "bench_body_handles");
+    range (2, n_bodies + 1) {
+        body_handles.push(idx);
+    }
+
+    solver::World world = {
+        .components = &components,
+        .spatial_components = &spatials,
+        .contacts = &contacts,
+        .body_handles = &body_handles,
+    };
+    f64 contacts_ms = 0.0;
+    f64 solver_ms = 0.0;
+    range_named (idx_step, 0, N_STEPS) {
+        auto t0 = debug_start_timer();
+        find_contacts();
+        contacts_ms += debug_end_timer(t0);
+
+        t0 = debug_start_timer();
+        world.pair_cache = &pair_caches[idx_pair_cache];
+        solver::step(solver, &world, solver::FIXED_TIMESTEP);
+        solver_ms += debug_end_timer(t0);
+    }
+
+    f32 max_top_drift = 0.0f;
+    for (
+        entities::Handle idx_top = 1 + stack_height;
+        idx_top <= n_bodies;
+        idx_top += stack_height
+    ) {
+        max_top_drift = max(max_top_drift,
+            length(spatials[idx_top]->position - *rest_positions[idx_top]));
+    }
+
+    bool did_pass = max_top_drift <= MAX_TOP_DRIFT;
+    gui::log("solver (%u bodies, stacks of %u, %u steps, %u iterations, %u substeps): "
+        "contacts %.3fms, solver %.3fms (%.3fms per step), max top box drift %.4f%s",
+        n_bodies, stack_height, N_STEPS, solver->config.n_iterations,
+        solver->config.n_substeps, contacts_ms, solver_ms, solver_ms / N_STEPS,
+        max_top_drift, did_pass ? "" : " (FAILED)");
+    logs::info("solver (%u bodies, stacks of %u): solver %.3fms per step, "
+        "max top box drift %.4f",
+        n_bodies, stack_height, solver_ms / N_STEPS, max_top_drift);
+    if (!did_pass) {
+        logs::error("solver (%u bodies, stacks of %u): max top box drift %.4f is more than %.4f",
+            n_bodies, stack_height, max_top_drift, MAX_TOP_DRIFT);
+    }
+    return did_pass;
+}
+
+
+void
+bench::run_sat()
+{
+    u32 const pair_counts[] = { 1000, 100000 };
+    for (u32 n_pairs : pair_counts) {
+        run_sat_for_n_pairs(n_pairs);
+    }
+}
+
+
+/*!
+    Compares finding out which of a set of OBB pairs overlap using the scalar
+    `physics::intersect_obb_obb()`, which is what the narrowphase used to run
+    on every candidate pair, against `physics::intersect_obb_packets()`, and
+    against running the packet test first, then `physics::intersect_obb_obb()`
+    only for the pairs that overlap, which is what the narrowphase does now.
+    The pairs are placed so that about half of them overlap.
+*/
+void
+bench::run_sat_for_n_pairs(u32 n_pairs)
+{
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    auto make_random_obb = [](v3 center) -> spatial::Obb {
+        spatial::Component spatial_component = {
+            .position = center,
+            .rotation = glm::angleAxis(radians(util::random(0.0f, 360.0f)),
+                normalize(v3(
+                    util::random(-1.0f, 1.0f),
+                    util::random(-1.0f, 1.0f),
+                    util::random(-1.0f, 1.0f)))),
+            .scale = v3(1.0f),
+        };
+        spatial::Obb obb = {
+            .center = v3(0.0f),
+            .x_axis = v3(1.0f, 0.0f, 0.0f),
+            .y_axis = v3(0.0f, 1.0f, 0.0f),
+            .extents = v3(
+                util::random(0.25f, 1.0f),
+                util::random(0.25f, 1.0f),
+                util::random(0.25f, 1.0f)),
+        };
+        return physics::transform_obb(obb, &spatial_component);
+    };
+
+    Array<spatial::Obb> a_obbs(&memory_pool, n_pairs, "bench_sat_a_obbs");
+    Array<spatial::Obb> b_obbs(&memory_pool, n_pairs, "bench_sat_b_obbs");
+    range (0, n_pairs) {
+        v3 offset = normalize(v3(
+            util::random(-1.0f, 1.0f),
+            util::random(-1.0f, 1.0f),
+            util::random(-1.0f, 1.0f))) * (f32)util::random(0.0f, 2.5f);
+        a_obbs.push(make_random_obb(v3(0.0f)));
+        b_obbs.push(make_random_obb(offset));
+    }
+    Array<bool> scalar_results(&memory_pool, n_pairs, "bench_sat_scalar_results");
+    scalar_results.alloc();
+    Array<bool> packet_results(&memory_pool, n_pairs, "bench_sat_packet_results");
+    packet_results.alloc();
+
+    // Scalar, one pair at a time
+    u32 n_scalar_overlaps = 0;
+    auto t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        n_scalar_overlaps = 0;
+        range (0, n_pairs) {
+            physics::CollisionManifold manifold = physics::intersect_obb_obb(
+                a_obbs[idx], b_obbs[idx]);
+            scalar_results.items[idx] = manifold.did_collide;
+            n_scalar_overlaps += manifold.did_collide;
+        }
+    }
+    f64 scalar_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    // Runs `fn(idx_first, n_lanes, overlap_mask)` for every packet of pairs.
+    auto for_each_packet = [&](auto fn) {
+        for (u32 idx_first = 0; idx_first < n_pairs; idx_first += simd::WIDTH) {
+            u32 n_lanes = min(simd::WIDTH, n_pairs - idx_first);
+            physics::ObbPacket a_packet = { .n_obbs = n_lanes };
+            physics::ObbPacket b_packet = { .n_obbs = n_lanes };
+            range_named (idx_lane, 0, n_lanes) {
+                physics::set_obb_packet_lane(&a_packet, idx_lane, a_obbs[idx_first + idx_lane]);
+                physics::set_obb_packet_lane(&b_packet, idx_lane, b_obbs[idx_first + idx_lane]);
+            }
+            u32 separating_axes[simd::WIDTH];
+            fn(idx_first, n_lanes,
+                physics::intersect_obb_packets(&a_packet, &b_packet, separating_axes));
+        }
+    };
+
+    // Packets, only finding out which pairs overlap
+    u32 n_packet_overlaps = 0;
+    t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        n_packet_overlaps = 0;
+        for_each_packet([&](u32 idx_first, u32 n_lanes, u32 overlap_mask) {
+            range_named (idx_lane, 0, n_lanes) {
+                bool does_overlap = (overlap_mask & (1u << idx_lane)) != 0;
+                packet_results.items[idx_first + idx_lane] = does_overlap;
+                n_packet_overlaps += does_overlap;
+            }
+        });
+    }
+    f64 packets_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    u32 n_mismatches = 0;
+    range (0, n_pairs) {
+        if (scalar_results.items[idx] != packet_results.items[idx]) {
+            n_mismatches++;
+        }
+    }
+
+    // Packets, then a full manifold for the pairs that overlap
+    u32 n_contact_points = 0;
+    t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        n_contact_points = 0;
+        for_each_packet([&](u32 idx_first, u32 n_lanes, u32 overlap_mask) {
+            range_named (idx_lane, 0, n_lanes) {
+                if (!(overlap_mask & (1u << idx_lane))) {
+                    continue;
+                }
+                physics::CollisionManifold manifold = physics::intersect_obb_obb(
+                    a_obbs[idx_first + idx_lane], b_obbs[idx_first + idx_lane]);
+                n_contact_points += manifold.n_contact_points;
+            }
+        });
+    }
+    f64 packets_and_manifolds_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    gui::log("sat (%u pairs, %u overlapping): scalar %.3fms, packets %.3fms "
+        "(%u overlapping, %u mismatches), packets then manifolds %.3fms (%u contact points)",
+        n_pairs, n_scalar_overlaps, scalar_ms, packets_ms, n_packet_overlaps, n_mismatches,
+        packets_and_manifolds_ms, n_contact_points);
+    logs::info("sat (%u pairs): scalar %.3fms, packets %.3fms, "
+        "packets then manifolds %.3fms, %u mismatches",
+        n_pairs, scalar_ms, packets_ms, packets_and_manifolds_ms, n_mismatches);
+}
+
+
+void
+bench::run_meshbvh()
+{
+    // 20,000 and 2,000,000 triangles
+    u32 const segment_counts[] = { 100, 1000 };
+    for (u32 n_segments : segment_counts) {
+        run_meshbvh_for_n_segments(n_segments);
+    }
+}
+
+
+/*!
+    Compares casting rays at a bumpy terrain mesh of `n_segments` by
+    `n_segments` quads by testing every triangle, which is all we could do
+    without a BVH, against `meshbvh::intersect_ray()`. Testing every triangle
+    is so slow for big meshes that we only do it for a few of the rays, and
+    check that they hit the same triangles.
+*/
+void
+bench::run_meshbvh_for_n_segments(u32 n_segments)
+{
+    constexpr u32 N_RAYS = 10000;
+    constexpr u32 N_BRUTE_FORCE_RAYS = 20;
+    constexpr u32 SIZE = 100;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(512) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    u32 n_vertices;
+    u32 n_indices;
+    geom::Vertex *vertices;
+    u32 *indices;
+    geom::make_plane(&memory_pool, SIZE, SIZE, n_segments, n_segments,
+        &n_vertices, &n_indices, &vertices, &indices);
+    range (0, n_vertices) {
+        v3 *position = &vertices[idx].position;
+        position->y = sin(position->x * 0.3f) * cos(position->z * 0.2f) * 2.0f +
+            (f32)util::random(0.0f, 0.2f);
+    }
+    u32 n_triangles = n_indices / 3;
+
+    meshbvh::Bvh bvh;
+    auto t0 = debug_start_timer();
+    meshbvh::build(&bvh, &memory_pool, vertices, indices, n_indices);
+    f64 build_ms = debug_end_timer(t0);
+    defer { meshbvh::destroy(&bvh); };
+
+    Array<spatial::Ray> rays(&memory_pool, N_RAYS, "bench_meshbvh_rays");
+    range (0, N_RAYS) {
+        rays.push({
+            .origin = v3(
+                util::random(-(f32)SIZE / 2.0f, (f32)SIZE / 2.0f),
+                util::random(10.0f, 20.0f),
+                util::random(-(f32)SIZE / 2.0f, (f32)SIZE / 2.0f)),
+            .direction = normalize(v3(
+                util::random(-1.0f, 1.0f),
+                util::random(-1.0f, -0.2f),
+                util::random(-1.0f, 1.0f))),
+        });
+    }
+    Array<meshbvh::RayHit> hits(&memory_pool, N_RAYS, "bench_meshbvh_hits");
+    hits.alloc();
+
+    // BVH
+    u32 n_hits = 0;
+    t0 = debug_start_timer();
+    range_named (idx_iteration, 0, N_ITERATIONS) {
+        n_hits = 0;
+        range (0, N_RAYS) {
+            hits.items[idx] = meshbvh::intersect_ray(&bvh, rays[idx], FLT_MAX);
+            n_hits += hits.items[idx].did_hit;
+        }
+    }
+    f64 bvh_ms = debug_end_timer(t0) / N_ITERATIONS;
+
+    // Every triangle, for a few of the rays, using a tree with one leaf
+    meshbvh::Node root = *bvh.nodes;
+    root.idx_first = 0;
+    root.n_triangles = n_triangles;
+    meshbvh::Bvh flat_bvh = bvh;
+    flat_bvh.nodes = &root;
+    flat_bvh.n_nodes = 1;
+    u32 n_mismatches = 0;
+    t0 = debug_start_timer();
+    range (0, N_BRUTE_FORCE_RAYS) {
+        meshbvh::RayHit hit = meshbvh::intersect_ray(&flat_bvh, rays[idx], FLT_MAX);
+        if (
+            hit.did_hit != hits.items[idx].did_hit ||
+            hit.idx_triangle != hits.items[idx].idx_triangle
+        ) {
+            n_mismatches++;
+        }
+    }
+    f64 brute_force_ms = debug_end_timer(t0) * (f64)N_RAYS / (f64)N_BRUTE_FORCE_RAYS;
+
+    gui::log("meshbvh (%u triangles, %u nodes): build %.3fms, %u rays: "
+        "every triangle %.3fms (estimated), bvh %.3fms (%u hits, %u mismatches)",
+        n_triangles, bvh.n_nodes, build_ms, N_RAYS, brute_force_ms, bvh_ms,
+        n_hits, n_mismatches);
+    logs::info("meshbvh (%u triangles): build %.3fms, every triangle %.3fms, "
+        "bvh %.3fms, %u mismatches",
+        n_triangles, build_ms, brute_force_ms, bvh_ms, n_mismatches);
+}
+
+
+void
+bench::run_anim()
+{
+    // A small character, and a big one with a long animation
+    u32 const bone_counts[] = { 32, 120 };
+    u32 const key_counts[] = { 60, 240 };
+    range (0, 2) {
+        run_anim_for_n_bones(bone_counts[idx], key_counts[idx]);
+    }
+    // A crowd
+    run_anim_update(500, 64);
+}
+
+
+/*!
+    Fills in `skeleton`'s first `n_bones` bones, and makes an animation for
+    them with `n_keys` keys at `ticks_per_second`, shaped like a typical walk
+    cycle: every bone rotates smoothly, only the root moves, and nothing
+    scales. The animation must be deleted by the caller.
+*/
+aiAnimation *
+bench::make_walk_cycle(
+    anim::Skeleton *skeleton,
+    u32 n_bones,
+    u32 n_keys,
+    f64 ticks_per_second
+) {
+    // This is deleted like assimp deletes its own animations, which also
+    // deletes the channels and their keys.
+    aiAnimation *ai_animation = new aiAnimation();
+    ai_animation->mDuration = (f64)(n_keys - 1);
+    ai_animation->mTicksPerSecond = ticks_per_second;
+    ai_animation->mNumChannels = n_bones;
+    ai_animation->mChannels = new aiNodeAnim*[n_bones];
+
+    range_named (idx_bone, 0, n_bones) {
+        anim::Bone *bone = &skeleton->bones[idx_bone];
+        *bone = {
+            .idx_parent = idx_bone == 0 ? 0 : (idx_bone - 1) / 2,
+            .offset = m4(1.0f),
+            .rest_transform = {
+                .translation = v3(0.0f, 0.2f, 0.0f),
+                .rotation = quat(1.0f, 0.0f, 0.0f, 0.0f),
+                .scale = v3(1.0f),
+            },
+        };
+        snprintf(bone->name, MAX_NODE_NAME_LENGTH, "bone_%u", idx_bone);
+
+        aiNodeAnim *ai_channel = new aiNodeAnim();
+        ai_animation->mChannels[idx_bone] = ai_channel;
+        ai_channel->mNodeName.Set(bone->name);
+        ai_channel->mNumPositionKeys = n_keys;
+        ai_channel->mPositionKeys = new aiVectorKey[n_keys];
+        ai_channel->mNumRotationKeys = n_keys;
+        ai_channel->mRotationKeys = new aiQuatKey[n_keys];
+        ai_channel->mNumScalingKeys = n_keys;
+        ai_channel->mScalingKeys = new aiVectorKey[n_keys];
+
+        f32 phase = util::random(0.0f, 2.0f * PI32);
+        v3 axis = normalize(v3(util::random(-1.0f, 1.0f), util::random(-1.0f, 1.0f),
+            util::random(-1.0f, 1.0f)));
+        range_named (idx_key, 0, n_keys) {
+            f32 cycle = (f32)idx_key / (f32)(n_keys - 1) * 2.0f * PI32;
+            v3 translation = idx_bone == 0 ?
+                v3(0.0f, 0.05f * sin(2.0f * cycle), 0.5f * cycle) :
+                bone->rest_transform.translation;
+            quat rotation = glm::angleAxis(0.4f * sin(cycle + phase), axis);
+            ai_channel->mPositionKeys[idx_key].mTime = (f64)idx_key;
+            ai_channel->mPositionKeys[idx_key].mValue =
+                aiVector3D(translation.x, translation.y, translation.z);
+            ai_channel->mRotationKeys[idx_key].mTime = (f64)idx_key;
+            ai_channel->mRotationKeys[idx_key].mValue =
+                aiQuaternion(rotation.w, rotation.x, rotation.y, rotation.z);
+            ai_channel->mScalingKeys[idx_key].mTime = (f64)idx_key;
+            ai_channel->mScalingKeys[idx_key].mValue = aiVector3D(1.0f, 1.0f, 1.0f);
+        }
+    }
+
+    return ai_animation;
+}
+
+
+/*!
+    Compresses a made-up walk cycle of `n_bones` bones with `n_keys` keys at
+    30 keys per second. Compares how much memory the compressed animation
+    takes against the uncompressed keys, and against one matrix and time per
+    bone per key, which is what we used to store.
+    Then compares sampling every bone from the compressed keys against
+    sampling the uncompressed ones, and checks how far apart they are. We
+    also time building the bone matrices from one animation, and from a
+    blend of two, which is what a character costs each frame.
+*/
+void
+bench::run_anim_for_n_bones(u32 n_bones, u32 n_keys)
+{
+    constexpr u32 N_SAMPLES = 1000;
+    constexpr f64 TICKS_PER_SECOND = 30.0;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    anim::Skeleton *skeleton = MEMORY_PUSH(&memory_pool, anim::Skeleton, "bench_skeleton");
+    *skeleton = {
+        .n_bones = n_bones,
+        .n_animations = 2,
+        .scene_root_transform = m4(1.0f),
+    };
+    m4 *bone_matrices = (m4*)memory::push(&memory_pool, n_bones * sizeof(m4),
+        "bench_bone_matrices");
+
+    aiAnimation *ai_animation = make_walk_cycle(skeleton, n_bones, n_keys, TICKS_PER_SECOND);
+    defer { delete ai_animation; };
+
+    anim::Animation *animation = &skeleton->animations[0];
+    auto t0 = debug_start_timer();
+    anim::make_animation(skeleton, animation, ai_animation);
+    f64 compress_ms = debug_end_timer(t0);
+    // We only use this one to time blending two animations, so it doesn't
+    // matter that it's the same.
+    anim::make_animation(skeleton, &skeleton->animations[1], ai_animation);
+    defer { anim::destroy_skeleton(skeleton); };
+
+    u32 n_source_keys = n_bones * n_keys;
+    size_t matrix_bytes = n_source_keys * (sizeof(m4) + sizeof(f64));
+    size_t uncompressed_bytes = n_source_keys *
+        (2 * (sizeof(f32) + sizeof(v3)) + sizeof(f32) + sizeof(quat));
+    size_t compressed_bytes = animation->memory_pool.size;
+
+    // Samples the uncompressed keys the same way we sample compressed ones,
+    // with a binary search for each track.
+    auto find_source_key = [](auto *keys, u32 n_source_keys, f64 t, f32 *lerp_factor) -> u32 {
+        f64 tick = t * TICKS_PER_SECOND;
+        u32 idx_low = 0;
+        u32 idx_high = n_source_keys - 1;
+        while (idx_high - idx_low > 1) {
+            u32 idx_mid = (idx_low + idx_high) / 2;
+            if (keys[idx_mid].mTime <= tick) {
+                idx_low = idx_mid;
+            } else {
+                idx_high = idx_mid;
+            }
+        }
+        f64 key_duration = keys[idx_high].mTime - keys[idx_low].mTime;
+        *lerp_factor = (f32)min(max((tick - keys[idx_low].mTime) / key_duration, 0.0), 1.0);
+        return idx_low;
+    };
+    auto sample_source_bone = [&](aiNodeAnim *ai_channel, f64 t) -> anim::BoneTransform {
+        f32 translation_factor;
+        u32 idx_translation = find_source_key(ai_channel->mPositionKeys,
+            ai_channel->mNumPositionKeys, t, &translation_factor);
+        f32 rotation_factor;
+        u32 idx_rotation = find_source_key(ai_channel->mRotationKeys,
+            ai_channel->mNumRotationKeys, t, &rotation_factor);
+        f32 scale_factor;
+        u32 idx_scale = find_source_key(ai_channel->mScalingKeys,
+            ai_channel->mNumScalingKeys, t, &scale_factor);
+        aiVectorKey *translations = &ai_channel->mPositionKeys[idx_translation];
+        aiQuatKey *rotations = &ai_channel->mRotationKeys[idx_rotation];
+        aiVectorKey *scales = &ai_channel->mScalingKeys[idx_scale];
+        v3 p0 = util::aiVector3D_to_glm(&translations[0].mValue);
+        v3 p1 = util::aiVector3D_to_glm(&translations[1].mValue);
+        v3 s0 = util::aiVector3D_to_glm(&scales[0].mValue);
+        v3 s1 = util::aiVector3D_to_glm(&scales[1].mValue);
+        return {
+            .translation = p0 + (p1 - p0) * translation_factor,
+            .rotation = glm::slerp(util::aiQuaternion_to_glm(&rotations[0].mValue),
+                util::aiQuaternion_to_glm(&rotations[1].mValue), rotation_factor),
+            .scale = s0 + (s1 - s0) * scale_factor,
+        };
+    };
+
+    f32 *sample_times = (f32*)memory::push(&memory_pool, N_SAMPLES * sizeof(f32),
+        "bench_anim_sample_times");
+    range (0, N_SAMPLES) {
+        sample_times[idx] = util::random(0.0f, (f32)animation->duration);
+    }
+
+    // Uncompressed
+    f32 checksum = 0.0f;
+    t0 = debug_start_timer();
+    range_named (idx_sample, 0, N_SAMPLES) {
+        range_named (idx_bone, 0, n_bones) {
+            anim::BoneTransform transform = sample_source_bone(
+                ai_animation->mChannels[idx_bone], sample_times[idx_sample]);
+            checksum += transform.rotation.w;
+        }
+    }
+    f64 uncompressed_ms = debug_end_timer(t0) / N_SAMPLES;
+
+    // Compressed
+    t0 = debug_start_timer();
+    range_named (idx_sample, 0, N_SAMPLES) {
+        range_named (idx_bone, 0, n_bones) {
+            anim::BoneTransform transform = anim::sample_bone(animation,
+                &skeleton->bones[idx_bone], idx_bone, sample_times[idx_sample]);
+            checksum += transform.rotation.w;
+        }
+    }
+    f64 compressed_ms = debug_end_timer(t0) / N_SAMPLES;
+
+    // Whole pass, including building the bone matrices, for one animation
+    // and for a crossfade between two
+    anim::Layer layers[2] = {
+        { .idx_animation = 0, .weight = 1.0f },
+        { .idx_animation = 1, .weight = 0.5f },
+    };
+    t0 = debug_start_timer();
+    range (0, N_SAMPLES) {
+        layers[0].time = sample_times[idx];
+        anim::make_bone_matrices(skeleton, layers, 1, bone_matrices);
+        checksum += bone_matrices[n_bones - 1][3][0];
+    }
+    f64 bone_matrices_ms = debug_end_timer(t0) / N_SAMPLES;
+
+    t0 = debug_start_timer();
+    range (0, N_SAMPLES) {
+        layers[0].time = sample_times[idx];
+        layers[1].time = sample_times[N_SAMPLES - 1 - idx];
+        anim::make_bone_matrices(skeleton, layers, 2, bone_matrices);
+        checksum += bone_matrices[n_bones - 1][3][0];
+    }
+    f64 blend_ms = debug_end_timer(t0) / N_SAMPLES;
+
+    f32 max_translation_error = 0.0f;
+    f32 max_rotation_error = 0.0f;
+    range_named (idx_sample, 0, N_SAMPLES) {
+        range_named (idx_bone, 0, n_bones) {
+            anim::BoneTransform expected = sample_source_bone(
+                ai_animation->mChannels[idx_bone], sample_times[idx_sample]);
+            anim::BoneTransform actual = anim::sample_bone(animation,
+                &skeleton->bones[idx_bone], idx_bone, sample_times[idx_sample]);
+            max_translation_error = max(max_translation_error,
+                length(actual.translation - expected.translation));
+            quat difference = actual.rotation * glm::conjugate(expected.rotation);
+            max_rotation_error = max(max_rotation_error, 2.0f * (f32)atan2(
+                length(v3(difference.x, difference.y, difference.z)), abs(difference.w)));
+        }
+    }
+
+    gui::log("anim (%u bones, %u keys): matrices %.1fKB, uncompressed %.1fKB, "
+        "compressed %.1fKB in %.3fms, sampling: uncompressed %.4fms, compressed %.4fms, "
+        "with bone matrices %.4fms, blending two %.4fms, max error %.5f, %.5frad",
+        n_bones, n_keys, matrix_bytes / 1024.0f, uncompressed_bytes / 1024.0f,
+        compressed_bytes / 1024.0f, compress_ms, uncompressed_ms, compressed_ms,
+        bone_matrices_ms, blend_ms, max_translation_error, max_rotation_error);
+    logs::info("anim (%u bones, %u keys): matrices %uB, uncompressed %uB, compressed %uB, "
+        "uncompressed %.4fms, compressed %.4fms, with bone matrices %.4fms, "
+        "blending two %.4fms, max error %.5f, %.5frad",
+        n_bones, n_keys, (u32)matrix_bytes, (u32)uncompressed_bytes,
+        (u32)compressed_bytes, uncompressed_ms, compressed_ms, bone_matrices_ms,
+        blend_ms, max_translation_error, max_rotation_error);
+    logs::info("(checksum %f)", checksum);
+}
+
+
+/*!
+    Times a frame of `anim::update_batch()` for `n_characters` characters
+    sharing a skeleton of `n_bones` bones, each blending two animations at
+    its own times, which is about as much work as a character does in the
+    middle of a crossfade. We start on this thread alone, then add our
+    workers one at a time, to see how it scales with the number of cores.
+*/
+void
+bench::run_anim_update(u32 n_characters, u32 n_bones)
+{
+    constexpr u32 N_KEYS = 60;
+    constexpr u32 N_FRAMES = 100;
+    constexpr f64 TICKS_PER_SECOND = 30.0;
+    constexpr f64 DT = 1.0 / 60.0;
+
+    memory::Pool memory_pool = { .size = util::mb_to_b(64) };
+    defer { memory::destroy_memory_pool(&memory_pool); };
+
+    anim::Skeleton *skeleton = MEMORY_PUSH(&memory_pool, anim::Skeleton, "bench_skeleton");
+    *skeleton = {
+        .n_bones = n_bones,
+        .n_animations = 2,
+        .scene_root_transform = m4(1.0f),
+    };
+    aiAnimation *ai_animation = make_walk_cycle(skeleton, n_bones, N_KEYS, TICKS_PER_SECOND);
+    defer { delete ai_animation; };
+    // The second animation is the same as the first, but since every
+    // character plays them at different times, it costs the same as a
+    // different one would.
+    anim::make_animation(skeleton, &skeleton->animations[0], ai_animation);
+    anim::make_animation(skeleton, &skeleton->animations[1], ai_animation);
+    defer { anim::destroy_skeleton(skeleton); };
+    f32 duration = (f32)skeleton->animations[0].duration;
+
+    anim::Component *components = (anim::Component*)memory::push(&memory_pool,
+        n_characters * sizeof(anim::Component), "bench_anim_components");
+    m4 *bone_matrices = (m4*)memory::push(&memory_pool,
+        n_characters * n_bones * sizeof(m4), "bench_bone_matrices");
+    range (0, n_characters) {
+        anim::Component *animation_component = &components[idx];
+        *animation_component = {
+            .entity_handle = idx + 1,
+            .skeleton = skeleton,
+            .bone_matrices = &bone_matrices[idx * n_bones],
+        };
+        anim::add_layer(animation_component, 0, 1.0f)->time = util::random(0.0f, duration);
+        anim::add_layer(animation_component, 1, 0.5f)->time = util::random(0.0f, duration);
+    }
+
+    f64 frame_ms[N_WORKER_THREADS + 1];
+    f32 checksum = 0.0f;
+    range_named (n_workers, 0, N_WORKER_THREADS + 1) {
+        tasks::set_n_active_workers(n_workers);
+        auto t0 = debug_start_timer();
+        range (0, N_FRAMES) {
+            anim::update_batch(components, n_characters, DT);
+        }
+        frame_ms[n_workers] = debug_end_timer(t0) / N_FRAMES;
+        checksum += bone_matrices[n_characters * n_bones - 1][3][0];
+    }
+    tasks::set_n_active_workers(N_WORKER_THREADS);
+
+    gui::log("anim update (%u characters, %u bones, blending two):", n_characters, n_bones);
+    range (0, N_WORKER_THREADS + 1) {
+        gui::log("  %u cores: %.3fms per frame (%.2fx)",
+            idx + 1, frame_ms[idx], frame_ms[0] / frame_ms[idx]);
+        logs::info("anim update (%u characters, %u bones), %u cores: %.3fms per frame",
+            n_characters, n_bones, idx + 1, frame_ms[idx]);
+    }
+    logs::info("(checksum %f)", checksum);
+}
+
+
+void
+bench::log_result(char const *name, u32 n_entities, f64 arrays_ms, f64 chunks_ms)
+{
+    gui::log("%s (%u entities): arrays %.3fms, chunks %.3fms",
+        name, n_entities, arrays_ms, chunks_ms);
+    logs::info("%s (%u entities): arrays %.3fms, chunks %.3fms",
+        name, n_entities, arrays_ms, chunks_ms);
+}
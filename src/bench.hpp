@@ -0,0 +1,86 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "memory.hpp"
+#include "array.hpp"
+#include "entities.hpp"
+#include "spatial.hpp"
+#include "drawable.hpp"
+#include "physics.hpp"
+#include "anim.hpp"
+#include "models.hpp"
+#include "archetypes.hpp"
+#include "aabbtree.hpp"
+#include "spatialgrid.hpp"
+#include "solver.hpp"
+#include "meshbvh.hpp"
+
+/*!
+    Benchmarks that can be run from the console using `bench <name>`. They
+    work on their own data, in their own memory pool, so they don't touch
+    whatever scene is currently loaded.
+*/
+class bench {
+public:
+    static void run(char const *bench_name);
+
+private:
+    static constexpr u32 N_ITERATIONS = 10;
+
+    // Mirrors the way our systems normally store components: one sparse
+    // array per component type, indexed by entity handle.
+    struct ComponentArrays {
+        Array<entities::Signature> signatures;
+        Array<spatial::Component> spatials;
+        Array<drawable::Component> drawables;
+        Array<physics::Component> physics_components;
+        Array<anim::Component> anim_components;
+    };
+
+    // The way `drawable::Component` used to look, with each component holding
+    // its own copy of the mesh, including everything we only need when
+    // loading it.
+    struct EmbeddedMeshDrawableComponent {
+        entities::Handle entity_handle;
+        models::MeshData mesh_data;
+        geom::Mesh mesh;
+        drawable::Pass target_render_pass;
+    };
+
+    static void make_component_arrays(
+        ComponentArrays *arrays,
+        memory::Pool *memory_pool,
+        u32 n_entities
+    );
+    static void fill_archetype_store(archetypes::Store *store, ComponentArrays *arrays);
+    static void run_archetypes();
+    static void run_archetypes_for_n_entities(u32 n_entities);
+    static void run_drawables();
+    static void run_drawables_for_n_entities(u32 n_entities);
+    static void run_aabbtree();
+    static void run_aabbtree_for_n_bodies(u32 n_bodies);
+    static void run_spatialgrid();
+    static void run_spatialgrid_for_n_entities(u32 n_entities);
+    static void run_raycasts();
+    static void run_raycasts_for_n_bodies(u32 n_bodies);
+    static void run_paircache();
+    static void run_paircache_for_stack_height(u32 stack_height);
+    static void run_solver();
+    static bool run_solver_for_stacks(u32 n_stacks_per_side, u32 stack_height);
+    static void run_sat();
+    static void run_sat_for_n_pairs(u32 n_pairs);
+    static void run_meshbvh();
+    static void run_meshbvh_for_n_segments(u32 n_segments);
+    static void run_anim();
+    static aiAnimation * make_walk_cycle(
+        anim::Skeleton *skeleton,
+        u32 n_bones,
+        u32 n_keys,
+        f64 ticks_per_second
+    );
+    static void run_anim_for_n_bones(u32 n_bones, u32 n_keys);
+    static void run_anim_update(u32 n_characters, u32 n_bones);
+    static void log_result(char const *name, u32 n_entities, f64 arrays_ms, f64 chunks_ms);
+};
@@ -0,0 +1,319 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "logs.hpp"
+#include "tasks.hpp"
+#include "charcontroller.hpp"
+
+
+charcontroller::State *charcontroller::state = nullptr;
+
+
+/*!
+    Moves `controller`'s entity by as much of `displacement` as it can, and
+    updates `controller` with what it ran into on the way.
+*/
+void
+charcontroller::move(Controller *controller, v3 displacement)
+{
+    if (!update_position(controller, displacement)) {
+        logs::error("Could not get spatial::Component or physics::Component for character");
+        return;
+    }
+    entities::mark_changed(controller->entity_handle, entities::ComponentType::spatial);
+}
+
+
+/*!
+    Moves each of `controllers` by the corresponding one of `displacements`,
+    spread over our worker threads. Each controller must be for a different
+    entity.
+*/
+void
+charcontroller::move_batch(Controller *controllers, v3 const *displacements, u32 n_controllers)
+{
+    MoveBatchJob job = {
+        .controllers = controllers,
+        .displacements = displacements,
+    };
+    tasks::parallel_for(n_controllers, MOVE_BATCH_SIZE, run_move_batch_job, &job);
+
+    // Marking entities as changed isn't thread-safe, so we do it afterwards.
+    range (0, n_controllers) {
+        entities::mark_changed(controllers[idx].entity_handle, entities::ComponentType::spatial);
+    }
+}
+
+
+/*!
+    Gets the controller kept for `entity_handle`, which starts off with the
+    default settings the first time it's asked for, and after the entity has
+    been destroyed.
+*/
+charcontroller::Controller *
+charcontroller::get_controller(entities::Handle entity_handle)
+{
+    Controller *controller = charcontroller::state->controllers[entity_handle];
+    if (controller->entity_handle != entity_handle) {
+        *controller = { .entity_handle = entity_handle };
+    }
+    return controller;
+}
+
+
+Array<charcontroller::Controller> *
+charcontroller::get_controllers()
+{
+    return &charcontroller::state->controllers;
+}
+
+
+void
+charcontroller::init(charcontroller::State *charcontroller_state, memory::Pool *pool)
+{
+    charcontroller::state = charcontroller_state;
+    charcontroller::state->controllers = Array<Controller>(pool, MAX_N_ENTITIES,
+        "charcontroller_controllers", true, 1);
+}
+
+
+bool
+charcontroller::is_walkable(Controller *controller, v3 normal)
+{
+    return normal.y >= cos(controller->max_slope);
+}
+
+
+/*!
+    Pushes `obb` out of anything it's already inside of, which can happen if
+    something moved into the character, or the character turned.
+*/
+void
+charcontroller::depenetrate(
+    Controller *controller,
+    physics::Component *physics_component,
+    spatial::Obb *obb
+) {
+    physics::CollisionManifold manifolds[MAX_N_OVERLAPS];
+    u32 n_manifolds = physics::find_overlaps(obb, controller->layer_mask,
+        physics_component, manifolds, MAX_N_OVERLAPS);
+    range (0, n_manifolds) {
+        physics::CollisionManifold *manifold = &manifolds[idx];
+        obb->center += manifold->normal * (manifold->sep_max - controller->skin_width);
+        // The manifold's normal points away from us, into the other body.
+        if (is_walkable(controller, -manifold->normal)) {
+            controller->is_grounded = true;
+            controller->ground_normal = -manifold->normal;
+        }
+    }
+}
+
+
+/*!
+    Moves `obb` by `displacement`, and whenever it hits something, slides the
+    rest of the way along it. If we're moving vertically, we stop when we land
+    on the ground, so that we don't slide down gentle slopes we're standing
+    on. If we're moving horizontally, we treat slopes that are too steep as
+    vertical walls, so that we can't walk up them.
+*/
+void
+charcontroller::slide(
+    Controller *controller,
+    physics::Component *physics_component,
+    spatial::Obb *obb,
+    v3 displacement,
+    bool is_vertical
+) {
+    v3 remaining = displacement;
+    v3 previous_normal = v3(0.0f);
+
+    range (0, MAX_N_SLIDES) {
+        f32 distance = length(remaining);
+        if (distance < MIN_MOVE_DISTANCE) {
+            return;
+        }
+
+        physics::SweepResult sweep_result = physics::sweep_obb(obb, remaining,
+            controller->layer_mask, physics_component);
+        if (!sweep_result.did_hit) {
+            obb->center += remaining;
+            return;
+        }
+
+        // Stop a little before we touch, so the next sweep starts clear of it.
+        f32 time = max(sweep_result.time - controller->skin_width / distance, 0.0f);
+        obb->center += remaining * time;
+        remaining *= 1.0f - time;
+
+        v3 normal = sweep_result.normal;
+        if (is_walkable(controller, normal)) {
+            controller->is_grounded = true;
+            controller->ground_normal = normal;
+            if (is_vertical) {
+                return;
+            }
+        } else if (normal.y < 0.0f) {
+            controller->did_hit_ceiling = true;
+        } else {
+            controller->did_hit_wall = true;
+            if (!is_vertical && length(v2(normal.x, normal.z)) > MIN_MOVE_DISTANCE) {
+                normal = normalize(v3(normal.x, 0.0f, normal.z));
+            }
+        }
+
+        remaining -= normal * dot(remaining, normal);
+        // If we've hit two surfaces, we can only keep going along the crease
+        // between them, otherwise we'd slide back into the first one.
+        if (idx > 0 && dot(remaining, previous_normal) < 0.0f) {
+            v3 crease = cross(previous_normal, normal);
+            if (length(crease) < MIN_MOVE_DISTANCE) {
+                return;
+            }
+            crease = normalize(crease);
+            remaining = crease * dot(remaining, crease);
+        }
+        // Never slide backwards, which would make us jitter in corners.
+        if (dot(remaining, displacement) <= 0.0f) {
+            return;
+        }
+        previous_normal = normal;
+    }
+}
+
+
+/*!
+    Tries to get past whatever `obb` hit while moving by `displacement`, by
+    lifting it by `step_height`, moving it, then putting it back down. This
+    only works if we end up standing on something walkable.
+*/
+bool
+charcontroller::step_up(
+    Controller *controller,
+    physics::Component *physics_component,
+    spatial::Obb *obb,
+    v3 displacement
+) {
+    v3 up = v3(0.0f, 1.0f, 0.0f);
+
+    f32 lift = controller->step_height;
+    physics::SweepResult sweep_result = physics::sweep_obb(obb, up * lift,
+        controller->layer_mask, physics_component);
+    if (sweep_result.did_hit) {
+        lift = sweep_result.time * lift - controller->skin_width;
+    }
+    if (lift < MIN_MOVE_DISTANCE) {
+        return false;
+    }
+    obb->center += up * lift;
+
+    slide(controller, physics_component, obb, displacement, false);
+
+    sweep_result = physics::sweep_obb(obb, -up * lift, controller->layer_mask,
+        physics_component);
+    if (!sweep_result.did_hit || !is_walkable(controller, sweep_result.normal)) {
+        return false;
+    }
+    obb->center -= up * max(sweep_result.time * lift - controller->skin_width, 0.0f);
+    controller->is_grounded = true;
+    controller->ground_normal = sweep_result.normal;
+    controller->did_step_up = true;
+    return true;
+}
+
+
+/*!
+    Keeps characters that were on the ground on it, when they walk down a
+    slope or off a step that's no taller than `step_height`.
+*/
+void
+charcontroller::snap_to_ground(
+    Controller *controller,
+    physics::Component *physics_component,
+    spatial::Obb *obb
+) {
+    f32 snap_distance = controller->step_height + controller->skin_width;
+    v3 down = v3(0.0f, -snap_distance, 0.0f);
+    physics::SweepResult sweep_result = physics::sweep_obb(obb, down,
+        controller->layer_mask, physics_component);
+    if (!sweep_result.did_hit || !is_walkable(controller, sweep_result.normal)) {
+        return;
+    }
+    obb->center += down *
+        max(sweep_result.time - controller->skin_width / snap_distance, 0.0f);
+    controller->is_grounded = true;
+    controller->ground_normal = sweep_result.normal;
+}
+
+
+/*!
+    Works out where `controller`'s entity ends up, and moves its spatial
+    component there, without marking it as changed. This only reads the
+    physics world, and only writes to this entity, so different entities can
+    be moved at the same time. Returns false if the entity is missing a
+    component we need.
+*/
+bool
+charcontroller::update_position(Controller *controller, v3 displacement)
+{
+    spatial::Component *spatial_component = spatial::get_component(controller->entity_handle);
+    physics::Component *physics_component = physics::get_component(controller->entity_handle);
+    if (
+        !spatial::is_spatial_component_valid(spatial_component) ||
+        !physics::is_component_valid(physics_component)
+    ) {
+        return false;
+    }
+
+    bool was_grounded = controller->is_grounded;
+    controller->is_grounded = false;
+    controller->did_hit_wall = false;
+    controller->did_hit_ceiling = false;
+    controller->did_step_up = false;
+    controller->ground_normal = v3(0.0f);
+
+    spatial::Obb obb = physics::transform_obb(physics_component->obb, spatial_component);
+    v3 start_center = obb.center;
+
+    depenetrate(controller, physics_component, &obb);
+
+    v3 vertical = v3(0.0f, displacement.y, 0.0f);
+    v3 horizontal = v3(displacement.x, 0.0f, displacement.z);
+
+    spatial::Obb step_obb = obb;
+    Controller step_controller = *controller;
+    slide(controller, physics_component, &obb, horizontal, false);
+
+    // If we walked into something, see if we can get further by stepping
+    // onto it. We only keep the step if it got us further than walking did.
+    if (was_grounded && controller->did_hit_wall && controller->step_height > 0.0f) {
+        if (step_up(&step_controller, physics_component, &step_obb, horizontal)) {
+            v3 walk_progress = obb.center - start_center;
+            v3 step_progress = step_obb.center - start_center;
+            if (
+                length2(v2(step_progress.x, step_progress.z)) >
+                length2(v2(walk_progress.x, walk_progress.z)) + MIN_MOVE_DISTANCE
+            ) {
+                obb = step_obb;
+                *controller = step_controller;
+            }
+        }
+    }
+
+    slide(controller, physics_component, &obb, vertical, true);
+
+    if (was_grounded && !controller->is_grounded && displacement.y <= 0.0f) {
+        snap_to_ground(controller, physics_component, &obb);
+    }
+
+    spatial_component->position += obb.center - start_center;
+    return true;
+}
+
+
+void
+charcontroller::run_move_batch_job(void *data, u32 idx_start, u32 idx_end)
+{
+    MoveBatchJob *job = (MoveBatchJob*)data;
+    range (idx_start, idx_end) {
+        update_position(&job->controllers[idx], job->displacements[idx]);
+    }
+}
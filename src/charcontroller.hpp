@@ -0,0 +1,113 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "array.hpp"
+#include "entities.hpp"
+#include "spatial.hpp"
+#include "physics.hpp"
+
+/*!
+    Moves characters around without letting them go through the world, using
+    collide-and-slide. We sweep the character's OBB along the movement we
+    want, and when it hits something, we stop just before it and slide
+    whatever movement is left along the surface we hit.
+
+    Characters can walk up slopes that aren't steeper than `max_slope`, and
+    step up onto ledges that aren't taller than `step_height`. Anything steeper
+    is a wall, which we slide along but never climb. Characters that were on
+    the ground stay on it while walking down slopes and steps, rather than
+    flying off the top.
+
+    Characters aren't simulated by the solver. They only look at the physics
+    world as of the last physics update, and never change it, so we can move
+    lots of them in parallel using `move_batch()`. This also means characters
+    see each other where they were at the last physics update, rather than
+    where they've just moved to.
+
+    A controller remembers what it found on its last move, such as whether
+    it was on the ground, which decides whether it can step up or snap down
+    on the next one. Code that moves the same entity every frame should keep
+    its controller around, for example by using `get_controller()`.
+
+    Resources
+    ---------
+    Kasper Fauerby, "Improved Collision detection and Response"
+    www.peroxide.dk/papers/collision/collision.pdf
+*/
+class charcontroller {
+public:
+    // We never do more than this many sweeps for each part of a move, so
+    // each character costs at most a fixed number of queries per frame.
+    static constexpr u32 MAX_N_SLIDES = 4;
+    static constexpr u32 MAX_N_OVERLAPS = 8;
+    static constexpr u32 MOVE_BATCH_SIZE = 16;
+    static constexpr f32 MIN_MOVE_DISTANCE = 1.0e-5f;
+
+    struct Controller {
+        entities::Handle entity_handle;
+        u32 layer_mask = physics::DEFAULT_LAYER_MASK;
+        // How tall a ledge we can step up onto
+        f32 step_height = 0.3f;
+        // The steepest slope we can walk up, in radians
+        f32 max_slope = radians(45.0f);
+        // How far away from things we try to stay, so that we don't start
+        // the next sweep already touching them
+        f32 skin_width = 0.01f;
+
+        // These are set by each move.
+        bool is_grounded;
+        bool did_hit_wall;
+        bool did_hit_ceiling;
+        bool did_step_up;
+        v3 ground_normal;
+    };
+
+    struct State {
+        // One controller for each entity, for things like behaviors that
+        // don't have anywhere else to keep them between frames
+        Array<Controller> controllers;
+    };
+
+    static void move(Controller *controller, v3 displacement);
+    static void move_batch(Controller *controllers, v3 const *displacements, u32 n_controllers);
+    static Controller * get_controller(entities::Handle entity_handle);
+    static Array<Controller> * get_controllers();
+    static void init(charcontroller::State *charcontroller_state, memory::Pool *pool);
+
+private:
+    struct MoveBatchJob {
+        Controller *controllers;
+        v3 const *displacements;
+    };
+
+    static bool is_walkable(Controller *controller, v3 normal);
+    static void depenetrate(
+        Controller *controller,
+        physics::Component *physics_component,
+        spatial::Obb *obb
+    );
+    static void slide(
+        Controller *controller,
+        physics::Component *physics_component,
+        spatial::Obb *obb,
+        v3 displacement,
+        bool is_vertical
+    );
+    static bool step_up(
+        Controller *controller,
+        physics::Component *physics_component,
+        spatial::Obb *obb,
+        v3 displacement
+    );
+    static void snap_to_ground(
+        Controller *controller,
+        physics::Component *physics_component,
+        spatial::Obb *obb
+    );
+    static bool update_position(Controller *controller, v3 displacement);
+    static void run_move_batch_job(void *data, u32 idx_start, u32 idx_end);
+
+    static charcontroller::State *state;
+};
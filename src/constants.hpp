@@ -73,12 +73,13 @@ constexpr char DEFAULT_SCENE[] = "terraintest";
 constexpr char SCENE_EXTENSION[] = ".peony_scene";
 constexpr char MATERIAL_FILE_EXTENSION[] = ".peony_materials";
 constexpr u32 N_LOADING_THREADS = 5;
+constexpr u32 N_WORKER_THREADS = 3;
 constexpr u32 MAX_N_ENTITIES = 256;
 constexpr u32 MAX_N_MODELS = 128;
-constexpr u32 MAX_N_ANIMATED_MODELS = 128;
 constexpr u32 MAX_DEBUG_NAME_LENGTH = 256;
 constexpr u32 MAX_GENEROUS_STRING_LENGTH = 512;
 constexpr u32 MAX_N_MESHES = 128;
+constexpr u32 MAX_N_REGISTERED_MESHES = 1024;
 constexpr u32 MAX_N_MATERIALS = 256;
 constexpr u32 MAX_N_MATERIALS_PER_MODEL = 16;
 constexpr u32 MAX_UNIFORM_LENGTH = 256;
@@ -91,8 +92,8 @@ constexpr u32 MAX_COMMON_NAME_LENGTH = 128;
 constexpr u32 MAX_N_BONES = 128;
 constexpr u32 MAX_N_BONES_PER_VERTEX = 4;
 constexpr u32 MAX_NODE_NAME_LENGTH = 32;
-constexpr u32 MAX_N_ANIMATIONS = 2;
-constexpr u32 MAX_N_ANIM_KEYS = 256;
+constexpr u32 MAX_N_ANIMATIONS = 16;
+constexpr u32 MAX_N_ANIM_LAYERS = 4;
 constexpr u16 MAX_N_LIGHTS = 8;
 
 
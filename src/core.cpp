@@ -59,6 +59,19 @@ core::run()
     }
     defer { range (0, N_LOADING_THREADS) { loading_threads[idx].join(); } };
 
+    // Set up worker threads, which help out with `tasks::parallel_for()`
+    std::mutex worker_mutex;
+    std::condition_variable worker_condition;
+    tasks::init_workers(&worker_mutex, &worker_condition, N_WORKER_THREADS);
+    std::thread worker_threads[N_WORKER_THREADS];
+    range (0, N_WORKER_THREADS) {
+        worker_threads[idx] = std::thread(
+            tasks::run_worker_loop,
+            &state->engine_state.should_stop,
+            idx);
+    }
+    defer { range (0, N_WORKER_THREADS) { worker_threads[idx].join(); } };
+
     // Run main loop
     engine::run_main_loop(state->window);
 
@@ -135,6 +148,9 @@ core::init_state(State *state, memory::Pool *asset_memory_pool)
     lights::init(&state->lights_state, asset_memory_pool);
     anim::init(&state->anim_state, asset_memory_pool);
     physics::init(&state->physics_state, asset_memory_pool);
+    solver::init(&state->solver_state, asset_memory_pool);
+    charcontroller::init(&state->charcontroller_state, asset_memory_pool);
+    spatialgrid::init(&state->spatialgrid_state, asset_memory_pool);
     entities::init(&state->entities_state, asset_memory_pool);
     behavior::init(
         &state->behavior_state,
@@ -140,15 +140,12 @@ debug_ui::get_entity_text_representation(char *text, entities::Entity *entity, u
         return;
     }
 
-    bool has_spatial_component = spatial::is_spatial_component_valid(spatial_component);
-    bool has_drawable_component = drawable::is_component_valid(
-        drawable::get_component(handle));
-    bool has_light_component = lights::is_light_component_valid(
-        lights::get_component(handle));
-    bool has_behavior_component = behavior::is_behavior_component_valid(
-        behavior::get_component(handle));
-    bool has_animation_component = anim::is_animation_component_valid(
-        anim::get_component(handle));
+    entities::Signature signature = entities::get_signature(handle);
+    bool has_spatial_component = signature & (u32)entities::ComponentType::spatial;
+    bool has_drawable_component = signature & (u32)entities::ComponentType::drawable;
+    bool has_light_component = signature & (u32)entities::ComponentType::light;
+    bool has_behavior_component = signature & (u32)entities::ComponentType::behavior;
+    bool has_animation_component = signature & (u32)entities::ComponentType::anim;
 
     for (u8 level = 0; level < depth; level++) {
         strcat(text, "  ");
@@ -80,17 +80,69 @@ drawable::render_pass_from_string(const char* str)
 bool
 drawable::is_component_valid(drawable::Component *drawable_component)
 {
-    return geom::is_mesh_valid(&drawable_component->mesh);
+    return drawable_component->mesh_handle != NO_MESH_HANDLE;
+}
+
+
+/*!
+    Adds a mesh to the registry. If `bvh_or_nullptr` is given, the registry
+    takes ownership of it, and destroys it along with the mesh.
+*/
+drawable::MeshHandle
+drawable::push_mesh(geom::Mesh mesh, meshbvh::Bvh *bvh_or_nullptr)
+{
+    // NOTE: 0 is an invalid handle, so we start at 1.
+    MeshHandle mesh_handle = max(drawable::state->meshes.length,
+        drawable::state->meshes.starting_idx);
+    *drawable::state->meshes[mesh_handle] = mesh;
+    *drawable::state->mesh_bvhs[mesh_handle] = bvh_or_nullptr ? *bvh_or_nullptr : meshbvh::Bvh {};
+    return mesh_handle;
+}
+
+
+geom::Mesh *
+drawable::get_mesh(MeshHandle mesh_handle)
+{
+    return drawable::state->meshes[mesh_handle];
+}
+
+
+meshbvh::Bvh *
+drawable::get_mesh_bvh(MeshHandle mesh_handle)
+{
+    return drawable::state->mesh_bvhs[mesh_handle];
 }
 
 
 void
-drawable::destroy_component(drawable::Component *drawable_component)
+drawable::mark_start_of_non_internal_meshes()
 {
-    if (!is_component_valid(drawable_component)) {
-        return;
+    drawable::state->first_non_internal_mesh_handle = max(drawable::state->meshes.length,
+        drawable::state->meshes.starting_idx);
+}
+
+
+void
+drawable::destroy_non_internal_meshes()
+{
+    for (
+        MeshHandle mesh_handle = drawable::state->first_non_internal_mesh_handle;
+        mesh_handle < drawable::state->meshes.length;
+        mesh_handle++
+    ) {
+        geom::Mesh *mesh = drawable::state->meshes[mesh_handle];
+        if (geom::is_mesh_valid(mesh)) {
+            geom::destroy_mesh(mesh);
+        }
+        meshbvh::destroy(drawable::state->mesh_bvhs[mesh_handle]);
+    }
+
+    if (drawable::state->first_non_internal_mesh_handle < drawable::state->meshes.length) {
+        drawable::state->meshes.delete_elements_after_index(
+            drawable::state->first_non_internal_mesh_handle);
+        drawable::state->mesh_bvhs.delete_elements_after_index(
+            drawable::state->first_non_internal_mesh_handle);
     }
-    geom::destroy_mesh(&drawable_component->mesh);
 }
 
 
@@ -128,4 +180,9 @@ drawable::init(drawable::State *drawable_state, memory::Pool *asset_memory_pool)
     drawable::state = drawable_state;
     drawable::state->components = Array<drawable::Component>(
         asset_memory_pool, MAX_N_ENTITIES, "drawable_components", true, 1);
+    drawable::state->meshes = Array<geom::Mesh>(
+        asset_memory_pool, MAX_N_REGISTERED_MESHES, "meshes", true, 1);
+    drawable::state->mesh_bvhs = Array<meshbvh::Bvh>(
+        asset_memory_pool, MAX_N_REGISTERED_MESHES, "mesh_bvhs", true, 1);
+    drawable::state->first_non_internal_mesh_handle = drawable::state->meshes.starting_idx;
 }
@@ -4,6 +4,7 @@
 
 #include "types.hpp"
 #include "geom.hpp"
+#include "meshbvh.hpp"
 
 class drawable {
 public:
@@ -24,21 +25,43 @@ public:
         renderdebug = (1 << 10),
     };
 
+    // NOTE: 0 is an invalid handle.
+    typedef u32 MeshHandle;
+
+    static constexpr MeshHandle NO_MESH_HANDLE = 0;
+
+    // Many entities can share the same model, so the meshes themselves live
+    // in `State::meshes`, and the component only refers to them. This keeps
+    // the component small enough that four fit in a cache line.
     struct Component {
         entities::Handle entity_handle;
-        geom::Mesh mesh;
+        MeshHandle mesh_handle;
+        // NOTE: Index into `mats::get_materials()`, or mats::NO_MATERIAL_IDX
+        u32 idx_material;
         Pass target_render_pass = Pass::none;
     };
 
     struct State {
         Array<drawable::Component> components;
+        // Indexed by MeshHandle
+        Array<geom::Mesh> meshes;
+        // Indexed by MeshHandle, so that every entity using a mesh shares its
+        // triangle BVH for raycasts
+        Array<meshbvh::Bvh> mesh_bvhs;
+        // Certain meshes at the start of our registry are internal. See
+        // `entities::State::first_non_internal_handle`.
+        MeshHandle first_non_internal_mesh_handle;
         u32 last_drawn_shader_program;
     };
 
     static char const * render_pass_to_string(drawable::Pass render_pass);
     static drawable::Pass render_pass_from_string(const char* str);
     static bool is_component_valid(drawable::Component *drawable_component);
-    static void destroy_component(drawable::Component *drawable_component);
+    static MeshHandle push_mesh(geom::Mesh mesh, meshbvh::Bvh *bvh_or_nullptr);
+    static geom::Mesh * get_mesh(MeshHandle mesh_handle);
+    static meshbvh::Bvh * get_mesh_bvh(MeshHandle mesh_handle);
+    static void mark_start_of_non_internal_meshes();
+    static void destroy_non_internal_meshes();
     static Array<drawable::Component> * get_components();
     static drawable::Component * get_component(entities::Handle entity_handle);
     static u32 get_last_drawn_shader_program();
@@ -14,6 +14,8 @@ namespace chrono = std::chrono;
 #include "constants.hpp"
 #include "internals.hpp"
 #include "renderer.hpp"
+#include "bench.hpp"
+#include "solver.hpp"
 #include "intrinsics.hpp"
 
 
@@ -82,6 +84,7 @@ engine::run_main_loop(GLFWwindow *window)
 
             update();
             renderer::render(window);
+            entities::advance_frame();
 
             if (engine::state->is_manual_frame_advance_enabled) {
                 engine::state->should_manually_advance_to_next_frame = false;
@@ -122,6 +125,11 @@ void engine::init(engine::State *engine_state, memory::Pool *asset_memory_pool)
 void
 engine::destroy_model_loaders()
 {
+    // Skeletons are shared by every entity using the model, so the model
+    // loader owns them.
+    each (model_loader, engine::state->model_loaders) {
+        anim::destroy_skeleton(&model_loader->skeleton);
+    }
     engine::state->model_loaders.clear();
 }
 
@@ -140,8 +148,11 @@ engine::destroy_scene()
     // end up overflowing.
     destroy_model_loaders();
     mats::destroy_non_internal_materials();
+    drawable::destroy_non_internal_meshes();
+    physics::destroy_heightfields();
 
     entities::destroy_non_internal_entities();
+    anim::release_unused_bone_matrices();
     engine::state->entity_loaders.delete_elements_after_index(
         entities::get_first_non_internal_handle());
 }
@@ -259,6 +270,8 @@ engine::handle_console_command()
             "loadscene <scene_name>: Load a scene\n"
             "renderdebug <internal_texture_name>: Display an internal texture. "
             "Use texture \"none\" to disable.\n"
+            "bench <benchmark_name>: Run a benchmark, e.g. \"aabbtree\"\n"
+            "solver <n_iterations> <n_substeps>: Set how much work the physics solver does\n"
             "help: show help"
         );
     } else if (pstr_eq(command, "loadscene")) {
@@ -266,6 +279,24 @@ engine::handle_console_command()
     } else if (pstr_eq(command, "renderdebug")) {
         renderer::set_renderdebug_displayed_texture_type(
             mats::texture_type_from_string(arguments));
+    } else if (pstr_eq(command, "bench")) {
+        bench::run(arguments);
+    } else if (pstr_eq(command, "solver")) {
+        char n_iterations[input::MAX_TEXT_INPUT_ARGUMENTS_LENGTH] = {};
+        char n_substeps[input::MAX_TEXT_INPUT_ARGUMENTS_LENGTH] = {};
+        if (!pstr_split_on_first_occurrence(arguments,
+            n_iterations, input::MAX_TEXT_INPUT_ARGUMENTS_LENGTH,
+            n_substeps, input::MAX_TEXT_INPUT_ARGUMENTS_LENGTH,
+            ' ')
+        ) {
+            gui::log("Usage: solver <n_iterations> <n_substeps>");
+        } else {
+            solver::set_config((u32)strtoul(n_iterations, nullptr, 10),
+                (u32)strtoul(n_substeps, nullptr, 10));
+            solver::Config *config = &solver::get_solver()->config;
+            gui::log("Solver now does %d iterations in each of %d substeps",
+                config->n_iterations, config->n_substeps);
+        }
     } else {
         gui::log("Unknown command: %s", command);
     }
@@ -469,6 +500,9 @@ void
 engine::update()
 {
     if (engine::state->is_world_loaded && !engine::state->was_world_ever_loaded) {
+        // Our internal entities are done loading, so everything in the mesh
+        // registry at this point belongs to them.
+        drawable::mark_start_of_non_internal_meshes();
         load_scene(DEFAULT_SCENE);
         engine::state->was_world_ever_loaded = true;
     }
@@ -481,6 +515,7 @@ engine::update()
     behavior::update();
     anim::update();
     physics::update();
+    spatialgrid::update();
 }
 
 
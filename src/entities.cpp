@@ -2,6 +2,9 @@
 
 #include "entities.hpp"
 #include "engine.hpp"
+#include "charcontroller.hpp"
+#include "logs.hpp"
+#include "intrinsics.hpp"
 
 
 entities::State *entities::state = nullptr;
@@ -45,18 +48,26 @@ entities::get_first_non_internal_handle()
 void
 entities::destroy_non_internal_entities()
 {
+    // Let systems know that these components are gone.
     for (
         u32 idx = entities::state->first_non_internal_handle;
-        idx < entities::state->entities.length;
+        idx < entities::state->signatures.length;
         idx++
     ) {
-        drawable::destroy_component(drawable::get_component(idx));
+        Signature signature = *entities::state->signatures[idx];
+        range_named (idx_type, 0, N_COMPONENT_TYPES) {
+            if (signature & (1u << idx_type)) {
+                mark_changed(idx, get_component_type_from_idx(idx_type));
+            }
+        }
     }
 
     entities::state->next_handle = entities::state->first_non_internal_handle;
 
     entities::state->entities.delete_elements_after_index(
         entities::state->first_non_internal_handle);
+    entities::state->signatures.delete_elements_after_index(
+        entities::state->first_non_internal_handle);
 
     lights::get_components()->delete_elements_after_index(
         entities::state->first_non_internal_handle);
@@ -68,6 +79,14 @@ entities::destroy_non_internal_entities()
         entities::state->first_non_internal_handle);
     anim::get_components()->delete_elements_after_index(
         entities::state->first_non_internal_handle);
+    physics::get_components()->delete_elements_after_index(
+        entities::state->first_non_internal_handle);
+    // Only entities that have been moved by a behavior have a controller, so
+    // there might not be any after the internal ones.
+    Array<charcontroller::Controller> *controllers = charcontroller::get_controllers();
+    if (controllers->length > entities::state->first_non_internal_handle) {
+        controllers->delete_elements_after_index(entities::state->first_non_internal_handle);
+    }
 }
 
 
@@ -92,10 +111,122 @@ entities::get_entity(entities::Handle entity_handle)
 }
 
 
+void
+entities::add_to_signature(entities::Handle entity_handle, ComponentType component_type)
+{
+    *entities::state->signatures[entity_handle] |= (u32)component_type;
+    mark_changed(entity_handle, component_type);
+}
+
+
+void
+entities::remove_from_signature(entities::Handle entity_handle, ComponentType component_type)
+{
+    *entities::state->signatures[entity_handle] &= ~(u32)component_type;
+    mark_changed(entity_handle, component_type);
+}
+
+
+entities::Signature
+entities::get_signature(entities::Handle entity_handle)
+{
+    return *entities::state->signatures[entity_handle];
+}
+
+
+bool
+entities::has_components(entities::Handle entity_handle, Signature mask)
+{
+    return (get_signature(entity_handle) & mask) == mask;
+}
+
+
+u32
+entities::get_component_type_idx(ComponentType component_type)
+{
+    range (0, N_COMPONENT_TYPES) {
+        if ((u32)component_type == (1u << idx)) {
+            return idx;
+        }
+    }
+    logs::fatal("Invalid ComponentType: %d", (u32)component_type);
+    return 0;
+}
+
+
+entities::ComponentType
+entities::get_component_type_from_idx(u32 idx)
+{
+    assert(idx < N_COMPONENT_TYPES);
+    return (ComponentType)(1u << idx);
+}
+
+
+void
+entities::mark_changed(entities::Handle entity_handle, ComponentType component_type)
+{
+    u32 idx_type = get_component_type_idx(component_type);
+    u32 *version = &entities::state->component_versions[entity_handle]->frames[idx_type];
+    if (*version == entities::state->frame) {
+        // We already know about this change.
+        return;
+    }
+    *version = entities::state->frame;
+    entities::state->changed_handles[idx_type].push(entity_handle);
+}
+
+
+bool
+entities::was_changed_this_frame(entities::Handle entity_handle, ComponentType component_type)
+{
+    u32 idx_type = get_component_type_idx(component_type);
+    return entities::state->component_versions[entity_handle]->frames[idx_type] ==
+        entities::state->frame;
+}
+
+
+Array<entities::Handle> *
+entities::get_changed_handles(ComponentType component_type)
+{
+    return &entities::state->changed_handles[get_component_type_idx(component_type)];
+}
+
+
+u32
+entities::get_frame()
+{
+    return entities::state->frame;
+}
+
+
+void
+entities::advance_frame()
+{
+    entities::state->frame++;
+    range (0, N_COMPONENT_TYPES) {
+        Array<Handle> *changed_handles = &entities::state->changed_handles[idx];
+        if (changed_handles->length > 0) {
+            changed_handles->delete_elements_after_index(0);
+        }
+    }
+}
+
+
 void
 entities::init(entities::State *entities_state, memory::Pool *asset_memory_pool)
 {
     entities::state = entities_state;
     entities::state->entities = Array<entities::Entity>(
         asset_memory_pool, MAX_N_ENTITIES, "entities", true, 1);
+    entities::state->signatures = Array<entities::Signature>(
+        asset_memory_pool, MAX_N_ENTITIES, "entity_signatures", true, 1);
+    // NOTE: Frame 0 is never used, so that new components, whose versions
+    // are all 0, never look like they have already been marked as changed.
+    entities::state->frame = 1;
+    entities::state->component_versions = Array<entities::ComponentVersions>(
+        asset_memory_pool, MAX_N_ENTITIES, "entity_component_versions", true, 1);
+    range (0, N_COMPONENT_TYPES) {
+        entities::state->changed_handles[idx] = Array<entities::Handle>(
+            asset_memory_pool, MAX_N_ENTITIES, "entity_changed_handles");
+    }
 }
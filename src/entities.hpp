@@ -11,6 +11,30 @@ public:
     // NOTE: 0 is an invalid handle.
     typedef u32 Handle;
 
+    // Every component type gets one bit, and every entity has a signature
+    // made up of the bits of the components it has. This lets us find all
+    // entities with a certain combination of components by just testing
+    // bitmasks, without having to look at any of the component arrays.
+    enum class ComponentType : u32 {
+        none = 0,
+        spatial = (1 << 0),
+        drawable = (1 << 1),
+        light = (1 << 2),
+        behavior = (1 << 3),
+        anim = (1 << 4),
+        physics = (1 << 5),
+    };
+
+    static constexpr u32 N_COMPONENT_TYPES = 6;
+
+    typedef u32 Signature;
+
+    // The frame in which each of an entity's components was last changed,
+    // indexed by `get_component_type_idx()`.
+    struct ComponentVersions {
+        u32 frames[N_COMPONENT_TYPES];
+    };
+
     struct Entity {
         Handle handle;
         char debug_name[MAX_DEBUG_NAME_LENGTH];
@@ -18,6 +42,9 @@ public:
 
     struct State {
         Array<Entity> entities;
+        // NOTE: This is kept separate from `Entity`, so that queries only have
+        // to walk through a tightly packed array of bitmasks.
+        Array<Signature> signatures;
         // The handle of the next entity which has not yet been created.
         // NOTE: 0 is an invalid handle.
         Handle next_handle;
@@ -27,6 +54,15 @@ public:
         // This assumes all our internal entities will be contiguous and at the
         // start of our set.
         Handle first_non_internal_handle;
+        // Change tracking. Whoever writes to a component should call
+        // `mark_changed()`, so that systems can only look at the handles in
+        // `changed_handles` instead of going through every component.
+        // NOTE: The changed handles are cleared by `advance_frame()` at the
+        // end of each frame, so changes made after a system has already run
+        // in a certain frame will not be seen by that system.
+        u32 frame;
+        Array<ComponentVersions> component_versions;
+        Array<Handle> changed_handles[N_COMPONENT_TYPES];
     };
 
     static constexpr Handle NO_ENTITY_HANDLE = 0;
@@ -39,8 +75,36 @@ public:
     static u32 get_n_entities();
     static Array<entities::Entity> * get_entities();
     static entities::Entity * get_entity(entities::Handle entity_handle);
+    static void add_to_signature(entities::Handle entity_handle, ComponentType component_type);
+    static void remove_from_signature(entities::Handle entity_handle, ComponentType component_type);
+    static Signature get_signature(entities::Handle entity_handle);
+    static bool has_components(entities::Handle entity_handle, Signature mask);
+    static u32 get_component_type_idx(ComponentType component_type);
+    static ComponentType get_component_type_from_idx(u32 idx);
+    static void mark_changed(entities::Handle entity_handle, ComponentType component_type);
+    static bool was_changed_this_frame(entities::Handle entity_handle, ComponentType component_type);
+    static Array<entities::Handle> * get_changed_handles(ComponentType component_type);
+    static u32 get_frame();
+    static void advance_frame();
     static void init(entities::State *entities_state, memory::Pool *asset_memory_pool);
 
+    // Calls `fn(entity_handle)` for every entity which has all of the
+    // components in `mask`, e.g.
+    // `(u32)ComponentType::spatial | (u32)ComponentType::physics`.
+    template <typename F>
+        static void query(Signature mask, F fn) {
+            Array<Signature> *signatures = &entities::state->signatures;
+            for (
+                Handle handle = signatures->starting_idx;
+                handle < signatures->length;
+                handle++
+            ) {
+                if ((signatures->items[handle] & mask) == mask) {
+                    fn(handle);
+                }
+            }
+        }
+
 private:
     static entities::State *state;
 };
@@ -3,7 +3,6 @@
 #pragma once
 
 #include "types.hpp"
-#include "pack.hpp"
 #include "constants.hpp"
 
 class geom {
@@ -16,17 +15,14 @@ public:
         f32 bone_weights[MAX_N_BONES_PER_VERTEX];
     };
 
+    // NOTE: This only holds what we need to draw a mesh that's already on
+    // the GPU. Anything we only need while loading lives in
+    // `models::MeshData`.
     struct Mesh {
-        memory::Pool temp_memory_pool;
-        m4 transform;
-        char material_name[MAX_COMMON_NAME_LENGTH];
-        pack::Pack indices_pack;
         u32 vao;
         u32 vbo;
         u32 ebo;
         GLenum mode;
-        Vertex *vertices;
-        u32 *indices;
         u32 n_vertices;
         u32 n_indices;
     };
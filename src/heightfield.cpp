@@ -0,0 +1,455 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "logs.hpp"
+#include "files.hpp"
+#include "heightfield.hpp"
+#include "intrinsics.hpp"
+
+
+/*!
+    Makes `heightfield` from the first channel of the image at `path`, where
+    black is a height of 0 and white is a height of `height_scale`. Each
+    pixel is one point of the grid, `cell_size` away from its neighbours.
+*/
+bool
+heightfield::load(
+    Heightfield *heightfield,
+    char const *path,
+    f32 cell_size,
+    f32 height_scale
+) {
+    *heightfield = {};
+    i32 width, height, n_channels;
+    unsigned char *image_data = files::load_image(path, &width, &height, &n_channels, false);
+    defer { files::free_image(image_data); };
+
+    if (width < 2 || height < 2) {
+        logs::error("Heightmap %s needs to be at least 2x2, but is %dx%d", path, width, height);
+        return false;
+    }
+
+    u32 n_points = (u32)(width * height);
+    heightfield->memory_pool = { .size = n_points * sizeof(f32) };
+    heightfield->heights = (f32*)memory::push(&heightfield->memory_pool,
+        n_points * sizeof(f32), "heightfield_heights");
+    range (0, n_points) {
+        heightfield->heights[idx] = (f32)image_data[idx * n_channels] / 255.0f * height_scale;
+    }
+    heightfield->n_cols = (u32)width;
+    heightfield->n_rows = (u32)height;
+    heightfield->cell_size = cell_size;
+    update_height_range(heightfield);
+    return true;
+}
+
+
+/*!
+    Makes `heightfield` from a copy of `heights`, which must have
+    `n_cols * n_rows` items.
+*/
+void
+heightfield::make(
+    Heightfield *heightfield,
+    f32 const *heights,
+    u32 n_cols,
+    u32 n_rows,
+    f32 cell_size
+) {
+    assert(n_cols >= 2 && n_rows >= 2);
+    *heightfield = {};
+    u32 n_points = n_cols * n_rows;
+    heightfield->memory_pool = { .size = n_points * sizeof(f32) };
+    heightfield->heights = (f32*)memory::push(&heightfield->memory_pool,
+        n_points * sizeof(f32), "heightfield_heights");
+    memcpy(heightfield->heights, heights, n_points * sizeof(f32));
+    heightfield->n_cols = n_cols;
+    heightfield->n_rows = n_rows;
+    heightfield->cell_size = cell_size;
+    update_height_range(heightfield);
+}
+
+
+void
+heightfield::destroy(Heightfield *heightfield)
+{
+    if (heightfield->memory_pool.memory) {
+        memory::destroy_memory_pool(&heightfield->memory_pool);
+    }
+    *heightfield = {};
+}
+
+
+/*!
+    Gets a box around the whole heightfield, including the `THICKNESS` under
+    its lowest point, which the broadphase can use.
+*/
+spatial::Obb
+heightfield::get_bounds(Heightfield *heightfield)
+{
+    v3 size = v3(
+        (f32)(heightfield->n_cols - 1) * heightfield->cell_size,
+        heightfield->max_height - heightfield->min_height + THICKNESS,
+        (f32)(heightfield->n_rows - 1) * heightfield->cell_size);
+    return {
+        .center = v3(size.x / 2.0f, heightfield->max_height - size.y / 2.0f, size.z / 2.0f),
+        .x_axis = v3(1.0f, 0.0f, 0.0f),
+        .y_axis = v3(0.0f, 1.0f, 0.0f),
+        .extents = size / 2.0f,
+    };
+}
+
+
+bool
+heightfield::is_point_over(Heightfield *heightfield, f32 x, f32 z)
+{
+    return x >= 0.0f && z >= 0.0f &&
+        x <= (f32)(heightfield->n_cols - 1) * heightfield->cell_size &&
+        z <= (f32)(heightfield->n_rows - 1) * heightfield->cell_size;
+}
+
+
+/*!
+    Gets the height of the surface at `(x, z)`. Points that aren't over the
+    heightfield get the height of the nearest point on its edge.
+*/
+f32
+heightfield::get_height(Heightfield *heightfield, f32 x, f32 z)
+{
+    u32 i, j;
+    v2 t;
+    get_cell(heightfield, x, z, &i, &j, &t);
+    f32 h00 = get_point_height(heightfield, i, j);
+    f32 h10 = get_point_height(heightfield, i + 1, j);
+    f32 h01 = get_point_height(heightfield, i, j + 1);
+    f32 h11 = get_point_height(heightfield, i + 1, j + 1);
+    if (t.x >= t.y) {
+        return h00 + (h10 - h00) * t.x + (h11 - h10) * t.y;
+    }
+    return h00 + (h11 - h01) * t.x + (h01 - h00) * t.y;
+}
+
+
+/*!
+    Gets the normal of the triangle under `(x, z)`, which always points up.
+*/
+v3
+heightfield::get_normal(Heightfield *heightfield, f32 x, f32 z)
+{
+    u32 i, j;
+    v2 t;
+    get_cell(heightfield, x, z, &i, &j, &t);
+    f32 h00 = get_point_height(heightfield, i, j);
+    f32 h10 = get_point_height(heightfield, i + 1, j);
+    f32 h01 = get_point_height(heightfield, i, j + 1);
+    f32 h11 = get_point_height(heightfield, i + 1, j + 1);
+    f32 dx, dz;
+    if (t.x >= t.y) {
+        dx = h10 - h00;
+        dz = h11 - h10;
+    } else {
+        dx = h11 - h01;
+        dz = h01 - h00;
+    }
+    return normalize(v3(-dx, heightfield->cell_size, -dz));
+}
+
+
+/*!
+    Finds where `ray` first hits the surface, from above. We clip the ray to
+    the heightfield's bounds, then walk through the cells it passes over, in
+    order, using a 2D DDA. We skip cells that the ray passes entirely above,
+    and stop at the first cell where it hits one of the triangles.
+
+    Resources
+    ---------
+    John Amanatides and Andrew Woo, "A Fast Voxel Traversal Algorithm for Ray
+    Tracing"
+*/
+heightfield::RaycastResult
+heightfield::intersect_ray(Heightfield *heightfield, spatial::Ray *ray, f32 max_distance)
+{
+    RaycastResult result = {};
+    spatial::Obb bounds = get_bounds(heightfield);
+    v3 bounds_min = bounds.center - bounds.extents;
+    v3 bounds_max = bounds.center + bounds.extents;
+
+    f32 t_enter = 0.0f;
+    f32 t_exit = max_distance;
+    range (0, 3) {
+        if (ray->direction[idx] == 0.0f) {
+            if (ray->origin[idx] < bounds_min[idx] || ray->origin[idx] > bounds_max[idx]) {
+                return result;
+            }
+            continue;
+        }
+        f32 t0 = (bounds_min[idx] - ray->origin[idx]) / ray->direction[idx];
+        f32 t1 = (bounds_max[idx] - ray->origin[idx]) / ray->direction[idx];
+        t_enter = max(t_enter, min(t0, t1));
+        t_exit = min(t_exit, max(t0, t1));
+    }
+    if (t_enter > t_exit) {
+        return result;
+    }
+
+    f32 cell_size = heightfield->cell_size;
+    v3 start = ray->origin + ray->direction * t_enter;
+    u32 i, j;
+    v2 t_start;
+    get_cell(heightfield, start.x, start.z, &i, &j, &t_start);
+
+    // How far along the ray we go to cross the next cell boundary on each
+    // axis, and how far we go to cross a whole cell.
+    i32 step_x = (ray->direction.x > 0.0f) ? 1 : -1;
+    i32 step_z = (ray->direction.z > 0.0f) ? 1 : -1;
+    f32 t_delta_x = (ray->direction.x != 0.0f) ?
+        cell_size / abs(ray->direction.x) : FLT_MAX;
+    f32 t_delta_z = (ray->direction.z != 0.0f) ?
+        cell_size / abs(ray->direction.z) : FLT_MAX;
+    f32 t_next_x = (ray->direction.x != 0.0f) ?
+        ((f32)(i + (step_x > 0 ? 1 : 0)) * cell_size - ray->origin.x) / ray->direction.x :
+        FLT_MAX;
+    f32 t_next_z = (ray->direction.z != 0.0f) ?
+        ((f32)(j + (step_z > 0 ? 1 : 0)) * cell_size - ray->origin.z) / ray->direction.z :
+        FLT_MAX;
+
+    f32 t = t_enter;
+    while (t <= t_exit) {
+        f32 t_cell_exit = min(min(t_next_x, t_next_z), t_exit);
+
+        // If the ray stays above every corner of this cell, it can't hit it.
+        f32 cell_max_height = max(
+            max(get_point_height(heightfield, i, j), get_point_height(heightfield, i + 1, j)),
+            max(get_point_height(heightfield, i, j + 1),
+                get_point_height(heightfield, i + 1, j + 1)));
+        f32 ray_min_height = min(ray->origin.y + ray->direction.y * t,
+            ray->origin.y + ray->direction.y * t_cell_exit);
+        if (
+            ray_min_height <= cell_max_height &&
+            intersect_cell_ray(heightfield, i, j, ray, max_distance, &result)
+        ) {
+            return result;
+        }
+
+        if (t_next_x < t_next_z) {
+            if ((step_x < 0 && i == 0) || (step_x > 0 && i + 2 >= heightfield->n_cols)) {
+                break;
+            }
+            i += step_x;
+            t = t_next_x;
+            t_next_x += t_delta_x;
+        } else {
+            if (t_next_z == FLT_MAX) {
+                break;
+            }
+            if ((step_z < 0 && j == 0) || (step_z > 0 && j + 2 >= heightfield->n_rows)) {
+                break;
+            }
+            j += step_z;
+            t = t_next_z;
+            t_next_z += t_delta_z;
+        }
+    }
+
+    return result;
+}
+
+
+/*!
+    Finds the points where `obb` has gone into the terrain: corners of `obb`
+    that are under the surface, and points of the grid that are inside `obb`.
+    The second kind catch bumps poking into the side or bottom of a box that
+    is bigger than a cell. We keep the deepest `MAX_N_CONTACT_POINTS`, and
+    use the average of the surface normals under them, weighted by depth, as
+    the contact normal.
+*/
+heightfield::ObbContacts
+heightfield::intersect_obb(Heightfield *heightfield, spatial::Obb *obb)
+{
+    ObbContacts contacts = {};
+    v3 axes[3] = { obb->x_axis, obb->y_axis, cross(obb->x_axis, obb->y_axis) };
+    v3 weighted_normal = v3(0.0f);
+
+    // Corners under the surface
+    range_named (idx_corner, 0, 8) {
+        v3 corner = obb->center;
+        range_named (idx_axis, 0, 3) {
+            f32 sign = (idx_corner & (1u << idx_axis)) ? 1.0f : -1.0f;
+            corner += axes[idx_axis] * obb->extents[idx_axis] * sign;
+        }
+        if (!is_point_over(heightfield, corner.x, corner.z)) {
+            continue;
+        }
+        f32 surface_height = get_height(heightfield, corner.x, corner.z);
+        if (corner.y >= surface_height) {
+            continue;
+        }
+        v3 normal = get_normal(heightfield, corner.x, corner.z);
+        f32 depth = (surface_height - corner.y) * normal.y;
+        add_contact_point(&contacts, corner, depth);
+        weighted_normal += normal * depth;
+    }
+
+    // Grid points inside the box
+    spatial::Aabb aabb = spatial::make_aabb_from_obb(obb);
+    f32 cell_size = heightfield->cell_size;
+    i32 i_min = max((i32)ceil(aabb.min.x / cell_size), 0);
+    i32 i_max = min((i32)floor(aabb.max.x / cell_size), (i32)heightfield->n_cols - 1);
+    i32 j_min = max((i32)ceil(aabb.min.z / cell_size), 0);
+    i32 j_max = min((i32)floor(aabb.max.z / cell_size), (i32)heightfield->n_rows - 1);
+    for (i32 j = j_min; j <= j_max; j++) {
+        for (i32 i = i_min; i <= i_max; i++) {
+            v3 point = v3((f32)i * cell_size, get_point_height(heightfield, (u32)i, (u32)j),
+                (f32)j * cell_size);
+            if (point.y < aabb.min.y || point.y > aabb.max.y) {
+                continue;
+            }
+            v3 d = point - obb->center;
+            if (
+                abs(dot(d, axes[0])) > obb->extents[0] ||
+                abs(dot(d, axes[1])) > obb->extents[1] ||
+                abs(dot(d, axes[2])) > obb->extents[2]
+            ) {
+                continue;
+            }
+            // How far the box has to move along the normal for its lowest
+            // point to be above this one
+            v3 normal = get_normal(heightfield, point.x, point.z);
+            f32 radius = obb->extents[0] * abs(dot(axes[0], normal)) +
+                obb->extents[1] * abs(dot(axes[1], normal)) +
+                obb->extents[2] * abs(dot(axes[2], normal));
+            f32 depth = dot(d, normal) + radius;
+            add_contact_point(&contacts, point, depth);
+            weighted_normal += normal * depth;
+        }
+    }
+
+    if (contacts.n_points == 0) {
+        return contacts;
+    }
+    contacts.did_collide = true;
+    contacts.normal = (length2(weighted_normal) > 0.0f) ?
+        normalize(weighted_normal) : v3(0.0f, 1.0f, 0.0f);
+    return contacts;
+}
+
+
+f32
+heightfield::get_point_height(Heightfield *heightfield, u32 i, u32 j)
+{
+    return heightfield->heights[j * heightfield->n_cols + i];
+}
+
+
+void
+heightfield::update_height_range(Heightfield *heightfield)
+{
+    heightfield->min_height = FLT_MAX;
+    heightfield->max_height = -FLT_MAX;
+    range (0, heightfield->n_cols * heightfield->n_rows) {
+        heightfield->min_height = min(heightfield->min_height, heightfield->heights[idx]);
+        heightfield->max_height = max(heightfield->max_height, heightfield->heights[idx]);
+    }
+}
+
+
+/*!
+    Finds the cell that `(x, z)` is over, and how far across it `(x, z)` is,
+    from 0 to 1 on each axis. Points outside the heightfield get the nearest
+    point on its edge.
+*/
+void
+heightfield::get_cell(Heightfield *heightfield, f32 x, f32 z, u32 *i, u32 *j, v2 *t)
+{
+    f32 fx = x / heightfield->cell_size;
+    f32 fz = z / heightfield->cell_size;
+    *i = (u32)min(max((i32)floor(fx), 0), (i32)heightfield->n_cols - 2);
+    *j = (u32)min(max((i32)floor(fz), 0), (i32)heightfield->n_rows - 2);
+    *t = v2(min(max(fx - (f32)*i, 0.0f), 1.0f), min(max(fz - (f32)*j, 0.0f), 1.0f));
+}
+
+
+/*!
+    Tests `ray` against both triangles of cell (i, j), from above, and fills
+    in `result` if it hits one of them within `max_distance`.
+*/
+bool
+heightfield::intersect_cell_ray(
+    Heightfield *heightfield,
+    u32 i,
+    u32 j,
+    spatial::Ray *ray,
+    f32 max_distance,
+    RaycastResult *result
+) {
+    f32 cell_size = heightfield->cell_size;
+    v3 p00 = v3((f32)i * cell_size, get_point_height(heightfield, i, j), (f32)j * cell_size);
+    v3 p10 = v3(p00.x + cell_size, get_point_height(heightfield, i + 1, j), p00.z);
+    v3 p01 = v3(p00.x, get_point_height(heightfield, i, j + 1), p00.z + cell_size);
+    v3 p11 = v3(p00.x + cell_size, get_point_height(heightfield, i + 1, j + 1),
+        p00.z + cell_size);
+    // Both wound so that the normal points up
+    v3 triangles[2][3] = { { p00, p11, p10 }, { p00, p01, p11 } };
+
+    bool did_hit = false;
+    range (0, 2) {
+        // Moller-Trumbore, only counting hits on the upper side
+        v3 edge1 = triangles[idx][1] - triangles[idx][0];
+        v3 edge2 = triangles[idx][2] - triangles[idx][0];
+        v3 p = cross(ray->direction, edge2);
+        f32 det = dot(edge1, p);
+        if (det <= 1.0e-9f) {
+            continue;
+        }
+        f32 inv_det = 1.0f / det;
+        v3 s = ray->origin - triangles[idx][0];
+        f32 u = dot(s, p) * inv_det;
+        if (u < 0.0f || u > 1.0f) {
+            continue;
+        }
+        v3 q = cross(s, edge1);
+        f32 v = dot(ray->direction, q) * inv_det;
+        if (v < 0.0f || u + v > 1.0f) {
+            continue;
+        }
+        f32 distance = dot(edge2, q) * inv_det;
+        if (distance < 0.0f || distance > max_distance) {
+            continue;
+        }
+        if (!did_hit || distance < result->distance) {
+            *result = {
+                .did_intersect = true,
+                .distance = distance,
+                .normal = normalize(cross(edge1, edge2)),
+            };
+            did_hit = true;
+        }
+    }
+    return did_hit;
+}
+
+
+/*!
+    Adds a contact point to `contacts`, and if it's already full, replaces
+    the shallowest point with this one, if this one is deeper.
+*/
+void
+heightfield::add_contact_point(ObbContacts *contacts, v3 point, f32 depth)
+{
+    contacts->max_depth = (contacts->n_points == 0) ? depth : max(contacts->max_depth, depth);
+    if (contacts->n_points < MAX_N_CONTACT_POINTS) {
+        contacts->points[contacts->n_points] = point;
+        contacts->depths[contacts->n_points] = depth;
+        contacts->n_points++;
+        return;
+    }
+    u32 idx_shallowest = 0;
+    range (1, MAX_N_CONTACT_POINTS) {
+        if (contacts->depths[idx] < contacts->depths[idx_shallowest]) {
+            idx_shallowest = idx;
+        }
+    }
+    if (depth > contacts->depths[idx_shallowest]) {
+        contacts->points[idx_shallowest] = point;
+        contacts->depths[idx_shallowest] = depth;
+    }
+}
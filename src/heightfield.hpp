@@ -0,0 +1,97 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "memory.hpp"
+#include "spatial.hpp"
+
+/*!
+    A grid of heights that physics can use as the ground, so that terrain
+    doesn't have to be approximated by lots of boxes.
+
+    Heights are stored row by row, where each row goes along x, and there is
+    one row for each step along z. Point (i, j) of the grid is at
+    `(i * cell_size, heights[j * n_cols + i], j * cell_size)`, in the
+    heightfield's own space. Each cell is split into two triangles along the
+    diagonal from (i, j) to (i + 1, j + 1), and these triangles are the
+    surface. Everything under the surface, down to `THICKNESS` under the
+    lowest point, counts as being inside the terrain.
+
+    Since we can find the cell that any point is above by dividing by
+    `cell_size`, looking up a height takes the same time no matter how large
+    the heightfield is, and so do contacts, which only look at the cells under
+    a box. Rays step from cell to cell along their path, so they only ever
+    look at the cells they actually pass over.
+*/
+class heightfield {
+public:
+    static constexpr u32 MAX_N_CONTACT_POINTS = 8;
+    static constexpr f32 THICKNESS = 1.0f;
+
+    struct Heightfield {
+        memory::Pool memory_pool;
+        f32 *heights;
+        u32 n_cols;
+        u32 n_rows;
+        f32 cell_size;
+        f32 min_height;
+        f32 max_height;
+    };
+
+    struct RaycastResult {
+        bool did_intersect;
+        f32 distance;
+        v3 normal;
+    };
+
+    // `normal` points up, out of the terrain, and each depth is how far
+    // `points[i]` is under the surface along it.
+    struct ObbContacts {
+        bool did_collide;
+        v3 normal;
+        v3 points[MAX_N_CONTACT_POINTS];
+        f32 depths[MAX_N_CONTACT_POINTS];
+        u32 n_points;
+        f32 max_depth;
+    };
+
+    static bool load(
+        Heightfield *heightfield,
+        char const *path,
+        f32 cell_size,
+        f32 height_scale
+    );
+    static void make(
+        Heightfield *heightfield,
+        f32 const *heights,
+        u32 n_cols,
+        u32 n_rows,
+        f32 cell_size
+    );
+    static void destroy(Heightfield *heightfield);
+    static spatial::Obb get_bounds(Heightfield *heightfield);
+    static bool is_point_over(Heightfield *heightfield, f32 x, f32 z);
+    static f32 get_height(Heightfield *heightfield, f32 x, f32 z);
+    static v3 get_normal(Heightfield *heightfield, f32 x, f32 z);
+    static RaycastResult intersect_ray(
+        Heightfield *heightfield,
+        spatial::Ray *ray,
+        f32 max_distance
+    );
+    static ObbContacts intersect_obb(Heightfield *heightfield, spatial::Obb *obb);
+
+private:
+    static f32 get_point_height(Heightfield *heightfield, u32 i, u32 j);
+    static void update_height_range(Heightfield *heightfield);
+    static void get_cell(Heightfield *heightfield, f32 x, f32 z, u32 *i, u32 *j, v2 *t);
+    static bool intersect_cell_ray(
+        Heightfield *heightfield,
+        u32 i,
+        u32 j,
+        spatial::Ray *ray,
+        f32 max_distance,
+        RaycastResult *result
+    );
+    static void add_contact_point(ObbContacts *contacts, v3 point, f32 depth);
+};
@@ -70,33 +70,35 @@ lights::is_light_component_valid(lights::Component *light_component)
 void
 lights::update(v3 camera_position)
 {
-    each (light_component, *get_components()) {
-        if (light_component->entity_handle == entities::NO_ENTITY_HANDLE) {
-            continue;
-        }
-
-        spatial::Component *spatial_component =
-            spatial::get_component(light_component->entity_handle);
-
-        if (!(
-            is_light_component_valid(light_component) &&
-            spatial::is_spatial_component_valid(spatial_component)
-        )) {
-            continue;
-        }
-
-        if (light_component->type == LightType::point) {
-            light_component->color.b = ((f32)sin(engine::get_t()) + 1.0f) / 2.0f * 50.0f;
-        }
-
-        // For the sun! :)
-        if (light_component->type == LightType::directional) {
-            spatial_component->position = camera_position +
-                -light_component->direction * DIRECTIONAL_LIGHT_DISTANCE;
-            light_component->direction = v3(sin(lights::state->dir_light_angle),
-                -cos(lights::state->dir_light_angle), 0.0f);
-        }
-    }
+    entities::query(
+        (u32)entities::ComponentType::light | (u32)entities::ComponentType::spatial,
+        [camera_position](entities::Handle entity_handle) {
+            lights::Component *light_component = get_component(entity_handle);
+            spatial::Component *spatial_component = spatial::get_component(entity_handle);
+
+            if (light_component->type == LightType::point) {
+                light_component->color.b = ((f32)sin(engine::get_t()) + 1.0f) / 2.0f * 50.0f;
+                entities::mark_changed(entity_handle, entities::ComponentType::light);
+            }
+
+            // For the sun! :)
+            if (light_component->type == LightType::directional) {
+                v3 new_position = camera_position +
+                    -light_component->direction * DIRECTIONAL_LIGHT_DISTANCE;
+                v3 new_direction = v3(sin(lights::state->dir_light_angle),
+                    -cos(lights::state->dir_light_angle), 0.0f);
+                // The sun only moves if the camera moves, so don't tell anyone
+                // that it's changed unless it actually has.
+                if (new_position != spatial_component->position) {
+                    spatial_component->position = new_position;
+                    entities::mark_changed(entity_handle, entities::ComponentType::spatial);
+                }
+                if (new_direction != light_component->direction) {
+                    light_component->direction = new_direction;
+                    entities::mark_changed(entity_handle, entities::ComponentType::light);
+                }
+            }
+        });
 }
 
 
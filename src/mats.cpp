@@ -315,6 +315,25 @@ mats::get_material_by_name(char const *name)
 }
 
 
+u32
+mats::get_material_idx_by_name(char const *name)
+{
+    range (0, mats::state->materials.length) {
+        if (pstr_eq(mats::state->materials[idx]->name, name)) {
+            return idx;
+        }
+    }
+    return NO_MATERIAL_IDX;
+}
+
+
+mats::Material *
+mats::get_material(u32 idx)
+{
+    return mats::state->materials[idx];
+}
+
+
 void
 mats::add_texture_to_material(Material *material, Texture texture, const char *uniform_name)
 {
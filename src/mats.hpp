@@ -107,6 +107,8 @@ public:
         bool should_use_normal_map;
     };
 
+    static constexpr u32 NO_MATERIAL_IDX = UINT32_MAX;
+
     struct State {
         PersistentPbo persistent_pbo;
         TextureNamePool texture_name_pool;
@@ -153,6 +155,8 @@ public:
     );
     static void destroy_material(Material *material);
     static Material * get_material_by_name(char const *name);
+    static u32 get_material_idx_by_name(char const *name);
+    static Material * get_material(u32 idx);
     static void add_texture_to_material(
         Material *material, Texture texture, const char *uniform_name
     );
@@ -0,0 +1,482 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "meshbvh.hpp"
+#include "drawable.hpp"
+#include "intrinsics.hpp"
+
+
+/*!
+    Builds `bvh` for the triangles in `indices`, which index into `vertices`.
+    The tree gets its own memory pool, so that it can outlive the vertex data
+    it was built from, and `temp_memory_pool` is only used while building it.
+*/
+void
+meshbvh::build(
+    Bvh *bvh,
+    memory::Pool *temp_memory_pool,
+    geom::Vertex const *vertices,
+    u32 const *indices,
+    u32 n_indices
+) {
+    *bvh = {};
+    u32 n_triangles = n_indices / 3;
+    if (n_triangles == 0) {
+        return;
+    }
+
+    // A tree with one triangle per leaf has this many nodes, and no tree we
+    // build can have more.
+    u32 max_n_nodes = 2 * n_triangles - 1;
+    bvh->memory_pool = {
+        .size = max_n_nodes * sizeof(Node) +
+            n_triangles * (sizeof(Triangle) + sizeof(u32)),
+    };
+    bvh->nodes = (Node*)memory::push(&bvh->memory_pool,
+        max_n_nodes * sizeof(Node), "meshbvh_nodes");
+    bvh->triangles = (Triangle*)memory::push(&bvh->memory_pool,
+        n_triangles * sizeof(Triangle), "meshbvh_triangles");
+    bvh->triangle_idxs = (u32*)memory::push(&bvh->memory_pool,
+        n_triangles * sizeof(u32), "meshbvh_triangle_idxs");
+    bvh->n_triangles = n_triangles;
+
+    BuildTriangle *build_triangles = (BuildTriangle*)memory::push(temp_memory_pool,
+        n_triangles * sizeof(BuildTriangle), "meshbvh_build_triangles");
+    range (0, n_triangles) {
+        v3 a = vertices[indices[idx * 3]].position;
+        v3 b = vertices[indices[idx * 3 + 1]].position;
+        v3 c = vertices[indices[idx * 3 + 2]].position;
+        build_triangles[idx] = {
+            .aabb = {
+                .min = min(min(a, b), c),
+                .max = max(max(a, b), c),
+            },
+            .centroid = (a + b + c) / 3.0f,
+            .idx_triangle = idx,
+        };
+    }
+
+    bvh->nodes[0] = { .idx_first = 0, .n_triangles = n_triangles };
+    bvh->n_nodes = 1;
+    update_node_bounds(&bvh->nodes[0], build_triangles);
+
+    // We split nodes depth first, so we only ever have one pending sibling
+    // for each level above the node we're splitting.
+    u32 node_stack[MAX_DEPTH + 1];
+    u32 depth_stack[MAX_DEPTH + 1];
+    u32 n_stack = 0;
+    node_stack[n_stack] = 0;
+    depth_stack[n_stack] = 1;
+    n_stack++;
+    while (n_stack > 0) {
+        n_stack--;
+        u32 idx_node = node_stack[n_stack];
+        u32 depth = depth_stack[n_stack];
+        Node *node = &bvh->nodes[idx_node];
+
+        u32 split_axis;
+        f32 split_position;
+        if (
+            depth >= MAX_DEPTH ||
+            !find_best_split(node, build_triangles, &split_axis, &split_position)
+        ) {
+            continue;
+        }
+
+        // Partition the node's triangles in place, so that the ones on the
+        // left of the split come first.
+        u32 idx_left_end = node->idx_first;
+        u32 idx_right_start = node->idx_first + node->n_triangles;
+        while (idx_left_end < idx_right_start) {
+            if (build_triangles[idx_left_end].centroid[split_axis] < split_position) {
+                idx_left_end++;
+            } else {
+                idx_right_start--;
+                BuildTriangle temp = build_triangles[idx_left_end];
+                build_triangles[idx_left_end] = build_triangles[idx_right_start];
+                build_triangles[idx_right_start] = temp;
+            }
+        }
+        u32 n_left_triangles = idx_left_end - node->idx_first;
+        if (n_left_triangles == 0 || n_left_triangles == node->n_triangles) {
+            continue;
+        }
+
+        u32 idx_left = bvh->n_nodes;
+        bvh->n_nodes += 2;
+        bvh->nodes[idx_left] = {
+            .idx_first = node->idx_first,
+            .n_triangles = n_left_triangles,
+        };
+        bvh->nodes[idx_left + 1] = {
+            .idx_first = idx_left_end,
+            .n_triangles = node->n_triangles - n_left_triangles,
+        };
+        node->idx_first = idx_left;
+        node->n_triangles = 0;
+        update_node_bounds(&bvh->nodes[idx_left], build_triangles);
+        update_node_bounds(&bvh->nodes[idx_left + 1], build_triangles);
+
+        assert(n_stack + 2 <= MAX_DEPTH + 1);
+        range_named (idx_child, 0, 2) {
+            node_stack[n_stack] = idx_left + idx_child;
+            depth_stack[n_stack] = depth + 1;
+            n_stack++;
+        }
+    }
+
+    range (0, n_triangles) {
+        u32 idx_triangle = build_triangles[idx].idx_triangle;
+        bvh->triangle_idxs[idx] = idx_triangle;
+        v3 a = vertices[indices[idx_triangle * 3]].position;
+        v3 b = vertices[indices[idx_triangle * 3 + 1]].position;
+        v3 c = vertices[indices[idx_triangle * 3 + 2]].position;
+        bvh->triangles[idx] = {
+            .v0 = a,
+            .edge1 = b - a,
+            .edge2 = c - a,
+        };
+    }
+}
+
+
+void
+meshbvh::destroy(Bvh *bvh)
+{
+    if (bvh->memory_pool.memory) {
+        memory::destroy_memory_pool(&bvh->memory_pool);
+    }
+    *bvh = {};
+}
+
+
+/*!
+    Finds the nearest triangle `ray` hits within `max_distance`. Triangles
+    are hit from either side. We always go into the nearer child first, so
+    that once we've hit something, we can skip everything behind it.
+*/
+meshbvh::RayHit
+meshbvh::intersect_ray(Bvh *bvh, spatial::Ray *ray, f32 max_distance)
+{
+    RayHit result = {};
+    if (bvh->n_nodes == 0) {
+        return result;
+    }
+
+    // Rays parallel to an axis would divide by zero, and get infinities, which
+    // turn into NaNs in the slab test if the ray starts right on a slab.
+    v3 inv_direction;
+    range (0, 3) {
+        inv_direction[idx] = (ray->direction[idx] == 0.0f) ?
+            FLT_MAX : 1.0f / ray->direction[idx];
+    }
+
+    f32 nearest_distance = max_distance;
+    u32 stack[MAX_DEPTH + 1];
+    u32 n_stack = 0;
+    Node *node = &bvh->nodes[0];
+    if (intersect_node_ray(node, ray->origin, inv_direction, nearest_distance) == FLT_MAX) {
+        return result;
+    }
+
+    while (true) {
+        if (node->n_triangles > 0) {
+            range (node->idx_first, node->idx_first + node->n_triangles) {
+                f32 distance;
+                v2 barycentrics;
+                if (intersect_triangle_ray(&bvh->triangles[idx], ray->origin, ray->direction,
+                    nearest_distance, &distance, &barycentrics)
+                ) {
+                    nearest_distance = distance;
+                    result = {
+                        .did_hit = true,
+                        .distance = distance,
+                        .idx_triangle = bvh->triangle_idxs[idx],
+                        .barycentrics = barycentrics,
+                    };
+                }
+            }
+        } else {
+            Node *near_child = &bvh->nodes[node->idx_first];
+            Node *far_child = near_child + 1;
+            f32 near_distance = intersect_node_ray(near_child, ray->origin, inv_direction,
+                nearest_distance);
+            f32 far_distance = intersect_node_ray(far_child, ray->origin, inv_direction,
+                nearest_distance);
+            if (far_distance < near_distance) {
+                Node *temp_child = near_child;
+                near_child = far_child;
+                far_child = temp_child;
+                f32 temp_distance = near_distance;
+                near_distance = far_distance;
+                far_distance = temp_distance;
+            }
+            if (near_distance != FLT_MAX) {
+                if (far_distance != FLT_MAX) {
+                    assert(n_stack < MAX_DEPTH + 1);
+                    stack[n_stack++] = (u32)(far_child - bvh->nodes);
+                }
+                node = near_child;
+                continue;
+            }
+        }
+
+        // Go back to the nearest child we skipped that could still have
+        // something in it nearer than what we've already hit.
+        node = nullptr;
+        while (n_stack > 0) {
+            Node *skipped_child = &bvh->nodes[stack[--n_stack]];
+            if (
+                intersect_node_ray(skipped_child, ray->origin, inv_direction,
+                    nearest_distance) != FLT_MAX
+            ) {
+                node = skipped_child;
+                break;
+            }
+        }
+        if (!node) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+/*!
+    Finds the nearest triangle of any drawable entity's mesh that `ray` hits
+    within `max_distance`, for things like selecting entities by clicking on
+    them. Meshes are tested in their bind pose, so animated meshes might not
+    line up exactly. For models with more than one mesh, `entity_handle` is
+    the child entity whose mesh was hit, whose parent is the model's entity.
+*/
+meshbvh::PickResult
+meshbvh::pick(spatial::Ray *ray, f32 max_distance)
+{
+    PickResult result = {};
+    f32 nearest_distance = max_distance;
+    spatial::ModelMatrixCache cache = {};
+
+    each (drawable_component, *drawable::get_components()) {
+        if (!drawable::is_component_valid(drawable_component)) {
+            continue;
+        }
+        Bvh *bvh = drawable::get_mesh_bvh(drawable_component->mesh_handle);
+        if (bvh->n_nodes == 0) {
+            continue;
+        }
+        spatial::Component *spatial_component =
+            spatial::get_component(drawable_component->entity_handle);
+        if (!spatial::is_spatial_component_valid(spatial_component)) {
+            continue;
+        }
+
+        // Most drawables are nowhere near the ray, so check the mesh's bounds
+        // in world space before going to the trouble of inverting the model
+        // matrix and going into the tree.
+        m4 model_matrix = spatial::make_model_matrix(spatial_component, &cache);
+        spatial::Aabb world_aabb = spatial::transform_aabb(&bvh->nodes[0].aabb, &model_matrix);
+        if (!spatial::intersect_aabb_ray(&world_aabb, ray, nearest_distance)) {
+            continue;
+        }
+
+        // We don't normalize the direction, so that distances along the ray
+        // in model space are the same as in world space.
+        m4 inverse_model_matrix = inverse(model_matrix);
+        spatial::Ray model_ray = {
+            .origin = v3(inverse_model_matrix * v4(ray->origin, 1.0f)),
+            .direction = m3(inverse_model_matrix) * ray->direction,
+        };
+        RayHit hit = intersect_ray(bvh, &model_ray, nearest_distance);
+        if (!hit.did_hit) {
+            continue;
+        }
+        nearest_distance = hit.distance;
+        result = {
+            .did_hit = true,
+            .distance = hit.distance,
+            .entity_handle = drawable_component->entity_handle,
+            .idx_triangle = hit.idx_triangle,
+            .barycentrics = hit.barycentrics,
+            .position = ray->origin + ray->direction * hit.distance,
+        };
+    }
+
+    return result;
+}
+
+
+void
+meshbvh::update_node_bounds(Node *node, BuildTriangle *build_triangles)
+{
+    node->aabb = {
+        .min = v3(FLT_MAX),
+        .max = v3(-FLT_MAX),
+    };
+    range (node->idx_first, node->idx_first + node->n_triangles) {
+        node->aabb = spatial::merge_aabbs(&node->aabb, &build_triangles[idx].aabb);
+    }
+}
+
+
+/*!
+    Finds the split of `node`'s triangles with the lowest surface area
+    heuristic cost, by sorting their centroids into `N_BINS` bins along each
+    axis, and trying a split between each pair of bins. Returns false if no
+    split is cheaper than leaving `node` as a leaf.
+*/
+bool
+meshbvh::find_best_split(
+    Node *node,
+    BuildTriangle *build_triangles,
+    u32 *split_axis,
+    f32 *split_position
+) {
+    u32 idx_end = node->idx_first + node->n_triangles;
+    f32 node_area = spatial::get_aabb_surface_area(&node->aabb);
+    f32 best_cost = (f32)node->n_triangles * node_area;
+    bool did_find_split = false;
+
+    spatial::Aabb centroid_bounds = {
+        .min = v3(FLT_MAX),
+        .max = v3(-FLT_MAX),
+    };
+    range (node->idx_first, idx_end) {
+        centroid_bounds.min = min(centroid_bounds.min, build_triangles[idx].centroid);
+        centroid_bounds.max = max(centroid_bounds.max, build_triangles[idx].centroid);
+    }
+    v3 extent = centroid_bounds.max - centroid_bounds.min;
+
+    // We bin along all three axes at once, so we only go through the
+    // triangles once.
+    Bin bins[3][N_BINS];
+    v3 bin_scale;
+    range_named (axis, 0, 3) {
+        bin_scale[axis] = (extent[axis] > 0.0f) ? (f32)N_BINS / extent[axis] : 0.0f;
+        range (0, N_BINS) {
+            bins[axis][idx] = {
+                .aabb = { .min = v3(FLT_MAX), .max = v3(-FLT_MAX) },
+                .n_triangles = 0,
+            };
+        }
+    }
+    range (node->idx_first, idx_end) {
+        BuildTriangle *build_triangle = &build_triangles[idx];
+        range_named (axis, 0, 3) {
+            u32 idx_bin = min(N_BINS - 1,
+                (u32)((build_triangle->centroid[axis] - centroid_bounds.min[axis]) *
+                    bin_scale[axis]));
+            Bin *bin = &bins[axis][idx_bin];
+            bin->aabb = spatial::merge_aabbs(&bin->aabb, &build_triangle->aabb);
+            bin->n_triangles++;
+        }
+    }
+
+    range_named (axis, 0, 3) {
+        if (extent[axis] <= 0.0f) {
+            continue;
+        }
+
+        // The cost of splitting after bin `i` depends on everything in the
+        // bins up to `i`, and everything after it, so we sweep from both
+        // ends once, instead of going through the bins for every split.
+        f32 left_costs[N_BINS - 1];
+        f32 right_costs[N_BINS - 1];
+        u32 left_counts[N_BINS - 1];
+        u32 right_counts[N_BINS - 1];
+        spatial::Aabb left_aabb = { .min = v3(FLT_MAX), .max = v3(-FLT_MAX) };
+        spatial::Aabb right_aabb = { .min = v3(FLT_MAX), .max = v3(-FLT_MAX) };
+        u32 n_left = 0;
+        u32 n_right = 0;
+        range (0, N_BINS - 1) {
+            left_aabb = spatial::merge_aabbs(&left_aabb, &bins[axis][idx].aabb);
+            n_left += bins[axis][idx].n_triangles;
+            left_counts[idx] = n_left;
+            // Empty AABBs have infinite areas, which we'd rather not compute
+            left_costs[idx] = (n_left > 0) ?
+                (f32)n_left * spatial::get_aabb_surface_area(&left_aabb) : 0.0f;
+
+            u32 idx_right = N_BINS - 1 - idx;
+            right_aabb = spatial::merge_aabbs(&right_aabb, &bins[axis][idx_right].aabb);
+            n_right += bins[axis][idx_right].n_triangles;
+            right_counts[idx_right - 1] = n_right;
+            right_costs[idx_right - 1] = (n_right > 0) ?
+                (f32)n_right * spatial::get_aabb_surface_area(&right_aabb) : 0.0f;
+        }
+
+        range (0, N_BINS - 1) {
+            if (left_counts[idx] == 0 || right_counts[idx] == 0) {
+                continue;
+            }
+            f32 cost = NODE_COST * node_area + left_costs[idx] + right_costs[idx];
+            if (cost < best_cost) {
+                best_cost = cost;
+                *split_axis = axis;
+                *split_position = centroid_bounds.min[axis] + (f32)(idx + 1) / bin_scale[axis];
+                did_find_split = true;
+            }
+        }
+    }
+
+    return did_find_split;
+}
+
+
+/*!
+    Slab test. Returns the distance at which the ray enters the node's AABB,
+    which is 0 if it starts inside it, or FLT_MAX if it misses it, or only
+    gets to it after `max_distance`.
+*/
+f32
+meshbvh::intersect_node_ray(Node *node, v3 origin, v3 inv_direction, f32 max_distance)
+{
+    v3 t0 = (node->aabb.min - origin) * inv_direction;
+    v3 t1 = (node->aabb.max - origin) * inv_direction;
+    v3 t_near = min(t0, t1);
+    v3 t_far = max(t0, t1);
+    f32 t_enter = max(max(max(t_near.x, t_near.y), t_near.z), 0.0f);
+    f32 t_exit = min(min(min(t_far.x, t_far.y), t_far.z), max_distance);
+    if (t_enter > t_exit) {
+        return FLT_MAX;
+    }
+    return t_enter;
+}
+
+
+/*!
+    Moller-Trumbore. Returns whether the ray hits `triangle` from either side
+    at a distance of more than 0, and less than `max_distance`.
+*/
+bool
+meshbvh::intersect_triangle_ray(
+    Triangle *triangle,
+    v3 origin,
+    v3 direction,
+    f32 max_distance,
+    f32 *distance,
+    v2 *barycentrics
+) {
+    v3 p = cross(direction, triangle->edge2);
+    f32 determinant = dot(triangle->edge1, p);
+    // The ray is parallel to the triangle
+    if (abs(determinant) < 1.0e-12f) {
+        return false;
+    }
+    f32 inv_determinant = 1.0f / determinant;
+    v3 s = origin - triangle->v0;
+    f32 u = dot(s, p) * inv_determinant;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    v3 q = cross(s, triangle->edge1);
+    f32 v = dot(direction, q) * inv_determinant;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    f32 t = dot(triangle->edge2, q) * inv_determinant;
+    if (t <= 0.0f || t >= max_distance) {
+        return false;
+    }
+    *distance = t;
+    *barycentrics = v2(u, v);
+    return true;
+}
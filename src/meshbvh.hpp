@@ -0,0 +1,129 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "memory.hpp"
+#include "entities.hpp"
+#include "spatial.hpp"
+#include "geom.hpp"
+
+/*!
+    A static bounding volume hierarchy over a mesh's triangles, so that we can
+    find exactly which triangle a ray hits without testing every one of them.
+
+    We build one for each mesh when we load it, and every entity using that
+    mesh shares it. Rays are transformed into the mesh's model space, rather
+    than the other way around, so that we never have to touch the triangles
+    to place them in the world.
+
+    The tree is built once, using the surface area heuristic with binning,
+    and stored as a flat array of nodes, where the two children of a node are
+    always next to each other. The triangles are stored in the order their
+    leaves reference them, already set up for the ray test, so that a leaf's
+    triangles are next to each other in memory too.
+
+    Resources
+    ---------
+    This is heavily based on Jacco Bikker's "How to build a BVH" series.
+
+    jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics
+*/
+class meshbvh {
+public:
+    static constexpr u32 N_BINS = 8;
+    static constexpr u32 MAX_DEPTH = 64;
+    // How much going into a node costs, compared to testing a triangle, for
+    // the surface area heuristic. This stops us from splitting nodes with
+    // only a couple of triangles in them.
+    static constexpr f32 NODE_COST = 1.0f;
+
+    // For leaves, `idx_first` is the index of the leaf's first triangle. For
+    // other nodes, it's the index of the left child, and the right child comes
+    // right after it.
+    struct Node {
+        spatial::Aabb aabb;
+        u32 idx_first;
+        // 0 for nodes that aren't leaves
+        u32 n_triangles;
+    };
+
+    struct Triangle {
+        v3 v0;
+        v3 edge1;
+        v3 edge2;
+    };
+
+    // Meshes we haven't built a tree for, like ones that aren't made of
+    // triangles, have no nodes and no triangles, so rays never hit them.
+    struct Bvh {
+        memory::Pool memory_pool;
+        Node *nodes;
+        Triangle *triangles;
+        // The index of each of `triangles` in the mesh's original index data
+        u32 *triangle_idxs;
+        u32 n_nodes;
+        u32 n_triangles;
+    };
+
+    // `barycentrics` are the weights of the triangle's second and third
+    // vertices, so the hit is at v0 + u * (v1 - v0) + v * (v2 - v0).
+    struct RayHit {
+        bool did_hit;
+        f32 distance;
+        u32 idx_triangle;
+        v2 barycentrics;
+    };
+
+    struct PickResult {
+        bool did_hit;
+        f32 distance;
+        entities::Handle entity_handle;
+        u32 idx_triangle;
+        v2 barycentrics;
+        v3 position;
+    };
+
+    static void build(
+        Bvh *bvh,
+        memory::Pool *temp_memory_pool,
+        geom::Vertex const *vertices,
+        u32 const *indices,
+        u32 n_indices
+    );
+    static void destroy(Bvh *bvh);
+    static RayHit intersect_ray(Bvh *bvh, spatial::Ray *ray, f32 max_distance);
+    static PickResult pick(spatial::Ray *ray, f32 max_distance);
+
+private:
+    struct Bin {
+        spatial::Aabb aabb;
+        u32 n_triangles;
+    };
+
+    // What we need to know about each triangle while building the tree. We
+    // partition these themselves, rather than indices into them, so that we
+    // always go through a node's triangles in order.
+    struct BuildTriangle {
+        spatial::Aabb aabb;
+        v3 centroid;
+        u32 idx_triangle;
+    };
+
+    static void update_node_bounds(Node *node, BuildTriangle *build_triangles);
+    static bool find_best_split(
+        Node *node,
+        BuildTriangle *build_triangles,
+        u32 *split_axis,
+        f32 *split_position
+    );
+    static f32 intersect_node_ray(Node *node, v3 origin, v3 inv_direction, f32 max_distance);
+    static bool intersect_triangle_ray(
+        Triangle *triangle,
+        v3 origin,
+        v3 direction,
+        f32 max_distance,
+        f32 *distance,
+        v2 *barycentrics
+    );
+};
@@ -32,9 +32,11 @@ models::prepare_model_loader_and_check_if_done(ModelLoader *model_loader) {
 
     if (model_loader->state == ModelLoaderState::mesh_data_loaded) {
         for (u32 idx = 0; idx < model_loader->n_meshes; idx++) {
-            geom::Mesh *mesh = &model_loader->meshes[idx];
-            geom::setup_mesh_vertex_buffers(mesh, mesh->vertices, mesh->n_vertices, mesh->indices, mesh->n_indices);
-            memory::destroy_memory_pool(&mesh->temp_memory_pool);
+            MeshData *mesh_data = &model_loader->meshes[idx];
+            upload_mesh(mesh_data, mesh_data->vertices, mesh_data->indices);
+            memory::destroy_memory_pool(&mesh_data->temp_memory_pool);
+            mesh_data->vertices = nullptr;
+            mesh_data->indices = nullptr;
         }
         model_loader->state = ModelLoaderState::vertex_buffers_set_up;
     }
@@ -43,8 +45,8 @@ models::prepare_model_loader_and_check_if_done(ModelLoader *model_loader) {
         // Set material names for each mesh
         range_named (idx_material, 0, model_loader->n_material_names) {
             range_named (idx_mesh, 0, model_loader->n_meshes) {
-                geom::Mesh *mesh = &model_loader->meshes[idx_mesh];
-                u8 mesh_number = pack::get(&mesh->indices_pack, 0);
+                MeshData *mesh_data = &model_loader->meshes[idx_mesh];
+                u8 mesh_number = pack::get(&mesh_data->indices_pack, 0);
                 // For our model's mesh number `mesh_number`, we want to choose
                 // material `idx_mesh` such that `mesh_number == idx_mesh`, i.e.
                 // we choose the 4th material for mesh number 4.
@@ -54,7 +56,7 @@ models::prepare_model_loader_and_check_if_done(ModelLoader *model_loader) {
                     mesh_number == idx_material ||
                     (mesh_number >= model_loader->n_material_names && idx_material == 0)
                 ) {
-                    pstr_copy(mesh->material_name, MAX_COMMON_NAME_LENGTH, model_loader->material_names[idx_material]);
+                    pstr_copy(mesh_data->material_name, MAX_COMMON_NAME_LENGTH, model_loader->material_names[idx_material]);
                 }
             }
         }
@@ -82,38 +84,68 @@ models::prepare_entity_loader_and_check_if_done(
             return false;
         }
 
-        spatial::Component *spatial_component = spatial::get_component(entity_loader->entity_handle);
+        entities::Handle entity_handle = entity_loader->entity_handle;
+
+        spatial::Component *spatial_component = spatial::get_component(entity_handle);
         *spatial_component = entity_loader->spatial_component;
-        spatial_component->entity_handle = entity_loader->entity_handle;
+        spatial_component->entity_handle = entity_handle;
+        if (spatial::is_spatial_component_valid(spatial_component)) {
+            entities::add_to_signature(entity_handle, entities::ComponentType::spatial);
+        }
 
-        lights::Component *light_component = lights::get_component(entity_loader->entity_handle);
+        lights::Component *light_component = lights::get_component(entity_handle);
         *light_component = entity_loader->light_component;
-        light_component->entity_handle = entity_loader->entity_handle;
+        light_component->entity_handle = entity_handle;
+        if (lights::is_light_component_valid(light_component)) {
+            entities::add_to_signature(entity_handle, entities::ComponentType::light);
+        }
 
-        behavior::Component *behavior_component = behavior::get_component(entity_loader->entity_handle);
+        behavior::Component *behavior_component = behavior::get_component(entity_handle);
         *behavior_component = entity_loader->behavior_component;
-        behavior_component->entity_handle = entity_loader->entity_handle;
+        behavior_component->entity_handle = entity_handle;
+        if (behavior::is_behavior_component_valid(behavior_component)) {
+            entities::add_to_signature(entity_handle, entities::ComponentType::behavior);
+        }
 
-        anim::Component *animation_component = anim::get_component(entity_loader->entity_handle);
-        *animation_component = model_loader->animation_component;
-        animation_component->entity_handle = entity_loader->entity_handle;
+        anim::Component *animation_component = anim::get_component(entity_handle);
+        anim::make_component(animation_component, entity_handle, &model_loader->skeleton);
+        if (anim::is_animation_component_valid(animation_component)) {
+            entities::add_to_signature(entity_handle, entities::ComponentType::anim);
+        }
 
-        physics::Component *physics_component = physics::get_component(entity_loader->entity_handle);
+        physics::Component *physics_component = physics::get_component(entity_handle);
         *physics_component = entity_loader->physics_component;
-        physics_component->entity_handle = entity_loader->entity_handle;
+        physics_component->entity_handle = entity_handle;
+        if (!pstr_is_empty(entity_loader->heightmap_path)) {
+            char heightmap_path[MAX_PATH] = {};
+            pstr_vcat(heightmap_path, MAX_PATH, TEXTURE_DIR,
+                entity_loader->heightmap_path, NULL);
+            heightfield::Heightfield *terrain = physics::push_heightfield();
+            if (heightfield::load(terrain, heightmap_path,
+                entity_loader->heightfield_cell_size, entity_loader->heightfield_height_scale)
+            ) {
+                physics::set_heightfield(physics_component, terrain);
+            }
+        }
+        if (physics::is_component_valid(physics_component)) {
+            entities::add_to_signature(entity_handle, entities::ComponentType::physics);
+        }
 
         // drawable::Component
         if (model_loader->n_meshes == 1) {
-            drawable::Component *drawable_component = drawable::get_component(entity_loader->entity_handle);
+            drawable::Component *drawable_component = drawable::get_component(entity_handle);
             assert(drawable_component);
             *drawable_component = {
-                .entity_handle = entity_loader->entity_handle,
-                .mesh = model_loader->meshes[0],
+                .entity_handle = entity_handle,
+                .mesh_handle = model_loader->meshes[0].mesh_handle,
+                .idx_material = mats::get_material_idx_by_name(
+                    model_loader->meshes[0].material_name),
                 .target_render_pass = entity_loader->render_pass,
             };
+            entities::add_to_signature(entity_handle, entities::ComponentType::drawable);
         } else if (model_loader->n_meshes > 1) {
             for (u32 idx = 0; idx < model_loader->n_meshes; idx++) {
-                geom::Mesh *mesh = &model_loader->meshes[idx];
+                MeshData *mesh_data = &model_loader->meshes[idx];
 
                 entities::Entity *child_entity = entities::add_entity_to_set(entity_loader->name);
 
@@ -125,17 +157,22 @@ models::prepare_entity_loader_and_check_if_done(
                         .position = v3(0.0f),
                         .rotation = glm::angleAxis(radians(0.0f), v3(0.0f)),
                         .scale = v3(0.0f),
-                        .parent_entity_handle = entity_loader->entity_handle,
+                        .parent_entity_handle = entity_handle,
                     };
+                    entities::add_to_signature(child_entity->handle,
+                        entities::ComponentType::spatial);
                 }
 
                 drawable::Component *drawable_component = drawable::get_component(child_entity->handle);
                 assert(drawable_component);
                 *drawable_component = {
                     .entity_handle = child_entity->handle,
-                    .mesh = *mesh,
+                    .mesh_handle = mesh_data->mesh_handle,
+                    .idx_material = mats::get_material_idx_by_name(mesh_data->material_name),
                     .target_render_pass = entity_loader->render_pass,
                 };
+                entities::add_to_signature(child_entity->handle,
+                    entities::ComponentType::drawable);
             }
         }
 
@@ -252,28 +289,37 @@ models::find_root_bone(const aiScene *scene)
 
 
 void
-models::add_bone_tree_to_animation_component(
-    anim::Component *animation_component,
+models::add_bone_tree_to_skeleton(
+    anim::Skeleton *skeleton,
     aiNode *node,
     u32 idx_parent
 ) {
-    u32 idx_new_bone = animation_component->n_bones;
-    animation_component->bones[idx_new_bone] = {
+    u32 idx_new_bone = skeleton->n_bones;
+    aiVector3D ai_scale;
+    aiQuaternion ai_rotation;
+    aiVector3D ai_translation;
+    node->mTransformation.Decompose(ai_scale, ai_rotation, ai_translation);
+    skeleton->bones[idx_new_bone] = {
         .idx_parent = idx_parent,
         // NOTE: offset is added later, since we don't have the aiBone at this stage.
+        .rest_transform = {
+            .translation = util::aiVector3D_to_glm(&ai_translation),
+            .rotation = normalize(util::aiQuaternion_to_glm(&ai_rotation)),
+            .scale = util::aiVector3D_to_glm(&ai_scale),
+        },
     };
-    pstr_copy(animation_component->bones[idx_new_bone].name, MAX_NODE_NAME_LENGTH, node->mName.C_Str());
-    animation_component->n_bones++;
+    pstr_copy(skeleton->bones[idx_new_bone].name, MAX_NODE_NAME_LENGTH, node->mName.C_Str());
+    skeleton->n_bones++;
 
     range (0, node->mNumChildren) {
-        add_bone_tree_to_animation_component(animation_component, node->mChildren[idx], idx_new_bone);
+        add_bone_tree_to_skeleton(skeleton, node->mChildren[idx], idx_new_bone);
     }
 }
 
 
 void
 models::load_bones(
-    anim::Component *animation_component,
+    anim::Skeleton *skeleton,
     const aiScene *scene
 ) {
     aiNode *root_bone = find_root_bone(scene);
@@ -286,105 +332,84 @@ models::load_bones(
     // The root will just have its parent marked as itself, to avoid using
     // a -1 index and so on. This is fine, because the root will always be
     // index 0, so we can just disregard the parent if we're on index 0.
-    add_bone_tree_to_animation_component(animation_component, root_bone, 0);
+    add_bone_tree_to_skeleton(skeleton, root_bone, 0);
 }
 
 
 void
 models::load_animations(
-    anim::Component *animation_component,
+    anim::Skeleton *skeleton,
     const aiScene *scene
 ) {
     m4 scene_root_transform = util::aimatrix4x4_to_glm(&scene->mRootNode->mTransformation);
     m4 inverse_scene_root_transform = inverse(scene_root_transform);
 
-    animation_component->n_animations = scene->mNumAnimations;
-    range_named (idx_animation, 0, scene->mNumAnimations) {
-        anim::Animation *animation = &animation_component->animations[idx_animation];
-        aiAnimation *ai_animation = scene->mAnimations[idx_animation];
-
-        *animation = {
-            .duration = ai_animation->mDuration * ai_animation->mTicksPerSecond,
-            .idx_bone_matrix_set = anim::push_to_bone_matrix_pool(),
-        };
-        pstr_copy(animation->name, MAX_NODE_NAME_LENGTH, ai_animation->mName.C_Str());
-
-        // Calculate bone matrices.
-        // NOTE: We do not finalise the bone matrices at this stage!
-        // The matrices in local form are still needed for the children.
-        range_named(idx_bone, 0, animation_component->n_bones) {
-            anim::Bone *bone = &animation_component->bones[idx_bone];
-
-            u32 found_channel_idx = 0;
-            bool did_find_channel = false;
-
-            range_named (idx_channel, 0, ai_animation->mNumChannels) {
-                aiNodeAnim *ai_channel = ai_animation->mChannels[idx_channel];
-                if (pstr_eq(ai_channel->mNodeName.C_Str(), bone->name)) {
-                    found_channel_idx = idx_channel;
-                    did_find_channel = true;
-                    break;
-                }
-            }
+    // The scene root transform is applied on both sides of each bone's global
+    // transform, so we fold the inverse into the bone offsets once here,
+    // rather than doing it for every bone every frame.
+    skeleton->scene_root_transform = scene_root_transform;
+    range_named (idx_bone, 0, skeleton->n_bones) {
+        anim::Bone *bone = &skeleton->bones[idx_bone];
+        bone->offset = bone->offset * inverse_scene_root_transform;
+    }
 
-            if (!did_find_channel) {
-                // No channel for this bone. Maybe it's just not animated. Skip it.
-                continue;
-            }
+    skeleton->n_animations = scene->mNumAnimations;
+    if (skeleton->n_animations > MAX_N_ANIMATIONS) {
+        logs::warning("Model has %u animations, but we can only load %u",
+            skeleton->n_animations, MAX_N_ANIMATIONS);
+        skeleton->n_animations = MAX_N_ANIMATIONS;
+    }
+    range_named (idx_animation, 0, skeleton->n_animations) {
+        anim::make_animation(skeleton,
+            &skeleton->animations[idx_animation],
+            scene->mAnimations[idx_animation]);
+    }
+}
 
-            anim::make_bone_matrices_for_animation_bone(animation_component,
-                ai_animation->mChannels[found_channel_idx],
-                idx_animation, idx_bone);
-        }
 
-        // Finalise bone matrices.
-        // NOTE: Now that we've calculated all the bone matrices for this
-        // animation, we can finalise them.
-        range_named(idx_bone, 0, animation_component->n_bones) {
-            anim::Bone *bone = &animation_component->bones[idx_bone];
-
-            range_named (idx_anim_key, 0, bone->n_anim_keys) {
-                // #slow: We could avoid this multiplication here.
-                m4 *bone_matrix = anim::get_bone_matrix(animation->idx_bone_matrix_set,
-                    idx_bone, idx_anim_key);
-
-                *bone_matrix =
-                    scene_root_transform *
-                    *bone_matrix *
-                    bone->offset *
-                    inverse_scene_root_transform;
-            }
-        }
-    }
+void
+models::upload_mesh(
+    MeshData *mesh_data,
+    geom::Vertex *vertex_data,
+    u32 *index_data
+) {
+    geom::Mesh mesh = {
+        .mode = mesh_data->mode,
+        .n_vertices = mesh_data->n_vertices,
+        .n_indices = mesh_data->n_indices,
+    };
+    geom::setup_mesh_vertex_buffers(&mesh, vertex_data, mesh.n_vertices, index_data, mesh.n_indices);
+    mesh_data->mesh_handle = drawable::push_mesh(mesh, &mesh_data->bvh);
+    mesh_data->bvh = {};
 }
 
 
 void
 models::load_mesh(
-    geom::Mesh *mesh,
+    MeshData *mesh_data,
     aiMesh *ai_mesh,
     const aiScene *scene,
     ModelLoader *model_loader,
     m4 transform,
     pack::Pack indices_pack
 ) {
-    mesh->transform = transform;
+    mesh_data->transform = transform;
     m3 normal_matrix = m3(transpose(inverse(transform)));
-    mesh->mode = GL_TRIANGLES;
+    mesh_data->mode = GL_TRIANGLES;
 
-    mesh->indices_pack = indices_pack;
+    mesh_data->indices_pack = indices_pack;
 
     // Vertices
     if (!ai_mesh->mNormals) {
         logs::warning("Model does not have normals.");
     }
 
-    mesh->n_vertices = ai_mesh->mNumVertices;
-    mesh->vertices = (geom::Vertex*)memory::push(&mesh->temp_memory_pool,
-        mesh->n_vertices * sizeof(geom::Vertex), "mesh_vertices");
+    mesh_data->n_vertices = ai_mesh->mNumVertices;
+    mesh_data->vertices = (geom::Vertex*)memory::push(&mesh_data->temp_memory_pool,
+        mesh_data->n_vertices * sizeof(geom::Vertex), "mesh_vertices");
 
     for (u32 idx = 0; idx < ai_mesh->mNumVertices; idx++) {
-        geom::Vertex *vertex = &mesh->vertices[idx];
+        geom::Vertex *vertex = &mesh_data->vertices[idx];
         *vertex = {};
 
         v4 raw_vertex_pos = v4(
@@ -392,7 +417,7 @@ models::load_mesh(
             ai_mesh->mVertices[idx].y,
             ai_mesh->mVertices[idx].z,
             1.0f);
-        vertex->position = v3(mesh->transform * raw_vertex_pos);
+        vertex->position = v3(mesh_data->transform * raw_vertex_pos);
 
         v3 raw_vertex_normal = v3(
             ai_mesh->mNormals[idx].x,
@@ -412,9 +437,9 @@ models::load_mesh(
         n_indices += face.mNumIndices;
     }
 
-    mesh->n_indices = n_indices;
-    mesh->indices = (u32*)memory::push(&mesh->temp_memory_pool,
-        mesh->n_indices * sizeof(u32), "mesh_indices");
+    mesh_data->n_indices = n_indices;
+    mesh_data->indices = (u32*)memory::push(&mesh_data->temp_memory_pool,
+        mesh_data->n_indices * sizeof(u32), "mesh_indices");
     u32 idx_index = 0;
 
     for (u32 idx_face = 0; idx_face < ai_mesh->mNumFaces; idx_face++) {
@@ -424,24 +449,29 @@ models::load_mesh(
             idx_face_index < face.mNumIndices;
             idx_face_index++
         ) {
-            mesh->indices[idx_index++] = face.mIndices[idx_face_index];
+            mesh_data->indices[idx_index++] = face.mIndices[idx_face_index];
         }
     }
 
+    // The BVH only needs the vertices' positions, so we can build it now,
+    // while we're still off the main thread.
+    meshbvh::build(&mesh_data->bvh, &mesh_data->temp_memory_pool,
+        mesh_data->vertices, mesh_data->indices, mesh_data->n_indices);
+
     // Bones
     assert(ai_mesh->mNumBones < MAX_N_BONES);
-    anim::Component *animation_component = &model_loader->animation_component;
+    anim::Skeleton *skeleton = &model_loader->skeleton;
     range_named (idx_bone, 0, ai_mesh->mNumBones) {
         aiBone *ai_bone = ai_mesh->mBones[idx_bone];
         u32 idx_found_bone = 0;
         bool did_find_bone = false;
 
-        range_named (idx_animcomp_bone, 0, animation_component->n_bones) {
+        range_named (idx_skeleton_bone, 0, skeleton->n_bones) {
             if (pstr_eq(
-                animation_component->bones[idx_animcomp_bone].name, ai_bone->mName.C_Str()
+                skeleton->bones[idx_skeleton_bone].name, ai_bone->mName.C_Str()
             )) {
                 did_find_bone = true;
-                idx_found_bone = idx_animcomp_bone;
+                idx_found_bone = idx_skeleton_bone;
                 break;
             }
         }
@@ -452,18 +482,18 @@ models::load_mesh(
         // bothered to add some mechanism to check if we already set it, it would
         // just make things more complicated. We set it multiple times, whatever.
         // It's the same value anyway.
-        animation_component->bones[idx_found_bone].offset =
+        skeleton->bones[idx_found_bone].offset =
             util::aimatrix4x4_to_glm(&ai_bone->mOffsetMatrix);
 
         range_named (idx_weight, 0, ai_bone->mNumWeights) {
             u32 vertex_idx = ai_bone->mWeights[idx_weight].mVertexId;
             f32 weight = ai_bone->mWeights[idx_weight].mWeight;
-            assert(vertex_idx < mesh->n_vertices);
+            assert(vertex_idx < mesh_data->n_vertices);
             range_named (idx_vertex_weight, 0, MAX_N_BONES_PER_VERTEX) {
                 // Put it in the next free space, if there is any.
-                if (mesh->vertices[vertex_idx].bone_weights[idx_vertex_weight] == 0) {
-                    mesh->vertices[vertex_idx].bone_idxs[idx_vertex_weight] = idx_found_bone;
-                    mesh->vertices[vertex_idx].bone_weights[idx_vertex_weight] = weight;
+                if (mesh_data->vertices[vertex_idx].bone_weights[idx_vertex_weight] == 0) {
+                    mesh_data->vertices[vertex_idx].bone_idxs[idx_vertex_weight] = idx_found_bone;
+                    mesh_data->vertices[vertex_idx].bone_weights[idx_vertex_weight] = weight;
                     break;
                 }
             }
@@ -483,9 +513,9 @@ models::load_node(
 
     range (0, node->mNumMeshes) {
         aiMesh *ai_mesh = scene->mMeshes[node->mMeshes[idx]];
-        geom::Mesh *mesh = &model_loader->meshes[model_loader->n_meshes++];
-        *mesh = {};
-        load_mesh(mesh, ai_mesh, scene, model_loader, transform, indices_pack);
+        MeshData *mesh_data = &model_loader->meshes[model_loader->n_meshes++];
+        *mesh_data = {};
+        load_mesh(mesh_data, ai_mesh, scene, model_loader, transform, indices_pack);
     }
 
     range (0, node->mNumChildren) {
@@ -528,10 +558,10 @@ models::load_model_from_file(ModelLoader *model_loader)
         return;
     }
 
-    anim::Component *animation_component = &model_loader->animation_component;
-    load_bones(animation_component, scene);
+    anim::Skeleton *skeleton = &model_loader->skeleton;
+    load_bones(skeleton, scene);
     load_node(model_loader, scene->mRootNode, scene, m4(1.0f), 0ULL);
-    load_animations(animation_component, scene);
+    load_animations(skeleton, scene);
     aiReleaseImport(scene);
 
     model_loader->state = ModelLoaderState::mesh_data_loaded;
@@ -577,15 +607,15 @@ models::load_model_from_data(ModelLoader *model_loader)
         logs::fatal("Could not find builtin model: %s", model_loader->model_path);
     }
 
-    geom::Mesh *mesh = &model_loader->meshes[model_loader->n_meshes++];
-    *mesh = {};
-    mesh->transform = m4(1.0f);
-    mesh->mode = mode;
-    mesh->n_vertices = n_vertices;
-    mesh->n_indices = n_indices;
-    mesh->indices_pack = 0UL;
+    MeshData *mesh_data = &model_loader->meshes[model_loader->n_meshes++];
+    *mesh_data = {};
+    mesh_data->transform = m4(1.0f);
+    mesh_data->mode = mode;
+    mesh_data->n_vertices = n_vertices;
+    mesh_data->n_indices = n_indices;
+    mesh_data->indices_pack = 0UL;
 
-    geom::setup_mesh_vertex_buffers(mesh, vertex_data, n_vertices, index_data, n_indices);
+    upload_mesh(mesh_data, vertex_data, index_data);
     model_loader->state = ModelLoaderState::vertex_buffers_set_up;
 
     memory::destroy_memory_pool(&temp_memory_pool);
@@ -31,6 +31,25 @@ public:
         complete
     };
 
+    // Everything about a mesh that we only need while loading it. Once the
+    // mesh is on the GPU, we only keep its `geom::Mesh`, in the drawable
+    // mesh registry.
+    struct MeshData {
+        memory::Pool temp_memory_pool;
+        m4 transform;
+        char material_name[MAX_COMMON_NAME_LENGTH];
+        pack::Pack indices_pack;
+        GLenum mode;
+        geom::Vertex *vertices;
+        u32 *indices;
+        u32 n_vertices;
+        u32 n_indices;
+        // Built along with the vertex data, then handed over to the mesh
+        // registry when we upload the mesh
+        meshbvh::Bvh bvh;
+        drawable::MeshHandle mesh_handle;
+    };
+
     struct ModelLoader {
         // These from from the file
         char model_path[MAX_PATH];
@@ -38,9 +57,9 @@ public:
         u32 n_material_names;
 
         // These are created later
-        geom::Mesh meshes[MAX_N_MESHES];
+        MeshData meshes[MAX_N_MESHES];
         u32 n_meshes;
-        anim::Component animation_component;
+        anim::Skeleton skeleton;
         ModelLoaderState state;
     };
 
@@ -60,6 +79,11 @@ public:
         lights::Component light_component;
         behavior::Component behavior_component;
         physics::Component physics_component;
+        // If this is set, the physics component gets a heightfield made from
+        // this image, in `TEXTURE_DIR`.
+        char heightmap_path[MAX_PATH];
+        f32 heightfield_cell_size;
+        f32 heightfield_height_scale;
     };
 
 #include "models_data.hpp"
@@ -90,21 +114,26 @@ public:
 private:
     static bool is_bone_only_node(aiNode *node);
     static aiNode * find_root_bone(const aiScene *scene);
-    static void add_bone_tree_to_animation_component(
-        anim::Component *animation_component,
+    static void add_bone_tree_to_skeleton(
+        anim::Skeleton *skeleton,
         aiNode *node,
         u32 idx_parent
     );
     static void load_bones(
-        anim::Component *animation_component,
+        anim::Skeleton *skeleton,
         const aiScene *scene
     );
     static void load_animations(
-        anim::Component *animation_component,
+        anim::Skeleton *skeleton,
         const aiScene *scene
     );
+    static void upload_mesh(
+        MeshData *mesh_data,
+        geom::Vertex *vertex_data,
+        u32 *index_data
+    );
     static void load_mesh(
-        geom::Mesh *mesh,
+        MeshData *mesh_data,
         aiMesh *ai_mesh,
         const aiScene *scene,
         ModelLoader *model_loader,
@@ -56,6 +56,21 @@ peony_parser_utils::get_vec4(peony_parser::Prop *prop)
 }
 
 
+/*!
+    Combines a list of `physics::Layer` names, such as `[world, prop]`, into
+    bit flags.
+*/
+u32
+peony_parser_utils::get_layers(peony_parser::Prop *prop)
+{
+    u32 layers = 0;
+    range (0, prop->n_values) {
+        layers |= (u32)physics::layer_from_string(prop->values[idx].string_value);
+    }
+    return layers;
+}
+
+
 peony_parser::Prop *
 peony_parser_utils::find_prop(peony_parser::Entry *entry, char const *name)
 {
@@ -242,6 +257,10 @@ peony_parser_utils::create_entity_loader_from_peony_file_entry(
         render_pass, entity_handle);
 
     // Build physics::Component, spatial::Component, lights::Component, behavior::Component
+    entity_loader->physics_component.layers = physics::DEFAULT_LAYERS;
+    entity_loader->physics_component.layer_mask = physics::DEFAULT_LAYER_MASK;
+    entity_loader->heightfield_cell_size = 1.0f;
+    entity_loader->heightfield_height_scale = 1.0f;
     range (0, entry->n_props) {
         peony_parser::Prop *prop = &entry->props[idx];
         if (pstr_eq(prop->name, "physics_component.obb.center")) {
@@ -252,6 +271,26 @@ peony_parser_utils::create_entity_loader_from_peony_file_entry(
             entity_loader->physics_component.obb.y_axis = *get_vec3(prop);
         } else if (pstr_eq(prop->name, "physics_component.obb.extents")) {
             entity_loader->physics_component.obb.extents = *get_vec3(prop);
+        } else if (pstr_eq(prop->name, "physics_component.layers")) {
+            entity_loader->physics_component.layers = get_layers(prop);
+        } else if (pstr_eq(prop->name, "physics_component.layer_mask")) {
+            entity_loader->physics_component.layer_mask = get_layers(prop);
+        } else if (pstr_eq(prop->name, "physics_component.mass")) {
+            entity_loader->physics_component.mass = *get_number(prop);
+        } else if (pstr_eq(prop->name, "physics_component.velocity")) {
+            entity_loader->physics_component.velocity = *get_vec3(prop);
+        } else if (pstr_eq(prop->name, "physics_component.is_static")) {
+            entity_loader->physics_component.is_static = *get_boolean(prop);
+        } else if (pstr_eq(prop->name, "physics_component.is_ccd_enabled")) {
+            entity_loader->physics_component.is_ccd_enabled = *get_boolean(prop);
+        } else if (pstr_eq(prop->name, "physics_component.is_trigger")) {
+            entity_loader->physics_component.is_trigger = *get_boolean(prop);
+        } else if (pstr_eq(prop->name, "physics_component.heightfield.heightmap")) {
+            pstr_copy(entity_loader->heightmap_path, MAX_PATH, get_string(prop));
+        } else if (pstr_eq(prop->name, "physics_component.heightfield.cell_size")) {
+            entity_loader->heightfield_cell_size = *get_number(prop);
+        } else if (pstr_eq(prop->name, "physics_component.heightfield.height_scale")) {
+            entity_loader->heightfield_height_scale = *get_number(prop);
         } else if (pstr_eq(prop->name, "spatial_component.position")) {
             entity_loader->spatial_component.position = *get_vec3(prop);
         } else if (pstr_eq(prop->name, "spatial_component.rotation")) {
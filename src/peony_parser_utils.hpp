@@ -20,6 +20,7 @@ public:
     static v2 * get_vec2(peony_parser::Prop *prop);
     static v3 * get_vec3(peony_parser::Prop *prop);
     static v4 * get_vec4(peony_parser::Prop *prop);
+    static u32 get_layers(peony_parser::Prop *prop);
     static peony_parser::Prop * find_prop(peony_parser::Entry *entry, char const *name);
     static void get_unique_string_values_for_prop_name(
         peony_parser::PeonyFile *pf,
@@ -1,107 +1,1357 @@
 // (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
 
+#include "../src_external/pstr.h"
 #include "logs.hpp"
-#include "gui.hpp"
-#include "debugdraw.hpp"
 #include "physics.hpp"
+#include "tasks.hpp"
+#include "engine.hpp"
+#include "solver.hpp"
 #include "intrinsics.hpp"
 
 
 physics::State *physics::state = nullptr;
 
 
+physics::Layer
+physics::layer_from_string(const char *str)
+{
+    if (pstr_eq(str, "none")) {
+        return physics::Layer::none;
+    } else if (pstr_eq(str, "world")) {
+        return physics::Layer::world;
+    } else if (pstr_eq(str, "character")) {
+        return physics::Layer::character;
+    } else if (pstr_eq(str, "prop")) {
+        return physics::Layer::prop;
+    } else if (pstr_eq(str, "decoration")) {
+        return physics::Layer::decoration;
+    } else if (pstr_eq(str, "trigger")) {
+        return physics::Layer::trigger;
+    } else {
+        logs::fatal("Could not parse physics::Layer: %s", str);
+        return physics::Layer::none;
+    }
+}
+
+
+/*!
+    Two bodies only collide if each one is on one of the layers the other one
+    collides with.
+*/
+bool
+physics::should_layers_collide(Component *a, Component *b)
+{
+    return (a->layers & b->layer_mask) && (b->layers & a->layer_mask);
+}
+
+
+/*!
+    Finds the nearest body on one of `layer_mask`'s layers hit by `ray` within
+    `max_distance`. Every hit we find becomes the new max distance, so we skip
+    any part of the tree that's further away than our best hit so far.
+*/
 physics::RayCollisionResult
-physics::find_ray_collision(
+physics::closest_hit(
     spatial::Ray *ray,
-    // TODO: Replace this with some kind of collision layers.
+    f32 max_distance,
+    u32 layer_mask,
+    physics::Component *physics_component_to_ignore_or_nullptr
+) {
+    RayCollisionResult result = {};
+
+    auto visit_candidate = [&](entities::Handle entity_handle, f32 current_max_distance) -> f32 {
+        physics::Component *candidate = get_component(entity_handle);
+        if (physics_component_to_ignore_or_nullptr == candidate) {
+            return current_max_distance;
+        }
+
+        RaycastResult raycast_result = intersect_component_ray(candidate, ray,
+            current_max_distance);
+        if (
+            !raycast_result.did_intersect ||
+            raycast_result.distance > current_max_distance
+        ) {
+            return current_max_distance;
+        }
+        result = {
+            .did_intersect = true,
+            .distance = raycast_result.distance,
+            .collidee = candidate,
+        };
+        // Returning 0 stops the search, which is fine, because nothing can
+        // be nearer than a hit at 0.
+        return raycast_result.distance;
+    };
+
+    // The second tree only has to look as far as our hit in the first one.
+    aabbtree::cast_ray(&physics::state->static_tree, ray, max_distance, layer_mask,
+        visit_candidate);
+    if (result.did_intersect) {
+        if (result.distance == 0.0f) {
+            return result;
+        }
+        max_distance = result.distance;
+    }
+    aabbtree::cast_ray(&physics::state->tree, ray, max_distance, layer_mask,
+        visit_candidate);
+
+    return result;
+}
+
+
+/*!
+    Returns whether `ray` hits anything on one of `layer_mask`'s layers within
+    `max_distance`, stopping at the first hit. This is the cheapest query, so
+    use it for line-of-sight and occlusion checks, where we don't care what
+    we hit.
+*/
+bool
+physics::any_hit(
+    spatial::Ray *ray,
+    f32 max_distance,
+    u32 layer_mask,
+    physics::Component *physics_component_to_ignore_or_nullptr
+) {
+    bool did_hit = false;
+
+    auto visit_candidate = [&](entities::Handle entity_handle) -> bool {
+        physics::Component *candidate = get_component(entity_handle);
+        if (physics_component_to_ignore_or_nullptr == candidate) {
+            return true;
+        }
+
+        RaycastResult raycast_result = intersect_component_ray(candidate, ray, max_distance);
+        if (raycast_result.did_intersect && raycast_result.distance <= max_distance) {
+            did_hit = true;
+            return false;
+        }
+        return true;
+    };
+
+    aabbtree::query_ray(&physics::state->static_tree, ray, max_distance, layer_mask,
+        visit_candidate);
+    if (!did_hit) {
+        aabbtree::query_ray(&physics::state->tree, ray, max_distance, layer_mask,
+            visit_candidate);
+    }
+
+    return did_hit;
+}
+
+
+/*!
+    Writes every body on one of `layer_mask`'s layers hit by `ray` within
+    `max_distance` to `hits`, sorted from nearest to furthest, and returns
+    how many were written. If there are more than `max_n_hits` hits, we keep
+    the nearest ones.
+*/
+u32
+physics::all_hits(
+    spatial::Ray *ray,
+    f32 max_distance,
+    u32 layer_mask,
+    physics::Component *physics_component_to_ignore_or_nullptr,
+    RayCollisionResult *hits,
+    u32 max_n_hits
+) {
+    u32 n_hits = 0;
+    if (max_n_hits == 0) {
+        return 0;
+    }
+
+    auto visit_candidate = [&](entities::Handle entity_handle, f32 current_max_distance) -> f32 {
+        physics::Component *candidate = get_component(entity_handle);
+        if (physics_component_to_ignore_or_nullptr == candidate) {
+            return current_max_distance;
+        }
+
+        RaycastResult raycast_result = intersect_component_ray(candidate, ray,
+            current_max_distance);
+        if (
+            !raycast_result.did_intersect ||
+            raycast_result.distance > current_max_distance
+        ) {
+            return current_max_distance;
+        }
+
+        // Insertion sort. If we're full, the furthest hit falls off the end.
+        u32 idx = (n_hits < max_n_hits) ? n_hits++ : max_n_hits - 1;
+        while (idx > 0 && hits[idx - 1].distance > raycast_result.distance) {
+            hits[idx] = hits[idx - 1];
+            idx--;
+        }
+        hits[idx] = {
+            .did_intersect = true,
+            .distance = raycast_result.distance,
+            .collidee = candidate,
+        };
+
+        // Once we're full, there's no point looking further than our
+        // furthest hit. We can't return 0, because that means stop.
+        if (n_hits == max_n_hits) {
+            return max(hits[max_n_hits - 1].distance, FLT_MIN);
+        }
+        return current_max_distance;
+    };
+
+    aabbtree::cast_ray(&physics::state->static_tree, ray, max_distance, layer_mask,
+        visit_candidate);
+    if (n_hits == max_n_hits) {
+        max_distance = max(hits[max_n_hits - 1].distance, FLT_MIN);
+    }
+    aabbtree::cast_ray(&physics::state->tree, ray, max_distance, layer_mask,
+        visit_candidate);
+
+    return n_hits;
+}
+
+
+/*!
+    Finds the first body on one of `layer_mask`'s layers that `obb` hits if it
+    moves by `translation`, without rotating. Bodies that `obb` already
+    overlaps at the start are skipped, since they're the narrowphase's job,
+    and so are triggers, since nothing can hit them.
+*/
+physics::SweepResult
+physics::sweep_obb(
+    spatial::Obb *obb,
+    v3 translation,
+    u32 layer_mask,
     physics::Component *physics_component_to_ignore_or_nullptr
 ) {
-    each (candidate, *get_components()) {
-        if (!is_component_valid(candidate)) {
+    SweepResult result = {};
+
+    spatial::Aabb start_aabb = spatial::make_aabb_from_obb(obb);
+    spatial::Aabb end_aabb = {
+        .min = start_aabb.min + translation,
+        .max = start_aabb.max + translation,
+    };
+    spatial::Aabb swept_aabb = spatial::merge_aabbs(&start_aabb, &end_aabb);
+
+    auto visit_candidate = [&](entities::Handle entity_handle) -> bool {
+        physics::Component *candidate = get_component(entity_handle);
+        if (physics_component_to_ignore_or_nullptr == candidate || candidate->is_trigger) {
+            return true;
+        }
+        TimeOfImpactResult time_of_impact = candidate->terrain ?
+            get_time_of_impact_with_heightfield(obb, translation, candidate) :
+            get_time_of_impact(obb, translation, &candidate->transformed_obb);
+        if (
+            time_of_impact.did_hit &&
+            time_of_impact.time > 0.0f &&
+            (!result.did_hit || time_of_impact.time < result.time)
+        ) {
+            result = {
+                .did_hit = true,
+                .time = time_of_impact.time,
+                .normal = time_of_impact.normal,
+                .collidee = candidate,
+            };
+        }
+        return true;
+    };
+
+    aabbtree::query_aabb(&physics::state->static_tree, &swept_aabb, layer_mask,
+        visit_candidate);
+    aabbtree::query_aabb(&physics::state->tree, &swept_aabb, layer_mask, visit_candidate);
+
+    return result;
+}
+
+
+/*!
+    Finds up to `max_n_manifolds` bodies on one of `layer_mask`'s layers that
+    `obb` overlaps, and writes how it collides with each of them to
+    `manifolds`. Each manifold's normal points from `obb` to the other body,
+    so moving `obb` by `normal * sep_max` separates them. Like
+    `sweep_obb()`, this skips triggers.
+*/
+u32
+physics::find_overlaps(
+    spatial::Obb *obb,
+    u32 layer_mask,
+    physics::Component *physics_component_to_ignore_or_nullptr,
+    CollisionManifold *manifolds,
+    u32 max_n_manifolds
+) {
+    u32 n_manifolds = 0;
+    spatial::Aabb aabb = spatial::make_aabb_from_obb(obb);
+
+    auto visit_candidate = [&](entities::Handle entity_handle) -> bool {
+        if (n_manifolds == max_n_manifolds) {
+            return false;
+        }
+        physics::Component *candidate = get_component(entity_handle);
+        if (physics_component_to_ignore_or_nullptr == candidate || candidate->is_trigger) {
+            return true;
+        }
+        CollisionManifold manifold = candidate->terrain ?
+            intersect_obb_heightfield(obb, candidate) :
+            intersect_obb_obb(obb, &candidate->transformed_obb);
+        if (manifold.did_collide) {
+            manifold.collidee = candidate;
+            manifolds[n_manifolds++] = manifold;
+        }
+        return true;
+    };
+
+    aabbtree::query_aabb(&physics::state->static_tree, &aabb, layer_mask, visit_candidate);
+    aabbtree::query_aabb(&physics::state->tree, &aabb, layer_mask, visit_candidate);
+
+    return n_manifolds;
+}
+
+
+/*!
+    Finds the nearest body on one of `layer_mask`'s layers hit by each of
+    `n_rays` rays, and writes the result for `rays[i]` to `results[i]`. If
+    `handles_to_ignore_or_nullptr` is given, `rays[i]` ignores the body of
+    `handles_to_ignore_or_nullptr[i]`, which is useful if the ray starts
+    inside its own entity.
+
+    Rather than walking the broadphase tree once for every ray, this tests
+    each ray against `simd::WIDTH` OBBs at a time, which is quicker for the
+    number of bodies we usually have, and spreads the rays over our worker
+    threads.
+*/
+void
+physics::raycast_batch(
+    spatial::Ray const *rays,
+    u32 n_rays,
+    u32 layer_mask,
+    entities::Handle const *handles_to_ignore_or_nullptr,
+    RayCollisionResult *results
+) {
+    raycast_obb_packets(&physics::state->obb_packets, &physics::state->components,
+        rays, n_rays, layer_mask, handles_to_ignore_or_nullptr, results);
+}
+
+
+/*!
+    Does the work for `raycast_batch()`, but against any set of packets, which
+    must have been filled from `components`.
+*/
+void
+physics::raycast_obb_packets(
+    Array<ObbPacket> *obb_packets,
+    Array<Component> *components,
+    spatial::Ray const *rays,
+    u32 n_rays,
+    u32 layer_mask,
+    entities::Handle const *handles_to_ignore_or_nullptr,
+    RayCollisionResult *results
+) {
+    RaycastBatchJob job = {
+        .obb_packets = obb_packets,
+        .components = components,
+        .rays = rays,
+        .layer_mask = layer_mask,
+        .handles_to_ignore_or_nullptr = handles_to_ignore_or_nullptr,
+        .results = results,
+    };
+    tasks::parallel_for(n_rays, RAYCAST_BATCH_SIZE, run_raycast_batch_job, &job);
+}
+
+
+/*!
+    Copies the transformed OBB of every valid component into `obb_packets`,
+    `simd::WIDTH` at a time.
+*/
+void
+physics::fill_obb_packets(Array<ObbPacket> *obb_packets, Array<Component> *components)
+{
+    if (obb_packets->length > 0) {
+        obb_packets->delete_elements_after_index(0);
+    }
+
+    ObbPacket *packet = nullptr;
+    each (component, *components) {
+        if (
+            component->entity_handle == entities::NO_ENTITY_HANDLE ||
+            !is_component_valid(component)
+        ) {
+            continue;
+        }
+        push_obb(obb_packets, &packet, component);
+    }
+}
+
+
+/*!
+    Brings the broadphase and contacts up to date with whatever moved this
+    frame, then moves every dynamic body that's awake forward by however many
+    of the solver's fixed steps fit into the time that's passed. We find
+    contacts again after each step, so that the next step, and anything that
+    looks at `get_contacts()`, sees where bodies are now. Finally, we compare
+    what's overlapping each trigger to what was last frame.
+*/
+void
+physics::update()
+{
+    wake_moved_bodies();
+    update_changed_bodies();
+    update_body_lists();
+    if (
+        entities::get_changed_handles(entities::ComponentType::spatial)->length > 0 ||
+        entities::get_changed_handles(entities::ComponentType::physics)->length > 0
+    ) {
+        update_obb_packets();
+        find_contacts();
+    }
+
+    // If we've fallen behind by more than a few steps, we drop the extra
+    // time, so the solver can't take up more than a fixed part of a frame.
+    physics::state->time_accumulator += (f32)engine::get_dt();
+    u32 n_steps = (u32)(physics::state->time_accumulator / solver::FIXED_TIMESTEP);
+    physics::state->time_accumulator -= (f32)n_steps * solver::FIXED_TIMESTEP;
+    n_steps = min(n_steps, solver::MAX_N_STEPS_PER_FRAME);
+
+    solver::World world = {
+        .components = &physics::state->components,
+        .spatial_components = spatial::get_components(),
+        .contacts = &physics::state->contacts,
+        .body_handles = &physics::state->awake_bodies,
+    };
+    bool did_step = false;
+    range (0, n_steps) {
+        world.pair_cache = get_pair_cache();
+        start_ccd();
+        if (!solver::step(solver::get_solver(), &world, solver::FIXED_TIMESTEP)) {
+            break;
+        }
+        did_step = true;
+        each (entity_handle, physics::state->awake_bodies) {
+            if (is_component_dynamic(get_component(*entity_handle))) {
+                entities::mark_changed(*entity_handle, entities::ComponentType::spatial);
+            }
+        }
+        update_changed_bodies();
+        run_ccd();
+        update_sleep(solver::FIXED_TIMESTEP);
+        find_contacts();
+    }
+    if (did_step) {
+        update_obb_packets();
+    }
+    update_trigger_events();
+}
+
+
+/*!
+    Returns every pair of bodies that collided, as of the last
+    `physics::update()`. Each pair is only in here once.
+*/
+Array<physics::Contact> *
+physics::get_contacts()
+{
+    return &physics::state->contacts;
+}
+
+
+/*!
+    Returns what entered, stayed in, or left each trigger in the last
+    `physics::update()`. Bodies that enter and leave a trigger within the
+    same frame don't show up.
+*/
+Array<physics::TriggerEvent> *
+physics::get_trigger_events()
+{
+    return &physics::state->trigger_events;
+}
+
+
+Array<physics::Component> *
+physics::get_components()
+{
+    return &physics::state->components;
+}
+
+
+physics::Component *
+physics::get_component(entities::Handle entity_handle)
+{
+    return physics::state->components[entity_handle];
+}
+
+
+/*!
+    The cache filled in by the last `find_contacts()`, which has an entry for
+    every current candidate pair.
+*/
+physics::PairCache *
+physics::get_pair_cache()
+{
+    return &physics::state->pair_caches[physics::state->idx_pair_cache];
+}
+
+
+/*!
+    Wakes a sleeping body up, so that the solver moves it again. Bodies wake
+    up by themselves when they're moved or bumped into, so this is only needed
+    for anything else that should get them moving, like changing their
+    velocity.
+*/
+void
+physics::wake_body(entities::Handle entity_handle)
+{
+    physics::Component *physics_component = get_component(entity_handle);
+    if (!physics_component->is_sleeping) {
+        return;
+    }
+    physics_component->is_sleeping = false;
+    physics_component->sleep_time = 0.0f;
+    physics::state->are_body_lists_stale = true;
+}
+
+
+/*!
+    Adds `component`'s transformed OBB to `*packet`, or to a new packet if
+    there isn't one yet, or it's full.
+*/
+void
+physics::push_obb(Array<ObbPacket> *obb_packets, ObbPacket **packet, Component *component)
+{
+    if (!*packet || (*packet)->n_obbs == simd::WIDTH) {
+        *packet = obb_packets->push();
+        **packet = {};
+    }
+
+    u32 idx_lane = (*packet)->n_obbs;
+    set_obb_packet_lane(*packet, idx_lane, &component->transformed_obb);
+    (*packet)->entity_handles[idx_lane] = component->entity_handle;
+    (*packet)->layers[idx_lane] = component->layers;
+    (*packet)->n_obbs++;
+}
+
+
+/*!
+    Does the same as `fill_obb_packets()`, but we only copy the static bodies'
+    OBBs again if one of them has changed.
+*/
+void
+physics::update_obb_packets()
+{
+    Array<ObbPacket> *obb_packets = &physics::state->obb_packets;
+    ObbPacket *packet = nullptr;
+
+    if (physics::state->are_static_obb_packets_stale) {
+        if (obb_packets->length > 0) {
+            obb_packets->delete_elements_after_index(0);
+        }
+        each (component, physics::state->components) {
+            if (
+                component->entity_handle == entities::NO_ENTITY_HANDLE ||
+                *physics::state->static_tree_leaves[component->entity_handle] ==
+                    aabbtree::NO_NODE
+            ) {
+                continue;
+            }
+            push_obb(obb_packets, &packet, component);
+        }
+        physics::state->n_static_obb_packets = obb_packets->length;
+        physics::state->are_static_obb_packets_stale = false;
+    } else if (obb_packets->length > physics::state->n_static_obb_packets) {
+        obb_packets->delete_elements_after_index(physics::state->n_static_obb_packets);
+    }
+
+    // Start a new packet, so that the static ones stay the same.
+    packet = nullptr;
+    each (entity_handle, physics::state->awake_bodies) {
+        push_obb(obb_packets, &packet, get_component(*entity_handle));
+    }
+    each (entity_handle, physics::state->sleeping_bodies) {
+        push_obb(obb_packets, &packet, get_component(*entity_handle));
+    }
+}
+
+
+/*!
+    The transformed OBB only depends on the spatial and physics components, so
+    we only need to recompute it, and update the broadphase, for entities
+    where one of these has changed.
+*/
+void
+physics::update_body(entities::Handle entity_handle)
+{
+    physics::Component *physics_component = get_component(entity_handle);
+    bool is_static = physics_component->is_static;
+    aabbtree::Tree *tree = is_static ?
+        &physics::state->static_tree : &physics::state->tree;
+    u32 *idx_leaf = is_static ?
+        physics::state->static_tree_leaves[entity_handle] :
+        physics::state->tree_leaves[entity_handle];
+
+    // If the body has just become static, or stopped being static, it's
+    // still in the other tree.
+    u32 *idx_other_leaf = is_static ?
+        physics::state->tree_leaves[entity_handle] :
+        physics::state->static_tree_leaves[entity_handle];
+    if (*idx_other_leaf != aabbtree::NO_NODE) {
+        aabbtree::remove(is_static ? &physics::state->tree : &physics::state->static_tree,
+            *idx_other_leaf);
+        *idx_other_leaf = aabbtree::NO_NODE;
+        physics::state->are_body_lists_stale = true;
+        physics::state->are_static_obb_packets_stale = true;
+    }
+
+    if (is_static) {
+        physics::state->are_static_obb_packets_stale = true;
+    }
+
+    if (
+        !entities::has_components(entity_handle,
+            (u32)entities::ComponentType::spatial | (u32)entities::ComponentType::physics) ||
+        !is_component_valid(physics_component)
+    ) {
+        if (*idx_leaf != aabbtree::NO_NODE) {
+            aabbtree::remove(tree, *idx_leaf);
+            *idx_leaf = aabbtree::NO_NODE;
+            physics::state->are_body_lists_stale = true;
+        }
+        return;
+    }
+
+    spatial::Component *spatial_component = spatial::get_component(entity_handle);
+    physics_component->transformed_obb = transform_body_obb(physics_component,
+        spatial_component);
+
+    spatial::Aabb aabb = spatial::make_aabb_from_obb(&physics_component->transformed_obb);
+    if (*idx_leaf == aabbtree::NO_NODE) {
+        *idx_leaf = aabbtree::insert(tree, entity_handle, &aabb, physics_component->layers);
+        physics::state->are_body_lists_stale = true;
+    } else {
+        aabbtree::move(tree, *idx_leaf, &aabb);
+        if (aabbtree::get_node(tree, *idx_leaf)->layers != physics_component->layers) {
+            aabbtree::set_layers(tree, *idx_leaf, physics_component->layers);
+        }
+    }
+}
+
+
+void
+physics::update_changed_bodies()
+{
+    each (entity_handle, *entities::get_changed_handles(entities::ComponentType::spatial)) {
+        update_body(*entity_handle);
+    }
+    each (entity_handle, *entities::get_changed_handles(entities::ComponentType::physics)) {
+        if (entities::was_changed_this_frame(*entity_handle, entities::ComponentType::spatial)) {
+            // We've already done this one above.
+            continue;
+        }
+        update_body(*entity_handle);
+    }
+}
+
+
+/*!
+    Rebuilds `awake_bodies` and `sleeping_bodies`, if a body has been added,
+    removed, fallen asleep or woken up since we last did.
+*/
+void
+physics::update_body_lists()
+{
+    if (!physics::state->are_body_lists_stale) {
+        return;
+    }
+    physics::state->awake_bodies.length = 0;
+    physics::state->sleeping_bodies.length = 0;
+    each (component, physics::state->components) {
+        if (
+            component->entity_handle == entities::NO_ENTITY_HANDLE ||
+            *physics::state->tree_leaves[component->entity_handle] == aabbtree::NO_NODE
+        ) {
+            continue;
+        }
+        if (component->is_sleeping) {
+            physics::state->sleeping_bodies.push(component->entity_handle);
+        } else {
+            physics::state->awake_bodies.push(component->entity_handle);
+        }
+    }
+    physics::state->are_body_lists_stale = false;
+}
+
+
+/*!
+    Wakes up every sleeping body that something other than the solver has
+    moved or changed this frame. The solver never moves sleeping bodies, so if
+    one has been marked as changed, someone else did it. If a static body has
+    moved, we also wake up everything around where it was and where it is now,
+    since some of it might have been resting on it.
+*/
+void
+physics::wake_moved_bodies()
+{
+    entities::ComponentType component_types[] = {
+        entities::ComponentType::spatial,
+        entities::ComponentType::physics,
+    };
+    for (entities::ComponentType component_type : component_types) {
+        each (entity_handle, *entities::get_changed_handles(component_type)) {
+            physics::Component *physics_component = get_component(*entity_handle);
+            if (physics_component->is_sleeping) {
+                wake_body(*entity_handle);
+                continue;
+            }
+            if (!physics_component->is_static) {
+                continue;
+            }
+            u32 idx_leaf = *physics::state->static_tree_leaves[*entity_handle];
+            if (idx_leaf != aabbtree::NO_NODE) {
+                wake_bodies_in_aabb(
+                    &aabbtree::get_node(&physics::state->static_tree, idx_leaf)->aabb);
+            }
+            if (
+                entities::has_components(*entity_handle,
+                    (u32)entities::ComponentType::spatial |
+                    (u32)entities::ComponentType::physics) &&
+                is_component_valid(physics_component)
+            ) {
+                spatial::Obb obb = transform_body_obb(physics_component,
+                    spatial::get_component(*entity_handle));
+                spatial::Aabb aabb = spatial::make_aabb_from_obb(&obb);
+                wake_bodies_in_aabb(&aabb);
+            }
+        }
+    }
+}
+
+
+void
+physics::wake_bodies_in_aabb(spatial::Aabb *aabb)
+{
+    aabbtree::query_aabb(&physics::state->tree, aabb, ALL_LAYERS,
+        [&](entities::Handle entity_handle) -> bool {
+            wake_body(entity_handle);
+            return true;
+        });
+}
+
+
+/*!
+    Puts dynamic bodies to sleep once they've been moving slowly for long
+    enough. We don't have to check what they're resting on, because anything
+    that's still moving wakes up any sleeping body it touches.
+*/
+void
+physics::update_sleep(f32 dt)
+{
+    f32 max_linear_velocity_squared = SLEEP_MAX_LINEAR_VELOCITY * SLEEP_MAX_LINEAR_VELOCITY;
+    f32 max_angular_velocity_squared = SLEEP_MAX_ANGULAR_VELOCITY * SLEEP_MAX_ANGULAR_VELOCITY;
+    each (entity_handle, physics::state->awake_bodies) {
+        physics::Component *physics_component = get_component(*entity_handle);
+        if (!is_component_dynamic(physics_component)) {
             continue;
         }
-
-        if (physics_component_to_ignore_or_nullptr == candidate) {
+        if (
+            length2(physics_component->velocity) > max_linear_velocity_squared ||
+            length2(physics_component->angular_velocity) > max_angular_velocity_squared
+        ) {
+            physics_component->sleep_time = 0.0f;
             continue;
         }
-
-        RaycastResult raycast_result = intersect_obb_ray(&candidate->transformed_obb, ray);
-        if (raycast_result.did_intersect) {
-            return {
-                .did_intersect = raycast_result.did_intersect,
-                .distance = raycast_result.distance,
-                .collidee = candidate,
-            };
+        physics_component->sleep_time += dt;
+        if (physics_component->sleep_time >= TIME_TO_SLEEP) {
+            physics_component->is_sleeping = true;
+            physics_component->velocity = v3(0.0f);
+            physics_component->angular_velocity = v3(0.0f);
+            physics::state->are_body_lists_stale = true;
         }
     }
+}
 
-    return {};
+
+/*!
+    Whether a body should wake up any sleeping body it touches. Dynamic bodies
+    do until they start falling asleep, and other bodies that aren't static
+    do if something moved them this frame.
+*/
+bool
+physics::is_body_moving(Component *physics_component)
+{
+    if (physics_component->is_static || physics_component->is_sleeping) {
+        return false;
+    }
+    if (is_component_dynamic(physics_component)) {
+        return physics_component->sleep_time == 0.0f;
+    }
+    return entities::was_changed_this_frame(physics_component->entity_handle,
+        entities::ComponentType::spatial);
 }
 
 
-physics::CollisionManifold
-physics::find_collision(
-    physics::Component *self_physics,
-    spatial::Component *self_spatial
-) {
-    each (candidate_physics, *get_components()) {
-        if (!is_component_valid(candidate_physics)) {
+/*!
+    Remembers where each body with CCD that's awake is before a step, so
+    that `run_ccd()` can see how far it moved.
+*/
+void
+physics::start_ccd()
+{
+    physics::state->ccd_bodies.length = 0;
+    each (entity_handle, physics::state->awake_bodies) {
+        physics::Component *physics_component = get_component(*entity_handle);
+        if (!physics_component->is_ccd_enabled || !is_component_dynamic(physics_component)) {
             continue;
         }
-        spatial::Component *candidate_spatial = spatial::get_component(candidate_physics->entity_handle);
-        if (!candidate_spatial) {
-            logs::error("Could not get spatial::Component for candidate");
-            return physics::CollisionManifold {};
+        physics::state->ccd_bodies.push({
+            .entity_handle = *entity_handle,
+            .start_center = physics_component->transformed_obb.center,
+        });
+    }
+}
+
+
+/*!
+    Sweeps each body with CCD that moved far enough in the last step from
+    where it was to where it is now, and if it hit anything on the way,
+    moves it back to just past the point of impact, so that it can't tunnel
+    through thin bodies. We don't change its velocity, since the solver
+    deals with the contact in the next step. The sweep ignores rotation, and
+    treats every other body as if it stayed where it ended up.
+*/
+void
+physics::run_ccd()
+{
+    each (ccd_body, physics::state->ccd_bodies) {
+        physics::Component *physics_component = get_component(ccd_body->entity_handle);
+        spatial::Obb *obb = &physics_component->transformed_obb;
+        v3 translation = obb->center - ccd_body->start_center;
+        f32 min_motion = CCD_MIN_MOTION * min(min(obb->extents.x, obb->extents.y),
+            obb->extents.z);
+        if (length2(translation) <= min_motion * min_motion) {
+            continue;
         }
 
-        if (self_physics == candidate_physics) {
+        spatial::Obb start_obb = *obb;
+        start_obb.center = ccd_body->start_center;
+        SweepResult sweep_result = sweep_obb(&start_obb, translation,
+            physics_component->layer_mask, physics_component);
+        if (!sweep_result.did_hit) {
             continue;
         }
+        f32 time = min(sweep_result.time + CCD_TARGET_DEPTH / length(translation), 1.0f);
+        spatial::get_component(ccd_body->entity_handle)->position -= translation * (1.0f - time);
+        update_body(ccd_body->entity_handle);
+    }
+}
 
-        physics::CollisionManifold manifold = intersect_obb_obb(
-            &self_physics->transformed_obb, &candidate_physics->transformed_obb, self_spatial, candidate_spatial);
-        if (manifold.did_collide) {
-            manifold.collidee = candidate_physics;
-            return manifold;
+
+/*!
+    Finds every pair of bodies that collided, where at least one of them is
+    awake. Bodies we wake up while doing this can wake up the ones they touch,
+    so we keep going until nothing else wakes up, or we've done
+    `MAX_N_WAKE_PASSES` passes, in which case the rest wake up next time.
+*/
+void
+physics::find_contacts()
+{
+    range (0, MAX_N_WAKE_PASSES) {
+        update_body_lists();
+        if (!run_contact_pass()) {
+            break;
+        }
+    }
+}
+
+
+/*!
+    Finds every pair of bodies whose AABBs overlap using the broadphase, runs
+    the narrowphase for all of these pairs at the same time on our worker
+    threads, then collects the pairs that actually collided into `contacts`,
+    and the ones that overlap a trigger into `trigger_overlaps`. Returns
+    whether we woke any bodies up.
+*/
+bool
+physics::run_contact_pass()
+{
+    Array<CandidatePair> *candidate_pairs = &physics::state->candidate_pairs;
+    Array<CollisionManifold> *candidate_manifolds = &physics::state->candidate_manifolds;
+    Array<Contact> *contacts = &physics::state->contacts;
+    Array<TriggerOverlap> *trigger_overlaps = &physics::state->trigger_overlaps;
+    candidate_pairs->length = 0;
+    contacts->length = 0;
+    keep_resting_trigger_overlaps();
+
+    // Broadphase. We only look for pairs from the side of a body that's
+    // awake, so that sleeping and static bodies cost us nothing until
+    // something comes near them. If both bodies are awake, we only add the
+    // pair from the side of the one with the lower handle, so we get each
+    // pair once. The trees skip anything not on the awake body's layer mask,
+    // and we check that the other body wants to collide with it too.
+    bool did_run_out_of_pairs = false;
+    each (entity_handle, physics::state->awake_bodies) {
+        physics::Component *component = get_component(*entity_handle);
+        auto add_candidate_pair = [&](entities::Handle other_entity_handle) -> bool {
+            physics::Component *other_component = get_component(other_entity_handle);
+            bool is_other_awake = !other_component->is_static && !other_component->is_sleeping;
+            if (
+                other_entity_handle == *entity_handle ||
+                (is_other_awake && other_entity_handle < *entity_handle) ||
+                (component->is_trigger && other_component->is_trigger) ||
+                !should_layers_collide(component, other_component)
+            ) {
+                return true;
+            }
+            if (candidate_pairs->length == candidate_pairs->capacity) {
+                did_run_out_of_pairs = true;
+                return false;
+            }
+            candidate_pairs->push({
+                .entity_handle_a = min(*entity_handle, other_entity_handle),
+                .entity_handle_b = max(*entity_handle, other_entity_handle),
+            });
+            return true;
+        };
+        spatial::Aabb aabb = spatial::make_aabb_from_obb(&component->transformed_obb);
+        aabbtree::query_aabb(&physics::state->tree, &aabb, component->layer_mask,
+            add_candidate_pair);
+        aabbtree::query_aabb(&physics::state->static_tree, &aabb, component->layer_mask,
+            add_candidate_pair);
+    }
+    if (did_run_out_of_pairs) {
+        logs::warning("Ran out of candidate pairs, some collisions will be missed");
+    }
+
+    // Narrowphase, using what we found last frame. We keep two caches, and
+    // swap between them each frame, so that the narrowphase can read last
+    // frame's cache while we fill in this frame's, and so that pairs we don't
+    // see anymore get dropped.
+    PairCache *previous_pair_cache = &physics::state->pair_caches[physics::state->idx_pair_cache];
+    physics::state->idx_pair_cache = 1 - physics::state->idx_pair_cache;
+    PairCache *pair_cache = &physics::state->pair_caches[physics::state->idx_pair_cache];
+    clear_pair_cache(pair_cache);
+
+    candidate_manifolds->length = candidate_pairs->length;
+    tasks::parallel_for(candidate_pairs->length, NARROWPHASE_BATCH_SIZE,
+        run_narrowphase_job, previous_pair_cache);
+
+    bool did_wake_body = false;
+    bool did_run_out_of_trigger_overlaps = false;
+    range (0, candidate_pairs->length) {
+        CollisionManifold *manifold = &candidate_manifolds->items[idx];
+        CandidatePair *pair = &candidate_pairs->items[idx];
+        Component *a = physics::state->components.items + pair->entity_handle_a;
+        Component *b = physics::state->components.items + pair->entity_handle_b;
+        if (a->is_trigger || b->is_trigger) {
+            if (!manifold->did_collide) {
+                continue;
+            }
+            if (trigger_overlaps->length == trigger_overlaps->capacity) {
+                did_run_out_of_trigger_overlaps = true;
+                continue;
+            }
+            trigger_overlaps->push({
+                .trigger_entity_handle = a->is_trigger ?
+                    pair->entity_handle_a : pair->entity_handle_b,
+                .other_entity_handle = a->is_trigger ?
+                    pair->entity_handle_b : pair->entity_handle_a,
+            });
+            continue;
+        }
+        cache_pair(pair_cache,
+            find_cached_pair(previous_pair_cache, pair->entity_handle_a, pair->entity_handle_b),
+            pair->entity_handle_a, pair->entity_handle_b,
+            &a->transformed_obb, &b->transformed_obb,
+            manifold, can_reuse_manifold(a, b));
+        if (!manifold->did_collide) {
+            continue;
         }
+        contacts->push({
+            .entity_handle_a = pair->entity_handle_a,
+            .entity_handle_b = pair->entity_handle_b,
+            .manifold = *manifold,
+        });
+
+        // Anything that's moving wakes up any sleeping body it touches.
+        if (a->is_sleeping && is_body_moving(b)) {
+            wake_body(pair->entity_handle_a);
+            did_wake_body = true;
+        } else if (b->is_sleeping && is_body_moving(a)) {
+            wake_body(pair->entity_handle_b);
+            did_wake_body = true;
+        }
+    }
+    if (did_run_out_of_trigger_overlaps) {
+        logs::warning("Ran out of trigger overlaps, some trigger events will be missed");
     }
 
-    return physics::CollisionManifold {};
+    return did_wake_body;
 }
 
 
+/*!
+    Clears `trigger_overlaps`, except for overlaps where neither body is
+    awake. The broadphase only finds pairs from the side of a body that's
+    awake, so these can't have changed, and we wouldn't find them again,
+    which would make a body that falls asleep in a trigger look like it left.
+    If either body has been removed since, we drop the overlap, so that we
+    report it leaving.
+*/
 void
-physics::update()
+physics::keep_resting_trigger_overlaps()
 {
-    each (physics_component, *get_components()) {
-        if (!is_component_valid(physics_component)) {
+    auto is_body_awake = [](Component *component) -> bool {
+        return !component->is_static && !component->is_sleeping;
+    };
+    auto is_body_valid = [](Component *component) -> bool {
+        return component->entity_handle != entities::NO_ENTITY_HANDLE &&
+            (*physics::state->tree_leaves[component->entity_handle] != aabbtree::NO_NODE ||
+                *physics::state->static_tree_leaves[component->entity_handle] != aabbtree::NO_NODE);
+    };
+    Array<TriggerOverlap> *trigger_overlaps = &physics::state->trigger_overlaps;
+    u32 n_kept = 0;
+    each (overlap, *trigger_overlaps) {
+        Component *trigger = get_component(overlap->trigger_entity_handle);
+        Component *other = get_component(overlap->other_entity_handle);
+        if (
+            is_body_awake(trigger) || is_body_awake(other) ||
+            !is_body_valid(trigger) || !is_body_valid(other)
+        ) {
             continue;
         }
+        trigger_overlaps->items[n_kept++] = *overlap;
+    }
+    trigger_overlaps->length = n_kept;
+}
+
+
+physics::TriggerOverlapEntry *
+physics::get_trigger_overlap_entry(TriggerOverlap *overlap)
+{
+    u64 key = make_pair_key(overlap->trigger_entity_handle, overlap->other_entity_handle);
+    Array<TriggerOverlapEntry> *table = &physics::state->trigger_overlap_table;
+    u32 mask = table->capacity - 1;
+    for (u32 idx = hash_pair_key(key) & mask;; idx = (idx + 1) & mask) {
+        TriggerOverlapEntry *entry = &table->items[idx];
+        if (entry->generation != physics::state->trigger_overlap_generation) {
+            *entry = {
+                .key = key,
+                .generation = physics::state->trigger_overlap_generation,
+            };
+            return entry;
+        }
+        if (entry->key == key) {
+            return entry;
+        }
+    }
+}
 
-        spatial::Component *spatial_component = spatial::get_component(physics_component->entity_handle);
 
-        if (!spatial::is_spatial_component_valid(spatial_component)) {
-            logs::warning("Tried to update physics component %d but it had no spatial component.",
-                physics_component->entity_handle);
+/*!
+    Fills `trigger_events` in by comparing the trigger overlaps we've ended up
+    with this frame to the ones we ended up with last frame. We put both into
+    a hash set, so this only takes one pass over each of them.
+*/
+void
+physics::update_trigger_events()
+{
+    Array<TriggerOverlap> *trigger_overlaps = &physics::state->trigger_overlaps;
+    Array<TriggerOverlap> *previous_trigger_overlaps = &physics::state->previous_trigger_overlaps;
+    Array<TriggerEvent> *trigger_events = &physics::state->trigger_events;
+    trigger_events->length = 0;
+    physics::state->trigger_overlap_generation++;
+
+    each (overlap, *previous_trigger_overlaps) {
+        get_trigger_overlap_entry(overlap)->was_overlapping = true;
+    }
+    each (overlap, *trigger_overlaps) {
+        TriggerOverlapEntry *entry = get_trigger_overlap_entry(overlap);
+        entry->is_overlapping = true;
+        trigger_events->push({
+            .type = entry->was_overlapping ? TriggerEventType::stay : TriggerEventType::enter,
+            .trigger_entity_handle = overlap->trigger_entity_handle,
+            .other_entity_handle = overlap->other_entity_handle,
+        });
+    }
+    each (overlap, *previous_trigger_overlaps) {
+        if (get_trigger_overlap_entry(overlap)->is_overlapping) {
             continue;
         }
+        trigger_events->push({
+            .type = TriggerEventType::exit,
+            .trigger_entity_handle = overlap->trigger_entity_handle,
+            .other_entity_handle = overlap->other_entity_handle,
+        });
+    }
+
+    previous_trigger_overlaps->length = trigger_overlaps->length;
+    memcpy(previous_trigger_overlaps->items, trigger_overlaps->items,
+        trigger_overlaps->length * sizeof(TriggerOverlap));
+}
+
+
+/*!
+    Runs the narrowphase for candidate pairs `idx_start` to `idx_end`. Pairs
+    that were separated last frame are very likely still separated along the
+    same axis, so we test that one axis first, and we're done with the pair
+    if it still separates them. Most of the other pairs don't actually collide
+    either, so we check them `simd::WIDTH` at a time with
+    `run_narrowphase_packet()`.
+*/
+void
+physics::run_narrowphase_job(void *data, u32 idx_start, u32 idx_end)
+{
+    PairCache *previous_pair_cache = (PairCache*)data;
+    u32 packet_pair_idxs[simd::WIDTH];
+    CachedPair *packet_cached_pairs[simd::WIDTH];
+    u32 n_packet_pairs = 0;
+
+    range (idx_start, idx_end) {
+        CandidatePair *pair = &physics::state->candidate_pairs.items[idx];
+        Component *a = physics::state->components.items + pair->entity_handle_a;
+        Component *b = physics::state->components.items + pair->entity_handle_b;
+        // Pairs with a trigger are never cached.
+        CachedPair *cached_pair = (a->is_trigger || b->is_trigger) ? nullptr :
+            find_cached_pair(previous_pair_cache, pair->entity_handle_a, pair->entity_handle_b);
+        if (cached_pair && !cached_pair->manifold.did_collide) {
+            u32 cached_axis = cached_pair->manifold.axis;
+            if (
+                get_sat_axis_separation(&a->transformed_obb, &b->transformed_obb,
+                    cached_axis) > 0.0f
+            ) {
+                CollisionManifold *manifold = &physics::state->candidate_manifolds.items[idx];
+                *manifold = CollisionManifold { .axis = cached_axis };
+                manifold->collidee = b;
+                continue;
+            }
+            // There's nothing else we can reuse from a pair that was separated.
+            cached_pair = nullptr;
+        }
+
+        packet_pair_idxs[n_packet_pairs] = idx;
+        packet_cached_pairs[n_packet_pairs] = cached_pair;
+        n_packet_pairs++;
+        if (n_packet_pairs == simd::WIDTH) {
+            run_narrowphase_packet(packet_pair_idxs, packet_cached_pairs, n_packet_pairs);
+            n_packet_pairs = 0;
+        }
+    }
 
-        physics_component->transformed_obb = transform_obb(physics_component->obb, spatial_component);
+    if (n_packet_pairs > 0) {
+        run_narrowphase_packet(packet_pair_idxs, packet_cached_pairs, n_packet_pairs);
     }
 }
 
 
-Array<physics::Component> *
-physics::get_components()
+/*!
+    Finds manifolds for the `n_pairs` candidate pairs at `pair_idxs`, by first
+    checking them all at once with `intersect_obb_packets()`, and only doing
+    more work for the ones that overlap. `cached_pairs` has what we found for
+    each pair last frame, if it collided, and nullptr otherwise. Pairs with a
+    trigger never need a manifold, so for those, overlapping is enough, and a
+    trigger overlaps a heightfield if it overlaps its bounds. Other pairs with
+    a heightfield are tested against its surface.
+*/
+void
+physics::run_narrowphase_packet(u32 const *pair_idxs, CachedPair **cached_pairs, u32 n_pairs)
 {
-    return &physics::state->components;
+    ObbPacket a_packet = { .n_obbs = n_pairs };
+    ObbPacket b_packet = { .n_obbs = n_pairs };
+    range_named (idx_lane, 0, n_pairs) {
+        CandidatePair *pair = &physics::state->candidate_pairs.items[pair_idxs[idx_lane]];
+        set_obb_packet_lane(&a_packet, idx_lane,
+            &physics::state->components.items[pair->entity_handle_a].transformed_obb);
+        set_obb_packet_lane(&b_packet, idx_lane,
+            &physics::state->components.items[pair->entity_handle_b].transformed_obb);
+    }
+    u32 separating_axes[simd::WIDTH];
+    u32 overlap_mask = intersect_obb_packets(&a_packet, &b_packet, separating_axes);
+
+    range_named (idx_lane, 0, n_pairs) {
+        u32 idx = pair_idxs[idx_lane];
+        CandidatePair *pair = &physics::state->candidate_pairs.items[idx];
+        Component *a = physics::state->components.items + pair->entity_handle_a;
+        Component *b = physics::state->components.items + pair->entity_handle_b;
+        CollisionManifold *manifold = &physics::state->candidate_manifolds.items[idx];
+        if ((overlap_mask & (1u << idx_lane)) && (a->is_trigger || b->is_trigger)) {
+            *manifold = CollisionManifold { .did_collide = true };
+        } else if ((overlap_mask & (1u << idx_lane)) && (a->terrain || b->terrain)) {
+            // The OBBs only tell us that we're near the heightfield.
+            if (b->terrain) {
+                *manifold = intersect_obb_heightfield(&a->transformed_obb, b);
+            } else {
+                *manifold = intersect_obb_heightfield(&b->transformed_obb, a);
+                manifold->normal = -manifold->normal;
+            }
+        } else if (overlap_mask & (1u << idx_lane)) {
+            *manifold = intersect_obb_obb_cached(&a->transformed_obb, &b->transformed_obb,
+                cached_pairs[idx_lane], can_reuse_manifold(a, b));
+        } else {
+            *manifold = CollisionManifold { .axis = separating_axes[idx_lane] };
+        }
+        manifold->collidee = b;
+    }
 }
 
 
-physics::Component *
-physics::get_component(entities::Handle entity_handle)
+void
+physics::init_pair_cache(PairCache *pair_cache, memory::Pool *memory_pool, u32 capacity)
 {
-    return physics::state->components[entity_handle];
+    // We need a power of two so we can mask instead of using a modulo.
+    assert((capacity & (capacity - 1)) == 0);
+    pair_cache->entries = Array<CachedPair>(memory_pool, capacity, "physics_pair_cache");
+    pair_cache->entries.alloc();
+    pair_cache->entries.length = capacity;
+    // Entries start off with generation 0, so they all count as empty.
+    pair_cache->generation = 1;
+}
+
+
+/*!
+    Empties the cache, by making every entry in it stale, so we don't have to
+    touch any of them.
+*/
+void
+physics::clear_pair_cache(PairCache *pair_cache)
+{
+    pair_cache->generation++;
+}
+
+
+physics::CachedPair *
+physics::find_cached_pair(
+    PairCache *pair_cache,
+    entities::Handle entity_handle_a,
+    entities::Handle entity_handle_b
+) {
+    u64 key = make_pair_key(entity_handle_a, entity_handle_b);
+    u32 mask = pair_cache->entries.capacity - 1;
+    for (u32 idx = hash_pair_key(key) & mask;; idx = (idx + 1) & mask) {
+        CachedPair *entry = &pair_cache->entries.items[idx];
+        if (entry->generation != pair_cache->generation) {
+            return nullptr;
+        }
+        if (entry->key == key) {
+            return entry;
+        }
+    }
+}
+
+
+physics::CachedPair *
+physics::insert_cached_pair(
+    PairCache *pair_cache,
+    entities::Handle entity_handle_a,
+    entities::Handle entity_handle_b,
+    spatial::Obb *a,
+    spatial::Obb *b,
+    CollisionManifold *manifold
+) {
+    u64 key = make_pair_key(entity_handle_a, entity_handle_b);
+    u32 mask = pair_cache->entries.capacity - 1;
+    for (u32 idx = hash_pair_key(key) & mask;; idx = (idx + 1) & mask) {
+        CachedPair *entry = &pair_cache->entries.items[idx];
+        if (entry->generation != pair_cache->generation || entry->key == key) {
+            *entry = {
+                .key = key,
+                .generation = pair_cache->generation,
+                .a = *a,
+                .b = *b,
+                .manifold = *manifold,
+            };
+            return entry;
+        }
+    }
+}
+
+
+/*!
+    Adds a pair to `pair_cache`, with the manifold we've just found for it,
+    and carries over whatever the solver found for it last time. If we reused
+    the previous manifold, we also keep the OBBs it was found for, so that
+    bodies creeping along a little at a time can't keep reusing the same
+    contacts forever. `can_reuse_manifold` should be whatever we passed to
+    `intersect_obb_obb_cached()`.
+*/
+physics::CachedPair *
+physics::cache_pair(
+    PairCache *pair_cache,
+    CachedPair *previous_cached_pair_or_nullptr,
+    entities::Handle entity_handle_a,
+    entities::Handle entity_handle_b,
+    spatial::Obb *a,
+    spatial::Obb *b,
+    CollisionManifold *manifold,
+    bool can_reuse_manifold
+) {
+    if (!previous_cached_pair_or_nullptr) {
+        return insert_cached_pair(pair_cache, entity_handle_a, entity_handle_b, a, b, manifold);
+    }
+    if (can_reuse_manifold && can_reuse_contacts(previous_cached_pair_or_nullptr, a, b)) {
+        a = &previous_cached_pair_or_nullptr->a;
+        b = &previous_cached_pair_or_nullptr->b;
+    }
+    CachedPair *cached_pair = insert_cached_pair(pair_cache, entity_handle_a, entity_handle_b,
+        a, b, manifold);
+    carry_over_impulses(previous_cached_pair_or_nullptr, cached_pair);
+    return cached_pair;
+}
+
+
+/*!
+    Gives each of `cached_pair`'s contact points the solver's impulses from
+    whichever of `previous_cached_pair`'s contact points is in about the same
+    place, if any. Since the narrowphase finds contact points from scratch,
+    this is how we know which contact points are "the same" from one frame to
+    the next.
+*/
+void
+physics::carry_over_impulses(CachedPair *previous_cached_pair, CachedPair *cached_pair)
+{
+    CollisionManifold *previous_manifold = &previous_cached_pair->manifold;
+    CollisionManifold *manifold = &cached_pair->manifold;
+    if (
+        !previous_manifold->did_collide || !manifold->did_collide ||
+        dot(previous_manifold->normal, manifold->normal) < WARM_START_MIN_NORMAL_COS
+    ) {
+        return;
+    }
+    f32 max_distance_squared = WARM_START_MAX_DISTANCE * WARM_START_MAX_DISTANCE;
+    range_named (i, 0, manifold->n_contact_points) {
+        f32 best_distance_squared = max_distance_squared;
+        range_named (j, 0, previous_manifold->n_contact_points) {
+            f32 distance_squared = length2(
+                manifold->contact_points[i] - previous_manifold->contact_points[j]);
+            if (distance_squared < best_distance_squared) {
+                best_distance_squared = distance_squared;
+                range_named (k, 0, 3) {
+                    cached_pair->impulses[i][k] = previous_cached_pair->impulses[j][k];
+                }
+            }
+        }
+    }
+}
+
+
+/*!
+    Does the same as `intersect_obb_obb()`, but uses what we found for the
+    same pair last frame, if anything.
+
+    * If the pair was separated, it's very likely still separated along the
+      same axis, so we test that one first, and can often skip the other 14.
+    * If the pair was colliding, and neither OBB has really moved, we reuse
+      the whole manifold, including its contact points, but only if
+      `can_reuse_manifold` is true.
+*/
+physics::CollisionManifold
+physics::intersect_obb_obb_cached(
+    spatial::Obb *a,
+    spatial::Obb *b,
+    CachedPair *cached_pair_or_nullptr,
+    bool can_reuse_manifold
+) {
+    if (cached_pair_or_nullptr) {
+        CollisionManifold *cached_manifold = &cached_pair_or_nullptr->manifold;
+        if (!cached_manifold->did_collide) {
+            if (get_sat_axis_separation(a, b, cached_manifold->axis) > 0.0f) {
+                return CollisionManifold { .axis = cached_manifold->axis };
+            }
+        } else if (can_reuse_manifold && can_reuse_contacts(cached_pair_or_nullptr, a, b)) {
+            return *cached_manifold;
+        }
+    }
+    return intersect_obb_obb(a, b);
 }
 
 
@@ -111,6 +1361,55 @@ physics::init(physics::State *physics_state, memory::Pool *asset_memory_pool)
     physics::state = physics_state;
     physics::state->components = Array<physics::Component>(
         asset_memory_pool, MAX_N_ENTITIES, "physics_components", true, 1);
+    aabbtree::init_tree(&physics::state->tree, asset_memory_pool, MAX_N_ENTITIES);
+    aabbtree::init_tree(&physics::state->static_tree, asset_memory_pool, MAX_N_ENTITIES);
+    physics::state->tree_leaves = Array<u32>(
+        asset_memory_pool, MAX_N_ENTITIES, "physics_tree_leaves", true, 1);
+    physics::state->static_tree_leaves = Array<u32>(
+        asset_memory_pool, MAX_N_ENTITIES, "physics_static_tree_leaves", true, 1);
+    physics::state->awake_bodies = Array<entities::Handle>(asset_memory_pool,
+        MAX_N_ENTITIES, "physics_awake_bodies");
+    physics::state->sleeping_bodies = Array<entities::Handle>(asset_memory_pool,
+        MAX_N_ENTITIES, "physics_sleeping_bodies");
+    physics::state->ccd_bodies = Array<CcdBody>(asset_memory_pool,
+        MAX_N_ENTITIES, "physics_ccd_bodies");
+    physics::state->are_static_obb_packets_stale = true;
+    physics::state->obb_packets = Array<ObbPacket>(asset_memory_pool,
+        (MAX_N_ENTITIES + simd::WIDTH - 1) / simd::WIDTH, "physics_obb_packets");
+    physics::state->candidate_pairs = Array<CandidatePair>(asset_memory_pool,
+        MAX_N_CANDIDATE_PAIRS, "physics_candidate_pairs");
+    physics::state->candidate_manifolds = Array<CollisionManifold>(asset_memory_pool,
+        MAX_N_CANDIDATE_PAIRS, "physics_candidate_manifolds");
+    physics::state->contacts = Array<Contact>(asset_memory_pool,
+        MAX_N_CANDIDATE_PAIRS, "physics_contacts");
+    physics::state->trigger_overlaps = Array<TriggerOverlap>(asset_memory_pool,
+        MAX_N_TRIGGER_OVERLAPS, "physics_trigger_overlaps");
+    physics::state->previous_trigger_overlaps = Array<TriggerOverlap>(asset_memory_pool,
+        MAX_N_TRIGGER_OVERLAPS, "physics_previous_trigger_overlaps");
+    physics::state->trigger_overlap_table = Array<TriggerOverlapEntry>(asset_memory_pool,
+        TRIGGER_OVERLAP_TABLE_CAPACITY, "physics_trigger_overlap_table");
+    physics::state->trigger_overlap_table.alloc();
+    physics::state->trigger_overlap_table.length = TRIGGER_OVERLAP_TABLE_CAPACITY;
+    physics::state->trigger_overlap_generation = 1;
+    // Last frame's and this frame's overlaps can all be different, so the
+    // event list needs room for both.
+    physics::state->trigger_events = Array<TriggerEvent>(asset_memory_pool,
+        MAX_N_TRIGGER_OVERLAPS * 2, "physics_trigger_events");
+    physics::state->heightfields = Array<heightfield::Heightfield>(asset_memory_pool,
+        MAX_N_HEIGHTFIELDS, "physics_heightfields");
+    range (0, 2) {
+        init_pair_cache(&physics::state->pair_caches[idx], asset_memory_pool,
+            PAIR_CACHE_CAPACITY);
+    }
+    physics::state->candidate_pairs.alloc();
+    physics::state->candidate_manifolds.alloc();
+    physics::state->contacts.alloc();
+    physics::state->trigger_overlaps.alloc();
+    physics::state->previous_trigger_overlaps.alloc();
+    physics::state->trigger_events.alloc();
+    physics::state->awake_bodies.alloc();
+    physics::state->sleeping_bodies.alloc();
+    physics::state->ccd_bodies.alloc();
 }
 
 
@@ -126,6 +1425,89 @@ physics::transform_obb(spatial::Obb obb, spatial::Component *spatial)
 }
 
 
+/*!
+    Gets `physics_component`'s OBB in world space. Heightfields are only moved
+    by their spatial component, since they can't be rotated or scaled.
+*/
+spatial::Obb
+physics::transform_body_obb(
+    physics::Component *physics_component,
+    spatial::Component *spatial_component
+) {
+    if (physics_component->terrain) {
+        spatial::Obb obb = physics_component->obb;
+        obb.center += spatial_component->position;
+        return obb;
+    }
+    return transform_obb(physics_component->obb, spatial_component);
+}
+
+
+/*!
+    Gets a new, empty heightfield, which lives until `destroy_heightfields()`
+    is called, so that bodies can point to it.
+*/
+heightfield::Heightfield *
+physics::push_heightfield()
+{
+    return physics::state->heightfields.push();
+}
+
+
+/*!
+    Makes `physics_component` collide with `terrain`. This also makes it
+    static, since it has to be, and sets its OBB to the box around the
+    heightfield, which is what the broadphase uses.
+*/
+void
+physics::set_heightfield(
+    physics::Component *physics_component,
+    heightfield::Heightfield *terrain
+) {
+    physics_component->terrain = terrain;
+    physics_component->obb = heightfield::get_bounds(terrain);
+    physics_component->mass = 0.0f;
+    physics_component->is_static = true;
+    physics_component->is_trigger = false;
+}
+
+
+void
+physics::destroy_heightfields()
+{
+    each (terrain, physics::state->heightfields) {
+        heightfield::destroy(terrain);
+    }
+    physics::state->heightfields.length = 0;
+}
+
+
+/*!
+    Gets where `ray` hits `physics_component`, which is its OBB for most
+    bodies, and the surface for heightfields.
+*/
+physics::RaycastResult
+physics::intersect_component_ray(
+    physics::Component *physics_component,
+    spatial::Ray *ray,
+    f32 max_distance
+) {
+    if (!physics_component->terrain) {
+        return intersect_obb_ray(&physics_component->transformed_obb, ray);
+    }
+    spatial::Ray local_ray = {
+        .origin = ray->origin - get_heightfield_origin(physics_component),
+        .direction = ray->direction,
+    };
+    heightfield::RaycastResult raycast_result = heightfield::intersect_ray(
+        physics_component->terrain, &local_ray, max_distance);
+    return {
+        .did_intersect = raycast_result.did_intersect,
+        .distance = raycast_result.distance,
+    };
+}
+
+
 physics::RaycastResult
 physics::intersect_obb_ray(spatial::Obb *obb, spatial::Ray *ray)
 {
@@ -193,11 +1575,147 @@ physics::intersect_obb_ray(spatial::Obb *obb, spatial::Ray *ray)
             .distance = tmax,
         };
     }
-
-    return {
-        .did_intersect = true,
-        .distance = tmin,
-    };
+
+    return {
+        .did_intersect = true,
+        .distance = tmin,
+    };
+}
+
+
+/*!
+    The same test as `intersect_obb_ray()`, but against every OBB in
+    `obb_packets` on one of `layer_mask`'s layers, `simd::WIDTH` at a time,
+    keeping the nearest hit.
+*/
+physics::RayCollisionResult
+physics::intersect_obb_packets_ray(
+    Array<ObbPacket> *obb_packets,
+    Array<Component> *components,
+    spatial::Ray const *ray,
+    u32 layer_mask,
+    entities::Handle handle_to_ignore
+) {
+    using f32x4 = simd::f32x4;
+    RayCollisionResult result = {};
+    f32 nearest_distance = FLT_MAX;
+
+    f32x4 zero = simd::set1(0.0f);
+    f32x4 tiny = simd::set1(0.00001f);
+    f32x4 origin[3];
+    f32x4 direction[3];
+    range_named (i, 0, 3) {
+        origin[i] = simd::set1(ray->origin[i]);
+        direction[i] = simd::set1(ray->direction[i]);
+    }
+
+    each (packet, *obb_packets) {
+        // Check layers first, so we can skip packets with nothing we want.
+        u32 lane_mask = 0;
+        range_named (idx_lane, 0, packet->n_obbs) {
+            if (packet->layers[idx_lane] & layer_mask) {
+                lane_mask |= 1u << idx_lane;
+            }
+        }
+        if (!lane_mask) {
+            continue;
+        }
+
+        f32x4 p[3];
+        range_named (i, 0, 3) {
+            p[i] = simd::sub(simd::load(packet->center[i]), origin[i]);
+        }
+
+        f32x4 tmin = simd::set1(-FLT_MAX);
+        f32x4 tmax = simd::set1(FLT_MAX);
+        f32x4 is_parallel_miss = simd::set1(0.0f);
+
+        range_named (i, 0, 3) {
+            f32x4 axis_x = simd::load(packet->axes[i][0]);
+            f32x4 axis_y = simd::load(packet->axes[i][1]);
+            f32x4 axis_z = simd::load(packet->axes[i][2]);
+            f32x4 extent = simd::load(packet->extents[i]);
+
+            f32x4 f = simd::add(simd::add(
+                simd::mul(axis_x, direction[0]),
+                simd::mul(axis_y, direction[1])),
+                simd::mul(axis_z, direction[2]));
+            f32x4 e = simd::add(simd::add(
+                simd::mul(axis_x, p[0]),
+                simd::mul(axis_y, p[1])),
+                simd::mul(axis_z, p[2]));
+
+            // If the ray is parallel to this slab, and doesn't start inside it,
+            // there can't be a hit.
+            f32x4 is_parallel = simd::eq(f, zero);
+            f32x4 is_outside_slab = simd::mask_or(
+                simd::lt(simd::add(e, extent), zero),
+                simd::gt(simd::sub(e, extent), zero));
+            is_parallel_miss = simd::mask_or(is_parallel_miss,
+                simd::mask_and(is_parallel, is_outside_slab));
+            f = simd::select(is_parallel, tiny, f);
+
+            f32x4 t0 = simd::div(simd::add(e, extent), f);
+            f32x4 t1 = simd::div(simd::sub(e, extent), f);
+            tmin = simd::max(tmin, simd::min(t0, t1));
+            tmax = simd::min(tmax, simd::max(t0, t1));
+        }
+
+        f32x4 is_hit = simd::mask_and_not(
+            simd::mask_and(simd::le(zero, tmax), simd::le(tmin, tmax)),
+            is_parallel_miss);
+        u32 hit_mask = simd::get_mask(is_hit) & lane_mask;
+        if (!hit_mask) {
+            continue;
+        }
+
+        // If the ray starts inside the OBB, `tmax` is the hit.
+        f32 distances[simd::WIDTH];
+        simd::store(distances, simd::select(simd::lt(tmin, zero), tmax, tmin));
+
+        range_named (idx_lane, 0, simd::WIDTH) {
+            if (!(hit_mask & (1u << idx_lane))) {
+                continue;
+            }
+            entities::Handle entity_handle = packet->entity_handles[idx_lane];
+            if (entity_handle == handle_to_ignore || distances[idx_lane] >= nearest_distance) {
+                continue;
+            }
+            Component *collidee = (*components)[entity_handle];
+            f32 distance = distances[idx_lane];
+            // We've only hit the box around the heightfield, so we still
+            // need to find out if we hit its surface.
+            if (collidee->terrain) {
+                RaycastResult raycast_result = intersect_component_ray(collidee,
+                    (spatial::Ray*)ray, nearest_distance);
+                if (!raycast_result.did_intersect || raycast_result.distance >= nearest_distance) {
+                    continue;
+                }
+                distance = raycast_result.distance;
+            }
+            nearest_distance = distance;
+            result = {
+                .did_intersect = true,
+                .distance = distance,
+                .collidee = collidee,
+            };
+        }
+    }
+
+    return result;
+}
+
+
+void
+physics::run_raycast_batch_job(void *data, u32 idx_start, u32 idx_end)
+{
+    RaycastBatchJob *job = (RaycastBatchJob*)data;
+    for (u32 idx_ray = idx_start; idx_ray < idx_end; idx_ray++) {
+        entities::Handle handle_to_ignore = job->handles_to_ignore_or_nullptr ?
+            job->handles_to_ignore_or_nullptr[idx_ray] : entities::NO_ENTITY_HANDLE;
+        job->results[idx_ray] = intersect_obb_packets_ray(job->obb_packets, job->components,
+            &job->rays[idx_ray], job->layer_mask, handle_to_ignore);
+    }
 }
 
 
@@ -207,6 +1725,28 @@ physics::is_component_valid(physics::Component *physics_component) {
 }
 
 
+bool
+physics::is_component_dynamic(physics::Component *physics_component) {
+    return physics_component->entity_handle != entities::NO_ENTITY_HANDLE &&
+        physics_component->mass > 0.0f &&
+        !physics_component->is_static &&
+        !physics_component->is_trigger &&
+        is_component_valid(physics_component);
+}
+
+
+/*!
+    Whether the narrowphase can reuse last frame's manifold for a pair, if
+    neither body has really moved. The solver moves dynamic bodies by tiny
+    amounts every step, so it always needs fresh contacts for them.
+*/
+bool
+physics::can_reuse_manifold(physics::Component *a, physics::Component *b)
+{
+    return !is_component_dynamic(a) && !is_component_dynamic(b);
+}
+
+
 /*!
     This function gets the nearest contact point between two edges. It's used
     to determine a collision point for a box collision that has happened
@@ -364,24 +1904,27 @@ physics::get_reference_face_edges_and_basis(
         axis -= 3;
     }
 
+    // The columns of `cob` are the object's axes. The rows of the reference
+    // face's basis are two axes along the face, then the face's normal, so
+    // that multiplying by it takes us into the face's space.
+    v3 x = column(*cob, 0);
+    v3 y = column(*cob, 1);
+    v3 z = column(*cob, 2);
+
     if (axis == 0) {
         if (n.x > 0.0f) {
             clip_edges[0] = 1;
             clip_edges[1] = 8;
             clip_edges[2] = 7;
             clip_edges[3] = 9;
-            row(*reference_face_cob, 0, row(*cob, 1));
-            row(*reference_face_cob, 1, row(*cob, 2));
-            row(*reference_face_cob, 2, row(*cob, 0));
+            *reference_face_cob = transpose(m3(y, z, x));
             *reference_face_e = v3(e.y, e.z, e.x);
         } else {
             clip_edges[0] = 11;
             clip_edges[1] = 3;
             clip_edges[2] = 10;
             clip_edges[3] = 5;
-            row(*reference_face_cob, 0,  row(*cob, 2));
-            row(*reference_face_cob, 1,  row(*cob, 1));
-            row(*reference_face_cob, 2, -row(*cob, 0));
+            *reference_face_cob = transpose(m3(z, y, -x));
             *reference_face_e = v3(e.z, e.y, e.x);
         }
     } else if (axis == 1) {
@@ -390,18 +1933,14 @@ physics::get_reference_face_edges_and_basis(
             clip_edges[1] = 1;
             clip_edges[2] = 2;
             clip_edges[3] = 3;
-            row(*reference_face_cob, 0, row(*cob, 2));
-            row(*reference_face_cob, 1, row(*cob, 0));
-            row(*reference_face_cob, 2, row(*cob, 1));
+            *reference_face_cob = transpose(m3(z, x, y));
             *reference_face_e = v3(e.z, e.x, e.y);
         } else {
             clip_edges[0] = 4;
             clip_edges[1] = 5;
             clip_edges[2] = 6;
             clip_edges[3] = 7;
-            row(*reference_face_cob, 0,  row(*cob, 2));
-            row(*reference_face_cob, 1, -row(*cob, 0));
-            row(*reference_face_cob, 2, -row(*cob, 1));
+            *reference_face_cob = transpose(m3(z, -x, -y));
             *reference_face_e = v3(e.z, e.x, e.y);
         }
     } else if (axis == 2) {
@@ -410,24 +1949,62 @@ physics::get_reference_face_edges_and_basis(
             clip_edges[1] = 4;
             clip_edges[2] = 8;
             clip_edges[3] = 0;
-            row(*reference_face_cob, 0, -row(*cob, 1));
-            row(*reference_face_cob, 1,  row(*cob, 0));
-            row(*reference_face_cob, 2,  row(*cob, 2));
+            *reference_face_cob = transpose(m3(-y, x, z));
             *reference_face_e = v3(e.y, e.x, e.z);
         } else {
             clip_edges[0] = 6;
             clip_edges[1] = 10;
             clip_edges[2] = 2;
             clip_edges[3] = 9;
-            row(*reference_face_cob, 0, -row(*cob, 1));
-            row(*reference_face_cob, 1, -row(*cob, 0));
-            row(*reference_face_cob, 2, -row(*cob, 2));
+            *reference_face_cob = transpose(m3(-y, -x, -z));
             *reference_face_e = v3(e.y, e.x, e.z);
         }
     }
 }
 
 
+/*!
+    Clips `vertices` against the plane `sign * v[axis] <= limit`, keeping the
+    part on the inside, and writes the resulting polygon to `out_vertices`.
+    This is one step of Sutherland-Hodgman clipping.
+*/
+u32
+physics::clip_polygon_to_plane(
+    v3 const *vertices, u32 n_vertices,
+    u32 axis, f32 sign, f32 limit,
+    v3 out_vertices[8]
+) {
+    u32 n_out_vertices = 0;
+    if (n_vertices == 0) {
+        return 0;
+    }
+    v3 a = vertices[n_vertices - 1];
+    f32 a_distance = sign * a[axis] - limit;
+    range (0, n_vertices) {
+        v3 b = vertices[idx];
+        f32 b_distance = sign * b[axis] - limit;
+        if ((a_distance <= 0.0f) != (b_distance <= 0.0f)) {
+            // The edge crosses the plane, so keep the point where it does.
+            out_vertices[n_out_vertices++] =
+                a + (b - a) * (a_distance / (a_distance - b_distance));
+        }
+        if (b_distance <= 0.0f) {
+            out_vertices[n_out_vertices++] = b;
+        }
+        a = b;
+        a_distance = b_distance;
+    }
+    assert(n_out_vertices <= 8);
+    return n_out_vertices;
+}
+
+
+/*!
+    Clips the incident face against the sides of the reference face, then
+    keeps the vertices that are below the reference face, or only just above
+    it. These are our contact points, and how far below the reference face
+    they are is their depth.
+*/
 u32
 physics::clip_faces(
     v3 reference_center, v3 reference_face_extents,
@@ -435,7 +2012,200 @@ physics::clip_faces(
     spatial::Face incident_face,
     v3 clip_vertices[8], f32 clip_depths[8]
 ) {
-    return 0;
+    // In the reference face's space, the face is the rectangle that goes
+    // from -e.x to e.x and -e.y to e.y, at z = e.z.
+    v3 e = reference_face_extents;
+    v3 vertices[8];
+    v3 clipped_vertices[8];
+    range (0, 4) {
+        vertices[idx] = reference_face_cob * (incident_face.vertices[idx] - reference_center);
+    }
+
+    u32 n_vertices = 4;
+    n_vertices = clip_polygon_to_plane(vertices, n_vertices, 0, 1.0f, e.x, clipped_vertices);
+    n_vertices = clip_polygon_to_plane(clipped_vertices, n_vertices, 1, 1.0f, e.y, vertices);
+    n_vertices = clip_polygon_to_plane(vertices, n_vertices, 0, -1.0f, e.x, clipped_vertices);
+    n_vertices = clip_polygon_to_plane(clipped_vertices, n_vertices, 1, -1.0f, e.y, vertices);
+
+    u32 n_clip_vertices = 0;
+    m3 reference_face_cob_inverse = transpose(reference_face_cob);
+    range (0, n_vertices) {
+        f32 depth = e.z - vertices[idx].z;
+        if (depth < -SPECULATIVE_CONTACT_DISTANCE) {
+            continue;
+        }
+        clip_vertices[n_clip_vertices] =
+            reference_face_cob_inverse * vertices[idx] + reference_center;
+        clip_depths[n_clip_vertices] = depth;
+        n_clip_vertices++;
+    }
+    return n_clip_vertices;
+}
+
+
+/*!
+    Keeps at most 4 contact points: the deepest, the one furthest from it,
+    then the ones that make the biggest triangle with those two on either
+    side. These cover most of the contact area, and any more wouldn't make a
+    resting body any more stable, but would each cost the solver a constraint.
+*/
+u32
+physics::reduce_contact_points(v3 normal, v3 points[8], f32 depths[8], u32 n_points)
+{
+    if (n_points <= 4) {
+        return n_points;
+    }
+
+    u32 idx_deepest = 0;
+    range (1, n_points) {
+        if (depths[idx] > depths[idx_deepest]) {
+            idx_deepest = idx;
+        }
+    }
+    v3 p0 = points[idx_deepest];
+
+    u32 idx_furthest = idx_deepest;
+    f32 max_distance_squared = 0.0f;
+    range (0, n_points) {
+        f32 distance_squared = length2(points[idx] - p0);
+        if (distance_squared > max_distance_squared) {
+            max_distance_squared = distance_squared;
+            idx_furthest = idx;
+        }
+    }
+    v3 p1 = points[idx_furthest];
+
+    u32 idx_max_area = n_points;
+    u32 idx_min_area = n_points;
+    f32 max_area = 0.0f;
+    f32 min_area = 0.0f;
+    range (0, n_points) {
+        f32 area = dot(cross(p1 - p0, points[idx] - p0), normal);
+        if (area > max_area) {
+            max_area = area;
+            idx_max_area = idx;
+        } else if (area < min_area) {
+            min_area = area;
+            idx_min_area = idx;
+        }
+    }
+
+    u32 kept[4] = { idx_deepest, idx_furthest, idx_max_area, idx_min_area };
+    v3 kept_points[4];
+    f32 kept_depths[4];
+    u32 n_kept = 0;
+    range (0, 4) {
+        if (kept[idx] == n_points || (idx == 1 && kept[idx] == idx_deepest)) {
+            continue;
+        }
+        kept_points[n_kept] = points[kept[idx]];
+        kept_depths[n_kept] = depths[kept[idx]];
+        n_kept++;
+    }
+    range (0, n_kept) {
+        points[idx] = kept_points[idx];
+        depths[idx] = kept_depths[idx];
+    }
+    return n_kept;
+}
+
+
+/*!
+    Gets the separation of `a` and `b` along a single SAT axis, numbered as in
+    `intersect_obb_obb()`, using the same calculations, so that if this is
+    positive, `intersect_obb_obb()` would also have found them separated.
+*/
+f32
+physics::get_sat_axis_separation(spatial::Obb *a, spatial::Obb *b, u32 axis)
+{
+    v3 a_axes[3] = { a->x_axis, a->y_axis, cross(a->x_axis, a->y_axis) };
+    v3 b_axes[3] = { b->x_axis, b->y_axis, cross(b->x_axis, b->y_axis) };
+    m3 r;
+    m3 abs_r;
+    bool do_obbs_share_one_axis = false;
+    range_named (i, 0, 3) {
+        range_named (j, 0, 3) {
+            r[i][j] = dot(a_axes[i], b_axes[j]);
+            abs_r[i][j] = abs(r[i][j]) + physics::PARALLEL_FACE_TOLERANCE;
+            if (abs_r[i][j] >= 1.0f) {
+                do_obbs_share_one_axis = true;
+            }
+        }
+    }
+    v3 t_translation = b->center - a->center;
+    v3 t = v3(
+        dot(t_translation, a_axes[0]),
+        dot(t_translation, a_axes[1]),
+        dot(t_translation, a_axes[2]));
+
+    if (axis < 3) {
+        u32 i = axis;
+        f32 b_radius = b->extents[0] * abs_r[i][0] +
+            b->extents[1] * abs_r[i][1] +
+            b->extents[2] * abs_r[i][2];
+        return abs(t[i]) - (a->extents[i] + b_radius);
+    }
+
+    if (axis < 6) {
+        u32 i = axis - 3;
+        f32 a_radius = a->extents[0] * abs_r[0][i] +
+            a->extents[1] * abs_r[1][i] +
+            a->extents[2] * abs_r[2][i];
+        f32 a_to_b = abs(t[0] * r[0][i] + t[1] * r[1][i] + t[2] * r[2][i]);
+        return a_to_b - (a_radius + b->extents[i]);
+    }
+
+    // `intersect_obb_obb()` doesn't test the cross axes in this case.
+    if (do_obbs_share_one_axis) {
+        return -FLT_MAX;
+    }
+    u32 i = (axis - 6) / 3;
+    u32 j = (axis - 6) % 3;
+    f32 a_radius =
+        a->extents[i == 0 ? 1 : 0] * abs_r[i < 2 ? 2 : 1][j] +
+        a->extents[i < 2 ? 2 : 1] * abs_r[i == 0 ? 1 : 0][j];
+    f32 b_radius =
+        b->extents[j == 0 ? 1 : 0] * abs_r[i][j < 2 ? 2 : 1] +
+        b->extents[j < 2 ? 2 : 1] * abs_r[i][j == 0 ? 1 : 0];
+    f32 a_to_b = abs(
+        t[(2 + i) % 3] * r[(1 + i) % 3][j] -
+        t[(1 + i) % 3] * r[(2 + i) % 3][j]);
+    return a_to_b - (a_radius + b_radius);
+}
+
+
+bool
+physics::can_reuse_contacts(CachedPair *cached_pair, spatial::Obb *a, spatial::Obb *b)
+{
+    return cached_pair->manifold.did_collide &&
+        are_obbs_nearly_equal(a, &cached_pair->a) &&
+        are_obbs_nearly_equal(b, &cached_pair->b);
+}
+
+
+bool
+physics::are_obbs_nearly_equal(spatial::Obb *a, spatial::Obb *b)
+{
+    f32 max_distance_squared = CONTACT_REUSE_MAX_DISTANCE * CONTACT_REUSE_MAX_DISTANCE;
+    return length2(a->center - b->center) <= max_distance_squared &&
+        dot(a->x_axis, b->x_axis) >= CONTACT_REUSE_MIN_AXIS_COS &&
+        dot(a->y_axis, b->y_axis) >= CONTACT_REUSE_MIN_AXIS_COS &&
+        a->extents == b->extents;
+}
+
+
+u64
+physics::make_pair_key(entities::Handle entity_handle_a, entities::Handle entity_handle_b)
+{
+    return ((u64)entity_handle_a << 32) | (u64)entity_handle_b;
+}
+
+
+u32
+physics::hash_pair_key(u64 key)
+{
+    // Fibonacci hashing
+    return (u32)((key * 11400714819323198485ull) >> 32);
 }
 
 
@@ -471,7 +2241,9 @@ physics::update_best_for_edge_axis(
     This function implements collision detection between two OBBs.
 
     We're using the separating axis test (SAT) to check which axes, if any,
-    separates the two.
+    separates the two. Axes 0-2 are a's face axes, 3-5 are b's, and
+    6 + 3 * i + j is a[i] x b[j]. If the OBBs don't collide, `manifold.axis` is
+    the axis that separated them.
 
     For manifold generation, we're using the methods described by Dirk Gregorius,
     namely Sutherland-Hodgman clipping for face-something, and "just find the
@@ -496,12 +2268,8 @@ physics::update_best_for_edge_axis(
     * Ian Millington's Cyclone Physics engine (but not for face-something!)
 */
 physics::CollisionManifold
-physics::intersect_obb_obb(
-    spatial::Obb *a,
-    spatial::Obb *b,
-    spatial::Component *spatial_a,
-    spatial::Component *spatial_b
-) {
+physics::intersect_obb_obb(spatial::Obb *a, spatial::Obb *b)
+{
     // The radius from a/b's center to its outer vertex
     f32 a_radius, b_radius;
     // The distance between a and b
@@ -531,16 +2299,6 @@ physics::intersect_obb_obb(
 
     // Compute translation vector
     v3 t_translation = b->center - a->center;
-    gui::log(
-        "a: center (%f, %f, %f) extents (%f, %f, %f)",
-        a->center.x, a->center.y, a->center.z,
-        a->extents[0], a->extents[1], a->extents[2]
-    );
-    gui::log(
-        "b: center (%f, %f, %f) extents (%f, %f, %f)",
-        b->center.x, b->center.y, b->center.z,
-        b->extents[0], b->extents[1], b->extents[2]
-    );
 
     // Bring translation into a's coordinate frame
     v3 t = v3(
@@ -586,7 +2344,7 @@ physics::intersect_obb_obb(
             b->extents[2] * abs_r[i][2];
         a_to_b = abs(t[i]);
         sep = a_to_b - (a_radius + b_radius);
-        if (sep > 0) { return physics::CollisionManifold {}; }
+        if (sep > 0) { return physics::CollisionManifold { .axis = i }; }
         update_best_for_face_axis(
             &a_face_max_sep, &a_face_best_axis, &a_face_best_normal, sep, i, a_axes[i]);
     }
@@ -599,7 +2357,7 @@ physics::intersect_obb_obb(
         b_radius = b->extents[i];
         a_to_b = abs(t[0] * r[0][i] + t[1] * r[1][i] + t[2] * r[2][i]);
         sep = a_to_b - (a_radius + b_radius);
-        if (sep > 0) { return physics::CollisionManifold {}; }
+        if (sep > 0) { return physics::CollisionManifold { .axis = 3 + i }; }
         update_best_for_face_axis(
             &b_face_max_sep, &b_face_best_axis, &b_face_best_normal, sep, 3 + i, b_axes[i]);
     }
@@ -622,10 +2380,10 @@ physics::intersect_obb_obb(
                     t[(1 + i) % 3] * r[(2 + i) % 3][j]
                 );
                 sep = a_to_b - (a_radius + b_radius);
-                if (sep > 0) { return physics::CollisionManifold {}; }
+                if (sep > 0) { return physics::CollisionManifold { .axis = 6 + i * 3 + j }; }
                 normal = normalize(cross(a_axes[i], b_axes[j]));
                 update_best_for_edge_axis(
-                    &edge_max_sep, &edge_best_axis, &edge_best_normal, sep, 6 + i + j, normal);
+                    &edge_max_sep, &edge_best_axis, &edge_best_normal, sep, 6 + i * 3 + j, normal);
             }
         }
     }
@@ -641,34 +2399,10 @@ physics::intersect_obb_obb(
         face_best_axis = b_face_best_axis;
     }
 
-    // TODO: Remove this debugging code
-    {
-        v3 face_best_normal;
-        if (a_face_max_sep > b_face_max_sep) {
-            face_best_normal = a_face_best_normal;
-        } else {
-            face_best_normal = b_face_best_normal;
-        }
-        gui::log("a_face_max_sep %f", a_face_max_sep);
-        gui::log("b_face_max_sep %f", b_face_max_sep);
-        gui::log(
-            "(face_max_sep (real %f) (adjusted %f) (face_best_axis %d) (face_best_normal %f %f %f))",
-            face_max_sep,
-            face_max_sep + physics::ABSOLUTE_TOLERANCE,
-            face_best_axis,
-            face_best_normal.x, face_best_normal.y, face_best_normal.z);
-        gui::log(
-            "(edge_max_sep (real %f) (adjusted %f) (edge_best_axis %d) (edge_best_normal %f %f %f))",
-            edge_max_sep,
-            edge_max_sep * physics::RELATIVE_TOLERANCE,
-            edge_best_axis,
-            edge_best_normal.x, edge_best_normal.y, edge_best_normal.z);
-    }
-
     // Set manifold to our best option while taking tolerances into account
     // We use an artificial axis bias to improve frame coherence
     // (i.e. stop things from jumping between edge and face in nonsensical ways)
-    physics::CollisionManifold manifold;
+    physics::CollisionManifold manifold = {};
     if (edge_max_sep * physics::RELATIVE_TOLERANCE > face_max_sep + physics::ABSOLUTE_TOLERANCE) {
         manifold.sep_max = edge_max_sep;
         manifold.axis = edge_best_axis;
@@ -691,12 +2425,15 @@ physics::intersect_obb_obb(
     }
 
     if (manifold.axis < 6) {
-        // spatial::Face-something collision
+        // spatial::Face-something collision. The reference face is on the OBB
+        // whose axis we picked, and points towards the other OBB, whose face
+        // pointing back at it the most is the incident face.
         v3 reference_extents, incident_extents, reference_center, incident_center;
         m3 reference_cob, incident_cob;
+        v3 reference_normal;
 
         if (manifold.axis < 3) {
-            manifold.normal = -manifold.normal;
+            reference_normal = manifold.normal;
             reference_extents = a->extents;
             reference_cob = a_cob;
             reference_center = a->center;
@@ -704,6 +2441,7 @@ physics::intersect_obb_obb(
             incident_cob = b_cob;
             incident_center = b->center;
         } else {
+            reference_normal = -manifold.normal;
             reference_extents = b->extents;
             reference_cob = b_cob;
             reference_center = b->center;
@@ -712,46 +2450,23 @@ physics::intersect_obb_obb(
             incident_center = a->center;
         }
 
-        spatial::Face incident_face = get_incident_face(&incident_cob, incident_extents, incident_center, manifold.normal);
+        spatial::Face incident_face = get_incident_face(&incident_cob, incident_extents,
+            incident_center, -reference_normal);
 
         u32 clip_edges[4];
         m3 reference_face_cob;
         v3 reference_face_extents;
         get_reference_face_edges_and_basis(
-            &reference_cob, reference_extents, reference_center, manifold.normal,
+            &reference_cob, reference_extents, reference_center, reference_normal,
             manifold.axis, clip_edges, &reference_face_cob, &reference_face_extents);
 
-        u32 n_clip_vertices;
-        v3 clip_vertices[8];
-        f32 clip_depths[8];
-        n_clip_vertices = clip_faces(
+        manifold.n_contact_points = clip_faces(
             reference_center, reference_face_extents,
             clip_edges, reference_face_cob,
             incident_face,
-            clip_vertices, clip_depths);
-
-        debugdraw::draw_quad(
-            incident_face.vertices[0],
-            incident_face.vertices[1],
-            incident_face.vertices[2],
-            incident_face.vertices[3],
-            v4(0.0f, 1.0f, 0.0f, 1.0f));
-        debugdraw::draw_point(
-            incident_face.vertices[0],
-            0.1f,
-            v4(0.0f, 1.0f, 0.0f, 1.0f));
-        debugdraw::draw_point(
-            incident_face.vertices[1],
-            0.1f,
-            v4(0.0f, 1.0f, 0.0f, 1.0f));
-        debugdraw::draw_point(
-            incident_face.vertices[2],
-            0.1f,
-            v4(0.0f, 1.0f, 0.0f, 1.0f));
-        debugdraw::draw_point(
-            incident_face.vertices[3],
-            0.1f,
-            v4(0.0f, 1.0f, 0.0f, 1.0f));
+            manifold.contact_points, manifold.contact_depths);
+        manifold.n_contact_points = reduce_contact_points(manifold.normal,
+            manifold.contact_points, manifold.contact_depths, manifold.n_contact_points);
     } else {
         // Edge-edge collision
         u32 edge_axis = manifold.axis - 6;
@@ -785,10 +2500,9 @@ physics::intersect_obb_obb(
             b_axes[b_axis],
             b->extents[b_axis],
             face_best_axis >= 3);
-        debugdraw::draw_point(
-            contact_point,
-            0.1f,
-            v4(0.0f, 1.0f, 0.0f, 1.0f));
+        manifold.contact_points[0] = contact_point;
+        manifold.contact_depths[0] = -manifold.sep_max;
+        manifold.n_contact_points = 1;
     }
 
     // Since no separating axis is found, the OBBs must be intersecting
@@ -796,3 +2510,395 @@ physics::intersect_obb_obb(
     manifold.did_collide = true;
     return manifold;
 }
+
+
+/*!
+    Does the same as `intersect_obb_obb()`, but against the surface of
+    `heightfield_component`'s heightfield. The manifold's normal points from
+    `obb` into the heightfield.
+*/
+physics::CollisionManifold
+physics::intersect_obb_heightfield(
+    spatial::Obb *obb,
+    physics::Component *heightfield_component
+) {
+    v3 origin = get_heightfield_origin(heightfield_component);
+    spatial::Obb local_obb = *obb;
+    local_obb.center -= origin;
+    heightfield::ObbContacts contacts = heightfield::intersect_obb(
+        heightfield_component->terrain, &local_obb);
+    if (!contacts.did_collide) {
+        return {};
+    }
+
+    CollisionManifold manifold = {
+        .did_collide = true,
+        .sep_max = -contacts.max_depth,
+        .normal = -contacts.normal,
+        .n_contact_points = contacts.n_points,
+    };
+    range (0, contacts.n_points) {
+        manifold.contact_points[idx] = contacts.points[idx] + origin;
+        manifold.contact_depths[idx] = contacts.depths[idx];
+    }
+    manifold.n_contact_points = reduce_contact_points(manifold.normal,
+        manifold.contact_points, manifold.contact_depths, manifold.n_contact_points);
+    return manifold;
+}
+
+
+/*!
+    Gets where point (0, 0) of a heightfield body's heightfield is, in world
+    space.
+*/
+v3
+physics::get_heightfield_origin(physics::Component *heightfield_component)
+{
+    return heightfield_component->transformed_obb.center - heightfield_component->obb.center;
+}
+
+
+/*!
+    Runs the same separating axis test as `intersect_obb_obb()` on up to
+    `simd::WIDTH` pairs of OBBs at once, where pair i is lane i of both
+    packets, but only finds out whether each pair overlaps, not how. Rather
+    than stopping at the first axis that separates a pair, we test all 15
+    axes for every pair, so that we don't have to branch on anything.
+
+    Returns a mask with bit i set if pair i overlaps. If it doesn't,
+    `separating_axes[i]` is the first axis that separates it, numbered as in
+    `intersect_obb_obb()`.
+*/
+u32
+physics::intersect_obb_packets(
+    ObbPacket *a_packet,
+    ObbPacket *b_packet,
+    u32 separating_axes[simd::WIDTH]
+) {
+    using f32x4 = simd::f32x4;
+    assert(a_packet->n_obbs == b_packet->n_obbs);
+
+    f32x4 zero = simd::set1(0.0f);
+    f32x4 one = simd::set1(1.0f);
+    f32x4 parallel_face_tolerance = simd::set1(PARALLEL_FACE_TOLERANCE);
+
+    f32x4 a_axes[3][3];
+    f32x4 b_axes[3][3];
+    f32x4 a_extents[3];
+    f32x4 b_extents[3];
+    f32x4 t_translation[3];
+    range_named (i, 0, 3) {
+        range_named (j, 0, 3) {
+            a_axes[i][j] = simd::load(a_packet->axes[i][j]);
+            b_axes[i][j] = simd::load(b_packet->axes[i][j]);
+        }
+        a_extents[i] = simd::load(a_packet->extents[i]);
+        b_extents[i] = simd::load(b_packet->extents[i]);
+        t_translation[i] = simd::sub(simd::load(b_packet->center[i]),
+            simd::load(a_packet->center[i]));
+    }
+
+    auto dot = [](f32x4 const u[3], f32x4 const v[3]) -> f32x4 {
+        return simd::add(simd::add(simd::mul(u[0], v[0]), simd::mul(u[1], v[1])),
+            simd::mul(u[2], v[2]));
+    };
+
+    // These are the same as in `intersect_obb_obb()`.
+    f32x4 r[3][3];
+    f32x4 abs_r[3][3];
+    f32x4 do_obbs_share_one_axis = zero;
+    range_named (i, 0, 3) {
+        range_named (j, 0, 3) {
+            r[i][j] = dot(a_axes[i], b_axes[j]);
+            abs_r[i][j] = simd::add(simd::abs(r[i][j]), parallel_face_tolerance);
+            do_obbs_share_one_axis = simd::mask_or(do_obbs_share_one_axis,
+                simd::le(one, abs_r[i][j]));
+        }
+    }
+    f32x4 t[3];
+    range_named (i, 0, 3) {
+        t[i] = dot(t_translation, a_axes[i]);
+    }
+
+    // The first axis that separates each pair, if any
+    f32x4 is_separated = zero;
+    f32x4 separating_axis = zero;
+    auto add_axis = [&](u32 axis, f32x4 is_separated_by_axis) {
+        separating_axis = simd::select(
+            simd::mask_and_not(is_separated_by_axis, is_separated),
+            simd::set1((f32)axis), separating_axis);
+        is_separated = simd::mask_or(is_separated, is_separated_by_axis);
+    };
+    auto get_sep = [](f32x4 a_to_b, f32x4 a_radius, f32x4 b_radius) -> f32x4 {
+        return simd::sub(simd::abs(a_to_b), simd::add(a_radius, b_radius));
+    };
+
+    // Test a's face axes (a.x, a.y, a.z)
+    range_named (i, 0, 3) {
+        f32x4 b_radius = simd::add(simd::add(
+            simd::mul(b_extents[0], abs_r[i][0]),
+            simd::mul(b_extents[1], abs_r[i][1])),
+            simd::mul(b_extents[2], abs_r[i][2]));
+        add_axis(i, simd::gt(get_sep(t[i], a_extents[i], b_radius), zero));
+    }
+
+    // Test b's face axes (b.x, b.y, b.z)
+    range_named (i, 0, 3) {
+        f32x4 a_radius = simd::add(simd::add(
+            simd::mul(a_extents[0], abs_r[0][i]),
+            simd::mul(a_extents[1], abs_r[1][i])),
+            simd::mul(a_extents[2], abs_r[2][i]));
+        f32x4 a_to_b = simd::add(simd::add(
+            simd::mul(t[0], r[0][i]),
+            simd::mul(t[1], r[1][i])),
+            simd::mul(t[2], r[2][i]));
+        add_axis(3 + i, simd::gt(get_sep(a_to_b, a_radius, b_extents[i]), zero));
+    }
+
+    // Test cross axes (a[i] x b[j]), except for pairs that share an axis
+    range_named (i, 0, 3) {
+        range_named (j, 0, 3) {
+            f32x4 a_radius = simd::add(
+                simd::mul(a_extents[i == 0 ? 1 : 0], abs_r[i < 2 ? 2 : 1][j]),
+                simd::mul(a_extents[i < 2 ? 2 : 1], abs_r[i == 0 ? 1 : 0][j]));
+            f32x4 b_radius = simd::add(
+                simd::mul(b_extents[j == 0 ? 1 : 0], abs_r[i][j < 2 ? 2 : 1]),
+                simd::mul(b_extents[j < 2 ? 2 : 1], abs_r[i][j == 0 ? 1 : 0]));
+            f32x4 a_to_b = simd::sub(
+                simd::mul(t[(2 + i) % 3], r[(1 + i) % 3][j]),
+                simd::mul(t[(1 + i) % 3], r[(2 + i) % 3][j]));
+            add_axis(6 + i * 3 + j, simd::mask_and_not(
+                simd::gt(get_sep(a_to_b, a_radius, b_radius), zero),
+                do_obbs_share_one_axis));
+        }
+    }
+
+    f32 separating_axis_values[simd::WIDTH];
+    simd::store(separating_axis_values, separating_axis);
+    range_named (idx_lane, 0, simd::WIDTH) {
+        separating_axes[idx_lane] = (u32)separating_axis_values[idx_lane];
+    }
+    u32 lane_mask = (1u << a_packet->n_obbs) - 1;
+    return ~simd::get_mask(is_separated) & lane_mask;
+}
+
+
+void
+physics::set_obb_packet_lane(ObbPacket *packet, u32 idx_lane, spatial::Obb *obb)
+{
+    v3 axes[3] = { obb->x_axis, obb->y_axis, cross(obb->x_axis, obb->y_axis) };
+    range_named (i, 0, 3) {
+        packet->center[i][idx_lane] = obb->center[i];
+        packet->extents[i][idx_lane] = obb->extents[i];
+        range_named (j, 0, 3) {
+            packet->axes[i][j][idx_lane] = axes[i][j];
+        }
+    }
+}
+
+
+/*!
+    Finds the first time at which `a` touches `b` if `a` moves by
+    `translation`, without rotating, using the same 15 axes as
+    `intersect_obb_obb()`. Along each axis, the distance between the two
+    OBBs changes linearly as `a` moves, so we can work out exactly when their
+    projections overlap on that axis, and the OBBs overlap when their
+    projections overlap on every axis. If they already overlap at the start,
+    the time is 0.
+*/
+physics::TimeOfImpactResult
+physics::get_time_of_impact(spatial::Obb *a, v3 translation, spatial::Obb *b)
+{
+    v3 a_axes[3] = { a->x_axis, a->y_axis, cross(a->x_axis, a->y_axis) };
+    v3 b_axes[3] = { b->x_axis, b->y_axis, cross(b->x_axis, b->y_axis) };
+
+    // These are the same as in `intersect_obb_obb()`.
+    m3 r;
+    m3 abs_r;
+    bool do_obbs_share_one_axis = false;
+    range_named (i, 0, 3) {
+        range_named (j, 0, 3) {
+            r[i][j] = dot(a_axes[i], b_axes[j]);
+            abs_r[i][j] = abs(r[i][j]) + physics::PARALLEL_FACE_TOLERANCE;
+            if (abs_r[i][j] >= 1.0f) {
+                do_obbs_share_one_axis = true;
+            }
+        }
+    }
+
+    // Moving a by `translation` moves b by `-translation` in a's frame.
+    v3 t_translation = b->center - a->center;
+    v3 t = v3(dot(t_translation, a_axes[0]), dot(t_translation, a_axes[1]),
+        dot(t_translation, a_axes[2]));
+    v3 t_motion = -v3(dot(translation, a_axes[0]), dot(translation, a_axes[1]),
+        dot(translation, a_axes[2]));
+
+    // Projects a vector in a's frame onto `axis`, scaled like the radii.
+    auto project = [&](v3 v, u32 axis) -> f32 {
+        if (axis < 3) {
+            return v[axis];
+        }
+        if (axis < 6) {
+            u32 i = axis - 3;
+            return v[0] * r[0][i] + v[1] * r[1][i] + v[2] * r[2][i];
+        }
+        u32 i = (axis - 6) / 3;
+        u32 j = (axis - 6) % 3;
+        return v[(2 + i) % 3] * r[(1 + i) % 3][j] - v[(1 + i) % 3] * r[(2 + i) % 3][j];
+    };
+    auto get_radius = [&](u32 axis) -> f32 {
+        if (axis < 3) {
+            return a->extents[axis] +
+                b->extents[0] * abs_r[axis][0] +
+                b->extents[1] * abs_r[axis][1] +
+                b->extents[2] * abs_r[axis][2];
+        }
+        if (axis < 6) {
+            u32 i = axis - 3;
+            return a->extents[0] * abs_r[0][i] +
+                a->extents[1] * abs_r[1][i] +
+                a->extents[2] * abs_r[2][i] +
+                b->extents[i];
+        }
+        u32 i = (axis - 6) / 3;
+        u32 j = (axis - 6) % 3;
+        return a->extents[i == 0 ? 1 : 0] * abs_r[i < 2 ? 2 : 1][j] +
+            a->extents[i < 2 ? 2 : 1] * abs_r[i == 0 ? 1 : 0][j] +
+            b->extents[j == 0 ? 1 : 0] * abs_r[i][j < 2 ? 2 : 1] +
+            b->extents[j < 2 ? 2 : 1] * abs_r[i][j == 0 ? 1 : 0];
+    };
+
+    // Gets the axis in world space, which isn't always unit length for the
+    // edge axes.
+    auto get_axis = [&](u32 axis) -> v3 {
+        if (axis < 3) {
+            return a_axes[axis];
+        }
+        if (axis < 6) {
+            return b_axes[axis - 3];
+        }
+        return cross(a_axes[(axis - 6) / 3], b_axes[(axis - 6) % 3]);
+    };
+
+    f32 time_first = -FLT_MAX;
+    f32 time_last = FLT_MAX;
+    u32 first_axis = 0;
+    u32 n_axes = do_obbs_share_one_axis ? 6 : 15;
+    range_named (axis, 0, n_axes) {
+        f32 distance = project(t, axis);
+        f32 speed = project(t_motion, axis);
+        f32 radius = get_radius(axis);
+        if (abs(speed) < 1.0e-9f) {
+            if (abs(distance) > radius) {
+                return {};
+            }
+            continue;
+        }
+        f32 time_enter = (-radius - distance) / speed;
+        f32 time_exit = (radius - distance) / speed;
+        if (min(time_enter, time_exit) > time_first) {
+            time_first = min(time_enter, time_exit);
+            first_axis = axis;
+        }
+        time_last = min(time_last, max(time_enter, time_exit));
+        if (time_first > time_last) {
+            return {};
+        }
+    }
+
+    if (time_last < 0.0f || time_first > 1.0f) {
+        return {};
+    }
+    v3 normal = normalize(get_axis(first_axis));
+    if (dot(normal, translation) > 0.0f) {
+        normal = -normal;
+    }
+    return { .did_hit = true, .time = max(time_first, 0.0f), .normal = normal };
+}
+
+
+/*!
+    Like `get_time_of_impact()`, but against a heightfield's surface. There's
+    no exact way to do this, so we move `obb` along `translation` in steps
+    short enough that it can't skip over much, and once it touches the
+    surface, bisect the last step to find when it first did. We only step
+    over the part of `translation` where `obb` is within the heightfield's
+    bounds. This can miss bumps much thinner than `obb`, and since we never
+    take more than `MAX_N_HEIGHTFIELD_SWEEP_STEPS` steps, sweeps that stay
+    within the bounds for much more than that many steps take longer steps,
+    and so can miss bigger bumps too.
+*/
+physics::TimeOfImpactResult
+physics::get_time_of_impact_with_heightfield(
+    spatial::Obb *obb,
+    v3 translation,
+    physics::Component *heightfield_component
+) {
+    spatial::Obb moved_obb = *obb;
+    if (intersect_obb_heightfield(&moved_obb, heightfield_component).did_collide) {
+        return { .did_hit = true, .time = 0.0f };
+    }
+
+    // Find when `obb`'s AABB enters and leaves the heightfield's bounds, by
+    // sweeping its center against the bounds grown by its half size.
+    spatial::Aabb obb_aabb = spatial::make_aabb_from_obb(obb);
+    v3 half_size = (obb_aabb.max - obb_aabb.min) * 0.5f;
+    spatial::Aabb bounds = spatial::make_aabb_from_obb(
+        &heightfield_component->transformed_obb);
+    f32 time_start = 0.0f;
+    f32 time_end = 1.0f;
+    range (0, 3) {
+        f32 low = bounds.min[idx] - half_size[idx];
+        f32 high = bounds.max[idx] + half_size[idx];
+        if (abs(translation[idx]) < 1.0e-6f) {
+            if (obb->center[idx] < low || obb->center[idx] > high) {
+                return {};
+            }
+            continue;
+        }
+        f32 time_low = (low - obb->center[idx]) / translation[idx];
+        f32 time_high = (high - obb->center[idx]) / translation[idx];
+        time_start = max(time_start, min(time_low, time_high));
+        time_end = min(time_end, max(time_low, time_high));
+    }
+    if (time_start > time_end) {
+        return {};
+    }
+
+    f32 step_length = HEIGHTFIELD_SWEEP_STEP *
+        min(min(obb->extents.x, obb->extents.y), obb->extents.z);
+    u32 n_steps = (u32)ceil(length(translation) * (time_end - time_start) /
+        max(step_length, 1.0e-6f));
+    n_steps = min(max(n_steps, 1u), MAX_N_HEIGHTFIELD_SWEEP_STEPS);
+    f32 time_step = (time_end - time_start) / (f32)n_steps;
+
+    range (1, n_steps + 1) {
+        f32 time = time_start + time_step * (f32)idx;
+        moved_obb.center = obb->center + translation * time;
+        CollisionManifold manifold = intersect_obb_heightfield(&moved_obb,
+            heightfield_component);
+        if (!manifold.did_collide) {
+            continue;
+        }
+
+        f32 time_before = time_start + time_step * (f32)(idx - 1);
+        f32 time_after = time;
+        range_named (idx_bisection, 0, N_HEIGHTFIELD_SWEEP_BISECTIONS) {
+            f32 time_middle = (time_before + time_after) / 2.0f;
+            moved_obb.center = obb->center + translation * time_middle;
+            CollisionManifold middle_manifold = intersect_obb_heightfield(&moved_obb,
+                heightfield_component);
+            if (middle_manifold.did_collide) {
+                time_after = time_middle;
+                manifold = middle_manifold;
+            } else {
+                time_before = time_middle;
+            }
+        }
+        // The manifold's normal points into the heightfield, and we want
+        // the surface's normal.
+        return { .did_hit = true, .time = time_before, .normal = -manifold.normal };
+    }
+
+    return {};
+}
@@ -5,21 +5,129 @@
 #include "types.hpp"
 #include "entities.hpp"
 #include "spatial.hpp"
+#include "aabbtree.hpp"
+#include "simd.hpp"
+#include "heightfield.hpp"
 
 class physics {
 public:
     static constexpr f32 PARALLEL_FACE_TOLERANCE = 1.0e-2;
     static constexpr f32 RELATIVE_TOLERANCE = 1.00f;
     static constexpr f32 ABSOLUTE_TOLERANCE = 0.10f;
+    // How many rays each thread takes at a time in `raycast_batch()`
+    static constexpr u32 RAYCAST_BATCH_SIZE = 64;
+    // How many pairs each thread takes at a time in the narrowphase
+    static constexpr u32 NARROWPHASE_BATCH_SIZE = 16;
+    static constexpr u32 MAX_N_CANDIDATE_PAIRS = MAX_N_ENTITIES * 8;
+    static constexpr u32 MAX_N_CONTACT_POINTS = 8;
+    // We keep contact points that are this far apart, so that a body resting
+    // on another doesn't keep losing and finding contact points as it rocks.
+    static constexpr f32 SPECULATIVE_CONTACT_DISTANCE = 0.02f;
+    // Must be a power of two, and bigger than the number of pairs, so that
+    // lookups don't have to probe much.
+    static constexpr u32 PAIR_CACHE_CAPACITY = MAX_N_CANDIDATE_PAIRS * 2;
+    // How little an OBB must have moved for us to reuse last frame's contacts
+    static constexpr f32 CONTACT_REUSE_MAX_DISTANCE = 1.0e-3f;
+    static constexpr f32 CONTACT_REUSE_MIN_AXIS_COS = 0.99999f;
+    // How close a contact point must be to one from the last step for the
+    // solver to start off from that one's impulses
+    static constexpr f32 WARM_START_MAX_DISTANCE = 0.05f;
+    static constexpr f32 WARM_START_MIN_NORMAL_COS = 0.95f;
+    // How slowly a dynamic body must move, in m/s and rad/s, and for how
+    // long, in seconds, before we put it to sleep
+    static constexpr f32 SLEEP_MAX_LINEAR_VELOCITY = 0.05f;
+    static constexpr f32 SLEEP_MAX_ANGULAR_VELOCITY = 0.05f;
+    static constexpr f32 TIME_TO_SLEEP = 0.5f;
+    // Waking a body can make it wake the ones it touches, so we look for
+    // contacts again, up to this many times, until nothing else wakes up.
+    static constexpr u32 MAX_N_WAKE_PASSES = 4;
+    // Bodies with CCD only get swept if they move further than this fraction
+    // of their smallest extent in one step, since anything slower can't
+    // tunnel through anything.
+    static constexpr f32 CCD_MIN_MOTION = 0.5f;
+    // When we move a body back to where CCD found it hit something, we let
+    // it go this far past the point of impact, so that the narrowphase finds
+    // the contact, and the solver stops it.
+    static constexpr f32 CCD_TARGET_DEPTH = 0.005f;
+    static constexpr u32 MAX_N_TRIGGER_OVERLAPS = MAX_N_ENTITIES * 4;
+    // Must be a power of two, and have room for last frame's and this
+    // frame's overlaps with plenty to spare, like `PAIR_CACHE_CAPACITY`.
+    static constexpr u32 TRIGGER_OVERLAP_TABLE_CAPACITY = MAX_N_TRIGGER_OVERLAPS * 4;
+    static constexpr u32 MAX_N_HEIGHTFIELDS = 16;
+    // Sweeps against heightfields move the OBB along in steps no longer than
+    // this fraction of its smallest extent, checking for contacts after each
+    // one, then narrow down when it first touched by bisecting. Only the part
+    // of a sweep within the heightfield's bounds is stepped over, and if that
+    // needs more than `MAX_N_HEIGHTFIELD_SWEEP_STEPS` steps, they get longer.
+    static constexpr f32 HEIGHTFIELD_SWEEP_STEP = 0.5f;
+    static constexpr u32 MAX_N_HEIGHTFIELD_SWEEP_STEPS = 32;
+    static constexpr u32 N_HEIGHTFIELD_SWEEP_BISECTIONS = 8;
+
+    // Bit flags. Each body is on one or more layers, and only collides with
+    // bodies on the layers in its `layer_mask`. Queries take a mask too, and
+    // skip bodies that aren't on any of its layers.
+    enum class Layer : u32 {
+        none = 0,
+        world = (1 << 0),
+        character = (1 << 1),
+        prop = (1 << 2),
+        decoration = (1 << 3),
+        trigger = (1 << 4),
+    };
+
+    static constexpr u32 ALL_LAYERS = aabbtree::ALL_LAYERS;
+    // Used for bodies whose scene file entry doesn't say what their layers are
+    static constexpr u32 DEFAULT_LAYERS = (u32)Layer::world;
+    static constexpr u32 DEFAULT_LAYER_MASK = ALL_LAYERS;
 
     struct Component {
         entities::Handle entity_handle;
         spatial::Obb obb;
         spatial::Obb transformed_obb;
+        // The layers this body is on
+        u32 layers;
+        // The layers this body collides with
+        u32 layer_mask;
+        // Bodies with no mass never get moved by the solver.
+        f32 mass;
+        v3 velocity;
+        v3 angular_velocity;
+        // Static bodies should never move. They go in their own broadphase
+        // tree, which we only touch if they do move anyway, and we never look
+        // for contacts between two of them.
+        bool is_static;
+        // Sleeping bodies stay where they are until something moves them or
+        // bumps into them. Until then, we only look at them when looking for
+        // contacts with bodies that are awake.
+        bool is_sleeping;
+        // How long this body has been moving slowly enough to fall asleep
+        f32 sleep_time;
+        // Fast bodies with CCD don't tunnel through other bodies, which costs
+        // a sweep through the broadphase every step they move fast.
+        bool is_ccd_enabled;
+        // Triggers don't collide with anything. We only check which bodies
+        // overlap them, which is much cheaper than finding contacts, and
+        // report when those bodies enter, stay in, or leave them.
+        bool is_trigger;
+        // Bodies with a heightfield as their terrain collide with its
+        // surface, rather than with their OBB, which is just a box around
+        // the heightfield. Triggers only check whether they overlap that
+        // box. Their spatial component only moves them, and doesn't rotate
+        // or scale them. They're always static.
+        heightfield::Heightfield *terrain;
     };
 
-    struct State {
-        Array<Component> components;
+    // The transformed OBBs of up to `simd::WIDTH` bodies, with each value
+    // stored for all of them next to each other, so that we can test a ray
+    // against all of them at once.
+    struct ObbPacket {
+        f32 center[3][simd::WIDTH];
+        // axes[idx_axis][idx_component][idx_lane]
+        f32 axes[3][3][simd::WIDTH];
+        f32 extents[3][simd::WIDTH];
+        entities::Handle entity_handles[simd::WIDTH];
+        u32 layers[simd::WIDTH];
+        u32 n_obbs;
     };
 
     struct CollisionManifold {
@@ -28,6 +136,122 @@ public:
         f32 sep_max;
         u32 axis;
         v3 normal;
+        v3 contact_points[MAX_N_CONTACT_POINTS];
+        // Negative for points that aren't quite touching yet
+        f32 contact_depths[MAX_N_CONTACT_POINTS];
+        u32 n_contact_points;
+    };
+
+    struct CandidatePair {
+        entities::Handle entity_handle_a;
+        entities::Handle entity_handle_b;
+    };
+
+    // The manifold's normal points from a to b, and its collidee is b.
+    struct Contact {
+        entities::Handle entity_handle_a;
+        entities::Handle entity_handle_b;
+        CollisionManifold manifold;
+    };
+
+    // What we found for a pair of bodies in the last frame we looked at them.
+    // If they didn't collide, `manifold.axis` is the axis that separated them.
+    struct CachedPair {
+        u64 key;
+        u32 generation;
+        spatial::Obb a;
+        spatial::Obb b;
+        CollisionManifold manifold;
+        // The normal and friction impulses the solver applied at each of
+        // `manifold`'s contact points, which it starts off from next time.
+        f32 impulses[MAX_N_CONTACT_POINTS][3];
+    };
+
+    // A hash table of `CachedPair`s, keyed by entity handle pair, using linear
+    // probing. Entries from older generations count as empty.
+    struct PairCache {
+        Array<CachedPair> entries;
+        u32 generation;
+    };
+
+    // A body overlapping a trigger. Overlaps between two triggers don't count.
+    struct TriggerOverlap {
+        entities::Handle trigger_entity_handle;
+        entities::Handle other_entity_handle;
+    };
+
+    enum class TriggerEventType {
+        enter,
+        stay,
+        exit,
+    };
+
+    struct TriggerEvent {
+        TriggerEventType type;
+        entities::Handle trigger_entity_handle;
+        entities::Handle other_entity_handle;
+    };
+
+    // A hash set of trigger overlaps, keyed by entity handle pair, using
+    // linear probing, that we use to compare last frame's overlaps to this
+    // frame's. Entries from older generations count as empty.
+    struct TriggerOverlapEntry {
+        u64 key;
+        u32 generation;
+        bool was_overlapping;
+        bool is_overlapping;
+    };
+
+    // Where a body with CCD was at the start of a step
+    struct CcdBody {
+        entities::Handle entity_handle;
+        v3 start_center;
+    };
+
+    struct State {
+        Array<Component> components;
+        // Broadphase. `tree` contains a leaf for every valid physics component
+        // that isn't static, and `static_tree` one for every one that is.
+        aabbtree::Tree tree;
+        aabbtree::Tree static_tree;
+        // The index of each entity's leaf in `tree` or `static_tree`, or
+        // aabbtree::NO_NODE, indexed by entity handle.
+        Array<u32> tree_leaves;
+        Array<u32> static_tree_leaves;
+        // Every valid body that isn't static, split into the ones that are
+        // awake and the ones that are sleeping. We only rebuild these when a
+        // body is added or removed, falls asleep or wakes up.
+        Array<entities::Handle> awake_bodies;
+        Array<entities::Handle> sleeping_bodies;
+        bool are_body_lists_stale;
+        // The bodies with CCD that are awake during the current step
+        Array<CcdBody> ccd_bodies;
+        // A copy of every valid body's transformed OBB, for batch raycasts.
+        // Static bodies come first, in the first `n_static_obb_packets`
+        // packets, so we don't have to copy them every frame.
+        Array<ObbPacket> obb_packets;
+        u32 n_static_obb_packets;
+        bool are_static_obb_packets_stale;
+        // Pairs of bodies whose AABBs overlap, and the narrowphase result for
+        // each of them.
+        Array<CandidatePair> candidate_pairs;
+        Array<CollisionManifold> candidate_manifolds;
+        Array<Contact> contacts;
+        // Last frame's and this frame's pairs
+        PairCache pair_caches[2];
+        u32 idx_pair_cache;
+        // Every body overlapping a trigger, as of the last contact pass, and
+        // as of the last frame's trigger events
+        Array<TriggerOverlap> trigger_overlaps;
+        Array<TriggerOverlap> previous_trigger_overlaps;
+        Array<TriggerOverlapEntry> trigger_overlap_table;
+        u32 trigger_overlap_generation;
+        Array<TriggerEvent> trigger_events;
+        // Owned by us, and pointed to by the bodies that use them
+        Array<heightfield::Heightfield> heightfields;
+        // Time we haven't simulated yet, which is always less than one of
+        // the solver's fixed steps
+        f32 time_accumulator;
     };
 
     struct RaycastResult {
@@ -41,23 +265,171 @@ public:
         Component *collidee;
     };
 
-    static RayCollisionResult find_ray_collision(
+    // `time` goes from 0, at the start of the sweep, to 1, at the end.
+    // `normal` is the axis we touched along, pointing back against the
+    // movement, so it's the normal of the surface we ran into.
+    struct TimeOfImpactResult {
+        bool did_hit;
+        f32 time;
+        v3 normal;
+    };
+
+    struct SweepResult {
+        bool did_hit;
+        f32 time;
+        v3 normal;
+        Component *collidee;
+    };
+
+    struct RaycastBatchJob {
+        Array<ObbPacket> *obb_packets;
+        Array<Component> *components;
+        spatial::Ray const *rays;
+        u32 layer_mask;
+        entities::Handle const *handles_to_ignore_or_nullptr;
+        RayCollisionResult *results;
+    };
+
+    static Layer layer_from_string(const char *str);
+    static bool should_layers_collide(Component *a, Component *b);
+    static RayCollisionResult closest_hit(
         spatial::Ray *ray,
+        f32 max_distance,
+        u32 layer_mask,
         Component *physics_component_to_ignore_or_nullptr
     );
-    static CollisionManifold find_collision(
-        Component *self_physics,
-        spatial::Component *self_spatial
+    static bool any_hit(
+        spatial::Ray *ray,
+        f32 max_distance,
+        u32 layer_mask,
+        Component *physics_component_to_ignore_or_nullptr
+    );
+    static u32 all_hits(
+        spatial::Ray *ray,
+        f32 max_distance,
+        u32 layer_mask,
+        Component *physics_component_to_ignore_or_nullptr,
+        RayCollisionResult *hits,
+        u32 max_n_hits
+    );
+    static SweepResult sweep_obb(
+        spatial::Obb *obb,
+        v3 translation,
+        u32 layer_mask,
+        Component *physics_component_to_ignore_or_nullptr
+    );
+    static u32 find_overlaps(
+        spatial::Obb *obb,
+        u32 layer_mask,
+        Component *physics_component_to_ignore_or_nullptr,
+        CollisionManifold *manifolds,
+        u32 max_n_manifolds
+    );
+    static TimeOfImpactResult get_time_of_impact(spatial::Obb *a, v3 translation, spatial::Obb *b);
+    static TimeOfImpactResult get_time_of_impact_with_heightfield(
+        spatial::Obb *obb,
+        v3 translation,
+        Component *heightfield_component
+    );
+    static void raycast_batch(
+        spatial::Ray const *rays,
+        u32 n_rays,
+        u32 layer_mask,
+        entities::Handle const *handles_to_ignore_or_nullptr,
+        RayCollisionResult *results
+    );
+    static void raycast_obb_packets(
+        Array<ObbPacket> *obb_packets,
+        Array<Component> *components,
+        spatial::Ray const *rays,
+        u32 n_rays,
+        u32 layer_mask,
+        entities::Handle const *handles_to_ignore_or_nullptr,
+        RayCollisionResult *results
     );
+    static void run_raycast_batch_job(void *data, u32 idx_start, u32 idx_end);
+    static void init_pair_cache(PairCache *pair_cache, memory::Pool *memory_pool, u32 capacity);
+    static void clear_pair_cache(PairCache *pair_cache);
+    static CachedPair * find_cached_pair(
+        PairCache *pair_cache,
+        entities::Handle entity_handle_a,
+        entities::Handle entity_handle_b
+    );
+    static CachedPair * insert_cached_pair(
+        PairCache *pair_cache,
+        entities::Handle entity_handle_a,
+        entities::Handle entity_handle_b,
+        spatial::Obb *a,
+        spatial::Obb *b,
+        CollisionManifold *manifold
+    );
+    static CachedPair * cache_pair(
+        PairCache *pair_cache,
+        CachedPair *previous_cached_pair_or_nullptr,
+        entities::Handle entity_handle_a,
+        entities::Handle entity_handle_b,
+        spatial::Obb *a,
+        spatial::Obb *b,
+        CollisionManifold *manifold,
+        bool can_reuse_manifold
+    );
+    static CollisionManifold intersect_obb_obb(spatial::Obb *a, spatial::Obb *b);
+    static CollisionManifold intersect_obb_heightfield(
+        spatial::Obb *obb,
+        Component *heightfield_component
+    );
+    static v3 get_heightfield_origin(Component *heightfield_component);
+    static RaycastResult intersect_component_ray(
+        Component *physics_component,
+        spatial::Ray *ray,
+        f32 max_distance
+    );
+    static u32 intersect_obb_packets(
+        ObbPacket *a_packet,
+        ObbPacket *b_packet,
+        u32 separating_axes[simd::WIDTH]
+    );
+    static void set_obb_packet_lane(ObbPacket *packet, u32 idx_lane, spatial::Obb *obb);
+    static CollisionManifold intersect_obb_obb_cached(
+        spatial::Obb *a,
+        spatial::Obb *b,
+        CachedPair *cached_pair_or_nullptr,
+        bool can_reuse_manifold
+    );
+    static void fill_obb_packets(Array<ObbPacket> *obb_packets, Array<Component> *components);
+    static bool is_component_valid(Component *physics_component);
+    static bool is_component_dynamic(Component *physics_component);
+    static void wake_body(entities::Handle entity_handle);
+    static bool can_reuse_manifold(Component *a, Component *b);
     static void update();
+    static Array<Contact> * get_contacts();
+    static Array<TriggerEvent> * get_trigger_events();
+    static PairCache * get_pair_cache();
     static Array<physics::Component> * get_components();
     static physics::Component * get_component(entities::Handle entity_handle);
     static void init(physics::State *physics_state, memory::Pool *asset_memory_pool);
-
-private:
     static spatial::Obb transform_obb(spatial::Obb obb, spatial::Component *spatial);
+    static spatial::Obb transform_body_obb(
+        Component *physics_component,
+        spatial::Component *spatial_component
+    );
+    static heightfield::Heightfield * push_heightfield();
+    static void set_heightfield(
+        Component *physics_component,
+        heightfield::Heightfield *terrain
+    );
+    static void destroy_heightfields();
+
     static RaycastResult intersect_obb_ray(spatial::Obb *obb, spatial::Ray *ray);
-    static bool is_component_valid(Component *physics_component);
+
+private:
+    static RayCollisionResult intersect_obb_packets_ray(
+        Array<ObbPacket> *obb_packets,
+        Array<Component> *components,
+        spatial::Ray const *ray,
+        u32 layer_mask,
+        entities::Handle handle_to_ignore
+    );
     static v3 get_edge_contact_point(
         v3 a_edge_point,
         v3 a_axis,
@@ -78,12 +450,18 @@ private:
         m3 *reference_face_cob,
         v3 *reference_face_e
     );
+    static u32 clip_polygon_to_plane(
+        v3 const *vertices, u32 n_vertices,
+        u32 axis, f32 sign, f32 limit,
+        v3 out_vertices[8]
+    );
     static u32 clip_faces(
         v3 reference_center, v3 reference_face_extents,
         u32 clip_edges[4], m3 reference_face_cob,
         spatial::Face incident_face,
         v3 clip_vertices[8], f32 clip_depths[8]
     );
+    static u32 reduce_contact_points(v3 normal, v3 points[8], f32 depths[8], u32 n_points);
     static void update_best_for_face_axis(
         f32 *best_sep, u32 *best_axis, v3 *best_normal,
         f32 sep, u32 axis, v3 normal
@@ -92,11 +470,33 @@ private:
         f32 *best_sep, u32 *best_axis, v3 *best_normal,
         f32 sep, u32 axis, v3 normal
     );
-    static CollisionManifold intersect_obb_obb(
-        spatial::Obb *a,
-        spatial::Obb *b,
-        spatial::Component *spatial_a,
-        spatial::Component *spatial_b
+    static f32 get_sat_axis_separation(spatial::Obb *a, spatial::Obb *b, u32 axis);
+    static bool can_reuse_contacts(CachedPair *cached_pair, spatial::Obb *a, spatial::Obb *b);
+    static bool are_obbs_nearly_equal(spatial::Obb *a, spatial::Obb *b);
+    static u64 make_pair_key(entities::Handle entity_handle_a, entities::Handle entity_handle_b);
+    static u32 hash_pair_key(u64 key);
+    static void carry_over_impulses(CachedPair *previous_cached_pair, CachedPair *cached_pair);
+    static void push_obb(Array<ObbPacket> *obb_packets, ObbPacket **packet, Component *component);
+    static void update_obb_packets();
+    static void update_body(entities::Handle entity_handle);
+    static void update_changed_bodies();
+    static void update_body_lists();
+    static void wake_moved_bodies();
+    static void wake_bodies_in_aabb(spatial::Aabb *aabb);
+    static void update_sleep(f32 dt);
+    static bool is_body_moving(Component *physics_component);
+    static void start_ccd();
+    static void run_ccd();
+    static void find_contacts();
+    static bool run_contact_pass();
+    static void keep_resting_trigger_overlaps();
+    static TriggerOverlapEntry * get_trigger_overlap_entry(TriggerOverlap *overlap);
+    static void update_trigger_events();
+    static void run_narrowphase_job(void *data, u32 idx_start, u32 idx_end);
+    static void run_narrowphase_packet(
+        u32 const *pair_idxs,
+        CachedPair **cached_pairs,
+        u32 n_pairs
     );
 
     static physics::State *state;
@@ -300,17 +300,18 @@ renderer::render(GLFWwindow *window)
                     continue;
                 }
 
-                spatial::Component *spatial_component =
-                    spatial::get_component(light_component->entity_handle);
-
                 if (!(
-                        lights::is_light_component_valid(light_component) &&
                         light_component->type == lights::LightType::point &&
-                        spatial::is_spatial_component_valid(spatial_component)
+                        entities::has_components(light_component->entity_handle,
+                            (u32)entities::ComponentType::light |
+                            (u32)entities::ComponentType::spatial)
                 )) {
                     continue;
                 }
 
+                spatial::Component *spatial_component =
+                    spatial::get_component(light_component->entity_handle);
+
                 v3 position = spatial_component->position;
 
                 for (u32 idx_face = 0; idx_face < 6; idx_face++) {
@@ -356,17 +357,18 @@ renderer::render(GLFWwindow *window)
                     continue;
                 }
 
-                spatial::Component *spatial_component =
-                    spatial::get_component(light_component->entity_handle);
-
                 if (!(
-                        lights::is_light_component_valid(light_component) &&
                         light_component->type == lights::LightType::directional &&
-                        spatial::is_spatial_component_valid(spatial_component)
+                        entities::has_components(light_component->entity_handle,
+                            (u32)entities::ComponentType::light |
+                            (u32)entities::ComponentType::spatial)
                 )) {
                     continue;
                 }
 
+                spatial::Component *spatial_component =
+                    spatial::get_component(light_component->entity_handle);
+
                 renderer::state->shadowmap_2d_transforms[idx_light] = ortho_projection *
                     glm::lookAt(spatial_component->position,
                         spatial_component->position + light_component->direction,
@@ -1131,6 +1133,80 @@ renderer::init_gui(memory::Pool *memory_pool)
 }
 
 
+bool
+renderer::have_lights_changed()
+{
+    if (renderer::state->light_data_frame != entities::get_frame()) {
+        renderer::state->light_data_frame = entities::get_frame();
+        renderer::state->n_seen_light_changes = 0;
+        renderer::state->n_seen_spatial_changes = 0;
+    }
+
+    bool did_change = false;
+
+    Array<entities::Handle> *changed_lights =
+        entities::get_changed_handles(entities::ComponentType::light);
+    if (changed_lights->length > renderer::state->n_seen_light_changes) {
+        did_change = true;
+    }
+    renderer::state->n_seen_light_changes = changed_lights->length;
+
+    // Lights also need updating when their spatial component changes.
+    Array<entities::Handle> *changed_spatials =
+        entities::get_changed_handles(entities::ComponentType::spatial);
+    range (renderer::state->n_seen_spatial_changes, changed_spatials->length) {
+        if (entities::has_components(changed_spatials->items[idx],
+            (u32)entities::ComponentType::light
+        )) {
+            did_change = true;
+            break;
+        }
+    }
+    renderer::state->n_seen_spatial_changes = changed_spatials->length;
+
+    return did_change;
+}
+
+
+void
+renderer::copy_light_data_to_shader_common(ShaderCommon *shader_common)
+{
+    u32 n_point_lights = 0;
+    u32 n_directional_lights = 0;
+
+    entities::query(
+        (u32)entities::ComponentType::light | (u32)entities::ComponentType::spatial,
+        [&](entities::Handle entity_handle) {
+            lights::Component *light_component = lights::get_component(entity_handle);
+            spatial::Component *spatial_component = spatial::get_component(entity_handle);
+
+            if (light_component->type == lights::LightType::point) {
+                shader_common->point_light_position[n_point_lights] = v4(
+                    spatial_component->position, 1.0f
+                );
+                shader_common->point_light_color[n_point_lights] =
+                    light_component->color;
+                shader_common->point_light_attenuation[n_point_lights] =
+                    light_component->attenuation;
+                n_point_lights++;
+            } else if (light_component->type == lights::LightType::directional) {
+                shader_common->directional_light_position[n_directional_lights] =
+                    v4(spatial_component->position, 1.0f);
+                shader_common->directional_light_direction[n_directional_lights] =
+                    v4(light_component->direction, 1.0f);
+                shader_common->directional_light_color[n_directional_lights] =
+                    light_component->color;
+                shader_common->directional_light_attenuation[n_directional_lights] =
+                    light_component->attenuation;
+                n_directional_lights++;
+            }
+        });
+
+    shader_common->n_point_lights = n_point_lights;
+    shader_common->n_directional_lights = n_directional_lights;
+}
+
+
 void
 renderer::copy_scene_data_to_ubo(
     u32 current_shadow_light_idx,
@@ -1174,49 +1250,10 @@ renderer::copy_scene_data_to_ubo(
     shader_common->window_width = window_size->width;
     shader_common->window_height = window_size->height;
 
-    u32 n_point_lights = 0;
-    u32 n_directional_lights = 0;
-
-    each (light_component, *lights::get_components()) {
-        if (light_component->entity_handle == entities::NO_ENTITY_HANDLE) {
-            continue;
-        }
-
-        spatial::Component *spatial_component =
-            spatial::get_component(light_component->entity_handle);
-
-        if (!(
-            lights::is_light_component_valid(light_component) &&
-            spatial::is_spatial_component_valid(spatial_component)
-        )) {
-            continue;
-        }
-
-        if (light_component->type == lights::LightType::point) {
-            shader_common->point_light_position[n_point_lights] = v4(
-                spatial_component->position, 1.0f
-            );
-            shader_common->point_light_color[n_point_lights] =
-                light_component->color;
-            shader_common->point_light_attenuation[n_point_lights] =
-                light_component->attenuation;
-            n_point_lights++;
-        } else if (light_component->type == lights::LightType::directional) {
-            shader_common->directional_light_position[n_directional_lights] =
-                v4(spatial_component->position, 1.0f);
-            shader_common->directional_light_direction[n_directional_lights] =
-                v4(light_component->direction, 1.0f);
-            shader_common->directional_light_color[n_directional_lights] =
-                light_component->color;
-            shader_common->directional_light_attenuation[n_directional_lights] =
-                light_component->attenuation;
-            n_directional_lights++;
-        }
+    if (have_lights_changed()) {
+        copy_light_data_to_shader_common(shader_common);
     }
 
-    shader_common->n_point_lights = n_point_lights;
-    shader_common->n_directional_lights = n_directional_lights;
-
     glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ShaderCommon), shader_common);
 }
 
@@ -1229,6 +1266,7 @@ renderer::draw(
     m4 *model_matrix,
     m3 *model_normal_matrix,
     m4 *bone_matrices,
+    u32 n_bone_matrices,
     shaders::Asset *standard_depth_shader_asset
 ) {
     shaders::Asset *shader_asset = nullptr;
@@ -1275,12 +1313,12 @@ renderer::draw(
         } else if (pstr_eq(uniform_name, "model_normal_matrix")) {
             shaders::set_mat3(shader_asset, "model_normal_matrix", model_normal_matrix);
         } else if (bone_matrices && pstr_eq(uniform_name, "bone_matrices[0]")) {
-            shaders::set_mat4_multiple(shader_asset, MAX_N_BONES,
+            shaders::set_mat4_multiple(shader_asset, n_bone_matrices,
                 "bone_matrices[0]", bone_matrices);
         }
     }
 
-    geom::Mesh *mesh = &drawable_component->mesh;
+    geom::Mesh *mesh = drawable::get_mesh(drawable_component->mesh_handle);
     glBindVertexArray(mesh->vao);
     if (mesh->n_indices > 0) {
         glDrawElements(mesh->mode, mesh->n_indices, GL_UNSIGNED_INT, 0);
@@ -1298,13 +1336,11 @@ renderer::draw_all(
 ) {
     spatial::ModelMatrixCache cache = { m4(1.0f), nullptr };
 
-    each (drawable_component, *drawable::get_components()) {
-        if (!drawable::is_component_valid(drawable_component)) {
-            continue;
-        }
+    entities::query((u32)entities::ComponentType::drawable, [&](entities::Handle entity_handle) {
+        drawable::Component *drawable_component = drawable::get_component(entity_handle);
 
         if (!((u32)render_pass & (u32)drawable_component->target_render_pass)) {
-            continue;
+            return;
         }
 
 #if 0
@@ -1312,20 +1348,23 @@ renderer::draw_all(
             engine::get_entity(drawable_component->entity_handle)->debug_name);
 #endif
 
-        mats::Material *material = mats::get_material_by_name(
-            drawable_component->mesh.material_name);
+        mats::Material *material = nullptr;
+        if (drawable_component->idx_material != mats::NO_MATERIAL_IDX) {
+            material = mats::get_material(drawable_component->idx_material);
+        }
 
         if (!material || material->state != mats::MaterialState::complete) {
             material = mats::get_material_by_name("unknown");
         }
 
-        spatial::Component *spatial_component = spatial::get_component(drawable_component->entity_handle);
-
         m4 model_matrix = m4(1.0f);
         m3 model_normal_matrix = m3(1.0f);
         m4 *bone_matrices = nullptr;
+        u32 n_bone_matrices = 0;
+
+        if (entities::has_components(entity_handle, (u32)entities::ComponentType::spatial)) {
+            spatial::Component *spatial_component = spatial::get_component(entity_handle);
 
-        if (spatial::is_spatial_component_valid(spatial_component)) {
             // We only need to calculate the normal matrix if we have non-uniform
             // scaling.
             model_matrix = spatial::make_model_matrix(spatial_component, &cache);
@@ -1350,12 +1389,14 @@ renderer::draw_all(
                 spatial_component);
             if (animation_component) {
                 bone_matrices = animation_component->bone_matrices;
+                n_bone_matrices = animation_component->skeleton->n_bones;
             }
         }
 
         draw(render_mode, drawable_component, material,
-            &model_matrix, &model_normal_matrix, bone_matrices, standard_depth_shader_asset);
-    }
+            &model_matrix, &model_normal_matrix, bone_matrices, n_bone_matrices,
+            standard_depth_shader_asset);
+    });
 }
 
 
@@ -107,6 +107,13 @@ public:
         shaders::Asset gui_shader_asset;
         Array<fonts::FontAsset> gui_font_assets;
         u32 gui_n_vertices_pushed;
+        // `copy_scene_data_to_ubo()` is called many times per frame, but the
+        // light data only needs to be rebuilt when a light has changed. We
+        // remember how many of this frame's changed light and spatial handles
+        // we've already looked at, so we only look at each change once.
+        u32 light_data_frame;
+        u32 n_seen_light_changes;
+        u32 n_seen_spatial_changes;
     };
 
     static GLFWwindow * init_window(WindowSize *window_size);
@@ -188,6 +195,8 @@ private:
         u32 shadowmap_2d_height
     );
     static void init_gui(memory::Pool *memory_pool);
+    static bool have_lights_changed();
+    static void copy_light_data_to_shader_common(ShaderCommon *shader_common);
     static void copy_scene_data_to_ubo(
         u32 current_shadow_light_idx,
         u32 current_shadow_light_type,
@@ -200,6 +209,7 @@ private:
         m4 *model_matrix,
         m3 *model_normal_matrix,
         m4 *bone_matrices,
+        u32 n_bone_matrices,
         shaders::Asset *standard_depth_shader_asset
     );
     static void draw_all(
@@ -0,0 +1,118 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE
+#include <emmintrin.h>
+#else
+#include <string.h>
+#endif
+
+/*!
+    A thin wrapper around 4-wide float vectors, so that we can write batched
+    code once and have it use SSE where we have it, which is every x86-64
+    machine, and plain loops elsewhere.
+
+    Comparisons return masks, where each lane is either all ones or all zeros,
+    which can be passed to `select()` or turned into 4 bits with `get_mask()`.
+*/
+class simd {
+public:
+    static constexpr u32 WIDTH = 4;
+
+#if defined(SIMD_SSE)
+    struct f32x4 {
+        __m128 v;
+    };
+
+    static f32x4 load(f32 const *src) { return { _mm_loadu_ps(src) }; }
+    static f32x4 set1(f32 value) { return { _mm_set1_ps(value) }; }
+    static void store(f32 *dest, f32x4 a) { _mm_storeu_ps(dest, a.v); }
+    static f32x4 add(f32x4 a, f32x4 b) { return { _mm_add_ps(a.v, b.v) }; }
+    static f32x4 sub(f32x4 a, f32x4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+    static f32x4 mul(f32x4 a, f32x4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+    static f32x4 div(f32x4 a, f32x4 b) { return { _mm_div_ps(a.v, b.v) }; }
+    static f32x4 min(f32x4 a, f32x4 b) { return { _mm_min_ps(a.v, b.v) }; }
+    static f32x4 max(f32x4 a, f32x4 b) { return { _mm_max_ps(a.v, b.v) }; }
+    static f32x4 abs(f32x4 a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+    static f32x4 lt(f32x4 a, f32x4 b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+    static f32x4 le(f32x4 a, f32x4 b) { return { _mm_cmple_ps(a.v, b.v) }; }
+    static f32x4 gt(f32x4 a, f32x4 b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+    static f32x4 eq(f32x4 a, f32x4 b) { return { _mm_cmpeq_ps(a.v, b.v) }; }
+    static f32x4 mask_and(f32x4 a, f32x4 b) { return { _mm_and_ps(a.v, b.v) }; }
+    static f32x4 mask_or(f32x4 a, f32x4 b) { return { _mm_or_ps(a.v, b.v) }; }
+    static f32x4 mask_and_not(f32x4 a, f32x4 b) { return { _mm_andnot_ps(b.v, a.v) }; }
+    // For each lane, picks `a` where `mask` is set, and `b` otherwise.
+    static f32x4 select(f32x4 mask, f32x4 a, f32x4 b) {
+        return { _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)) };
+    }
+    static u32 get_mask(f32x4 mask) { return (u32)_mm_movemask_ps(mask.v); }
+    // Adds up all the lanes.
+    static f32 sum(f32x4 a) {
+        __m128 pairs = _mm_add_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_movehl_ps(pairs, pairs)));
+    }
+#else
+    struct f32x4 {
+        f32 v[WIDTH];
+    };
+
+    template <typename F>
+        static f32x4 map(f32x4 a, f32x4 b, F fn) {
+            f32x4 result;
+            for (u32 i = 0; i < WIDTH; i++) { result.v[i] = fn(a.v[i], b.v[i]); }
+            return result;
+        }
+
+    static f32 from_bool(bool value) {
+        u32 bits = value ? 0xFFFFFFFF : 0;
+        f32 result;
+        memcpy(&result, &bits, sizeof(f32));
+        return result;
+    }
+
+    static bool to_bool(f32 value) {
+        u32 bits;
+        memcpy(&bits, &value, sizeof(f32));
+        return bits != 0;
+    }
+
+    static f32x4 load(f32 const *src) { f32x4 r; memcpy(r.v, src, sizeof(r.v)); return r; }
+    static f32x4 set1(f32 value) { return { { value, value, value, value } }; }
+    static void store(f32 *dest, f32x4 a) { memcpy(dest, a.v, sizeof(a.v)); }
+    static f32x4 add(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return x + y; }); }
+    static f32x4 sub(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return x - y; }); }
+    static f32x4 mul(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return x * y; }); }
+    static f32x4 div(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return x / y; }); }
+    static f32x4 min(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return x < y ? x : y; }); }
+    static f32x4 max(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return x > y ? x : y; }); }
+    static f32x4 abs(f32x4 a) { return map(a, a, [](f32 x, f32) { return x < 0.0f ? -x : x; }); }
+    static f32x4 lt(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return from_bool(x < y); }); }
+    static f32x4 le(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return from_bool(x <= y); }); }
+    static f32x4 gt(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return from_bool(x > y); }); }
+    static f32x4 eq(f32x4 a, f32x4 b) { return map(a, b, [](f32 x, f32 y) { return from_bool(x == y); }); }
+    static f32x4 mask_and(f32x4 a, f32x4 b) {
+        return map(a, b, [](f32 x, f32 y) { return from_bool(to_bool(x) && to_bool(y)); });
+    }
+    static f32x4 mask_or(f32x4 a, f32x4 b) {
+        return map(a, b, [](f32 x, f32 y) { return from_bool(to_bool(x) || to_bool(y)); });
+    }
+    static f32x4 mask_and_not(f32x4 a, f32x4 b) {
+        return map(a, b, [](f32 x, f32 y) { return from_bool(to_bool(x) && !to_bool(y)); });
+    }
+    static f32x4 select(f32x4 mask, f32x4 a, f32x4 b) {
+        f32x4 result;
+        for (u32 i = 0; i < WIDTH; i++) { result.v[i] = to_bool(mask.v[i]) ? a.v[i] : b.v[i]; }
+        return result;
+    }
+    static u32 get_mask(f32x4 mask) {
+        u32 result = 0;
+        for (u32 i = 0; i < WIDTH; i++) { result |= (to_bool(mask.v[i]) ? 1u : 0u) << i; }
+        return result;
+    }
+    static f32 sum(f32x4 a) { return a.v[0] + a.v[1] + a.v[2] + a.v[3]; }
+#endif
+};
@@ -0,0 +1,557 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "logs.hpp"
+#include "constants.hpp"
+#include "solver.hpp"
+#include "intrinsics.hpp"
+
+
+solver::State *solver::state = nullptr;
+
+
+/*!
+    Sets up `solver` for up to `max_n_bodies` dynamic bodies and
+    `max_n_constraints` contact constraints, between entities whose handles
+    are all less than `max_n_entity_handles`.
+*/
+void
+solver::init_solver(
+    Solver *solver,
+    memory::Pool *memory_pool,
+    u32 max_n_bodies,
+    u32 max_n_constraints,
+    u32 max_n_entity_handles
+) {
+    solver->config = {
+        .n_iterations = DEFAULT_N_ITERATIONS,
+        .n_substeps = DEFAULT_N_SUBSTEPS,
+    };
+    // Body 0 is where all static bodies go, so we need one extra.
+    solver->bodies = Array<Body>(memory_pool, max_n_bodies + 1, "solver_bodies");
+    solver->body_indices = Array<u32>(memory_pool, max_n_entity_handles,
+        "solver_body_indices");
+    solver->body_indices.alloc();
+    solver->body_indices.length = max_n_entity_handles;
+    solver->first_free_batches = Array<u32>(memory_pool, max_n_bodies + 1,
+        "solver_first_free_batches");
+    solver->first_free_batches.alloc();
+    solver->first_free_batches.length = max_n_bodies + 1;
+    // In the worst case, every constraint is in its own batch.
+    solver->batches = Array<ConstraintBatch>(memory_pool, max_n_constraints, "solver_batches");
+}
+
+
+/*!
+    Simulates `world` for `dt` seconds, and writes the result back into its
+    spatial and physics components. Returns false if there was nothing that
+    could move, in which case we didn't do anything.
+*/
+bool
+solver::step(Solver *solver, World *world, f32 dt)
+{
+    add_bodies(solver, world);
+    if (solver->bodies.length <= 1) {
+        return false;
+    }
+    add_constraints(solver, world);
+
+    f32 h = dt / (f32)solver->config.n_substeps;
+    Softness softness = get_contact_softness(h);
+    range_named (idx_substep, 0, solver->config.n_substeps) {
+        integrate_velocities(solver, h);
+        warm_start(solver);
+        range_named (idx_iteration, 0, solver->config.n_iterations) {
+            each (batch, solver->batches) {
+                solve_batch(solver, batch, h, &softness);
+            }
+        }
+        integrate_positions(solver, h);
+        each (batch, solver->batches) {
+            solve_batch(solver, batch, h, nullptr);
+        }
+    }
+
+    store_impulses(solver, world);
+    write_back_bodies(solver, world);
+    return true;
+}
+
+
+void
+solver::set_config(u32 n_iterations, u32 n_substeps)
+{
+    solver::state->solver.config.n_iterations = max(1u, min(n_iterations, MAX_N_ITERATIONS));
+    solver::state->solver.config.n_substeps = max(1u, min(n_substeps, MAX_N_SUBSTEPS));
+}
+
+
+solver::Solver *
+solver::get_solver()
+{
+    return &solver::state->solver;
+}
+
+
+void
+solver::init(solver::State *solver_state, memory::Pool *memory_pool)
+{
+    solver::state = solver_state;
+    init_solver(&solver::state->solver, memory_pool, MAX_N_ENTITIES, MAX_N_CONSTRAINTS,
+        MAX_N_ENTITIES);
+}
+
+
+void
+solver::add_bodies(Solver *solver, World *world)
+{
+    // Only reset the indices we set last time, so this doesn't depend on how
+    // many entities there are.
+    range (1, solver->bodies.length) {
+        *solver->body_indices[solver->bodies.items[idx].entity_handle] = 0;
+    }
+    solver->bodies.length = 0;
+
+    solver->bodies.push({
+        .entity_handle = entities::NO_ENTITY_HANDLE,
+        .inverse_mass = 0.0f,
+        .inverse_inertia = m3(0.0f),
+    });
+
+    each (entity_handle, *world->body_handles) {
+        physics::Component *physics_component = (*world->components)[*entity_handle];
+        if (!physics::is_component_dynamic(physics_component)) {
+            continue;
+        }
+        // We write positions back in world space, so we can only move
+        // entities that don't have a parent.
+        spatial::Component *spatial_component =
+            (*world->spatial_components)[physics_component->entity_handle];
+        if (
+            spatial_component->entity_handle == entities::NO_ENTITY_HANDLE ||
+            spatial_component->parent_entity_handle != entities::NO_ENTITY_HANDLE
+        ) {
+            continue;
+        }
+        *solver->body_indices[physics_component->entity_handle] = solver->bodies.length;
+        solver->bodies.push({
+            .entity_handle = physics_component->entity_handle,
+            .velocity = physics_component->velocity,
+            .angular_velocity = physics_component->angular_velocity,
+            .delta_position = v3(0.0f),
+            .delta_rotation = v3(0.0f),
+            .inverse_mass = 1.0f / physics_component->mass,
+            .inverse_inertia = get_inverse_inertia(&physics_component->transformed_obb,
+                physics_component->mass),
+        });
+    }
+}
+
+
+void
+solver::add_constraints(Solver *solver, World *world)
+{
+    solver->batches.length = 0;
+    solver->idx_first_open_batch = 0;
+    memset(solver->first_free_batches.items, 0, sizeof(u32) * solver->bodies.length);
+
+    f32 const no_impulses[3] = {};
+    range (0, world->contacts->length) {
+        physics::Contact *contact = &world->contacts->items[idx];
+        if (
+            *solver->body_indices[contact->entity_handle_a] == 0 &&
+            *solver->body_indices[contact->entity_handle_b] == 0
+        ) {
+            continue;
+        }
+        physics::CachedPair *cached_pair = physics::find_cached_pair(world->pair_cache,
+            contact->entity_handle_a, contact->entity_handle_b);
+        range_named (idx_contact_point, 0, contact->manifold.n_contact_points) {
+            add_constraint(solver, world, idx, idx_contact_point,
+                cached_pair ? cached_pair->impulses[idx_contact_point] : no_impulses);
+        }
+    }
+}
+
+
+/*!
+    Puts a constraint for one contact point in the first batch that comes
+    after every batch its bodies are already in, and that still has room.
+*/
+void
+solver::add_constraint(
+    Solver *solver,
+    World *world,
+    u32 idx_contact,
+    u32 idx_contact_point,
+    f32 const impulses[3]
+) {
+    physics::Contact *contact = &world->contacts->items[idx_contact];
+    u32 idx_body_a = *solver->body_indices[contact->entity_handle_a];
+    u32 idx_body_b = *solver->body_indices[contact->entity_handle_b];
+    Body *a = &solver->bodies.items[idx_body_a];
+    Body *b = &solver->bodies.items[idx_body_b];
+
+    // Body 0 never moves, so its first free batch always stays at 0.
+    u32 idx_batch = max(solver->idx_first_open_batch,
+        max(solver->first_free_batches.items[idx_body_a],
+            solver->first_free_batches.items[idx_body_b]));
+    while (
+        idx_batch < solver->batches.length &&
+        solver->batches.items[idx_batch].n_constraints == simd::WIDTH
+    ) {
+        idx_batch++;
+    }
+    if (idx_batch == solver->batches.length) {
+        if (solver->batches.length == solver->batches.capacity) {
+            logs::warning("Ran out of solver constraint batches, some contacts will be ignored");
+            return;
+        }
+        // A batch of all zeros has every lane pointing at body 0, with no
+        // effective mass, so its unused lanes do nothing.
+        *solver->batches.push() = {};
+    }
+    ConstraintBatch *batch = &solver->batches.items[idx_batch];
+    if (idx_body_a != 0) {
+        solver->first_free_batches.items[idx_body_a] = idx_batch + 1;
+    }
+    if (idx_body_b != 0) {
+        solver->first_free_batches.items[idx_body_b] = idx_batch + 1;
+    }
+
+    u32 lane = batch->n_constraints;
+    batch->n_constraints++;
+    if (batch->n_constraints == simd::WIDTH) {
+        while (
+            solver->idx_first_open_batch < solver->batches.length &&
+            solver->batches.items[solver->idx_first_open_batch].n_constraints == simd::WIDTH
+        ) {
+            solver->idx_first_open_batch++;
+        }
+    }
+
+    physics::CollisionManifold *manifold = &contact->manifold;
+    v3 normal = manifold->normal;
+    v3 contact_point = manifold->contact_points[idx_contact_point];
+    v3 ra = contact_point -
+        (*world->components)[contact->entity_handle_a]->transformed_obb.center;
+    v3 rb = contact_point -
+        (*world->components)[contact->entity_handle_b]->transformed_obb.center;
+
+    // Pick any two tangents perpendicular to the normal, making sure we
+    // don't take the cross product with something nearly parallel to it.
+    v3 tangent_1 = (abs(normal.x) >= 0.57735f) ?
+        normalize(v3(normal.y, -normal.x, 0.0f)) :
+        normalize(v3(0.0f, normal.z, -normal.y));
+    v3 tangent_2 = cross(normal, tangent_1);
+    v3 directions[3] = { tangent_1, tangent_2, normal };
+
+    batch->idx_bodies_a[lane] = idx_body_a;
+    batch->idx_bodies_b[lane] = idx_body_b;
+    batch->idx_contacts[lane] = idx_contact;
+    batch->idx_contact_points[lane] = idx_contact_point;
+    batch->a_inverse_masses[lane] = a->inverse_mass;
+    batch->b_inverse_masses[lane] = b->inverse_mass;
+    batch->base_separations[lane] = -manifold->contact_depths[idx_contact_point];
+    range_named (d, 0, 3) {
+        v3 a_angular = cross(ra, directions[d]);
+        v3 b_angular = cross(rb, directions[d]);
+        v3 a_angular_response = a->inverse_inertia * a_angular;
+        v3 b_angular_response = b->inverse_inertia * b_angular;
+        f32 k = a->inverse_mass + b->inverse_mass +
+            dot(a_angular, a_angular_response) + dot(b_angular, b_angular_response);
+        range_named (c, 0, 3) {
+            batch->directions[d][c][lane] = directions[d][c];
+            batch->a_angular[d][c][lane] = a_angular[c];
+            batch->b_angular[d][c][lane] = b_angular[c];
+            batch->a_angular_responses[d][c][lane] = a_angular_response[c];
+            batch->b_angular_responses[d][c][lane] = b_angular_response[c];
+        }
+        batch->effective_masses[d][lane] = (k > 0.0f) ? 1.0f / k : 0.0f;
+        batch->impulses[d][lane] = impulses[d];
+    }
+}
+
+
+void
+solver::integrate_velocities(Solver *solver, f32 h)
+{
+    range (1, solver->bodies.length) {
+        solver->bodies.items[idx].velocity += GRAVITY * h;
+    }
+}
+
+
+void
+solver::integrate_positions(Solver *solver, f32 h)
+{
+    range (1, solver->bodies.length) {
+        Body *body = &solver->bodies.items[idx];
+        body->delta_position += body->velocity * h;
+        body->delta_rotation += body->angular_velocity * h;
+    }
+}
+
+
+/*!
+    Applies the impulses we've accumulated so far, so we don't have to find
+    them from scratch every substep.
+*/
+void
+solver::warm_start(Solver *solver)
+{
+    each (batch, solver->batches) {
+        range_named (lane, 0, batch->n_constraints) {
+            Body *a = &solver->bodies.items[batch->idx_bodies_a[lane]];
+            Body *b = &solver->bodies.items[batch->idx_bodies_b[lane]];
+            range_named (d, 0, 3) {
+                f32 impulse = batch->impulses[d][lane];
+                range_named (c, 0, 3) {
+                    a->velocity[c] -= batch->directions[d][c][lane] * impulse *
+                        batch->a_inverse_masses[lane];
+                    a->angular_velocity[c] -= batch->a_angular_responses[d][c][lane] * impulse;
+                    b->velocity[c] += batch->directions[d][c][lane] * impulse *
+                        batch->b_inverse_masses[lane];
+                    b->angular_velocity[c] += batch->b_angular_responses[d][c][lane] * impulse;
+                }
+            }
+        }
+    }
+}
+
+
+/*!
+    Solves each of a batch's constraints once, friction first, then the
+    contact normal. If we're given a softness, we also push penetrating bodies
+    apart.
+*/
+void
+solver::solve_batch(
+    Solver *solver,
+    ConstraintBatch *batch,
+    f32 h,
+    Softness *softness_or_nullptr
+)
+{
+    // Load each lane's bodies into lanes.
+    f32 gathered[8][3][simd::WIDTH];
+    range_named (lane, 0, simd::WIDTH) {
+        Body *a = &solver->bodies.items[batch->idx_bodies_a[lane]];
+        Body *b = &solver->bodies.items[batch->idx_bodies_b[lane]];
+        range_named (c, 0, 3) {
+            gathered[0][c][lane] = a->velocity[c];
+            gathered[1][c][lane] = a->angular_velocity[c];
+            gathered[2][c][lane] = b->velocity[c];
+            gathered[3][c][lane] = b->angular_velocity[c];
+            gathered[4][c][lane] = a->delta_position[c];
+            gathered[5][c][lane] = a->delta_rotation[c];
+            gathered[6][c][lane] = b->delta_position[c];
+            gathered[7][c][lane] = b->delta_rotation[c];
+        }
+    }
+    simd::f32x4 va[3], wa[3], vb[3], wb[3];
+    range_named (c, 0, 3) {
+        va[c] = simd::load(gathered[0][c]);
+        wa[c] = simd::load(gathered[1][c]);
+        vb[c] = simd::load(gathered[2][c]);
+        wb[c] = simd::load(gathered[3][c]);
+    }
+
+    auto load3 = [](f32 const src[3][simd::WIDTH], simd::f32x4 dest[3]) {
+        range_named (c, 0, 3) {
+            dest[c] = simd::load(src[c]);
+        }
+    };
+    auto dot3 = [](simd::f32x4 const a[3], simd::f32x4 const b[3]) -> simd::f32x4 {
+        return simd::add(simd::add(simd::mul(a[0], b[0]), simd::mul(a[1], b[1])),
+            simd::mul(a[2], b[2]));
+    };
+
+    simd::f32x4 zero = simd::set1(0.0f);
+    simd::f32x4 inverse_h = simd::set1(1.0f / h);
+    simd::f32x4 a_inverse_mass = simd::load(batch->a_inverse_masses);
+    simd::f32x4 b_inverse_mass = simd::load(batch->b_inverse_masses);
+
+    // The normal comes last, so the friction limit is last iteration's
+    // normal impulse.
+    range_named (d, 0, 3) {
+        simd::f32x4 direction[3], a_angular[3], b_angular[3];
+        simd::f32x4 a_angular_response[3], b_angular_response[3];
+        load3(batch->directions[d], direction);
+        load3(batch->a_angular[d], a_angular);
+        load3(batch->b_angular[d], b_angular);
+        load3(batch->a_angular_responses[d], a_angular_response);
+        load3(batch->b_angular_responses[d], b_angular_response);
+
+        simd::f32x4 dv[3];
+        range_named (c, 0, 3) {
+            dv[c] = simd::sub(vb[c], va[c]);
+        }
+        simd::f32x4 relative_velocity = simd::sub(
+            simd::add(dot3(direction, dv), dot3(b_angular, wb)),
+            dot3(a_angular, wa));
+
+        simd::f32x4 effective_mass = simd::load(batch->effective_masses[d]);
+        simd::f32x4 old_impulse = simd::load(batch->impulses[d]);
+        simd::f32x4 new_impulse;
+
+        if (d < 2) {
+            simd::f32x4 limit = simd::mul(simd::set1(FRICTION), simd::load(batch->impulses[2]));
+            simd::f32x4 lambda = simd::mul(effective_mass, simd::sub(zero, relative_velocity));
+            new_impulse = simd::max(simd::sub(zero, limit),
+                simd::min(simd::add(old_impulse, lambda), limit));
+        } else {
+            // Find the current separation from how far the bodies have moved
+            // since we found the contact.
+            simd::f32x4 dpa[3], dra[3], dpb[3], drb[3], dp[3];
+            range_named (c, 0, 3) {
+                dpa[c] = simd::load(gathered[4][c]);
+                dra[c] = simd::load(gathered[5][c]);
+                dpb[c] = simd::load(gathered[6][c]);
+                drb[c] = simd::load(gathered[7][c]);
+                dp[c] = simd::sub(dpb[c], dpa[c]);
+            }
+            simd::f32x4 separation = simd::add(simd::load(batch->base_separations),
+                simd::sub(simd::add(dot3(direction, dp), dot3(b_angular, drb)),
+                    dot3(a_angular, dra)));
+
+            // Bodies that aren't touching yet can get closer by at most the
+            // gap between them. Bodies that are penetrating get pushed apart
+            // by a soft constraint, which is what keeps this from adding
+            // energy, but only in the biased pass.
+            simd::f32x4 is_separated = simd::gt(separation, zero);
+            simd::f32x4 bias = zero;
+            simd::f32x4 mass_scale = simd::set1(1.0f);
+            simd::f32x4 impulse_scale = zero;
+            if (softness_or_nullptr) {
+                bias = simd::max(simd::mul(simd::set1(softness_or_nullptr->bias_rate), separation),
+                    simd::set1(-MAX_PUSH_VELOCITY));
+                mass_scale = simd::select(is_separated, mass_scale,
+                    simd::set1(softness_or_nullptr->mass_scale));
+                impulse_scale = simd::select(is_separated, impulse_scale,
+                    simd::set1(softness_or_nullptr->impulse_scale));
+            }
+            bias = simd::select(is_separated, simd::mul(separation, inverse_h), bias);
+            simd::f32x4 lambda = simd::sub(
+                simd::mul(simd::mul(effective_mass, mass_scale),
+                    simd::sub(zero, simd::add(relative_velocity, bias))),
+                simd::mul(impulse_scale, old_impulse));
+            new_impulse = simd::max(simd::add(old_impulse, lambda), zero);
+        }
+
+        simd::store(batch->impulses[d], new_impulse);
+        simd::f32x4 delta = simd::sub(new_impulse, old_impulse);
+        simd::f32x4 a_delta = simd::mul(delta, a_inverse_mass);
+        simd::f32x4 b_delta = simd::mul(delta, b_inverse_mass);
+        range_named (c, 0, 3) {
+            va[c] = simd::sub(va[c], simd::mul(direction[c], a_delta));
+            vb[c] = simd::add(vb[c], simd::mul(direction[c], b_delta));
+            wa[c] = simd::sub(wa[c], simd::mul(a_angular_response[c], delta));
+            wb[c] = simd::add(wb[c], simd::mul(b_angular_response[c], delta));
+        }
+    }
+
+    // No two lanes share a body that can move, so we can write them all back.
+    range_named (c, 0, 3) {
+        simd::store(gathered[0][c], va[c]);
+        simd::store(gathered[1][c], wa[c]);
+        simd::store(gathered[2][c], vb[c]);
+        simd::store(gathered[3][c], wb[c]);
+    }
+    range_named (lane, 0, batch->n_constraints) {
+        Body *a = &solver->bodies.items[batch->idx_bodies_a[lane]];
+        Body *b = &solver->bodies.items[batch->idx_bodies_b[lane]];
+        range_named (c, 0, 3) {
+            a->velocity[c] = gathered[0][c][lane];
+            a->angular_velocity[c] = gathered[1][c][lane];
+            b->velocity[c] = gathered[2][c][lane];
+            b->angular_velocity[c] = gathered[3][c][lane];
+        }
+    }
+}
+
+
+void
+solver::store_impulses(Solver *solver, World *world)
+{
+    each (batch, solver->batches) {
+        range_named (lane, 0, batch->n_constraints) {
+            physics::Contact *contact = &world->contacts->items[batch->idx_contacts[lane]];
+            physics::CachedPair *cached_pair = physics::find_cached_pair(world->pair_cache,
+                contact->entity_handle_a, contact->entity_handle_b);
+            if (!cached_pair) {
+                continue;
+            }
+            range_named (d, 0, 3) {
+                cached_pair->impulses[batch->idx_contact_points[lane]][d] =
+                    batch->impulses[d][lane];
+            }
+        }
+    }
+}
+
+
+/*!
+    Moves each body's spatial component by how far the body moved, rotating
+    it around its center of mass, which is the center of its OBB.
+*/
+void
+solver::write_back_bodies(Solver *solver, World *world)
+{
+    range (1, solver->bodies.length) {
+        Body *body = &solver->bodies.items[idx];
+        physics::Component *physics_component = (*world->components)[body->entity_handle];
+        spatial::Component *spatial_component =
+            (*world->spatial_components)[body->entity_handle];
+
+        physics_component->velocity = body->velocity;
+        physics_component->angular_velocity = body->angular_velocity;
+
+        quat delta_rotation = quat(1.0f, 0.0f, 0.0f, 0.0f);
+        f32 angle = length(body->delta_rotation);
+        if (angle > 0.0f) {
+            delta_rotation = glm::angleAxis(angle, body->delta_rotation / angle);
+        }
+        v3 center = physics_component->transformed_obb.center;
+        spatial_component->position = center + body->delta_position +
+            delta_rotation * (spatial_component->position - center);
+        spatial_component->rotation = normalize(delta_rotation * spatial_component->rotation);
+    }
+}
+
+
+/*!
+    Works out how to push penetrating bodies apart like a damped spring,
+    rather than all at once, as in Erin Catto's "Solver2D". The spring can't
+    be stiffer than a quarter of the substep rate, or it would overshoot.
+*/
+solver::Softness
+solver::get_contact_softness(f32 h)
+{
+    f32 hertz = min(CONTACT_HERTZ, 0.25f / h);
+    f32 omega = 2.0f * PI32 * hertz;
+    f32 a1 = 2.0f * CONTACT_DAMPING_RATIO + h * omega;
+    f32 a2 = h * omega * a1;
+    f32 a3 = 1.0f / (1.0f + a2);
+    return {
+        .bias_rate = omega / a1,
+        .mass_scale = a2 * a3,
+        .impulse_scale = a3,
+    };
+}
+
+
+/*!
+    The inverse inertia tensor of a solid box, in world space.
+*/
+m3
+solver::get_inverse_inertia(spatial::Obb *obb, f32 mass)
+{
+    v3 e2 = obb->extents * obb->extents;
+    v3 inertia = (mass / 3.0f) * v3(e2.y + e2.z, e2.x + e2.z, e2.x + e2.y);
+    m3 rotation = m3(obb->x_axis, obb->y_axis, cross(obb->x_axis, obb->y_axis));
+    m3 inverse_local_inertia = m3(0.0f);
+    inverse_local_inertia[0][0] = 1.0f / inertia.x;
+    inverse_local_inertia[1][1] = 1.0f / inertia.y;
+    inverse_local_inertia[2][2] = 1.0f / inertia.z;
+    return rotation * inverse_local_inertia * transpose(rotation);
+}
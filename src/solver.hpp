@@ -0,0 +1,169 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "memory.hpp"
+#include "array.hpp"
+#include "entities.hpp"
+#include "spatial.hpp"
+#include "physics.hpp"
+#include "simd.hpp"
+
+/*!
+    A sequential impulse solver, which moves bodies with mass, and pushes them
+    apart wherever the narrowphase found contacts.
+
+    Each call to `step()` simulates one fixed timestep, split into
+    `n_substeps` substeps. In each substep, we integrate gravity, solve
+    every contact's normal and friction constraints `n_iterations` times,
+    integrate positions, then solve once more without any position correction,
+    so that the correction doesn't leave bodies with extra velocity. Contacts
+    are only found once per step, and in between substeps we estimate how far
+    apart the two bodies are from how far each has moved since, which is what
+    lets us afford several substeps.
+
+    Constraints are split into batches of up to `simd::WIDTH`, where no two
+    constraints in a batch share a body that can move, so we solve a batch
+    at once, one constraint per lane, without them stepping on each other.
+    Static bodies all map to body 0, which never moves.
+
+    Contact point impulses are kept in the physics pair cache, so each step
+    starts off from last step's impulses, which is what keeps stacks stable.
+*/
+class solver {
+public:
+    static constexpr f32 FIXED_TIMESTEP = 1.0f / 60.0f;
+    // If we fall further behind than this, we drop the extra time.
+    static constexpr u32 MAX_N_STEPS_PER_FRAME = 2;
+    static constexpr u32 DEFAULT_N_ITERATIONS = 4;
+    static constexpr u32 DEFAULT_N_SUBSTEPS = 4;
+    static constexpr u32 MAX_N_ITERATIONS = 32;
+    static constexpr u32 MAX_N_SUBSTEPS = 32;
+    static constexpr u32 MAX_N_CONSTRAINTS =
+        physics::MAX_N_CANDIDATE_PAIRS * physics::MAX_N_CONTACT_POINTS;
+    // How stiff and how damped the spring that pushes penetrating bodies
+    // apart is
+    static constexpr f32 CONTACT_HERTZ = 30.0f;
+    static constexpr f32 CONTACT_DAMPING_RATIO = 10.0f;
+    // The fastest we push penetrating bodies apart, in m/s
+    static constexpr f32 MAX_PUSH_VELOCITY = 3.0f;
+    static constexpr f32 FRICTION = 0.6f;
+    static constexpr v3 GRAVITY = v3(0.0f, -9.8f, 0.0f);
+
+    struct Config {
+        u32 n_iterations;
+        u32 n_substeps;
+    };
+
+    // Everything the solver needs to know about a body with mass, in world
+    // space. The deltas are how far the body has moved since the start of the
+    // step.
+    struct Body {
+        entities::Handle entity_handle;
+        v3 velocity;
+        v3 angular_velocity;
+        v3 delta_position;
+        v3 delta_rotation;
+        f32 inverse_mass;
+        m3 inverse_inertia;
+    };
+
+    // Up to `simd::WIDTH` constraints, each on one contact point, with each
+    // value stored as `values[...][idx_lane]`. The three directions are the
+    // two friction tangents, then the contact normal. Unused lanes point at
+    // body 0, and have no effective mass, so they do nothing.
+    struct ConstraintBatch {
+        u32 idx_bodies_a[simd::WIDTH];
+        u32 idx_bodies_b[simd::WIDTH];
+        u32 idx_contacts[simd::WIDTH];
+        u32 idx_contact_points[simd::WIDTH];
+        f32 directions[3][3][simd::WIDTH];
+        // The cross product of the contact point's offset from each body's
+        // center with each direction
+        f32 a_angular[3][3][simd::WIDTH];
+        f32 b_angular[3][3][simd::WIDTH];
+        // The above, multiplied by each body's inverse inertia
+        f32 a_angular_responses[3][3][simd::WIDTH];
+        f32 b_angular_responses[3][3][simd::WIDTH];
+        f32 a_inverse_masses[simd::WIDTH];
+        f32 b_inverse_masses[simd::WIDTH];
+        f32 effective_masses[3][simd::WIDTH];
+        // The separation at the start of the step, which is negative when
+        // the bodies are penetrating
+        f32 base_separations[simd::WIDTH];
+        f32 impulses[3][simd::WIDTH];
+        u32 n_constraints;
+    };
+
+    struct Solver {
+        Config config;
+        Array<Body> bodies;
+        // The index into `bodies` of each entity, or 0 for static ones
+        Array<u32> body_indices;
+        // The first batch each body can go in, which is the one after the
+        // last batch it's already in
+        Array<u32> first_free_batches;
+        Array<ConstraintBatch> batches;
+        // Every batch before this one is full
+        u32 idx_first_open_batch;
+    };
+
+    // The components and contacts that a step works on. We only move the
+    // dynamic bodies in `body_handles`, and treat every other body as static.
+    struct World {
+        Array<physics::Component> *components;
+        Array<spatial::Component> *spatial_components;
+        Array<physics::Contact> *contacts;
+        physics::PairCache *pair_cache;
+        Array<entities::Handle> *body_handles;
+    };
+
+    struct State {
+        Solver solver;
+    };
+
+    struct Softness {
+        f32 bias_rate;
+        f32 mass_scale;
+        f32 impulse_scale;
+    };
+
+    static void init_solver(
+        Solver *solver,
+        memory::Pool *memory_pool,
+        u32 max_n_bodies,
+        u32 max_n_constraints,
+        u32 max_n_entity_handles
+    );
+    static bool step(Solver *solver, World *world, f32 dt);
+    static void set_config(u32 n_iterations, u32 n_substeps);
+    static Solver * get_solver();
+    static void init(solver::State *solver_state, memory::Pool *memory_pool);
+
+private:
+    static void add_bodies(Solver *solver, World *world);
+    static void add_constraints(Solver *solver, World *world);
+    static void add_constraint(
+        Solver *solver,
+        World *world,
+        u32 idx_contact,
+        u32 idx_contact_point,
+        f32 const impulses[3]
+    );
+    static void integrate_velocities(Solver *solver, f32 h);
+    static void integrate_positions(Solver *solver, f32 h);
+    static void warm_start(Solver *solver);
+    static void solve_batch(
+        Solver *solver,
+        ConstraintBatch *batch,
+        f32 h,
+        Softness *softness_or_nullptr
+    );
+    static Softness get_contact_softness(f32 h);
+    static void store_impulses(Solver *solver, World *world);
+    static void write_back_bodies(Solver *solver, World *world);
+    static m3 get_inverse_inertia(spatial::Obb *obb, f32 mass);
+
+    static solver::State *state;
+};
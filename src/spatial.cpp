@@ -3,6 +3,7 @@
 #include "spatial.hpp"
 #include "logs.hpp"
 #include "engine.hpp"
+#include "intrinsics.hpp"
 
 
 spatial::State *spatial::state = nullptr;
@@ -43,6 +44,120 @@ spatial::is_spatial_component_valid(spatial::Component *spatial_component)
 }
 
 
+spatial::Aabb
+spatial::make_aabb_from_obb(Obb *obb)
+{
+    // The AABB's half-size along each world axis is the sum of the OBB's axes'
+    // projections onto that world axis.
+    v3 z_axis = cross(obb->x_axis, obb->y_axis);
+    v3 half_size =
+        abs(obb->x_axis) * obb->extents.x +
+        abs(obb->y_axis) * obb->extents.y +
+        abs(z_axis) * obb->extents.z;
+    return {
+        .min = obb->center - half_size,
+        .max = obb->center + half_size,
+    };
+}
+
+
+spatial::Aabb
+spatial::transform_aabb(Aabb *aabb, m4 *transform)
+{
+    // Same as for an OBB, the columns of `transform` are the box's axes.
+    v3 center = v3(*transform * v4((aabb->min + aabb->max) * 0.5f, 1.0f));
+    v3 extents = (aabb->max - aabb->min) * 0.5f;
+    v3 half_size =
+        abs(v3((*transform)[0])) * extents.x +
+        abs(v3((*transform)[1])) * extents.y +
+        abs(v3((*transform)[2])) * extents.z;
+    return {
+        .min = center - half_size,
+        .max = center + half_size,
+    };
+}
+
+
+spatial::Aabb
+spatial::merge_aabbs(Aabb *a, Aabb *b)
+{
+    return {
+        .min = min(a->min, b->min),
+        .max = max(a->max, b->max),
+    };
+}
+
+
+spatial::Aabb
+spatial::grow_aabb(Aabb *aabb, f32 margin)
+{
+    return {
+        .min = aabb->min - v3(margin),
+        .max = aabb->max + v3(margin),
+    };
+}
+
+
+bool
+spatial::do_aabbs_overlap(Aabb *a, Aabb *b)
+{
+    return a->min.x <= b->max.x && a->max.x >= b->min.x &&
+        a->min.y <= b->max.y && a->max.y >= b->min.y &&
+        a->min.z <= b->max.z && a->max.z >= b->min.z;
+}
+
+
+bool
+spatial::does_aabb_contain_aabb(Aabb *outer, Aabb *inner)
+{
+    return outer->min.x <= inner->min.x && outer->max.x >= inner->max.x &&
+        outer->min.y <= inner->min.y && outer->max.y >= inner->max.y &&
+        outer->min.z <= inner->min.z && outer->max.z >= inner->max.z;
+}
+
+
+f32
+spatial::get_aabb_surface_area(Aabb *aabb)
+{
+    v3 size = aabb->max - aabb->min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+
+/*!
+    Slab test. Returns whether the ray hits the AABB at a distance of at most
+    `max_distance`. If the ray starts inside the AABB, that counts as a hit.
+*/
+bool
+spatial::intersect_aabb_ray(Aabb *aabb, Ray *ray, f32 max_distance)
+{
+    f32 tmin = 0.0f;
+    f32 tmax = max_distance;
+    range_named (i, 0, 3) {
+        if (ray->direction[i] == 0.0f) {
+            if (ray->origin[i] < aabb->min[i] || ray->origin[i] > aabb->max[i]) {
+                return false;
+            }
+            continue;
+        }
+        f32 inv_direction = 1.0f / ray->direction[i];
+        f32 t0 = (aabb->min[i] - ray->origin[i]) * inv_direction;
+        f32 t1 = (aabb->max[i] - ray->origin[i]) * inv_direction;
+        if (t0 > t1) {
+            f32 temp = t0;
+            t0 = t1;
+            t1 = temp;
+        }
+        tmin = max(tmin, t0);
+        tmax = min(tmax, t1);
+        if (tmin > tmax) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
 m4
 spatial::make_model_matrix(
     spatial::Component *spatial_component,
@@ -14,6 +14,11 @@ public:
         v3 extents;
     };
 
+    struct Aabb {
+        v3 min;
+        v3 max;
+    };
+
     struct Face {
         v3 vertices[4];
     };
@@ -46,6 +51,14 @@ public:
     static void print_spatial_component(Component *spatial_component);
     static bool does_spatial_component_have_dimensions(Component *spatial_component);
     static bool is_spatial_component_valid(Component *spatial_component);
+    static Aabb make_aabb_from_obb(Obb *obb);
+    static Aabb transform_aabb(Aabb *aabb, m4 *transform);
+    static Aabb merge_aabbs(Aabb *a, Aabb *b);
+    static Aabb grow_aabb(Aabb *aabb, f32 margin);
+    static bool do_aabbs_overlap(Aabb *a, Aabb *b);
+    static bool does_aabb_contain_aabb(Aabb *outer, Aabb *inner);
+    static f32 get_aabb_surface_area(Aabb *aabb);
+    static bool intersect_aabb_ray(Aabb *aabb, Ray *ray, f32 max_distance);
     static m4 make_model_matrix(
         Component *spatial_component,
         ModelMatrixCache *cache
@@ -0,0 +1,359 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#include "logs.hpp"
+#include "spatialgrid.hpp"
+#include "intrinsics.hpp"
+
+
+spatialgrid::State *spatialgrid::state = nullptr;
+
+
+void
+spatialgrid::init_grid(
+    Grid *grid,
+    memory::Pool *memory_pool,
+    u32 max_n_entries,
+    f32 cell_size
+) {
+    // Keep the load factor at 0.5 or below, and make the number of buckets a
+    // power of two so we can mask instead of using a modulo.
+    u32 n_buckets = 64;
+    while (n_buckets < 2 * max_n_entries) {
+        n_buckets *= 2;
+    }
+
+    grid->cell_size = cell_size;
+    grid->n_buckets = n_buckets;
+    grid->unsorted_entries = Array<Entry>(memory_pool, max_n_entries, "spatialgrid_unsorted_entries");
+    grid->entries = Array<Entry>(memory_pool, max_n_entries, "spatialgrid_entries");
+    grid->bucket_starts = Array<u32>(memory_pool, n_buckets + 1, "spatialgrid_bucket_starts");
+    grid->unsorted_entries.alloc();
+    grid->entries.alloc();
+    grid->bucket_starts.alloc();
+    grid->bucket_starts.length = n_buckets + 1;
+    grid->min_cell = iv3(0);
+    grid->max_cell = iv3(-1);
+}
+
+
+void
+spatialgrid::begin_rebuild(Grid *grid)
+{
+    grid->unsorted_entries.length = 0;
+}
+
+
+void
+spatialgrid::add_entry(Grid *grid, entities::Handle entity_handle, v3 position)
+{
+    grid->unsorted_entries.push({
+        .position = position,
+        .cell = get_cell(grid, position),
+        .entity_handle = entity_handle,
+    });
+}
+
+
+/*!
+    Sorts the entries added since `begin_rebuild()` by bucket, using a
+    counting sort, which is linear in the number of entries and buckets.
+*/
+void
+spatialgrid::end_rebuild(Grid *grid)
+{
+    u32 n_entries = grid->unsorted_entries.length;
+    u32 *bucket_starts = grid->bucket_starts.items;
+    memset(bucket_starts, 0, sizeof(u32) * (grid->n_buckets + 1));
+
+    grid->min_cell = iv3(INT32_MAX);
+    grid->max_cell = iv3(INT32_MIN);
+
+    // Count the entries in each bucket, offset by one so that the prefix sum
+    // below gives us the start of each bucket.
+    range (0, n_entries) {
+        Entry *entry = &grid->unsorted_entries.items[idx];
+        bucket_starts[get_bucket(grid, entry->cell) + 1]++;
+        grid->min_cell = min(grid->min_cell, entry->cell);
+        grid->max_cell = max(grid->max_cell, entry->cell);
+    }
+    range (0, grid->n_buckets) {
+        bucket_starts[idx + 1] += bucket_starts[idx];
+    }
+
+    // Scatter the entries into their buckets, using each bucket's start as a
+    // cursor. Afterwards, each bucket's start has moved to the next bucket's
+    // start, so we shift everything back by one.
+    range (0, n_entries) {
+        Entry *entry = &grid->unsorted_entries.items[idx];
+        u32 idx_bucket = get_bucket(grid, entry->cell);
+        grid->entries.items[bucket_starts[idx_bucket]++] = *entry;
+    }
+    for (u32 idx = grid->n_buckets; idx > 0; idx--) {
+        bucket_starts[idx] = bucket_starts[idx - 1];
+    }
+    bucket_starts[0] = 0;
+
+    grid->entries.length = n_entries;
+}
+
+
+/*!
+    Writes the handles of up to `max_n_results` entities within `radius` of
+    `center` to `results`, and returns how many were written.
+*/
+u32
+spatialgrid::overlap_sphere(
+    Grid *grid,
+    v3 center,
+    f32 radius,
+    entities::Handle *results,
+    u32 max_n_results
+) {
+    u32 n_results = 0;
+    if (max_n_results == 0) {
+        return 0;
+    }
+    f32 radius_squared = radius * radius;
+    for_each_entry_in_cells(grid,
+        get_cell(grid, center - v3(radius)),
+        get_cell(grid, center + v3(radius)),
+        [&](Entry *entry) -> bool {
+            if (length2(entry->position - center) <= radius_squared) {
+                results[n_results++] = entry->entity_handle;
+            }
+            return n_results < max_n_results;
+        });
+    return n_results;
+}
+
+
+/*!
+    Writes the handles of up to `max_n_results` entities inside `box` to
+    `results`, and returns how many were written.
+*/
+u32
+spatialgrid::overlap_box(
+    Grid *grid,
+    spatial::Aabb *box,
+    entities::Handle *results,
+    u32 max_n_results
+) {
+    u32 n_results = 0;
+    if (max_n_results == 0) {
+        return 0;
+    }
+    for_each_entry_in_cells(grid,
+        get_cell(grid, box->min),
+        get_cell(grid, box->max),
+        [&](Entry *entry) -> bool {
+            if (
+                entry->position.x >= box->min.x && entry->position.x <= box->max.x &&
+                entry->position.y >= box->min.y && entry->position.y <= box->max.y &&
+                entry->position.z >= box->min.z && entry->position.z <= box->max.z
+            ) {
+                results[n_results++] = entry->entity_handle;
+            }
+            return n_results < max_n_results;
+        });
+    return n_results;
+}
+
+
+/*!
+    Finds the `k` entities closest to `point` that are at most `max_distance`
+    away. Their handles are written to `results` and their distances to
+    `distances`, both of which must have space for `k` items, sorted from
+    nearest to furthest. Returns how many were found.
+
+    We look at the cells in growing shells around `point`'s cell. Any entity in
+    shell `r + 1` or further out is at least `r * cell_size` away, so once we
+    have `k` entities closer than that, we can stop.
+*/
+u32
+spatialgrid::find_k_nearest(
+    Grid *grid,
+    v3 point,
+    u32 k,
+    f32 max_distance,
+    entities::Handle *results,
+    f32 *distances
+) {
+    u32 n_results = 0;
+    if (k == 0 || grid->entries.length == 0) {
+        return 0;
+    }
+
+    // We keep squared distances while searching, and take the square root at
+    // the end.
+    f32 max_distance_squared = max_distance * max_distance;
+    auto consider_entry = [&](Entry *entry) -> bool {
+        f32 distance_squared = length2(entry->position - point);
+        if (distance_squared > max_distance_squared) {
+            return true;
+        }
+        if (n_results == k && distance_squared >= distances[k - 1]) {
+            return true;
+        }
+        // Insertion sort, since `k` is small.
+        u32 idx = (n_results < k) ? n_results++ : k - 1;
+        while (idx > 0 && distances[idx - 1] > distance_squared) {
+            distances[idx] = distances[idx - 1];
+            results[idx] = results[idx - 1];
+            idx--;
+        }
+        distances[idx] = distance_squared;
+        results[idx] = entry->entity_handle;
+        return true;
+    };
+
+    iv3 center_cell = get_cell(grid, point);
+    // Once our shell contains every occupied cell, there's nothing more to see.
+    iv3 furthest_occupied = max(
+        glm::abs(grid->max_cell - center_cell),
+        glm::abs(grid->min_cell - center_cell));
+    i32 max_shell = max(furthest_occupied.x, max(furthest_occupied.y, furthest_occupied.z));
+
+    for (i32 shell = 0; shell <= max_shell; shell++) {
+        if (shell == 0) {
+            for_each_entry_in_cells(grid, center_cell, center_cell, consider_entry);
+        } else {
+            // The top and bottom faces of the shell, then the four sides,
+            // without their top and bottom rows, which we've already done.
+            iv3 shell_min = center_cell - iv3(shell);
+            iv3 shell_max = center_cell + iv3(shell);
+            for_each_entry_in_cells(grid,
+                iv3(shell_min.x, shell_min.y, shell_min.z),
+                iv3(shell_max.x, shell_max.y, shell_min.z), consider_entry);
+            for_each_entry_in_cells(grid,
+                iv3(shell_min.x, shell_min.y, shell_max.z),
+                iv3(shell_max.x, shell_max.y, shell_max.z), consider_entry);
+            for_each_entry_in_cells(grid,
+                iv3(shell_min.x, shell_min.y, shell_min.z + 1),
+                iv3(shell_min.x, shell_max.y, shell_max.z - 1), consider_entry);
+            for_each_entry_in_cells(grid,
+                iv3(shell_max.x, shell_min.y, shell_min.z + 1),
+                iv3(shell_max.x, shell_max.y, shell_max.z - 1), consider_entry);
+            for_each_entry_in_cells(grid,
+                iv3(shell_min.x + 1, shell_min.y, shell_min.z + 1),
+                iv3(shell_max.x - 1, shell_min.y, shell_max.z - 1), consider_entry);
+            for_each_entry_in_cells(grid,
+                iv3(shell_min.x + 1, shell_max.y, shell_min.z + 1),
+                iv3(shell_max.x - 1, shell_max.y, shell_max.z - 1), consider_entry);
+        }
+
+        f32 searched_distance = (f32)shell * grid->cell_size;
+        if (searched_distance >= max_distance) {
+            break;
+        }
+        if (n_results == k && distances[k - 1] <= searched_distance * searched_distance) {
+            break;
+        }
+    }
+
+    range (0, n_results) {
+        distances[idx] = sqrt(distances[idx]);
+    }
+    return n_results;
+}
+
+
+/*!
+    Runs `overlap_sphere()` for `n_queries` spheres. The results for query `i`
+    are written to `results[i * max_n_results_per_query]` onwards, and their
+    number to `n_results[i]`.
+*/
+void
+spatialgrid::overlap_spheres(
+    Grid *grid,
+    v3 const *centers,
+    f32 const *radii,
+    u32 n_queries,
+    entities::Handle *results,
+    u32 max_n_results_per_query,
+    u32 *n_results
+) {
+    range (0, n_queries) {
+        n_results[idx] = overlap_sphere(grid, centers[idx], radii[idx],
+            &results[idx * max_n_results_per_query], max_n_results_per_query);
+    }
+}
+
+
+/*!
+    Runs `find_k_nearest()` for `n_queries` points. The results for query `i`
+    are written to `results[i * k]` and `distances[i * k]` onwards, and their
+    number to `n_results[i]`.
+*/
+void
+spatialgrid::find_k_nearest_batch(
+    Grid *grid,
+    v3 const *points,
+    u32 n_queries,
+    u32 k,
+    f32 max_distance,
+    entities::Handle *results,
+    f32 *distances,
+    u32 *n_results
+) {
+    range (0, n_queries) {
+        n_results[idx] = find_k_nearest(grid, points[idx], k, max_distance,
+            &results[idx * k], &distances[idx * k]);
+    }
+}
+
+
+spatialgrid::Grid *
+spatialgrid::get_grid()
+{
+    return &spatialgrid::state->grid;
+}
+
+
+void
+spatialgrid::update()
+{
+    // Moving, adding or removing any spatial component marks it as changed,
+    // so if nothing has changed, the grid is still correct.
+    if (entities::get_changed_handles(entities::ComponentType::spatial)->length == 0) {
+        return;
+    }
+
+    Grid *grid = &spatialgrid::state->grid;
+    begin_rebuild(grid);
+    each (spatial_component, *spatial::get_components()) {
+        if (
+            spatial_component->entity_handle == entities::NO_ENTITY_HANDLE ||
+            !spatial::is_spatial_component_valid(spatial_component)
+        ) {
+            continue;
+        }
+        add_entry(grid, spatial_component->entity_handle, spatial_component->position);
+    }
+    end_rebuild(grid);
+}
+
+
+void
+spatialgrid::init(spatialgrid::State *spatialgrid_state, memory::Pool *asset_memory_pool)
+{
+    spatialgrid::state = spatialgrid_state;
+    init_grid(&spatialgrid::state->grid, asset_memory_pool, MAX_N_ENTITIES, DEFAULT_CELL_SIZE);
+}
+
+
+iv3
+spatialgrid::get_cell(Grid *grid, v3 position)
+{
+    return iv3(floor(position / grid->cell_size));
+}
+
+
+u32
+spatialgrid::get_bucket(Grid *grid, iv3 cell)
+{
+    // Large primes from Teschner et al., "Optimized Spatial Hashing for
+    // Collision Detection of Deformable Objects".
+    u32 hash = ((u32)cell.x * 73856093u) ^ ((u32)cell.y * 19349663u) ^
+        ((u32)cell.z * 83492791u);
+    return hash & (grid->n_buckets - 1);
+}
@@ -0,0 +1,169 @@
+// (c) 2020 Vlad-Stefan Harbuz <vlad@vladh.net>
+
+#pragma once
+
+#include "types.hpp"
+#include "array.hpp"
+#include "entities.hpp"
+#include "spatial.hpp"
+
+/*!
+    A uniform spatial hash grid of entity positions, used to answer "what is
+    near this point" without going through every spatial component.
+
+    Space is split into cubic cells of `cell_size`, and each cell is hashed
+    into one of `n_buckets` buckets. Rather than keeping a list per bucket, we
+    rebuild the whole grid at once with a counting sort, so all entries in a
+    bucket sit next to each other in `entries`, and `bucket_starts[i]` to
+    `bucket_starts[i + 1]` is the range of bucket `i`. Different cells can
+    hash to the same bucket, so each entry also stores its cell.
+
+    Entities are treated as points at their spatial component's position.
+
+    None of the queries allocate. The caller passes in a result buffer and
+    its size, and we return how many results were written to it.
+*/
+class spatialgrid {
+public:
+    static constexpr f32 DEFAULT_CELL_SIZE = 4.0f;
+
+    struct Entry {
+        v3 position;
+        iv3 cell;
+        entities::Handle entity_handle;
+    };
+
+    struct Grid {
+        f32 cell_size;
+        u32 n_buckets;
+        // Entries are added here, then sorted by bucket into `entries`.
+        Array<Entry> unsorted_entries;
+        Array<Entry> entries;
+        Array<u32> bucket_starts;
+        // The range of cells that contain at least one entry.
+        iv3 min_cell;
+        iv3 max_cell;
+    };
+
+    struct State {
+        Grid grid;
+    };
+
+    static void init_grid(
+        Grid *grid,
+        memory::Pool *memory_pool,
+        u32 max_n_entries,
+        f32 cell_size
+    );
+    static void begin_rebuild(Grid *grid);
+    static void add_entry(Grid *grid, entities::Handle entity_handle, v3 position);
+    static void end_rebuild(Grid *grid);
+    static u32 overlap_sphere(
+        Grid *grid,
+        v3 center,
+        f32 radius,
+        entities::Handle *results,
+        u32 max_n_results
+    );
+    static u32 overlap_box(
+        Grid *grid,
+        spatial::Aabb *box,
+        entities::Handle *results,
+        u32 max_n_results
+    );
+    static u32 find_k_nearest(
+        Grid *grid,
+        v3 point,
+        u32 k,
+        f32 max_distance,
+        entities::Handle *results,
+        f32 *distances
+    );
+    static void overlap_spheres(
+        Grid *grid,
+        v3 const *centers,
+        f32 const *radii,
+        u32 n_queries,
+        entities::Handle *results,
+        u32 max_n_results_per_query,
+        u32 *n_results
+    );
+    static void find_k_nearest_batch(
+        Grid *grid,
+        v3 const *points,
+        u32 n_queries,
+        u32 k,
+        f32 max_distance,
+        entities::Handle *results,
+        f32 *distances,
+        u32 *n_results
+    );
+    static Grid * get_grid();
+    static void update();
+    static void init(spatialgrid::State *spatialgrid_state, memory::Pool *asset_memory_pool);
+
+private:
+    static iv3 get_cell(Grid *grid, v3 position);
+    static u32 get_bucket(Grid *grid, iv3 cell);
+
+    // Calls `fn(entry)` once for every entry in the cells from `min_cell` to
+    // `max_cell`, inclusive. If `fn` returns false, we stop.
+    template <typename F>
+        static void for_each_entry_in_cells(Grid *grid, iv3 min_cell, iv3 max_cell, F fn) {
+            if (grid->entries.length == 0) {
+                return;
+            }
+            min_cell = max(min_cell, grid->min_cell);
+            max_cell = min(max_cell, grid->max_cell);
+            if (
+                min_cell.x > max_cell.x || min_cell.y > max_cell.y ||
+                min_cell.z > max_cell.z
+            ) {
+                return;
+            }
+
+            // If the query covers more cells than there are buckets, we would
+            // visit the same buckets over and over, so it's quicker to just go
+            // through everything.
+            u64 n_cells = (u64)(max_cell.x - min_cell.x + 1) *
+                (u64)(max_cell.y - min_cell.y + 1) *
+                (u64)(max_cell.z - min_cell.z + 1);
+            if (n_cells >= grid->n_buckets) {
+                for (u32 idx = 0; idx < grid->entries.length; idx++) {
+                    Entry *entry = grid->entries[idx];
+                    if (
+                        entry->cell.x >= min_cell.x && entry->cell.x <= max_cell.x &&
+                        entry->cell.y >= min_cell.y && entry->cell.y <= max_cell.y &&
+                        entry->cell.z >= min_cell.z && entry->cell.z <= max_cell.z
+                    ) {
+                        if (!fn(entry)) {
+                            return;
+                        }
+                    }
+                }
+                return;
+            }
+
+            for (i32 z = min_cell.z; z <= max_cell.z; z++) {
+                for (i32 y = min_cell.y; y <= max_cell.y; y++) {
+                    for (i32 x = min_cell.x; x <= max_cell.x; x++) {
+                        iv3 cell = iv3(x, y, z);
+                        u32 idx_bucket = get_bucket(grid, cell);
+                        u32 idx_start = *grid->bucket_starts[idx_bucket];
+                        u32 idx_end = *grid->bucket_starts[idx_bucket + 1];
+                        for (u32 idx = idx_start; idx < idx_end; idx++) {
+                            Entry *entry = grid->entries[idx];
+                            if (entry->cell != cell) {
+                                continue;
+                            }
+                            if (!fn(entry)) {
+                                return;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+    static spatialgrid::State *state;
+};
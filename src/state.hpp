@@ -14,6 +14,9 @@
 #include "engine.hpp"
 #include "renderer.hpp"
 #include "behavior.hpp"
+#include "spatialgrid.hpp"
+#include "solver.hpp"
+#include "charcontroller.hpp"
 #include "array.hpp"
 #include "stackarray.hpp"
 #include "queue.hpp"
@@ -27,6 +30,9 @@ struct State {
     lights::State lights_state;
     anim::State anim_state;
     physics::State physics_state;
+    solver::State solver_state;
+    charcontroller::State charcontroller_state;
+    spatialgrid::State spatialgrid_state;
     entities::State entities_state;
     behavior::State behavior_state;
     engine::State engine_state;
@@ -42,6 +42,117 @@ tasks::run_loading_loop(
 }
 
 
+void
+tasks::init_workers(
+    std::mutex *worker_mutex,
+    std::condition_variable *worker_condition,
+    u32 n_workers
+) {
+    tasks::state->worker_mutex = worker_mutex;
+    tasks::state->worker_condition = worker_condition;
+    tasks::state->n_workers = n_workers;
+    tasks::state->n_active_workers = n_workers;
+}
+
+
+/*!
+    Worker threads sleep until `parallel_for()` gives them a new job, then help
+    with it until there's nothing left to take.
+*/
+void
+tasks::run_worker_loop(bool *should_stop, u32 idx_thread)
+{
+    u32 last_job_generation = 0;
+    while (!*should_stop) {
+        {
+            std::unique_lock<std::mutex> lock(*tasks::state->worker_mutex);
+            // We wake up every so often to check `should_stop`.
+            tasks::state->worker_condition->wait_for(lock, std::chrono::milliseconds(10),
+                [&]() {
+                    return tasks::state->job_generation != last_job_generation || *should_stop;
+                });
+            if (tasks::state->job_generation == last_job_generation) {
+                continue;
+            }
+            last_job_generation = tasks::state->job_generation;
+            // Workers we aren't using sit this job out.
+            if (idx_thread >= tasks::state->n_active_workers) {
+                continue;
+            }
+            tasks::state->n_busy_workers++;
+        }
+
+        run_job_batches(&tasks::state->job);
+        tasks::state->n_busy_workers--;
+    }
+}
+
+
+/*!
+    Makes only the first `n_active_workers` workers help with
+    `parallel_for()`, so that we can see how something scales with the number
+    of cores. This should only be called from the main thread.
+*/
+void
+tasks::set_n_active_workers(u32 n_active_workers)
+{
+    std::lock_guard<std::mutex> lock(*tasks::state->worker_mutex);
+    tasks::state->n_active_workers = min(n_active_workers, tasks::state->n_workers);
+}
+
+
+/*!
+    Calls `fn(data, idx_start, idx_end)` for batches of at most `batch_size`
+    items, covering all `n_items`, spread over the worker threads and the
+    calling thread, and returns once all of them are done.
+
+    `fn` must be safe to call from different threads at the same time, for
+    different batches. This should only be called from the main thread, and
+    can't be nested.
+*/
+void
+tasks::parallel_for(u32 n_items, u32 batch_size, ParallelForFn fn, void *data)
+{
+    if (n_items == 0) {
+        return;
+    }
+    batch_size = max(batch_size, 1u);
+
+    // If we have no workers, or there's only one batch, it's not worth waking
+    // anyone up.
+    if (tasks::state->n_active_workers == 0 || n_items <= batch_size) {
+        fn(data, 0, n_items);
+        return;
+    }
+
+    ParallelForJob *job = &tasks::state->job;
+    {
+        std::lock_guard<std::mutex> lock(*tasks::state->worker_mutex);
+        // A worker that slept through the last job might have only just
+        // picked it up, so wait until it's seen there's nothing left to do.
+        while (tasks::state->n_busy_workers > 0) {
+            std::this_thread::yield();
+        }
+        job->fn = fn;
+        job->data = data;
+        job->n_items = n_items;
+        job->batch_size = batch_size;
+        job->idx_next_item = 0;
+        job->n_done_items = 0;
+        tasks::state->job_generation++;
+    }
+    tasks::state->worker_condition->notify_all();
+
+    run_job_batches(job);
+
+    // Workers might still be finishing their last batch, and we can't touch
+    // the job until everyone is done with it.
+    while (job->n_done_items < n_items || tasks::state->n_busy_workers > 0) {
+        std::this_thread::yield();
+    }
+}
+
+
 void
 tasks::init(tasks::State *tasks_state, memory::Pool *pool)
 {
@@ -58,3 +169,18 @@ tasks::run_task(Task *task)
     f64 duration = debug_end_timer(t0);
     logs::info("Task took %.0fms", duration);
 }
+
+
+void
+tasks::run_job_batches(ParallelForJob *job)
+{
+    while (true) {
+        u32 idx_start = job->idx_next_item.fetch_add(job->batch_size);
+        if (idx_start >= job->n_items) {
+            return;
+        }
+        u32 idx_end = min(idx_start + job->batch_size, job->n_items);
+        job->fn(job->data, idx_start, idx_end);
+        job->n_done_items += idx_end - idx_start;
+    }
+}
@@ -3,18 +3,47 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include "types.hpp"
 #include "queue.hpp"
 
 class tasks {
 public:
     typedef void (*TaskFn)(void*);
+    // Processes items `idx_start` to `idx_end`, not including `idx_end`.
+    typedef void (*ParallelForFn)(void *data, u32 idx_start, u32 idx_end);
+
     struct Task {
         TaskFn fn;
         void *argument_1;
     };
+
+    // The work currently being done by `parallel_for()`. Threads take batches
+    // of `batch_size` items off it until it's done.
+    struct ParallelForJob {
+        ParallelForFn fn;
+        void *data;
+        u32 n_items;
+        u32 batch_size;
+        std::atomic<u32> idx_next_item;
+        std::atomic<u32> n_done_items;
+    };
+
     struct State {
         Queue<Task> task_queue;
+        // These are owned by `core::run()`, and set by `init_workers()`.
+        std::mutex *worker_mutex;
+        std::condition_variable *worker_condition;
+        u32 n_workers;
+        // How many of the workers help with `parallel_for()`, which is all
+        // of them unless a benchmark has lowered it. Protected by
+        // `worker_mutex`, and only changed from the main thread.
+        u32 n_active_workers;
+        // Protected by `worker_mutex`.
+        u32 job_generation;
+        ParallelForJob job;
+        std::atomic<u32> n_busy_workers;
     };
 
     static void push(Task task);
@@ -23,10 +52,19 @@ public:
         bool *should_stop,
         u32 idx_thread
     );
+    static void init_workers(
+        std::mutex *worker_mutex,
+        std::condition_variable *worker_condition,
+        u32 n_workers
+    );
+    static void run_worker_loop(bool *should_stop, u32 idx_thread);
+    static void set_n_active_workers(u32 n_active_workers);
+    static void parallel_for(u32 n_items, u32 batch_size, ParallelForFn fn, void *data);
     static void init(tasks::State *tasks_state, memory::Pool *pool);
 
 private:
     static void run_task(Task *task);
+    static void run_job_batches(ParallelForJob *job);
 
     static tasks::State *state;
 };